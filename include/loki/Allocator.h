@@ -31,6 +31,15 @@
 
 #include <loki/SmallObj.h>
 
+#if (__cplusplus >= 201703L) && defined(__has_include)
+#if __has_include(<memory_resource>)
+#define LOKI_HAS_MEMORY_RESOURCE
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+#endif
+#endif
+
 namespace Loki {
 
 //-----------------------------------------------------------------------------
@@ -60,14 +69,14 @@ public:
 
   /// Type converting allocator constructor does nothing.
   template <typename Type1>
-  inline LokiAllocator(const LokiAllocator<Type1> &) throw() {}
+  inline LokiAllocator(const LokiAllocator<Type1, AllocT> &) throw() {}
 
   /// Destructor does nothing.
   inline ~LokiAllocator() throw() {}
 
   /// Convert an allocator<Type> to an allocator <Type1>.
   template <typename Type1> struct rebind {
-    typedef LokiAllocator<Type1> other;
+    typedef LokiAllocator<Type1, AllocT> other;
   };
 
   /// Return address of reference to mutable element.
@@ -125,23 +134,99 @@ public:
 /** All equality operators return true since LokiAllocator is basically a
  monostate design pattern, so all instances of it are identical.
  */
-template <typename Type>
-inline bool operator==(const LokiAllocator<Type> &,
-                       const LokiAllocator<Type> &) {
+template <typename Type, typename AllocT>
+inline bool operator==(const LokiAllocator<Type, AllocT> &,
+                       const LokiAllocator<Type, AllocT> &) {
   return true;
 }
 
 /** All inequality operators return false since LokiAllocator is basically a
  monostate design pattern, so all instances of it are identical.
  */
-template <typename Type>
-inline bool operator!=(const LokiAllocator<Type> &,
-                       const LokiAllocator<Type> &) {
+template <typename Type, typename AllocT>
+inline bool operator!=(const LokiAllocator<Type, AllocT> &,
+                       const LokiAllocator<Type, AllocT> &) {
   return false;
 }
 
 //-----------------------------------------------------------------------------
 
+#ifdef LOKI_HAS_MEMORY_RESOURCE
+
+namespace Private {
+
+/// Tells if blocks of a threading model may come from a Region.
+template <class ThreadingModel> struct IsRegionModel : ::std::false_type {};
+
+template <class Host, class MutexPolicy>
+struct IsRegionModel<RegionLockable<Host, MutexPolicy>> : ::std::true_type {};
+
+} // namespace Private
+
+/** @class SmallObjMemoryResource
+ Adapts Loki's Small-Object Allocator to std::pmr::memory_resource, so that
+ pmr containers such as std::pmr::vector, std::pmr::list and
+ std::pmr::unordered_map can use the small-object pools.  It is only
+ available when compiling for C++17 or later.
+
+ Memory goes through the same front end as SmallObject, so it takes the lock
+ - or the thread cache - of the AllocatorSingleton's ThreadingModel.  A block
+ is taken from the pools only if it is small enough and its size class
+ keeps the requested alignment.  Larger requests, and requests for stricter
+ alignment, go to the aligned global operator new.  Like LokiAllocator, this
+ is a monostate: all instances for the same AllocT share the same pools, and
+ compare equal.
+ */
+template <typename AllocT = Loki::AllocatorSingleton<>>
+class SmallObjMemoryResource : public ::std::pmr::memory_resource {
+public:
+  /// Default constructor does nothing.
+  inline SmallObjMemoryResource(void) noexcept {}
+
+  /** Returns true if a request for bytes with the given alignment is served
+   by the pools.  Each Chunk starts at a multiple of its size class's chunk
+   alignment, which is at least as long as the Chunk, so blocks of a class
+   are as aligned as the largest power of two which divides their size.
+   With RegionLockable, a block may come from a region instead, which only
+   aligns it on the allocator's alignment.
+   */
+  static bool IsPooled(::std::size_t bytes, ::std::size_t alignment) {
+    const SmallObjAllocator &allocator = AllocT::Instance();
+    if (bytes > allocator.GetMaxObjectSize())
+      return false;
+    if (Private::IsRegionModel<typename AllocT::MyThreadingModel>::value &&
+        (alignment > allocator.GetAlignment()))
+      return false;
+    const ::std::size_t blockSize =
+        allocator.GetBlockSize(allocator.GetSizeClass(bytes));
+    return (alignment <= (blockSize & (~blockSize + 1)));
+  }
+
+protected:
+  void *do_allocate(::std::size_t bytes, ::std::size_t alignment) override {
+    if (IsPooled(bytes, alignment))
+      return AllocT::MyFrontEnd::Allocate(bytes, true);
+    return ::operator new(bytes, ::std::align_val_t(alignment));
+  }
+
+  void do_deallocate(void *p, ::std::size_t bytes,
+                     ::std::size_t alignment) override {
+    if (IsPooled(bytes, alignment))
+      AllocT::MyFrontEnd::Deallocate(p, bytes);
+    else
+      ::operator delete(p, bytes, ::std::align_val_t(alignment));
+  }
+
+  bool do_is_equal(const ::std::pmr::memory_resource &other) const
+      noexcept override {
+    return (nullptr != dynamic_cast<const SmallObjMemoryResource *>(&other));
+  }
+};
+
+#endif // LOKI_HAS_MEMORY_RESOURCE
+
+//-----------------------------------------------------------------------------
+
 } // namespace Loki
 
 #endif // LOKI_ALLOCATOR_INCLUDED
@@ -35,6 +35,7 @@
 #include <loki/SmallObj.h>
 #include <loki/TypeTraits.h>
 #include <loki/Typelist.h>
+#include <functional>
 #include <memory>
 #include <typeinfo>
 
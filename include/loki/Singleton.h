@@ -30,6 +30,7 @@
 // $Id$
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdlib>
 #include <list>
@@ -78,6 +79,19 @@ typedef LifetimeTracker **TrackerArray;
 extern TrackerArray pTrackerArray;
 extern unsigned int elements;
 
+/// Makes room in pTrackerArray for one more tracker, growing it geometrically.
+/// Throws std::bad_alloc, before the tracker exists, if it can't.
+LOKI_EXPORT void ReserveLifetimeTracker();
+
+/// Gives back the room ReserveLifetimeTracker made, for a tracker which
+/// could not be made after all.
+LOKI_EXPORT void UnreserveLifetimeTracker();
+
+/// Adds a tracker to the heap in pTrackerArray in O(log n), and makes sure
+/// AtExitFn is registered with std::atexit.  Needs ReserveLifetimeTracker
+/// first, so it can't fail.  Both may be called from several threads at once.
+LOKI_EXPORT void AddLifetimeTracker(LifetimeTracker *p);
+
 ////////////////////////////////////////////////////////////////////////////////
 // class LifetimeTracker
 // Helper class for SetLongevity
@@ -85,16 +99,24 @@ extern unsigned int elements;
 
 class LifetimeTracker {
 public:
-  LifetimeTracker(unsigned int x) : longevity_(x) {}
+  LifetimeTracker(unsigned int x) : longevity_(x), order_(0) {}
 
   virtual ~LifetimeTracker() = 0;
 
+  /// True if lhs is destroyed after rhs: it has a longer longevity, or the
+  /// same one and was registered earlier.
   static bool Compare(const LifetimeTracker *lhs, const LifetimeTracker *rhs) {
-    return lhs->longevity_ > rhs->longevity_;
+    if (lhs->longevity_ != rhs->longevity_)
+      return lhs->longevity_ > rhs->longevity_;
+    return lhs->order_ < rhs->order_;
   }
 
 private:
+  friend void AddLifetimeTracker(LifetimeTracker *p);
+
   unsigned int longevity_;
+  /// Order of registration, which breaks ties between equal longevities.
+  unsigned long order_;
 };
 
 // Definition required
@@ -140,27 +162,19 @@ template <typename T, typename Destroyer>
 void SetLongevity(T *pDynObject, unsigned int longevity, Destroyer d) {
   using namespace Private;
 
-  TrackerArray pNewArray = static_cast<TrackerArray>(
-      std::realloc(pTrackerArray, sizeof(*pTrackerArray) * (elements + 1)));
-  if (!pNewArray)
-    throw std::bad_alloc();
-
-  // Delayed assignment for exception safety
-  pTrackerArray = pNewArray;
+  // Room first, for exception safety
+  ReserveLifetimeTracker();
 
-  LifetimeTracker *p =
-      new ConcreteLifetimeTracker<T, Destroyer>(pDynObject, longevity, d);
+  LifetimeTracker *p = 0;
+  try {
+    p = new ConcreteLifetimeTracker<T, Destroyer>(pDynObject, longevity, d);
+  } catch (...) {
+    UnreserveLifetimeTracker();
+    throw;
+  }
 
   // Insert a pointer to the object into the queue
-  TrackerArray pos = std::upper_bound(pTrackerArray, pTrackerArray + elements,
-                                      p, LifetimeTracker::Compare);
-  std::copy_backward(pos, pTrackerArray + elements,
-                     pTrackerArray + elements + 1);
-  *pos = p;
-  ++elements;
-
-  // Register a call to AtExitFn
-  std::atexit(Private::AtExitFn);
+  AddLifetimeTracker(p);
 }
 
 template <typename T>
@@ -270,6 +284,24 @@ template <class T> struct CreateStatic {
   static void Destroy(T *p) { p->~T(); }
 };
 
+////////////////////////////////////////////////////////////////////////////////
+///  \struct CreateThreadLocal
+///
+///  \ingroup CreationGroup
+///  Implementation of the CreationPolicy used by SingletonHolder
+///  Creates an object in thread_local memory, like CreateStatic does in static
+///  memory, so each thread's object costs no heap allocation.  Only for use
+///  with ThreadLocalLifetime, since the memory goes away with its thread.
+////////////////////////////////////////////////////////////////////////////////
+template <class T> struct CreateThreadLocal {
+  static T *Create() {
+    alignas(T) static thread_local unsigned char threadMemory_[sizeof(T)];
+    return new (&threadMemory_) T;
+  }
+
+  static void Destroy(T *p) { p->~T(); }
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 ///  \struct DefaultLifetime
 ///
@@ -426,6 +458,40 @@ template <class T> struct NoDestroy {
   static void OnDeadReference() {}
 };
 
+////////////////////////////////////////////////////////////////////////////////
+///  \class ThreadLocalLifetime
+///
+///  \ingroup LifetimeGroup
+///  Implementation of the LifetimePolicy used by SingletonHolder
+///  Schedules an object's destruction when the thread which made it exits.
+///  A SingletonHolder with this policy keeps one object per thread, see the
+///  SingletonHolder specialization below.
+////////////////////////////////////////////////////////////////////////////////
+template <class T> class ThreadLocalLifetime {
+  /// Calls the functions scheduled by one thread, last first, as it exits.
+  struct Reaper {
+    std::vector<atexit_pfn_t> pFuns_;
+
+    ~Reaper() {
+      while (!pFuns_.empty()) {
+        atexit_pfn_t pFun = pFuns_.back();
+        pFuns_.pop_back();
+        pFun();
+      }
+    }
+  };
+
+public:
+  static void ScheduleDestruction(T *, atexit_pfn_t pFun) {
+    static thread_local Reaper reaper;
+    reaper.pFuns_.push_back(pFun);
+  }
+
+  static void OnDeadReference() {
+    throw std::logic_error("Dead Reference Detected");
+  }
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 ///  \defgroup LongevityLifetimeGroup LongevityLifetime
 ///  \ingroup LifetimeGroup
@@ -607,15 +673,17 @@ public:
 
 private:
   // Helpers
-  static void MakeInstance();
+  static T *MakeInstance();
   static void LOKI_C_CALLING_CONVENTION_QUALIFIER DestroySingleton();
 
   // Protection
   SingletonHolder();
 
   // Data
-  typedef
-      typename ThreadingModel<T *, MutexPolicy>::VolatileType PtrInstanceType;
+  /// Set with release once the object is made, so a thread which reads it
+  /// with acquire sees the object fully constructed without the lock.
+  typedef typename AtomicTypeOf<ThreadingModel<T *, MutexPolicy>, T *>::Type
+      PtrInstanceType;
   static PtrInstanceType pInstance_;
   static bool destroyed_;
 };
@@ -627,7 +695,7 @@ private:
 template <class T, template <class> class C, template <class> class L,
           template <class, class> class M, class X>
 typename SingletonHolder<T, C, L, M, X>::PtrInstanceType
-    SingletonHolder<T, C, L, M, X>::pInstance_ = 0;
+    SingletonHolder<T, C, L, M, X>::pInstance_(nullptr);
 
 template <class T, template <class> class C, template <class> class L,
           template <class, class> class M, class X>
@@ -642,10 +710,12 @@ template <class T, template <class> class CreationPolicy,
           template <class, class> class ThreadingModel, class MutexPolicy>
 inline T &SingletonHolder<T, CreationPolicy, LifetimePolicy, ThreadingModel,
                           MutexPolicy>::Instance() {
-  if (!pInstance_) {
-    MakeInstance();
+  // Once the object exists, this is a single load.
+  T *p = pInstance_.load(std::memory_order_acquire);
+  if (!p) {
+    p = MakeInstance();
   }
-  return *pInstance_;
+  return *p;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -655,19 +725,23 @@ inline T &SingletonHolder<T, CreationPolicy, LifetimePolicy, ThreadingModel,
 template <class T, template <class> class CreationPolicy,
           template <class> class LifetimePolicy,
           template <class, class> class ThreadingModel, class MutexPolicy>
-void SingletonHolder<T, CreationPolicy, LifetimePolicy, ThreadingModel,
-                     MutexPolicy>::MakeInstance() {
+T *SingletonHolder<T, CreationPolicy, LifetimePolicy, ThreadingModel,
+                   MutexPolicy>::MakeInstance() {
   typename ThreadingModel<SingletonHolder, MutexPolicy>::Lock guard;
   (void)guard;
 
-  if (!pInstance_) {
+  // The lock orders this with the store of any other thread.
+  T *p = pInstance_.load(std::memory_order_relaxed);
+  if (!p) {
     if (destroyed_) {
       destroyed_ = false;
       LifetimePolicy<T>::OnDeadReference();
     }
-    pInstance_ = CreationPolicy<T>::Create();
-    LifetimePolicy<T>::ScheduleDestruction(pInstance_, &DestroySingleton);
+    p = CreationPolicy<T>::Create();
+    pInstance_.store(p, std::memory_order_release);
+    LifetimePolicy<T>::ScheduleDestruction(p, &DestroySingleton);
   }
+  return p;
 }
 
 template <class T, template <class> class CreationPolicy,
@@ -675,8 +749,150 @@ template <class T, template <class> class CreationPolicy,
 void LOKI_C_CALLING_CONVENTION_QUALIFIER
 SingletonHolder<T, CreationPolicy, L, M, X>::DestroySingleton() {
   assert(!destroyed_);
-  CreationPolicy<T>::Destroy(pInstance_);
-  pInstance_ = 0;
+  CreationPolicy<T>::Destroy(pInstance_.load(std::memory_order_relaxed));
+  pInstance_.store(nullptr, std::memory_order_release);
+  destroyed_ = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+///  \class  SingletonHolder<T, CreationPolicy, ThreadLocalLifetime>
+///
+///  \ingroup SingletonGroup
+///
+///  Keeps one object per thread, for scratch buffers, random number generators
+///  and the like which need no lock as long as no thread shares them.
+///  Instance() makes the calling thread's object on first use, and
+///  ThreadLocalLifetime destroys it when that thread exits.
+///
+///  ForEach visits the objects of all live threads, e.g. to merge per-thread
+///  counters.  The ThreadingModel's lock only guards the list of objects, so
+///  Instance() never takes it once the thread's object exists.  Leave it at
+///  ClassLevelLockable unless a single thread uses the singleton, or use
+///  ClassLevelRWLockable with LOKI_DEFAULT_RW_MUTEX to let several threads
+///  run ForEach at once.
+////////////////////////////////////////////////////////////////////////////////
+template <class T, template <class> class CreationPolicy,
+          template <class, class> class ThreadingModel, class MutexPolicy>
+class SingletonHolder<T, CreationPolicy, ThreadLocalLifetime, ThreadingModel,
+                      MutexPolicy> {
+public:
+  ///  Type of the singleton object
+  typedef T ObjectType;
+
+  ///  Returns a reference to the calling thread's object
+  static T &Instance();
+
+  ///  Calls f(T &) for the object of each thread which has one.  No object
+  ///  is destroyed meanwhile, but its thread may still be using it, so f may
+  ///  only read what T makes safe to read from another thread.  f must not
+  ///  make an object, i.e. call Instance() in a thread which has none yet.
+  template <class F> static void ForEach(F f);
+
+private:
+  typedef typename ThreadingModel<SingletonHolder, MutexPolicy>::Lock Lock;
+  typedef typename ThreadingModel<SingletonHolder, MutexPolicy>::ReadLock
+      ReadLock;
+
+  /// Each thread's object, linked into the list which ForEach walks.
+  struct Link {
+    T *pInstance_;
+    Link *prev_;
+    Link *next_;
+  };
+
+  // Helpers
+  static T *MakeInstance();
+  static void LOKI_C_CALLING_CONVENTION_QUALIFIER DestroySingleton();
+
+  // Protection
+  SingletonHolder();
+
+  // Data
+  static thread_local Link link_;
+  static thread_local bool destroyed_;
+  static Link *pFirst_;
+};
+
+template <class T, template <class> class C, template <class, class> class M,
+          class X>
+thread_local typename SingletonHolder<T, C, ThreadLocalLifetime, M, X>::Link
+    SingletonHolder<T, C, ThreadLocalLifetime, M, X>::link_ = {nullptr,
+                                                               nullptr,
+                                                               nullptr};
+
+template <class T, template <class> class C, template <class, class> class M,
+          class X>
+thread_local bool SingletonHolder<T, C, ThreadLocalLifetime, M, X>::destroyed_ =
+    false;
+
+template <class T, template <class> class C, template <class, class> class M,
+          class X>
+typename SingletonHolder<T, C, ThreadLocalLifetime, M, X>::Link
+    *SingletonHolder<T, C, ThreadLocalLifetime, M, X>::pFirst_ = nullptr;
+
+template <class T, template <class> class C, template <class, class> class M,
+          class X>
+inline T &SingletonHolder<T, C, ThreadLocalLifetime, M, X>::Instance() {
+  // Only this thread writes its own pointer, so no load needs ordering.
+  T *p = link_.pInstance_;
+  if (!p) {
+    p = MakeInstance();
+  }
+  return *p;
+}
+
+template <class T, template <class> class C, template <class, class> class M,
+          class X>
+template <class F>
+void SingletonHolder<T, C, ThreadLocalLifetime, M, X>::ForEach(F f) {
+  ReadLock guard;
+  (void)guard;
+  for (Link *link = pFirst_; link; link = link->next_)
+    f(*link->pInstance_);
+}
+
+template <class T, template <class> class CreationPolicy,
+          template <class, class> class M, class X>
+T *SingletonHolder<T, CreationPolicy, ThreadLocalLifetime, M,
+                   X>::MakeInstance() {
+  if (destroyed_) {
+    destroyed_ = false;
+    ThreadLocalLifetime<T>::OnDeadReference();
+  }
+  T *p = CreationPolicy<T>::Create();
+  {
+    Lock guard;
+    (void)guard;
+    link_.pInstance_ = p;
+    link_.prev_ = nullptr;
+    link_.next_ = pFirst_;
+    if (pFirst_)
+      pFirst_->prev_ = &link_;
+    pFirst_ = &link_;
+  }
+  ThreadLocalLifetime<T>::ScheduleDestruction(p, &DestroySingleton);
+  return p;
+}
+
+template <class T, template <class> class CreationPolicy,
+          template <class, class> class M, class X>
+void LOKI_C_CALLING_CONVENTION_QUALIFIER
+SingletonHolder<T, CreationPolicy, ThreadLocalLifetime, M,
+                X>::DestroySingleton() {
+  assert(!destroyed_);
+  {
+    // Once unlinked, ForEach can't reach the object any more.
+    Lock guard;
+    (void)guard;
+    if (link_.prev_)
+      link_.prev_->next_ = link_.next_;
+    else
+      pFirst_ = link_.next_;
+    if (link_.next_)
+      link_.next_->prev_ = link_.prev_;
+  }
+  CreationPolicy<T>::Destroy(link_.pInstance_);
+  link_.pInstance_ = nullptr;
   destroyed_ = true;
 }
 
@@ -0,0 +1,164 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+////////////////////////////////////////////////////////////////////////////////
+#ifndef LOKI_SINGLETONWARMUP_INC_
+#define LOKI_SINGLETONWARMUP_INC_
+
+// $Id$
+
+#include <loki/LokiExport.h>
+#include <loki/NullType.h>
+#include <loki/Sequence.h>
+#include <loki/Typelist.h>
+
+#include <chrono>
+#include <cstddef>
+#include <typeinfo>
+#include <vector>
+
+/** @file SingletonWarmUp.h
+ Makes registered singletons ahead of their first use, several at once, each
+ after the singletons it depends on.
+ */
+
+namespace Loki {
+
+////////////////////////////////////////////////////////////////////////////////
+///  \class SingletonWarmUp
+///
+///  \ingroup SingletonGroup
+///  Registry of SingletonHolders to make at startup rather than on the first
+///  request which needs them.  Each holder names the holders its object uses
+///  in a typelist or Seq, and WarmUp makes it only after those, so its
+///  constructor finds them ready.  Independent holders are made at once by
+///  several threads.
+///
+///  The holders' lifetime policies still decide the order of destruction.  A
+///  dependency is made before its dependents, so with DefaultLifetime it also
+///  dies after them, just as when made lazily.  SetLongevity may be called by
+///  several threads at once, so SingletonWithLongevity works as well.
+///
+///  \par Usage
+///  \code
+///  typedef SingletonHolder<Config> TheConfig;
+///  typedef SingletonHolder<Database> TheDatabase;
+///  static SingletonWarmUp::Registration<TheConfig> configWarmUp("Config");
+///  static SingletonWarmUp::Registration<TheDatabase, Seq<TheConfig> >
+///      databaseWarmUp("Database");
+///  ...
+///  std::vector<SingletonWarmUp::Timing> timings = SingletonWarmUp::WarmUp(8);
+///  \endcode
+////////////////////////////////////////////////////////////////////////////////
+class LOKI_EXPORT SingletonWarmUp {
+public:
+  /// Makes the object of one holder, by calling its Instance().
+  typedef void (*MakeFunction)();
+
+  /// One holder to make, and the name to report it by.
+  struct Task {
+    MakeFunction make;
+    /// 0 for the name of type.
+    const char *name;
+    /// The holder's object type.
+    const std::type_info *type;
+  };
+
+  /// How long making one holder's object took, reported by WarmUp.
+  struct Timing {
+    const char *name;
+    /// Which thread made it, 0 being the one which called WarmUp.
+    unsigned int thread;
+    /// When it started, since WarmUp began.
+    std::chrono::nanoseconds start;
+    std::chrono::nanoseconds duration;
+  };
+
+  /// Registers Holder, to be made after each holder in Dependencies, a
+  /// typelist or Seq.  Those need no registration of their own unless they
+  /// have dependencies too.  @param name Reported in the timings, by default
+  /// the name of Holder's object type from typeid, demangled where the
+  /// compiler mangles it.
+  template <class Holder, class Dependencies = NullType>
+  static void Register(const char *name = 0);
+
+  /// Registers a holder when constructed, for use at namespace scope.
+  template <class Holder, class Dependencies = NullType> class Registration {
+  public:
+    explicit Registration(const char *name = 0) {
+      SingletonWarmUp::Register<Holder, Dependencies>(name);
+    }
+  };
+
+  /// Makes the objects of all registered holders and their dependencies,
+  /// with threadCount threads including the calling one.  Objects which
+  /// already exist take no time, so WarmUp may be called more than once.
+  /// If a constructor throws, the holders not started yet are left alone,
+  /// and the exception is rethrown once the others are done.
+  /// Throws std::logic_error if the dependencies form a cycle.
+  /// @return The timings, in the order the objects were finished.
+  static std::vector<Timing> WarmUp(unsigned int threadCount);
+
+  /// Forgets all registered holders.
+  static void Clear();
+
+private:
+  template <class Holder> static void Make() { Holder::Instance(); }
+
+  template <class Holder> static Task MakeTask(const char *name) {
+    const Task task = {&Make<Holder>, name,
+                       &typeid(typename Holder::ObjectType)};
+    return task;
+  }
+
+  template <class TList> struct DependencyTasks;
+
+  static void Add(const Task &task, const std::vector<Task> &dependencies);
+
+  SingletonWarmUp();
+};
+
+template <> struct SingletonWarmUp::DependencyTasks<NullType> {
+  static void Append(std::vector<Task> &) {}
+};
+
+template <class Head, class Tail>
+struct SingletonWarmUp::DependencyTasks<Typelist<Head, Tail>> {
+  static void Append(std::vector<Task> &tasks) {
+    tasks.push_back(MakeTask<Head>(0));
+    DependencyTasks<Tail>::Append(tasks);
+  }
+};
+
+template <class... Types>
+struct SingletonWarmUp::DependencyTasks<Seq<Types...>>
+    : DependencyTasks<typename Seq<Types...>::Type> {};
+
+template <class Holder, class TList>
+void SingletonWarmUp::Register(const char *name) {
+  std::vector<Task> dependencies;
+  DependencyTasks<TList>::Append(dependencies);
+  Add(MakeTask<Holder>(name), dependencies);
+}
+
+} // namespace Loki
+
+#endif // end file guardian
@@ -27,11 +27,20 @@
 
 // $Id$
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <climits>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iosfwd>
 #include <loki/LokiExport.h>
 #include <loki/Singleton.h>
 #include <loki/Threads.h>
+#include <loki/static_check.h>
 #include <new> // needed for std::nothrow_t parameter.
+#include <vector>
 
 #ifndef LOKI_DEFAULT_CHUNK_SIZE
 #define LOKI_DEFAULT_CHUNK_SIZE 4096
@@ -45,6 +54,62 @@
 #define LOKI_DEFAULT_OBJECT_ALIGNMENT 4
 #endif
 
+#ifndef LOKI_DEFAULT_CHUNK_INDEX_TYPE
+#define LOKI_DEFAULT_CHUNK_INDEX_TYPE unsigned char
+#endif
+
+#ifndef LOKI_SMALLOBJ_CLASSES_PER_DOUBLING
+/** # of size classes between each power of two once classes are further
+ apart than the object alignment.  Zero makes every class one alignment
+ step apart, which uses many more FixedAllocator's for big objects.
+ */
+#define LOKI_SMALLOBJ_CLASSES_PER_DOUBLING 4
+#endif
+
+#ifndef LOKI_SMALLOBJ_THREAD_CACHE_SIZE
+#define LOKI_SMALLOBJ_THREAD_CACHE_SIZE 64
+#endif
+
+#ifndef LOKI_SMALLOBJ_LOCK_FREE_BATCH
+#define LOKI_SMALLOBJ_LOCK_FREE_BATCH 32
+#endif
+
+#ifndef LOKI_SMALLOBJ_LOCK_FREE_DEPTH
+/// Most # of free blocks LockFreeLockable keeps for each size class.
+#define LOKI_SMALLOBJ_LOCK_FREE_DEPTH (4 * LOKI_SMALLOBJ_LOCK_FREE_BATCH)
+#endif
+
+#ifndef LOKI_SMALLOBJ_FAILURE_TRIM_BUDGET
+/// Most empty Chunks released when an allocation fails in incremental mode.
+#define LOKI_SMALLOBJ_FAILURE_TRIM_BUDGET 16
+#endif
+
+#ifndef LOKI_SMALLOBJ_CACHE_LINE_SIZE
+/** # of bytes in a cache line.  If LOKI_SMALLOBJ_CACHE_LINE_PADDING is
+ defined when building Loki, every block is padded to a whole # of cache
+ lines, so objects used by different threads never share one.
+ */
+#define LOKI_SMALLOBJ_CACHE_LINE_SIZE 64
+#endif
+
+#if defined(__cpp_aligned_new) && (__cpp_aligned_new >= 201606L)
+/// Defined if the align_val_t overloads of operator new are available.
+#define LOKI_HAS_ALIGNED_NEW
+#endif
+
+#ifndef LOKI_SMALLOBJ_SAMPLE_INTERVAL
+/** Mean # of bytes allocated between samples of the heap profiler.  Samples
+ are only taken while sampling is on.
+ @see SmallObjProfiler::SetSampling
+ */
+#define LOKI_SMALLOBJ_SAMPLE_INTERVAL (512 * 1024)
+#endif
+
+#ifndef LOKI_SMALLOBJ_ADDRESS_BITS
+/// # of significant bits in a user-space address.
+#define LOKI_SMALLOBJ_ADDRESS_BITS ((sizeof(void *) > 4) ? 48 : 32)
+#endif
+
 #ifndef LOKI_DEFAULT_SMALLOBJ_LIFETIME
 #define LOKI_DEFAULT_SMALLOBJ_LIFETIME                                         \
   ::Loki::LongevityLifetime::DieAsSmallObjectParent
@@ -57,148 +122,2129 @@
 #undef LOKI_SMALL_OBJECT_USE_NEW_ARRAY
 #endif
 
-///  \defgroup  SmallObjectGroup Small objects
-///
-///  \defgroup  SmallObjectGroupInternal Internals
-///  \ingroup   SmallObjectGroup
+///  \defgroup  SmallObjectGroup Small objects
+///
+///  \defgroup  SmallObjectGroupInternal Internals
+///  \ingroup   SmallObjectGroup
+
+namespace Loki {
+namespace LongevityLifetime {
+/** @struct DieAsSmallObjectParent
+    @ingroup SmallObjectGroup
+    Lifetime policy to manage lifetime dependencies of
+    SmallObject base and child classes.
+    The Base class should have this lifetime
+*/
+template <class T> struct DieAsSmallObjectParent : DieLast<T> {};
+
+/** @struct DieAsSmallObjectChild
+    @ingroup SmallObjectGroup
+    Lifetime policy to manage lifetime dependencies of
+    SmallObject base and child classes.
+    The Child class should have this lifetime
+*/
+template <class T> struct DieAsSmallObjectChild : DieDirectlyBeforeLast<T> {};
+
+} // namespace LongevityLifetime
+
+namespace Private {
+class FixedAllocator;
+class ChunkMap;
+class ChunkArena;
+} // end namespace Private
+
+/** @struct SmallObjSizeClassStats
+    @ingroup SmallObjectGroup
+ Counters for one size class of a SmallObjAllocator.  Blocks held by the
+ per-thread caches of ThreadCachedLockable, or by the free stacks of
+ LockFreeLockable, count as live since the allocator handed them out.
+ */
+struct SmallObjSizeClassStats {
+  /// # of bytes in each block.
+  std::size_t blockSize;
+  /// # of blocks in each Chunk.
+  std::size_t blocksPerChunk;
+  /// # of blocks ever allocated.
+  std::uint64_t allocations;
+  /// # of blocks ever deallocated.
+  std::uint64_t deallocations;
+  /// # of blocks allocated now.
+  std::size_t liveBlocks;
+  /// Most blocks ever allocated at once.
+  std::size_t maxLiveBlocks;
+  /// # of Chunks held now, including spares.
+  std::size_t chunks;
+  /// # of Chunks with no allocated blocks.  This is never more than one
+  /// unless SmallObjAllocator::SetIncrementalTrim keeps spare Chunks.
+  std::size_t emptyChunks;
+  /// Most Chunks ever held at once.
+  std::size_t maxChunks;
+  /// # of bytes in all Chunks.
+  std::size_t bytesReserved;
+  /// # of bytes in allocated blocks.
+  std::size_t bytesInUse;
+};
+
+/** @struct SmallObjStats
+    @ingroup SmallObjectGroup
+ Snapshot of the counters of a SmallObjAllocator, as made by
+ AllocatorSingleton::GetStats.  The counters are kept all the time, since
+ updating them is a few increments inside calls which already hold the
+ allocator's lock.  Comparing bytesReserved with bytesInUse for each size
+ class shows how fragmented it is, and the fallback counts show how often
+ objects were too big for the pools.
+ */
+struct LOKI_EXPORT SmallObjStats {
+  /// One entry per size class, in increasing order of block size.
+  std::vector<SmallObjSizeClassStats> sizeClasses;
+  /// # of allocations passed to DefaultAllocator since they were too big.
+  std::uint64_t fallbackAllocations;
+  /// # of blocks passed to DefaultDeallocator.
+  std::uint64_t fallbackDeallocations;
+  /// Sum of bytesReserved over all size classes.
+  std::size_t bytesReserved;
+  /// Sum of bytesInUse over all size classes.
+  std::size_t bytesInUse;
+
+  /// Writes the snapshot as a table with one line per used size class.
+  void WriteText(std::ostream &out) const;
+
+  /// Writes the snapshot as a JSON object, including unused size classes.
+  void WriteJson(std::ostream &out) const;
+};
+
+/** @class SmallObjAccount
+    @ingroup SmallObjectGroup
+ Counters of the small objects of one subsystem, which SmallObject and its
+ relatives keep when given a SmallObjTag or SmallObjHeapTag.  Each object
+ is charged the size of the block it takes, so the live bytes are what the
+ subsystem holds of the pools.  Counting is a few relaxed atomic updates,
+ and needs no lock.  An account may have a budget: an allocation which
+ would take the live bytes past it fails as if memory ran out.
+
+ There is one account per Subsystem, made on first use and never
+ destroyed, since objects may be deleted during static destruction.  All
+ accounts are linked together, so a report can walk them.
+ @code
+ struct Cache { static const char *GetName(void) { return "cache"; } };
+ class Entry : public Loki::SmallObject<LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL,
+     LOKI_DEFAULT_CHUNK_SIZE, LOKI_MAX_SMALL_OBJECT_SIZE,
+     LOKI_DEFAULT_OBJECT_ALIGNMENT, LOKI_DEFAULT_SMALLOBJ_LIFETIME,
+     LOKI_DEFAULT_MUTEX, LOKI_DEFAULT_CHUNK_INDEX_TYPE,
+     Loki::SmallObjTag<Cache> > { ... };
+ Loki::SmallObjAccount::Get<Cache>().SetBudget(64 * 1024 * 1024);
+ @endcode
+ */
+class LOKI_EXPORT SmallObjAccount {
+public:
+  /// Returns the account of Subsystem, whose GetName names it.
+  template <class Subsystem> static SmallObjAccount &Get(void) {
+    static SmallObjAccount *account = new SmallObjAccount(Subsystem::GetName());
+    return *account;
+  }
+
+  /// Returns the account made last, or nullptr.
+  static SmallObjAccount *GetFirst(void);
+
+  /// Writes one line for every account.
+  static void WriteText(std::ostream &out);
+
+  /// Returns the next account in the list, or nullptr.
+  inline SmallObjAccount *GetNext(void) const { return next_; }
+
+  inline const char *GetName(void) const { return name_; }
+
+  /// Returns # of bytes in the blocks of live objects.
+  inline std::size_t GetLiveBytes(void) const {
+    return liveBytes_.load(std::memory_order_relaxed);
+  }
+
+  /// Returns most # of bytes ever live at once, or since ResetPeak.
+  inline std::size_t GetPeakBytes(void) const {
+    return peakBytes_.load(std::memory_order_relaxed);
+  }
+
+  /// Makes the peak the current live bytes.
+  inline void ResetPeak(void) {
+    peakBytes_.store(GetLiveBytes(), std::memory_order_relaxed);
+  }
+
+  /// Returns # of objects ever allocated.
+  inline std::uint64_t GetAllocations(void) const {
+    return allocations_.load(std::memory_order_relaxed);
+  }
+
+  /// Returns # of objects ever deallocated.
+  inline std::uint64_t GetDeallocations(void) const {
+    return deallocations_.load(std::memory_order_relaxed);
+  }
+
+  /// Returns # of allocations which failed because of the budget.
+  inline std::uint64_t GetRefusals(void) const {
+    return refusals_.load(std::memory_order_relaxed);
+  }
+
+  /// Returns most # of live bytes allowed, or zero if there is no budget.
+  inline std::size_t GetBudget(void) const {
+    return budget_.load(std::memory_order_relaxed);
+  }
+
+  /** Sets most # of live bytes allowed, or zero for no budget.  Objects
+   already live stay live if they exceed it.
+   */
+  inline void SetBudget(std::size_t budget) {
+    budget_.store(budget, std::memory_order_relaxed);
+  }
+
+  /** Charges bytes for one object.
+   @return False if that would exceed the budget, which charges nothing.
+   */
+  inline bool Charge(std::size_t bytes) {
+    const std::size_t live =
+        liveBytes_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    const std::size_t budget = budget_.load(std::memory_order_relaxed);
+    if ((0 != budget) && (budget < live)) {
+      liveBytes_.fetch_sub(bytes, std::memory_order_relaxed);
+      refusals_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    allocations_.fetch_add(1, std::memory_order_relaxed);
+    std::size_t peak = peakBytes_.load(std::memory_order_relaxed);
+    while ((peak < live) && !peakBytes_.compare_exchange_weak(
+                                peak, live, std::memory_order_relaxed))
+      ;
+    return true;
+  }
+
+  /// Gives back bytes charged for one object.
+  inline void Credit(std::size_t bytes) {
+    liveBytes_.fetch_sub(bytes, std::memory_order_relaxed);
+    deallocations_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /// Gives back bytes charged for an object whose allocation then failed.
+  inline void Refund(std::size_t bytes) {
+    liveBytes_.fetch_sub(bytes, std::memory_order_relaxed);
+    allocations_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+private:
+  /// Links the account to the list of all accounts.
+  explicit SmallObjAccount(const char *name);
+  /// Never called, since accounts are never destroyed.
+  ~SmallObjAccount(void);
+  /// Copy-constructor is not implemented.
+  SmallObjAccount(const SmallObjAccount &);
+  /// Copy-assignment operator is not implemented.
+  SmallObjAccount &operator=(const SmallObjAccount &);
+
+  const char *const name_;
+  SmallObjAccount *next_;
+  std::atomic<std::size_t> liveBytes_;
+  std::atomic<std::size_t> peakBytes_;
+  std::atomic<std::size_t> budget_;
+  std::atomic<std::uint64_t> allocations_;
+  std::atomic<std::uint64_t> deallocations_;
+  std::atomic<std::uint64_t> refusals_;
+};
+
+/** @struct SmallObjTag
+    @ingroup SmallObjectGroup
+ Tag for SmallObject and its relatives, which charges their objects to the
+ SmallObjAccount of Subsystem.  They share the pools of untagged classes,
+ so only the account tells them apart.  Subsystem needs a static GetName.
+ */
+template <class Subsystem> struct SmallObjTag {
+  /// Pools come from the AllocatorSingleton of this tag.
+  typedef void PoolTag;
+
+  inline static SmallObjAccount &GetAccount(void) {
+    return SmallObjAccount::Get<Subsystem>();
+  }
+};
+
+/** @struct SmallObjHeapTag
+    @ingroup SmallObjectGroup
+ Like SmallObjTag, but also gives the classes of Subsystem pools of their
+ own, in an AllocatorSingleton whose GetStats covers only them.  Memory
+ held in those pools is never reused by other subsystems.
+ */
+template <class Subsystem> struct SmallObjHeapTag {
+  typedef Subsystem PoolTag;
+
+  inline static SmallObjAccount &GetAccount(void) {
+    return SmallObjAccount::Get<Subsystem>();
+  }
+};
+
+/** @struct SmallObjChunkState
+    @ingroup SmallObjectGroupInternal
+ Everything needed to rebuild the record of one Chunk of a SmallObjAllocator
+ from its storage, since the free blocks of a Chunk are linked through
+ indexes kept inside the blocks themselves.
+ */
+struct SmallObjChunkState {
+  /// Size class of the FixedAllocator which owns the Chunk.
+  std::size_t sizeClass;
+  /// Start of the Chunk's storage.
+  void *data;
+  /// Index of the first free block.
+  std::size_t firstAvailable;
+  /// # of free blocks.
+  std::size_t available;
+};
+
+/** @class SmallObjChunkSource
+    @ingroup SmallObjectGroupInternal
+ Provides the storage for the Chunks of a SmallObjAllocator in place of the
+ heap, e.g. slots of a memory-mapped file.  Each Chunk's storage must be
+ aligned on, and as long as, SmallObjAllocator::GetRegionChunkSize.
+ */
+class LOKI_EXPORT SmallObjChunkSource {
+public:
+  /// Returns storage for one Chunk, or nullptr if none is left.  No throw.
+  virtual void *AllocateChunk(void) = 0;
+
+  /// Takes back storage made by AllocateChunk.  This never throws.
+  virtual void DeallocateChunk(void *p) = 0;
+
+protected:
+  virtual ~SmallObjChunkSource(void) {}
+};
+
+class SmallObjAllocator;
+
+/** @class SmallObjProfiler
+    @ingroup SmallObjectGroup
+ Sampling heap profiler of one SmallObjAllocator, which tells which call
+ sites fill which size classes.  Each thread counts down the bytes it
+ allocates, and the block which takes the count past zero is sampled: its
+ backtrace and size class go into a table of live samples.  Each count is
+ drawn from an exponential distribution whose mean is the interval, so the
+ samples are a Poisson process over allocated bytes, and a sample of s
+ bytes stands for s / (1 - exp(-s / interval)) bytes.  When a sampled block
+ is deallocated, its sample moves to a table of freed samples.
+
+ Samples are only taken while sampling is on, which SetSampling switches
+ for the whole program.  While it is off, an allocation costs one relaxed
+ load.  While it is on, an allocation costs a thread-local subtraction, and
+ a deallocation costs a load from a small filter, unless the block is
+ sampled.
+ */
+class LOKI_EXPORT SmallObjProfiler {
+public:
+  /// # of slots in the filter which tells if a block may be sampled.
+  enum { FilterSize = 1024 };
+
+  /// Profiles blocks of allocator, one every LOKI_SMALLOBJ_SAMPLE_INTERVAL.
+  explicit SmallObjProfiler(const SmallObjAllocator &allocator);
+
+  ~SmallObjProfiler(void);
+
+  /** Turns sampling on or off for every allocator of the program.  It starts
+   off, unless the library was built with LOKI_SMALLOBJ_SAMPLING.
+   */
+  static inline void SetSampling(bool on) {
+    sampling_.store(on, std::memory_order_relaxed);
+  }
+
+  /// Returns true if the front ends count bytes towards samples.
+  static inline bool IsSampling(void) {
+    return sampling_.load(std::memory_order_relaxed);
+  }
+
+  /** Sets mean # of bytes allocated between samples.  Zero stops sampling,
+   but keeps the samples already taken.
+   */
+  void SetInterval(std::size_t bytes);
+
+  /// Returns mean # of bytes allocated between samples.
+  inline std::size_t GetInterval(void) const {
+    return interval_.load(std::memory_order_relaxed);
+  }
+
+  /** Samples block p of size bytes unless sampling is off, and returns #
+   of bytes the calling thread may allocate before its next sample.  The
+   front ends call this when the thread's count passes zero.  This never
+   throws.  If a sample can't be stored, it is dropped.
+   */
+  std::ptrdiff_t Sample(void *p, std::size_t size);
+
+  /** Returns # of bytes the calling thread may allocate before its next
+   sample, without sampling anything.  The front ends call this on the
+   thread's first allocation, so a new thread starts at a random point of
+   the interval rather than with a sample.  This never throws.
+   */
+  std::ptrdiff_t DrawCountdown(void);
+
+  /// Returns false if p is certainly not a sampled block.
+  inline bool MayHold(const void *p) const {
+    return 0 != filter_[GetSlot(p)].load(std::memory_order_relaxed);
+  }
+
+  /// Moves the sample of block p, if there is one, to the freed samples.
+  void Release(const void *p);
+
+  /// Forgets every sample, live or freed.
+  void Clear(void);
+
+  /// Returns # of samples of blocks which are still allocated.
+  std::size_t GetLiveSampleCount(void) const;
+
+  /// Returns # of samples of blocks which were deallocated.
+  std::size_t GetFreedSampleCount(void) const;
+
+  /** Writes estimated live bytes and objects for each size class, and then
+   for each call site, with symbol names where they can be found.
+   */
+  void WriteText(std::ostream &out) const;
+
+  /** Writes the samples in the legacy heap profile format which pprof
+   reads, with live and all-time counts for each call site, followed by the
+   mapped libraries of the process so pprof can find symbols.
+   */
+  void WritePprof(std::ostream &out) const;
+
+private:
+  /// Samples, kept in the source file.
+  struct Tables;
+
+  /// Not implemented.
+  SmallObjProfiler(const SmallObjProfiler &);
+  /// Not implemented.
+  SmallObjProfiler &operator=(const SmallObjProfiler &);
+
+  /// Returns a count drawn for interval, as DrawCountdown does.
+  static std::ptrdiff_t Draw(std::size_t interval);
+
+  /// Returns the filter slot of address p.
+  static inline std::size_t GetSlot(const void *p) {
+    const std::uintptr_t address = reinterpret_cast<std::uintptr_t>(p);
+    return static_cast<std::size_t>((address >> 4) ^ (address >> 14)) %
+           FilterSize;
+  }
+
+  /// True while the front ends count bytes towards samples.
+  static std::atomic<bool> sampling_;
+
+  /// Allocator whose blocks are sampled.
+  const SmallObjAllocator &allocator_;
+  /// Mean # of bytes between samples, or zero if sampling is off.
+  std::atomic<std::size_t> interval_;
+  /// # of live samples whose addresses fall in each slot.
+  std::atomic<unsigned int> filter_[FilterSize];
+  /// Live and freed samples.
+  Tables *tables_;
+};
+
+/** @class SmallObjAllocator
+    @ingroup SmallObjectGroupInternal
+ Manages pool of fixed-size allocators.
+ Designed to be a non-templated base class of AllocatorSingleton so that
+ implementation details can be safely hidden in the source code file.
+
+ @par Size Classes
+ Each FixedAllocator serves one size class.  Small classes are one object
+ alignment apart.  Once a power of two holds more than
+ LOKI_SMALLOBJ_CLASSES_PER_DOUBLING of those steps, classes are spaced so
+ there are only that many per power of two, e.g. 80, 96, 112 and 128 bytes.
+ That keeps the pool small when the max object size is a few KB, while
+ wasting at most a quarter of a block to rounding.
+ */
+class LOKI_EXPORT SmallObjAllocator {
+protected:
+  /** The only available constructor needs certain parameters in order to
+   initialize all the FixedAllocator's.  This throws only if
+   @param pageSize # of bytes in a page of memory.
+   @param maxObjectSize Max # of bytes which this may allocate.
+   @param objectAlignSize # of bytes between alignment boundaries.
+   @param maxBlocksPerChunk Most # of blocks in a Chunk.  Chunks of more
+    than UCHAR_MAX blocks use 16-bit stealth indexes, so this may not
+    exceed USHRT_MAX.
+   @param chunkSource Provides storage for Chunks, or nullptr for the heap.
+    It must outlive every Chunk, or have them dropped by DiscardChunks.
+   */
+  SmallObjAllocator(std::size_t pageSize, std::size_t maxObjectSize,
+                    std::size_t objectAlignSize,
+                    std::size_t maxBlocksPerChunk = UCHAR_MAX,
+                    SmallObjChunkSource *chunkSource = nullptr);
+
+  /** Destructor releases all blocks, all Chunks, and FixedAllocator's.
+   Any outstanding blocks are unavailable, and should not be used after
+   this destructor is called.  The destructor is deliberately non-virtual
+   because it is protected, not public.
+   */
+  ~SmallObjAllocator(void);
+
+public:
+  /** Allocates a block of memory of requested size.  Complexity is often
+   constant-time, but might be O(C) where C is the number of Chunks in a
+   FixedAllocator.
+
+   @par Exception Safety Level
+   Provides either strong-exception safety, or no-throw exception-safety
+   level depending upon doThrow parameter.  The reason it provides two
+   levels of exception safety is because it is used by both the nothrow
+   and throwing new operators.  The underlying implementation will never
+   throw of its own accord, but this can decide to throw if it does not
+   allocate.  The only exception it should emit is std::bad_alloc.
+
+   @par Allocation Failure
+   If it does not allocate, it will call TrimExcessMemory - or in
+   incremental trim mode, release up to LOKI_SMALLOBJ_FAILURE_TRIM_BUDGET
+   empty Chunks, and only call TrimExcessMemory if none were found - and
+   attempt to allocate again, before it decides to throw or return NULL.  Many
+   allocators loop through several new_handler functions, and terminate
+   if they can not allocate, but not this one.  It only makes one attempt
+   using its own implementation of the new_handler, and then returns NULL
+   or throws so that the program can decide what to do at a higher level.
+   (Side note: Even though the C++ Standard allows allocators and
+   new_handlers to terminate if they fail, the Loki allocator does not do
+   that since that policy is not polite to a host program.)
+
+   @param size # of bytes needed for allocation.
+   @param doThrow True if this should throw if unable to allocate, false
+    if it should provide no-throw exception safety level.
+   @return NULL if nothing allocated and doThrow is false.  Else the
+    pointer to an available block of memory.
+   */
+  void *Allocate(std::size_t size, bool doThrow);
+
+  /** Deallocates a block of memory at a given place and of a specific
+  size.  Complexity is constant-time, since the Chunk which owns the block
+  is found by a radix-tree lookup on its address.  This never throws.
+   */
+  void Deallocate(void *p, std::size_t size);
+
+  /** Deallocates a block of memory at a given place but of unknown size
+  size.  Complexity is constant-time, since the same radix-tree lookup
+  also tells which FixedAllocator owns the block.  This does not throw
+  exceptions.  This overloaded version of Deallocate is
+  called by the nothow delete operator - which is called when the nothrow
+  new operator is used, but a constructor throws an exception.
+   */
+  void Deallocate(void *p);
+
+  /** Allocates count blocks of numBytes each, and stores them in blocks.
+   The size class is found once, and each Chunk is drained of as many
+   blocks as it has before the next Chunk is searched.  This never throws.
+   @return # of blocks allocated, which is less than count only if memory
+    ran out.
+   */
+  std::size_t AllocateBatch(std::size_t numBytes, void **blocks,
+                            std::size_t count);
+
+  /** Deallocates count blocks of numBytes each.  The size class is found
+   once, and consecutive blocks from the same Chunk are freed without
+   looking up their Chunk again.  Null pointers are skipped.  This never
+   throws.
+   */
+  void DeallocateBatch(void **blocks, std::size_t count, std::size_t numBytes);
+
+  /** Returns the pool which makes blocks of numBytes, or nullptr if
+   numBytes is larger than the max object size.  A caller which knows the
+   size at compile time can look the pool up once, and then allocate with
+   AllocateFrom and DeallocateTo, which skip the size checks and the size
+   class lookup.  The pool lives as long as this allocator.
+   */
+  Loki::Private::FixedAllocator *GetPool(std::size_t numBytes);
+
+  /** Allocates a block from pool, which must come from GetPool of this
+   allocator.  Fails the same way as Allocate.
+   */
+  void *AllocateFrom(Loki::Private::FixedAllocator &pool, bool doThrow);
+
+  /// Deallocates block p, which came from AllocateFrom with the same pool.
+  void DeallocateTo(Loki::Private::FixedAllocator &pool, void *p);
+
+  /// Returns max # of bytes which this can allocate.
+  inline std::size_t GetMaxObjectSize() const { return maxSmallObjectSize_; }
+
+  /// Returns # of bytes in a page, from which blocks per Chunk are found.
+  inline std::size_t GetPageSize() const { return pageSize_; }
+
+  /// Returns # of bytes between allocation boundaries.
+  inline std::size_t GetAlignment() const { return objectAlignSize_; }
+
+  /** Returns # of bytes to pass to Allocate and Deallocate for a block of
+   numBytes aligned on alignment, or zero if no pool gives that alignment.
+   The size is rounded up to the alignment, and the pools are grouped by
+   alignment: every pool whose block size is a multiple of alignment gives
+   blocks so aligned, since each Chunk is aligned on at least its length.
+   */
+  std::size_t GetAlignedSize(std::size_t numBytes,
+                             std::size_t alignment) const;
+
+  /// Returns most # of blocks which a Chunk may hold.
+  inline std::size_t GetMaxBlocksPerChunk() const {
+    return maxBlocksPerChunk_;
+  }
+
+  /** Returns a number which no other SmallObjAllocator made by this
+   process has, even one made again at the same address after this one was
+   destroyed.  So pointers into the pools may be kept along with it.
+   */
+  inline std::uint64_t GetGeneration() const { return generation_; }
+
+  /// Returns # of size classes, each served by its own FixedAllocator.
+  inline std::size_t GetSizeClassCount() const { return sizeClassCount_; }
+
+  /** Returns index of the smallest size class whose blocks can hold
+   numBytes, which may not exceed GetMaxObjectSize.  This is a lookup in
+   a table made by the constructor.
+   */
+  inline std::size_t GetSizeClass(std::size_t numBytes) const {
+    assert(numBytes <= maxSmallObjectSize_);
+    if (0 == numBytes)
+      numBytes = 1;
+    return sizeClassTable_[(numBytes + objectAlignSize_ - 1) /
+                               objectAlignSize_ -
+                           1];
+  }
+
+  /// Returns # of bytes in each block of a size class.
+  std::size_t GetBlockSize(std::size_t sizeClass) const;
+
+  /** Returns true if p is a block of one of the pools.  Complexity is
+   constant-time, since it is a radix-tree lookup on its address.
+   */
+  bool HasBlock(const void *p) const;
+
+  /** Returns # of bytes in the block at p, or zero if p is not a block of
+   one of the pools.  This is as fast as HasBlock.
+   */
+  std::size_t GetBlockSizeOf(const void *p) const;
+
+  /** Returns # of bytes a block for numBytes takes: the block size of its
+   size class, or numBytes if it is too big for the pools.  This needs no
+   lock, since the size classes never change.
+   */
+  std::size_t GetFootprint(std::size_t numBytes) const;
+
+  /** Returns storage for a region chunk of GetRegionChunkSize bytes, taken
+   from the same arena as the Chunks of the pools, or nullptr if none is
+   available.  RegionLockable uses this to carve objects by pointer bump.
+   This never throws.
+   */
+  void *AllocateRegionChunk(void);
+
+  /// Releases storage made by AllocateRegionChunk.
+  void DeallocateRegionChunk(void *p);
+
+  /// Returns # of bytes in each region chunk.
+  std::size_t GetRegionChunkSize(void) const;
+
+  /** Returns the least power of two on which any Chunk is aligned.  Blocks
+   of at most one Chunk lie in each range of addresses so aligned.
+   */
+  std::size_t GetLeastChunkAlignment(void) const;
+
+  /** Releases empty Chunks from memory.  Complexity is O(F + C) where F
+  is the count of FixedAllocator's in the pool, and C is the number of
+  Chunks in all FixedAllocator's.  This will never throw.  This is called
+  by AllocatorSingleto::ClearExtraMemory, the new_handler function for
+  Loki's allocator, and is called internally when an allocation fails.
+  If the library is built with LOKI_SMALLOBJ_MMAP_ARENA, the pages of
+  released Chunks go back to the OS, so this lowers resident memory.
+  @return True if any memory released, or false if none released.
+   */
+  bool TrimExcessMemory(void);
+
+  /** Releases at most budget empty Chunks, leaving up to
+   GetKeepEmptyChunks empty Chunks in each size class.  Each call resumes
+   at the size class where the last one stopped, so a maintenance thread
+   can call this now and then with a small budget to trim every pool
+   gradually, and never hold the lock for long.  Complexity is
+   O(F + budget) where F is the count of FixedAllocator's.  This never
+   throws.
+   @return # of Chunks released.
+   */
+  std::size_t Trim(std::size_t budget);
+
+  /** Selects how Chunks emptied by Deallocate are handled.  By default, a
+   size class keeps one empty Chunk, and releases another Chunk as soon as
+   it becomes empty.  In incremental mode, each emptied Chunk is kept as a
+   spare, so a burst of frees followed by a burst of allocations does not
+   release and reacquire memory, and no memory is released in Deallocate.
+   Spares are released later by Trim - down to keepEmptyChunks per size
+   class - or by TrimExcessMemory.  Either way, keepEmptyChunks is how
+   many empty Chunks Trim leaves in each size class.
+   */
+  void SetIncrementalTrim(bool incremental, std::size_t keepEmptyChunks);
+
+  /// Returns true if Chunks emptied by Deallocate are kept as spares.
+  inline bool IsIncrementalTrim() const { return incrementalTrim_; }
+
+  /// Returns # of empty Chunks which Trim leaves in each size class.
+  inline std::size_t GetKeepEmptyChunks() const { return keepEmptyChunks_; }
+
+  /** Returns true if anything in implementation is corrupt.  Complexity
+   is O(F + C + B) where F is the count of FixedAllocator's in the pool,
+   C is the number of Chunks in all FixedAllocator's, and B is the number
+   of blocks in all Chunks.  If it determines any data is corrupted, this
+   will return true in release version, but assert in debug version at
+   the line where it detects the corrupted data.  If it does not detect
+   any corrupted data, it returns false.
+   */
+  bool IsCorrupt(void) const;
+
+  /** Fills stats with the counters of every size class.  Complexity is
+   O(F) where F is the count of FixedAllocator's in the pool.  This throws
+   only if the vector of size classes can't grow.
+   */
+  void GetStats(SmallObjStats &stats) const;
+
+  /** Returns the heap profiler of this allocator, which is made by the
+   first call.  This is safe to call from any thread.
+   @throw std::bad_alloc if the profiler can't be made.
+   */
+  SmallObjProfiler &GetProfiler(void);
+
+protected:
+  /** Fills state with the record of the Chunk which holds p, and returns
+   true, or returns false if no Chunk in the pools holds p.  This is as fast
+   as HasBlock.
+   */
+  bool GetChunkState(const void *p, SmallObjChunkState &state) const;
+
+  /** Fills states with the records of all Chunks, including spares.
+   @throw std::bad_alloc if the vector can't grow.
+   */
+  void GetChunkStates(std::vector<SmallObjChunkState> &states) const;
+
+  /** Puts a Chunk whose storage already holds blocks back into its size
+   class, as recorded by GetChunkState.  The free blocks are checked before
+   the Chunk is taken.  If its size class already has an empty Chunk, an
+   empty one is released to the Chunk source instead.  This never throws.
+   @return False if the record is invalid or the pool can't grow.
+   */
+  bool AdoptChunk(const SmallObjChunkState &state);
+
+  /** Forgets all Chunks without releasing their storage, for when that
+   storage goes away on its own, e.g. when a file is unmapped.  Blocks in
+   those Chunks must not be deallocated afterwards.
+   */
+  void DiscardChunks(void);
+
+private:
+  /// Default-constructor is not implemented.
+  SmallObjAllocator(void);
+  /// Copy-constructor is not implemented.
+  SmallObjAllocator(const SmallObjAllocator &);
+  /// Copy-assignment operator is not implemented.
+  SmallObjAllocator &operator=(const SmallObjAllocator &);
+
+  /** Releases at most budget empty Chunks, leaving up to keep empty
+   Chunks in each size class, starting at trimCursor_.
+   */
+  std::size_t TrimSome(std::size_t keep, std::size_t budget);
+
+  /** Releases memory after an allocation failed.  In incremental mode,
+   this first tries releasing a few empty Chunks, and calls
+   TrimExcessMemory only if there were none.
+   @return True if any memory released.
+   */
+  bool TrimAfterFailure(void);
+
+  /// Pointer to array of fixed-size allocators.
+  Loki::Private::FixedAllocator *pool_;
+
+  /// Finds the FixedAllocator and Chunk which own a block.
+  Loki::Private::ChunkMap *chunkMap_;
+
+  /// Provides storage for the Chunks of all FixedAllocator's.
+  Loki::Private::ChunkArena *chunkArena_;
+
+  /// # of bytes in a page of memory.
+  const std::size_t pageSize_;
+
+  /// Largest object size supported by allocators.
+  const std::size_t maxSmallObjectSize_;
+
+  /// Size of alignment boundaries.
+  const std::size_t objectAlignSize_;
+
+  /// Most # of blocks in a Chunk.
+  const std::size_t maxBlocksPerChunk_;
+
+  /// # of size classes, and of FixedAllocator's in the pool.
+  std::size_t sizeClassCount_;
+
+  /// Size class for each multiple of the alignment up to the max size.
+  unsigned short *sizeClassTable_;
+
+  /// # of calls to DefaultAllocator.
+  std::uint64_t fallbackAllocations_;
+
+  /// # of calls to DefaultDeallocator.
+  std::uint64_t fallbackDeallocations_;
+
+  /// True if Chunks emptied by Deallocate are kept as spares.
+  bool incrementalTrim_;
+
+  /// # of empty Chunks which Trim leaves in each size class.
+  std::size_t keepEmptyChunks_;
+
+  /// Size class where the next Trim starts.
+  std::size_t trimCursor_;
+
+  /// Heap profiler, or nullptr until GetProfiler is first called.
+  std::atomic<SmallObjProfiler *> profiler_;
+
+  /// Tells this allocator from any other made by the process.
+  const std::uint64_t generation_;
+};
+
+/** @class ThreadCachedLockable
+    @ingroup SmallObjectGroup
+ ThreadingModel policy for SmallObject, SmallValueObject and
+ AllocatorSingleton.  It locks exactly like ClassLevelLockable, but when it
+ is used, SmallObjectBase puts a per-thread cache of free blocks in front of
+ the allocator.  Each thread keeps a small stack ("magazine") of blocks for
+ each size class, so most allocations and deallocations take no lock at all.
+ An empty magazine is refilled from the shared FixedAllocator, and a full one
+ is flushed back to it, a batch of blocks at a time under one lock.
+
+ A block may be released by another thread than the one which allocated it;
+ it just goes into the releasing thread's cache.  Blocks held by a thread's
+ cache are returned to the shared allocator when that thread exits.  Those
+ blocks are seen as allocated by TrimExcessMemory and IsCorrupt.
+ */
+template <class Host, class MutexPolicy = LOKI_DEFAULT_MUTEX>
+class ThreadCachedLockable : public ClassLevelLockable<Host, MutexPolicy> {};
+
+namespace Private {
+
+/** @class ThreadCache
+    @ingroup SmallObjectGroupInternal
+ Per-thread magazines of free blocks used by ThreadCachedLockable.  There is
+ one cache per thread for each allocator singleton.  AllocSingleton is the
+ SingletonHolder of the allocator, and LockT is the lock which guards the
+ shared allocator.
+ */
+template <class AllocSingleton, class LockT> class ThreadCache {
+public:
+  /** Pops a block for size bytes from this thread's magazine, refilling the
+   magazine under the lock if it is empty.  Sizes which the pools can not
+   handle go straight to the shared allocator.
+   */
+  static void *Allocate(std::size_t size, bool doThrow) {
+    ThreadCache *cache = Current();
+    Magazine *magazine = (nullptr == cache) ? nullptr : cache->Find(size);
+    if (nullptr == magazine) {
+      LockT lock;
+      (void)lock; // get rid of warning
+      return AllocSingleton::Instance().Allocate(size, doThrow);
+    }
+    if ((0 == magazine->count_) && !cache->Refill(*magazine)) {
+      if (doThrow)
+        throw std::bad_alloc();
+      return nullptr;
+    }
+    return magazine->blocks_[--magazine->count_];
+  }
+
+  /** Pushes the block onto this thread's magazine, first flushing half of
+   the magazine under the lock if it is full.
+   */
+  static void Deallocate(void *p, std::size_t size) {
+    if (nullptr == p)
+      return;
+    ThreadCache *cache = Current();
+    Magazine *magazine = (nullptr == cache) ? nullptr : cache->Find(size);
+    if (nullptr == magazine) {
+      LockT lock;
+      (void)lock; // get rid of warning
+      AllocSingleton::Instance().Deallocate(p, size);
+      return;
+    }
+    if (Capacity == magazine->count_)
+      cache->Flush(*magazine, Capacity / 2);
+    magazine->blocks_[magazine->count_++] = p;
+  }
+
+private:
+  /// Most # of blocks a magazine holds, and twice the # moved per batch.
+  enum { Capacity = LOKI_SMALLOBJ_THREAD_CACHE_SIZE };
+
+  /// Stack of free blocks of a single size class.
+  struct Magazine {
+    std::size_t blockSize_;
+    std::size_t count_;
+    void *blocks_[Capacity];
+  };
+
+  /// Whether the calling thread's cache exists yet, or was destroyed.
+  enum State { Unused, Alive, Dead };
+
+  explicit ThreadCache(State &state)
+      : state_(state), magazines_(nullptr), magazineCount_(0),
+        allocator_(nullptr), maxObjectSize_(0) {
+    state_ = Alive;
+  }
+
+  /// Returns every cached block to the shared allocator.
+  ~ThreadCache(void) {
+    for (std::size_t ii = 0; ii < magazineCount_; ++ii) {
+      if (nullptr == magazines_[ii])
+        continue;
+      Flush(*magazines_[ii], magazines_[ii]->count_);
+      delete magazines_[ii];
+    }
+    delete[] magazines_;
+    state_ = Dead;
+  }
+
+  /** Returns the calling thread's cache, or nullptr if the thread is past
+   the point where its thread_local objects were destroyed.
+   */
+  static ThreadCache *Current(void) {
+    static thread_local State state = Unused;
+    if (Dead == state)
+      return nullptr;
+    static thread_local ThreadCache cache(state);
+    return &cache;
+  }
+
+  /// Returns the magazine for size bytes, or nullptr if size is too big.
+  Magazine *Find(std::size_t size) {
+    if (nullptr == magazines_) {
+      allocator_ = &AllocSingleton::Instance();
+      maxObjectSize_ = allocator_->GetMaxObjectSize();
+      magazineCount_ = allocator_->GetSizeClassCount();
+      magazines_ = new Magazine *[magazineCount_]();
+    }
+    if (size > maxObjectSize_)
+      return nullptr;
+    const std::size_t index = allocator_->GetSizeClass(size);
+    if (nullptr == magazines_[index]) {
+      magazines_[index] = new Magazine;
+      magazines_[index]->blockSize_ = allocator_->GetBlockSize(index);
+      magazines_[index]->count_ = 0;
+    }
+    return magazines_[index];
+  }
+
+  /// Moves up to half a magazine of blocks from the shared allocator.
+  bool Refill(Magazine &magazine) {
+    LockT lock;
+    (void)lock; // get rid of warning
+    SmallObjAllocator &allocator = AllocSingleton::Instance();
+    magazine.count_ += allocator.AllocateBatch(
+        magazine.blockSize_, magazine.blocks_ + magazine.count_,
+        Capacity / 2 - magazine.count_);
+    return (0 < magazine.count_);
+  }
+
+  /// Moves count blocks from the top of the magazine to the shared allocator.
+  void Flush(Magazine &magazine, std::size_t count) {
+    if (0 == count)
+      return;
+    LockT lock;
+    (void)lock; // get rid of warning
+    SmallObjAllocator &allocator = AllocSingleton::Instance();
+    magazine.count_ -= count;
+    allocator.DeallocateBatch(magazine.blocks_ + magazine.count_, count,
+                              magazine.blockSize_);
+  }
+
+  /// Not implemented.
+  ThreadCache(const ThreadCache &);
+  /// Not implemented.
+  ThreadCache &operator=(const ThreadCache &);
+
+  State &state_;
+  Magazine **magazines_;
+  std::size_t magazineCount_;
+  const SmallObjAllocator *allocator_;
+  std::size_t maxObjectSize_;
+};
+
+} // end namespace Private
+
+/** @class LockFreeLockable
+    @ingroup SmallObjectGroup
+ ThreadingModel policy for SmallObject, SmallValueObject and
+ AllocatorSingleton.  It locks exactly like ClassLevelLockable, but when it
+ is used, SmallObjectBase puts a bounded lock-free stack of free blocks in
+ front of each size class of the allocator.  The common allocation or
+ deallocation is two compare-and-swaps, on heads tagged with a counter to
+ defeat the ABA problem.  An empty stack is refilled under the lock with
+ LOKI_SMALLOBJ_LOCK_FREE_BATCH blocks, which are then published to all
+ threads with one compare-and-swap.  A full stack is flushed by half back
+ to the allocator under the lock, as ThreadCachedLockable does.
+
+ Blocks on a stack are seen as allocated by TrimExcessMemory, GetStats and
+ IsCorrupt, but there are at most LOKI_SMALLOBJ_LOCK_FREE_DEPTH of them per
+ size class.  The stacks are never destroyed, so use this with a
+ LifetimePolicy such as NoDestroy which keeps the allocator alive until
+ exit.
+ */
+template <class Host, class MutexPolicy = LOKI_DEFAULT_MUTEX>
+class LockFreeLockable : public ClassLevelLockable<Host, MutexPolicy> {};
+
+namespace Private {
+
+/** @class LockFreeStack
+    @ingroup SmallObjectGroupInternal
+ Bounded lock-free stack of free blocks for LockFreeLockable.  The stack
+ owns Capacity nodes, each of which holds a block and the index of the node
+ below it, so no link is ever kept in a block.  A thread delayed in Pop
+ thus reads only a node, never a block which another thread may own by
+ now.  Nodes not in use are on a second stack of spare nodes, and Push
+ fails once there are none.
+
+ Each head keeps the index of its top node in the low 32 bits, and a tag
+ which changes on every update in the high 32 bits.  So addresses may use
+ all 64 bits, and a thread must be delayed for 2^32 updates of a head
+ before it could mistake a recycled node for the one it saw.
+ */
+class LockFreeStack {
+public:
+  /// Most # of blocks on the stack.
+  enum { Capacity = LOKI_SMALLOBJ_LOCK_FREE_DEPTH };
+
+  LockFreeStack(void)
+      : head_(Pack(NoNode, 0)), spare_(Pack(0, 0)), blockSize_(0) {
+    for (std::uint32_t ii = 0; ii < Capacity; ++ii) {
+      nodes_[ii].block_ = nullptr;
+      nodes_[ii].next_.store((ii + 1 < Capacity) ? ii + 1 : NoNode,
+                             std::memory_order_relaxed);
+    }
+  }
+
+  /// Returns the top block, or nullptr if the stack is empty.
+  void *Pop(void) {
+    const std::uint32_t node = PopNode(head_);
+    if (NoNode == node)
+      return nullptr;
+    void *block = nodes_[node].block_;
+    PushNode(spare_, node, node);
+    return block;
+  }
+
+  /// Pushes block, unless the stack is full.  @return False if it is.
+  bool Push(void *block) { return 1 == Push(&block, 1); }
+
+  /** Pushes as many of count blocks as there is room for, with one
+   compare-and-swap.  blocks[0] ends up on top.
+   @return # of blocks pushed, from the start of blocks.
+   */
+  std::size_t Push(void *const *blocks, std::size_t count) {
+    std::uint32_t first = NoNode;
+    std::uint32_t last = NoNode;
+    std::size_t pushed = 0;
+    for (; pushed < count; ++pushed) {
+      const std::uint32_t node = PopNode(spare_);
+      if (NoNode == node)
+        break;
+      nodes_[node].block_ = blocks[pushed];
+      if (NoNode == last)
+        first = node;
+      else
+        nodes_[last].next_.store(node, std::memory_order_relaxed);
+      last = node;
+    }
+    if (0 < pushed)
+      PushNode(head_, first, last);
+    return pushed;
+  }
+
+  inline std::size_t GetBlockSize(void) const { return blockSize_; }
+  inline void SetBlockSize(std::size_t blockSize) { blockSize_ = blockSize; }
+
+private:
+  /// Index of no node, which ends a stack.
+  static const std::uint32_t NoNode = 0xFFFFFFFF;
+
+  struct Node {
+    /// Written only by the thread which took the node off a stack.
+    void *block_;
+    /// Atomic, since a thread delayed in PopNode may read it at any time.
+    std::atomic<std::uint32_t> next_;
+  };
+
+  static std::uint32_t GetIndex(std::uint64_t head) {
+    return static_cast<std::uint32_t>(head);
+  }
+
+  /// Combines node with the tag of tagSource, advanced by one.
+  static std::uint64_t Pack(std::uint32_t node, std::uint64_t tagSource) {
+    return (((tagSource >> 32) + 1) << 32) | node;
+  }
+
+  /// Takes the top node off the stack at head, or returns NoNode.
+  std::uint32_t PopNode(std::atomic<std::uint64_t> &head) {
+    std::uint64_t old = head.load(std::memory_order_acquire);
+    for (;;) {
+      const std::uint32_t top = GetIndex(old);
+      if (NoNode == top)
+        return NoNode;
+      // If another thread took top first, next may be stale, but then the
+      // tag has changed and the swap fails.
+      const std::uint32_t next =
+          nodes_[top].next_.load(std::memory_order_relaxed);
+      if (head.compare_exchange_weak(old, Pack(next, old),
+                                     std::memory_order_acquire,
+                                     std::memory_order_acquire))
+        return top;
+    }
+  }
+
+  /// Puts the nodes linked from first to last on top of the stack at head.
+  void PushNode(std::atomic<std::uint64_t> &head, std::uint32_t first,
+                std::uint32_t last) {
+    std::uint64_t old = head.load(std::memory_order_relaxed);
+    for (;;) {
+      nodes_[last].next_.store(GetIndex(old), std::memory_order_relaxed);
+      if (head.compare_exchange_weak(old, Pack(first, old),
+                                     std::memory_order_release,
+                                     std::memory_order_relaxed))
+        return;
+    }
+  }
+
+  std::atomic<std::uint64_t> head_;
+  std::atomic<std::uint64_t> spare_;
+  std::size_t blockSize_;
+  /// Keeps the heads off the cache line of the nodes.
+  char padding_[64 - 2 * sizeof(std::atomic<std::uint64_t>) -
+                sizeof(std::size_t)];
+  Node nodes_[Capacity];
+};
+
+/** @class LockFreeCache
+    @ingroup SmallObjectGroupInternal
+ One LockFreeStack per size class of an allocator singleton, used by
+ LockFreeLockable.  The stacks are made on first use and live until the
+ program exits.
+ */
+template <class AllocSingleton, class LockT> class LockFreeCache {
+public:
+  static void *Allocate(std::size_t size, bool doThrow) {
+    LockFreeStack *stack = Find(size);
+    if (nullptr == stack) {
+      LockT lock;
+      (void)lock; // get rid of warning
+      return AllocSingleton::Instance().Allocate(size, doThrow);
+    }
+    void *place = stack->Pop();
+    if (nullptr == place)
+      place = Refill(*stack);
+    if ((nullptr == place) && doThrow)
+      throw std::bad_alloc();
+    return place;
+  }
+
+  static void Deallocate(void *p, std::size_t size) {
+    if (nullptr == p)
+      return;
+    LockFreeStack *stack = Find(size);
+    if (nullptr == stack) {
+      LockT lock;
+      (void)lock; // get rid of warning
+      AllocSingleton::Instance().Deallocate(p, size);
+      return;
+    }
+    if (!stack->Push(p))
+      Flush(*stack, p);
+  }
+
+private:
+  /// Array of stacks, one per size class.
+  struct Stacks {
+    Stacks(void) {
+      allocator_ = &AllocSingleton::Instance();
+      maxObjectSize_ = allocator_->GetMaxObjectSize();
+      const std::size_t count = allocator_->GetSizeClassCount();
+      stacks_ = new LockFreeStack[count];
+      for (std::size_t ii = 0; ii < count; ++ii)
+        stacks_[ii].SetBlockSize(allocator_->GetBlockSize(ii));
+    }
+
+    LockFreeStack *stacks_;
+    const SmallObjAllocator *allocator_;
+    std::size_t maxObjectSize_;
+  };
+
+  /// Returns the stack for size bytes, or nullptr if size is too big.
+  static LockFreeStack *Find(std::size_t size) {
+    // Never destroyed, so blocks may be freed during static destruction.
+    static Stacks &stacks = *new Stacks;
+    if (size > stacks.maxObjectSize_)
+      return nullptr;
+    return stacks.stacks_ + stacks.allocator_->GetSizeClass(size);
+  }
+
+  /// Returns one block, and pushes the rest of a batch onto the stack.
+  static void *Refill(LockFreeStack &stack) {
+    void *batch[LOKI_SMALLOBJ_LOCK_FREE_BATCH];
+    std::size_t count = 0;
+    {
+      LockT lock;
+      (void)lock; // get rid of warning
+      SmallObjAllocator &allocator = AllocSingleton::Instance();
+      count = allocator.AllocateBatch(stack.GetBlockSize(), batch,
+                                      LOKI_SMALLOBJ_LOCK_FREE_BATCH);
+    }
+    if (0 == count)
+      return nullptr;
+    // Other threads may have filled the stack meanwhile.
+    const std::size_t pushed = stack.Push(batch + 1, count - 1);
+    if (pushed + 1 < count) {
+      LockT lock;
+      (void)lock; // get rid of warning
+      SmallObjAllocator &allocator = AllocSingleton::Instance();
+      allocator.DeallocateBatch(batch + 1 + pushed, count - 1 - pushed,
+                                stack.GetBlockSize());
+    }
+    return batch[0];
+  }
+
+  /// Gives p and half the full stack back to the allocator, under the lock.
+  static void Flush(LockFreeStack &stack, void *p) {
+    void *batch[LockFreeStack::Capacity / 2 + 1];
+    std::size_t count = 0;
+    batch[count++] = p;
+    while (count < LockFreeStack::Capacity / 2 + 1) {
+      void *block = stack.Pop();
+      if (nullptr == block)
+        break;
+      batch[count++] = block;
+    }
+    LockT lock;
+    (void)lock; // get rid of warning
+    SmallObjAllocator &allocator = AllocSingleton::Instance();
+    allocator.DeallocateBatch(batch, count, stack.GetBlockSize());
+  }
+};
+
+} // end namespace Private
+
+/** @class RegionLockable
+    @ingroup SmallObjectGroup
+ ThreadingModel policy for SmallObject, SmallValueObject and
+ AllocatorSingleton.  It locks exactly like ClassLevelLockable, but when it
+ is used, objects made while a SmallObjRegion is open on the current thread
+ come from that region instead of the pools.  Allocation is a pointer bump,
+ deleting an object runs its destructor but releases nothing, and the
+ region gives back all its memory at once when it is reset or closed.  This
+ suits objects which all die together, such as the nodes built while
+ handling one request.  Objects made while no region is open come from the
+ pools as usual.
+
+ Objects in a region must be deleted - or abandoned - before the region is
+ closed.  Objects larger than the max small object size never go into a
+ region.
+ */
+template <class Host, class MutexPolicy = LOKI_DEFAULT_MUTEX>
+class RegionLockable : public ClassLevelLockable<Host, MutexPolicy> {};
+
+namespace Private {
+
+/** @class Region
+    @ingroup SmallObjectGroupInternal
+ Bump allocator used by RegionLockable.  It takes region chunks from the
+ same arena as the pools, and keeps their addresses sorted so it can tell
+ in O(log C) time whether it owns a block.  Each thread has a stack of open
+ regions for each allocator singleton, and new objects come from the
+ innermost one.  AllocSingleton is the SingletonHolder of the allocator, and
+ LockT is the lock which guards the shared allocator.
+ */
+template <class AllocSingleton, class LockT> class Region {
+public:
+  /// Opens a region as the innermost one of this thread.
+  Region(void)
+      : allocator_(AllocSingleton::Instance()),
+        chunkSize_(allocator_.GetRegionChunkSize()), outer_(Current()),
+        chunks_(), chunk_(nullptr), next_(nullptr), end_(nullptr) {
+    Current() = this;
+  }
+
+  /// Releases all memory, and reopens the enclosing region, if any.
+  ~Region(void) {
+    Release();
+    Current() = outer_;
+  }
+
+  /// Returns the innermost region open on this thread, or nullptr.
+  static Region *&Current(void) {
+    static thread_local Region *current = nullptr;
+    return current;
+  }
+
+  /** Returns a block of size bytes, rounded up to the allocator's
+   alignment, or nullptr if no memory is left.  The block comes from the
+   latest region chunk, or from a new one if that is full.
+   */
+  void *Allocate(std::size_t size) {
+    const std::size_t alignment = allocator_.GetAlignment();
+    size = (size + alignment - 1) / alignment * alignment;
+    if ((static_cast<std::size_t>(end_ - next_) < size) && !AddChunk())
+      return nullptr;
+    void *p = next_;
+    next_ += size;
+    return p;
+  }
+
+  /// Returns true if p is in a region chunk of this or any outer region.
+  bool Contains(const void *p) const {
+    unsigned char *pc = static_cast<unsigned char *>(const_cast<void *>(p));
+    for (const Region *region = this; nullptr != region;
+         region = region->outer_) {
+      const std::vector<unsigned char *> &chunks = region->chunks_;
+      std::vector<unsigned char *>::const_iterator it =
+          std::upper_bound(chunks.begin(), chunks.end(), pc);
+      if ((chunks.begin() != it) && (pc < *(--it) + chunkSize_))
+        return true;
+    }
+    return false;
+  }
+
+  /** Makes every block in the region available again, and keeps only the
+   latest region chunk.  Complexity is O(C) where C is the # of region
+   chunks.
+   */
+  void Reset(void) {
+    if (nullptr == chunk_)
+      return;
+    LockT lock;
+    (void)lock; // get rid of warning
+    for (std::size_t ii = 0; ii < chunks_.size(); ++ii) {
+      if (chunk_ != chunks_[ii])
+        allocator_.DeallocateRegionChunk(chunks_[ii]);
+    }
+    chunks_.assign(1, chunk_);
+    next_ = chunk_;
+  }
+
+  /// Gives every region chunk back.  Complexity is O(C).
+  void Release(void) {
+    if (chunks_.empty())
+      return;
+    LockT lock;
+    (void)lock; // get rid of warning
+    for (std::size_t ii = 0; ii < chunks_.size(); ++ii)
+      allocator_.DeallocateRegionChunk(chunks_[ii]);
+    chunks_.clear();
+    chunk_ = next_ = end_ = nullptr;
+  }
+
+private:
+  /// Not implemented.
+  Region(const Region &);
+  /// Not implemented.
+  Region &operator=(const Region &);
+
+  /// Takes a region chunk from the allocator under the lock.
+  bool AddChunk(void) {
+    LockT lock;
+    (void)lock; // get rid of warning
+    unsigned char *chunk =
+        static_cast<unsigned char *>(allocator_.AllocateRegionChunk());
+    if (nullptr == chunk)
+      return false;
+    try {
+      chunks_.insert(std::upper_bound(chunks_.begin(), chunks_.end(), chunk),
+                     chunk);
+    } catch (...) {
+      allocator_.DeallocateRegionChunk(chunk);
+      return false;
+    }
+    chunk_ = next_ = chunk;
+    end_ = chunk + chunkSize_;
+    return true;
+  }
+
+  SmallObjAllocator &allocator_;
+  const std::size_t chunkSize_;
+  Region *outer_;
+  /// Every region chunk, sorted by address.
+  std::vector<unsigned char *> chunks_;
+  /// Latest region chunk, from which blocks are bumped.
+  unsigned char *chunk_;
+  unsigned char *next_;
+  unsigned char *end_;
+};
+
+} // end namespace Private
+
+/** @class ThreadOwnedLockable
+    @ingroup SmallObjectGroup
+ ThreadingModel policy for SmallObject, SmallValueObject and
+ AllocatorSingleton.  It locks exactly like ClassLevelLockable, but when it
+ is used, each thread allocates from a heap of its own - a private set of
+ pools which no other thread allocates from - so allocations take no lock.
+ Every Chunk is recorded as owned by its heap.  A block freed by its owning
+ thread goes straight back to its Chunk.  A block freed by another thread
+ is pushed onto a lock-free list of remote frees of the owning heap, which
+ the owner drains in one batch on its next allocation.  So objects made by
+ a producer thread and deleted by a consumer thread cost neither of them a
+ lock, and the memory always returns to the producer's pools.
+
+ When a thread exits, its heap is abandoned: remote frees into it are then
+ drained under the lock, and the next thread which needs a heap adopts it,
+ so its memory is not lost.  Sizes too small to hold a pointer, and sizes
+ above the max small object size, go to the shared allocator under the
+ lock.  Blocks held by the heaps are not seen by TrimExcessMemory, IsCorrupt
+ or GetStats of the shared allocator.
+ */
+template <class Host, class MutexPolicy = LOKI_DEFAULT_MUTEX>
+class ThreadOwnedLockable : public ClassLevelLockable<Host, MutexPolicy> {};
+
+namespace Private {
+
+/** @class OwnerMap
+    @ingroup SmallObjectGroupInternal
+ Lock-free radix tree which maps each aligned range of addresses to the
+ heap owning the Chunk there.  Ranges are as long as the least alignment of
+ any Chunk, so a Chunk may span several of them, but none holds blocks of
+ two Chunks.  Nodes are only added, with a compare-and-
+ swap, and never released until the map is destroyed, so any thread may
+ look up an address while another records one.
+ */
+class LOKI_EXPORT OwnerMap {
+public:
+  /// @param chunkAlignment Power of two, the least alignment of any Chunk.
+  explicit OwnerMap(std::size_t chunkAlignment);
+
+  /// Releases all nodes of the radix tree.
+  ~OwnerMap(void);
+
+  /** Returns the entry for the aligned range containing p, or nullptr if
+   none exists and doCreate is false, or if a node can't be allocated.
+   */
+  std::atomic<void *> *GetEntry(const void *p, bool doCreate);
+
+  /// Returns owner of the aligned range containing p, or nullptr.
+  inline void *Find(const void *p) {
+    std::atomic<void *> *entry = GetEntry(p, false);
+    return (nullptr == entry) ? nullptr : entry->load();
+  }
+
+private:
+  /// Each node of the tree is indexed by NodeBits bits of the key.
+  enum { NodeBits = 9, NodeSize = 1 << NodeBits };
+
+  /// Releases node and all of its children.
+  static void FreeNode(std::atomic<void *> *node, unsigned int level);
+
+  /// Not implemented.
+  OwnerMap(const OwnerMap &);
+  /// Not implemented.
+  OwnerMap &operator=(const OwnerMap &);
+
+  std::atomic<void *> root_;
+  /// log2 of the least chunk alignment.
+  unsigned int shift_;
+  /// # of levels in the tree, including the leaves.
+  unsigned int levels_;
+};
+
+/** @class OwnedHeap
+    @ingroup SmallObjectGroupInternal
+ Per-thread heap used by ThreadOwnedLockable.  Each heap is a private
+ SmallObjAllocator with the same parameters as the shared one, plus a list
+ of blocks freed by other threads, linked through their first bytes.
+ AllocSingleton is the SingletonHolder of the shared allocator, and LockT is
+ the lock which guards it, and also guards abandoned heaps.
+ */
+template <class AllocSingleton, class LockT>
+class OwnedHeap : public SmallObjAllocator {
+public:
+  /// Allocates from this thread's heap, which takes no lock.
+  static void *Allocate(std::size_t size, bool doThrow) {
+    OwnedHeap *heap = Current(true);
+    if ((nullptr != heap) && heap->Owns(size))
+      return heap->AllocateOwned(size, doThrow);
+    LockT lock;
+    (void)lock; // get rid of warning
+    // Past thread exit, blocks come from a heap which is always abandoned.
+    heap = GetShared().orphan_;
+    if (heap->Owns(size))
+      return heap->AllocateOwned(size, doThrow);
+    return AllocSingleton::Instance().Allocate(size, doThrow);
+  }
+
+  /** Frees a block into its Chunk if this thread owns it, or else pushes it
+   onto the remote free list of its owner.
+   */
+  static void Deallocate(void *p, std::size_t size) {
+    if (nullptr == p)
+      return;
+    Shared &shared = GetShared();
+    if (!shared.orphan_->Owns(size)) {
+      LockT lock;
+      (void)lock; // get rid of warning
+      AllocSingleton::Instance().Deallocate(p, size);
+      return;
+    }
+    OwnedHeap *owner = static_cast<OwnedHeap *>(shared.owners_.Find(p));
+    assert(nullptr != owner);
+    if (owner == Current(false))
+      owner->SmallObjAllocator::Deallocate(p, size);
+    else
+      owner->FreeRemote(p);
+  }
+
+  /** Size is unknown, but this is only called when a constructor throws,
+   so the block was made by this thread.
+   */
+  static void Deallocate(void *p) {
+    OwnedHeap *heap = Current(false);
+    if ((nullptr != heap) && heap->HasBlock(p)) {
+      heap->SmallObjAllocator::Deallocate(p);
+      return;
+    }
+    LockT lock;
+    (void)lock; // get rid of warning
+    heap = GetShared().orphan_;
+    if (heap->HasBlock(p))
+      heap->SmallObjAllocator::Deallocate(p);
+    else
+      AllocSingleton::Instance().Deallocate(p);
+  }
+
+private:
+  /// Heaps of every thread, and the map of which heap owns each Chunk.
+  struct Shared {
+    explicit Shared(const SmallObjAllocator &allocator)
+        : owners_(allocator.GetLeastChunkAlignment()), abandoned_(),
+          orphan_(new OwnedHeap(allocator)) {
+      orphan_->abandoned_ = true;
+    }
+    OwnerMap owners_;
+    /// Heaps of exited threads, waiting to be adopted.
+    std::vector<OwnedHeap *> abandoned_;
+    /// Heap for threads past the point where their heap was abandoned.
+    OwnedHeap *orphan_;
+  };
+
+  /// Whether the calling thread's heap holder exists yet, or was destroyed.
+  enum State { Unused, Alive, Dead };
+
+  /// Abandons the calling thread's heap when the thread exits.
+  struct Holder {
+    explicit Holder(State &state) : state_(state), heap_(nullptr) {
+      state_ = Alive;
+    }
+    ~Holder(void) {
+      if (nullptr != heap_)
+        heap_->Abandon();
+      state_ = Dead;
+    }
+    State &state_;
+    OwnedHeap *heap_;
+  };
+
+  explicit OwnedHeap(const SmallObjAllocator &allocator)
+      : SmallObjAllocator(allocator.GetPageSize(), allocator.GetMaxObjectSize(),
+                          allocator.GetAlignment(),
+                          allocator.GetMaxBlocksPerChunk()),
+        remote_(nullptr), abandoned_(false), minOwnedSize_(0),
+        lastChunks_(new std::uintptr_t[GetSizeClassCount()]()),
+        lastEntries_(new std::atomic<void *> *[GetSizeClassCount()]()) {
+    // The OwnerMap's ranges must hold blocks of one Chunk at most.
+    assert(GetLeastChunkAlignment() == allocator.GetLeastChunkAlignment());
+    // A block on the remote free list must hold a pointer.
+    for (std::size_t ii = 0; (ii < GetSizeClassCount()) &&
+                             (GetBlockSize(ii) < sizeof(void *));
+         ++ii)
+      minOwnedSize_ = GetBlockSize(ii) + 1;
+  }
+
+  /// Heaps are adopted by new threads, but never destroyed.
+  ~OwnedHeap(void);
+
+  static Shared &GetShared(void) {
+    // Leaked, so abandoned heaps outlive every thread and static object.
+    static Shared &shared = *new Shared(AllocSingleton::Instance());
+    return shared;
+  }
+
+  /** Returns the calling thread's heap, or nullptr if the thread has none
+   and create is false, or is past the point where its heap was abandoned.
+   A new heap is an abandoned one if there is any.
+   */
+  static OwnedHeap *Current(bool create) {
+    static thread_local State state = Unused;
+    if ((Dead == state) || (!create && (Unused == state)))
+      return nullptr;
+    static thread_local Holder holder(state);
+    if ((nullptr == holder.heap_) && create) {
+      Shared &shared = GetShared();
+      LockT lock;
+      (void)lock; // get rid of warning
+      if (!shared.abandoned_.empty()) {
+        holder.heap_ = shared.abandoned_.back();
+        shared.abandoned_.pop_back();
+        holder.heap_->abandoned_ = false;
+      } else {
+        try {
+          holder.heap_ = new OwnedHeap(AllocSingleton::Instance());
+        } catch (...) {
+          return nullptr;
+        }
+      }
+    }
+    return holder.heap_;
+  }
+
+  /// Returns true if blocks of size bytes come from a heap.
+  inline bool Owns(std::size_t size) const {
+    return (minOwnedSize_ <= size) && (size <= GetMaxObjectSize());
+  }
+
+  /** Drains the remote free list, allocates a block, and makes sure the
+   OwnerMap says this heap owns the block's Chunk.
+   */
+  void *AllocateOwned(std::size_t size, bool doThrow) {
+    if (nullptr != remote_.load(std::memory_order_relaxed))
+      DrainRemote();
+    void *p = SmallObjAllocator::Allocate(size, false);
+    if ((nullptr != p) && !Register(p, size)) {
+      SmallObjAllocator::Deallocate(p, size);
+      p = nullptr;
+    }
+    if ((nullptr == p) && doThrow)
+      throw std::bad_alloc();
+    return p;
+  }
+
+  /** Records this heap as owner of the range of the OwnerMap holding p.
+   The entry of the range last used by each size class is remembered, so
+   this is usually a comparison and one load.
+   */
+  bool Register(void *p, std::size_t size) {
+    const std::size_t sizeClass = GetSizeClass(size);
+    const std::uintptr_t chunk = reinterpret_cast<std::uintptr_t>(p) &
+                                 ~(GetLeastChunkAlignment() - 1);
+    if ((lastChunks_[sizeClass] == chunk) &&
+        (this == lastEntries_[sizeClass]->load(std::memory_order_relaxed)))
+      return true;
+    std::atomic<void *> *entry = GetShared().owners_.GetEntry(p, true);
+    if (nullptr == entry)
+      return false;
+    entry->store(this);
+    lastChunks_[sizeClass] = chunk;
+    lastEntries_[sizeClass] = entry;
+    return true;
+  }
+
+  /** Pushes p onto the remote free list.  If this heap was abandoned, its
+   list is drained under the lock, since no thread will do it otherwise.
+   */
+  void FreeRemote(void *p) {
+    void *head = remote_.load(std::memory_order_relaxed);
+    do {
+      std::memcpy(p, &head, sizeof(head));
+    } while (!remote_.compare_exchange_weak(head, p));
+    if (abandoned_) {
+      LockT lock;
+      (void)lock; // get rid of warning
+      if (abandoned_)
+        DrainRemote();
+    }
+  }
+
+  /// Frees every block on the remote free list into its Chunk.
+  void DrainRemote(void) {
+    void *p = remote_.exchange(nullptr);
+    while (nullptr != p) {
+      void *next;
+      std::memcpy(&next, p, sizeof(next));
+      SmallObjAllocator::Deallocate(p);
+      p = next;
+    }
+  }
+
+  /// Releases what the heap can, and leaves it for the next thread.
+  void Abandon(void) {
+    LockT lock;
+    (void)lock; // get rid of warning
+    // Set before draining, so a thread which pushes a block after the
+    // drain sees this heap is abandoned, and drains it again itself.
+    abandoned_ = true;
+    DrainRemote();
+    TrimExcessMemory();
+    try {
+      GetShared().abandoned_.push_back(this);
+    } catch (...) {
+      // Remote frees are still drained, but the heap is not reused.
+    }
+  }
+
+  /// Not implemented.
+  OwnedHeap(const OwnedHeap &);
+  /// Not implemented.
+  OwnedHeap &operator=(const OwnedHeap &);
+
+  /// Blocks freed by other threads, linked through their first bytes.
+  std::atomic<void *> remote_;
+  /// True if no thread owns this heap.
+  std::atomic<bool> abandoned_;
+  /// Smallest size whose blocks can hold a pointer.
+  std::size_t minOwnedSize_;
+  /// Address of the range last registered for each size class.
+  std::uintptr_t *lastChunks_;
+  /// OwnerMap entry of the range last registered for each size class.
+  std::atomic<void *> **lastEntries_;
+};
+
+/** @struct SmallObjFrontEnd
+    @ingroup SmallObjectGroupInternal
+ Decides how SmallObjectBase and AllocatorSingleton reach the allocator.
+ For most threading models every call takes the lock of the ThreadingModel.
+ The specialization for ThreadCachedLockable goes through a ThreadCache, and
+ the one for LockFreeLockable goes through a LockFreeCache, the one for
+ RegionLockable goes through the thread's innermost Region, and the one for
+ ThreadOwnedLockable goes through the thread's OwnedHeap.
+ */
+template <template <class, class> class ThreadingModel, class AllocSingleton,
+          class LockT>
+struct SmallObjFrontEnd {
+  static void *Allocate(std::size_t size, bool doThrow) {
+    LockT lock;
+    (void)lock; // get rid of warning
+    return AllocSingleton::Instance().Allocate(size, doThrow);
+  }
+
+  static void Deallocate(void *p, std::size_t size) {
+    LockT lock;
+    (void)lock; // get rid of warning
+    AllocSingleton::Instance().Deallocate(p, size);
+  }
+
+  static void Deallocate(void *p) {
+    LockT lock;
+    (void)lock; // get rid of warning
+    AllocSingleton::Instance().Deallocate(p);
+  }
+};
+
+template <class AllocSingleton, class LockT>
+struct SmallObjFrontEnd<ThreadCachedLockable, AllocSingleton, LockT> {
+  static void *Allocate(std::size_t size, bool doThrow) {
+    return ThreadCache<AllocSingleton, LockT>::Allocate(size, doThrow);
+  }
+
+  static void Deallocate(void *p, std::size_t size) {
+    ThreadCache<AllocSingleton, LockT>::Deallocate(p, size);
+  }
+
+  /// Size is unknown, so the block can not go into a magazine.
+  static void Deallocate(void *p) {
+    LockT lock;
+    (void)lock; // get rid of warning
+    AllocSingleton::Instance().Deallocate(p);
+  }
+};
+
+template <class AllocSingleton, class LockT>
+struct SmallObjFrontEnd<LockFreeLockable, AllocSingleton, LockT> {
+  static void *Allocate(std::size_t size, bool doThrow) {
+    return LockFreeCache<AllocSingleton, LockT>::Allocate(size, doThrow);
+  }
+
+  static void Deallocate(void *p, std::size_t size) {
+    LockFreeCache<AllocSingleton, LockT>::Deallocate(p, size);
+  }
+
+  /// Size is unknown, so the block goes straight back to its Chunk.
+  static void Deallocate(void *p) {
+    LockT lock;
+    (void)lock; // get rid of warning
+    AllocSingleton::Instance().Deallocate(p);
+  }
+};
+
+template <class AllocSingleton, class LockT>
+struct SmallObjFrontEnd<RegionLockable, AllocSingleton, LockT> {
+  typedef Region<AllocSingleton, LockT> MyRegion;
+
+  static void *Allocate(std::size_t size, bool doThrow) {
+    MyRegion *region = MyRegion::Current();
+    SmallObjAllocator &allocator = AllocSingleton::Instance();
+    if ((nullptr == region) || (allocator.GetMaxObjectSize() < size)) {
+      LockT lock;
+      (void)lock; // get rid of warning
+      return allocator.Allocate(size, doThrow);
+    }
+    void *p = region->Allocate(size);
+    if ((nullptr == p) && doThrow)
+      throw std::bad_alloc();
+    return p;
+  }
+
+  /// Blocks of this thread's regions are released with the region.
+  static void Deallocate(void *p, std::size_t size) {
+    MyRegion *region = MyRegion::Current();
+    if ((nullptr != region) && region->Contains(p))
+      return;
+    LockT lock;
+    (void)lock; // get rid of warning
+    SmallObjAllocator &allocator = AllocSingleton::Instance();
+    // A block of another thread's region is not in any pool.
+    if ((allocator.GetMaxObjectSize() < size) || allocator.HasBlock(p))
+      allocator.Deallocate(p, size);
+  }
+
+  /** This is only called when a constructor throws, so a block from a
+   region is always in one of this thread's regions.
+   */
+  static void Deallocate(void *p) {
+    MyRegion *region = MyRegion::Current();
+    if ((nullptr != region) && region->Contains(p))
+      return;
+    LockT lock;
+    (void)lock; // get rid of warning
+    AllocSingleton::Instance().Deallocate(p);
+  }
+};
+
+template <class AllocSingleton, class LockT>
+struct SmallObjFrontEnd<ThreadOwnedLockable, AllocSingleton, LockT> {
+  static void *Allocate(std::size_t size, bool doThrow) {
+    return OwnedHeap<AllocSingleton, LockT>::Allocate(size, doThrow);
+  }
+
+  static void Deallocate(void *p, std::size_t size) {
+    OwnedHeap<AllocSingleton, LockT>::Deallocate(p, size);
+  }
+
+  static void Deallocate(void *p) {
+    OwnedHeap<AllocSingleton, LockT>::Deallocate(p);
+  }
+};
+
+/** @struct SmallObjTypedFrontEnd
+    @ingroup SmallObjectGroupInternal
+ Front end used by SmallObjectOf for blocks whose size is known at compile
+ time.  For models which lock on every call, the pool for that size is
+ looked up once and kept, so each call skips finding the size class.  Each
+ call still takes the lock, gets the singleton with Instance, and compares
+ its generation with the one the pool was found in, in case the singleton
+ was destroyed and made again, maybe at the same address.  Models with
+ per-thread caches just pass the size to their usual front end.
+ */
+template <template <class, class> class ThreadingModel, class AllocSingleton,
+          class LockT, std::size_t size>
+struct SmallObjTypedFrontEnd {
+  static void *Allocate(bool doThrow) {
+    LockT lock;
+    (void)lock; // get rid of warning
+    FixedAllocator *pool = GetPool();
+    return (nullptr == pool) ? allocator_->Allocate(size, doThrow)
+                             : allocator_->AllocateFrom(*pool, doThrow);
+  }
+
+  static void Deallocate(void *p) {
+    LockT lock;
+    (void)lock; // get rid of warning
+    FixedAllocator *pool = GetPool();
+    if (nullptr == pool)
+      allocator_->Deallocate(p, size);
+    else
+      allocator_->DeallocateTo(*pool, p);
+  }
+
+private:
+  /// Must be called under the lock.
+  static FixedAllocator *GetPool(void) {
+    SmallObjAllocator &allocator = AllocSingleton::Instance();
+    allocator_ = &allocator;
+    if (allocator.GetGeneration() != generation_) {
+      generation_ = allocator.GetGeneration();
+      pool_ = allocator.GetPool(size);
+    }
+    return pool_;
+  }
+
+  static SmallObjAllocator *allocator_;
+  static FixedAllocator *pool_;
+  /// Generation of the allocator pool_ belongs to, or 0 for none.
+  static std::uint64_t generation_;
+};
+
+template <template <class, class> class T, class A, class L, std::size_t S>
+SmallObjAllocator *SmallObjTypedFrontEnd<T, A, L, S>::allocator_ = nullptr;
+
+template <template <class, class> class T, class A, class L, std::size_t S>
+FixedAllocator *SmallObjTypedFrontEnd<T, A, L, S>::pool_ = nullptr;
+
+template <template <class, class> class T, class A, class L, std::size_t S>
+std::uint64_t SmallObjTypedFrontEnd<T, A, L, S>::generation_ = 0;
+
+/** @struct SmallObjSizedFrontEnd
+    @ingroup SmallObjectGroupInternal
+ Typed front end which passes the size to FrontEnd.
+ */
+template <class FrontEnd, std::size_t size> struct SmallObjSizedFrontEnd {
+  static void *Allocate(bool doThrow) {
+    return FrontEnd::Allocate(size, doThrow);
+  }
+
+  static void Deallocate(void *p) { FrontEnd::Deallocate(p, size); }
+};
+
+template <class AllocSingleton, class LockT, std::size_t size>
+struct SmallObjTypedFrontEnd<ThreadCachedLockable, AllocSingleton, LockT, size>
+    : public SmallObjSizedFrontEnd<
+          SmallObjFrontEnd<ThreadCachedLockable, AllocSingleton, LockT>, size> {
+};
+
+template <class AllocSingleton, class LockT, std::size_t size>
+struct SmallObjTypedFrontEnd<LockFreeLockable, AllocSingleton, LockT, size>
+    : public SmallObjSizedFrontEnd<
+          SmallObjFrontEnd<LockFreeLockable, AllocSingleton, LockT>, size> {};
 
-namespace Loki {
-namespace LongevityLifetime {
-/** @struct DieAsSmallObjectParent
-    @ingroup SmallObjectGroup
-    Lifetime policy to manage lifetime dependencies of
-    SmallObject base and child classes.
-    The Base class should have this lifetime
-*/
-template <class T> struct DieAsSmallObjectParent : DieLast<T> {};
+template <class AllocSingleton, class LockT, std::size_t size>
+struct SmallObjTypedFrontEnd<RegionLockable, AllocSingleton, LockT, size>
+    : public SmallObjSizedFrontEnd<
+          SmallObjFrontEnd<RegionLockable, AllocSingleton, LockT>, size> {};
 
-/** @struct DieAsSmallObjectChild
-    @ingroup SmallObjectGroup
-    Lifetime policy to manage lifetime dependencies of
-    SmallObject base and child classes.
-    The Child class should have this lifetime
-*/
-template <class T> struct DieAsSmallObjectChild : DieDirectlyBeforeLast<T> {};
+template <class AllocSingleton, class LockT, std::size_t size>
+struct SmallObjTypedFrontEnd<ThreadOwnedLockable, AllocSingleton, LockT, size>
+    : public SmallObjSizedFrontEnd<
+          SmallObjFrontEnd<ThreadOwnedLockable, AllocSingleton, LockT>, size> {
+};
 
-} // namespace LongevityLifetime
+/** @struct SmallObjSampling
+    @ingroup SmallObjectGroupInternal
+ Per-thread byte count for the heap profiler of AllocSingleton, and the
+ profiler which deallocations must check once anything was sampled.
+ */
+template <class AllocSingleton> struct SmallObjSampling {
+  /// Counts size bytes, and samples p if that takes the count past zero.
+  static inline void OnAllocate(void *p, std::size_t size) {
+    if (!SmallObjProfiler::IsSampling())
+      return;
+    static thread_local std::ptrdiff_t countdown = Unseeded;
+    countdown -= static_cast<std::ptrdiff_t>(size);
+    if ((0 <= countdown) || (nullptr == p))
+      return;
+    try {
+      SmallObjAllocator &allocator = AllocSingleton::Instance();
+      SmallObjProfiler &profiler = allocator.SmallObjAllocator::GetProfiler();
+      profiler_.store(&profiler, std::memory_order_release);
+      if (countdown < Unseeded / 2) {
+        // The thread's first allocation.  Its bytes count towards the
+        // first draw, and p is only sampled if the draw ends inside it.
+        countdown =
+            profiler.DrawCountdown() - static_cast<std::ptrdiff_t>(size);
+        if (0 <= countdown)
+          return;
+      }
+      countdown = profiler.Sample(p, size);
+    } catch (...) {
+      // No profiler, so nothing is sampled.
+      countdown = PTRDIFF_MAX;
+    }
+  }
 
-namespace Private {
-class FixedAllocator;
-} // end namespace Private
+  /// Forgets the sample of p if there is one.
+  static inline void OnDeallocate(const void *p) {
+    SmallObjProfiler *profiler = profiler_.load(std::memory_order_acquire);
+    if ((nullptr != profiler) && profiler->MayHold(p))
+      profiler->Release(p);
+  }
 
-/** @class SmallObjAllocator
+  static std::atomic<SmallObjProfiler *> profiler_;
+
+private:
+  /// Count of a thread which has not drawn one yet, far below any count
+  /// reached by allocating.
+  static const std::ptrdiff_t Unseeded = PTRDIFF_MIN / 2;
+};
+
+template <class AllocSingleton>
+std::atomic<SmallObjProfiler *>
+    SmallObjSampling<AllocSingleton>::profiler_(nullptr);
+
+/** @struct SmallObjSampledFrontEnd
     @ingroup SmallObjectGroupInternal
- Manages pool of fixed-size allocators.
- Designed to be a non-templated base class of AllocatorSingleton so that
- implementation details can be safely hidden in the source code file.
+ Wraps FrontEnd so its blocks are sampled by the heap profiler while
+ sampling is on.  It is always used, so every file of a program sees the
+ same front end.
  */
-class LOKI_EXPORT SmallObjAllocator {
-protected:
-  /** The only available constructor needs certain parameters in order to
-   initialize all the FixedAllocator's.  This throws only if
-   @param pageSize # of bytes in a page of memory.
-   @param maxObjectSize Max # of bytes which this may allocate.
-   @param objectAlignSize # of bytes between alignment boundaries.
-   */
-  SmallObjAllocator(std::size_t pageSize, std::size_t maxObjectSize,
-                    std::size_t objectAlignSize);
+template <class FrontEnd, class AllocSingleton> struct SmallObjSampledFrontEnd {
+  static void *Allocate(std::size_t size, bool doThrow) {
+    void *p = FrontEnd::Allocate(size, doThrow);
+    SmallObjSampling<AllocSingleton>::OnAllocate(p, size);
+    return p;
+  }
 
-  /** Destructor releases all blocks, all Chunks, and FixedAllocator's.
-   Any outstanding blocks are unavailable, and should not be used after
-   this destructor is called.  The destructor is deliberately non-virtual
-   because it is protected, not public.
-   */
-  ~SmallObjAllocator(void);
+  static void Deallocate(void *p, std::size_t size) {
+    // The sample goes first, so the block can't be reused and sampled again
+    // by another thread before it is forgotten.
+    SmallObjSampling<AllocSingleton>::OnDeallocate(p);
+    FrontEnd::Deallocate(p, size);
+  }
 
-public:
-  /** Allocates a block of memory of requested size.  Complexity is often
-   constant-time, but might be O(C) where C is the number of Chunks in a
-   FixedAllocator.
+  static void Deallocate(void *p) {
+    SmallObjSampling<AllocSingleton>::OnDeallocate(p);
+    FrontEnd::Deallocate(p);
+  }
+};
 
-   @par Exception Safety Level
-   Provides either strong-exception safety, or no-throw exception-safety
-   level depending upon doThrow parameter.  The reason it provides two
-   levels of exception safety is because it is used by both the nothrow
-   and throwing new operators.  The underlying implementation will never
-   throw of its own accord, but this can decide to throw if it does not
-   allocate.  The only exception it should emit is std::bad_alloc.
+/** @struct SmallObjSampledTypedFrontEnd
+    @ingroup SmallObjectGroupInternal
+ Typed front end whose blocks are sampled by the heap profiler.
+ */
+template <class TypedFrontEnd, class AllocSingleton, std::size_t size>
+struct SmallObjSampledTypedFrontEnd {
+  static void *Allocate(bool doThrow) {
+    void *p = TypedFrontEnd::Allocate(doThrow);
+    SmallObjSampling<AllocSingleton>::OnAllocate(p, size);
+    return p;
+  }
 
-   @par Allocation Failure
-   If it does not allocate, it will call TrimExcessMemory and attempt to
-   allocate again, before it decides to throw or return NULL.  Many
-   allocators loop through several new_handler functions, and terminate
-   if they can not allocate, but not this one.  It only makes one attempt
-   using its own implementation of the new_handler, and then returns NULL
-   or throws so that the program can decide what to do at a higher level.
-   (Side note: Even though the C++ Standard allows allocators and
-   new_handlers to terminate if they fail, the Loki allocator does not do
-   that since that policy is not polite to a host program.)
+  static void Deallocate(void *p) {
+    SmallObjSampling<AllocSingleton>::OnDeallocate(p);
+    TypedFrontEnd::Deallocate(p);
+  }
+};
 
-   @param size # of bytes needed for allocation.
-   @param doThrow True if this should throw if unable to allocate, false
-    if it should provide no-throw exception safety level.
-   @return NULL if nothing allocated and doThrow is false.  Else the
-    pointer to an available block of memory.
-   */
-  void *Allocate(std::size_t size, bool doThrow);
+/** @struct SmallObjPoolTag
+    @ingroup SmallObjectGroupInternal
+ PoolTag of the AllocatorSingleton for the objects of Tag.
+ */
+template <class Tag> struct SmallObjPoolTag {
+  typedef typename Tag::PoolTag Type;
+};
 
-  /** Deallocates a block of memory at a given place and of a specific
-  size.  Complexity is almost always constant-time, and is O(C) only if
-  it has to search for which Chunk deallocates.  This never throws.
-   */
-  void Deallocate(void *p, std::size_t size);
+template <> struct SmallObjPoolTag<void> { typedef void Type; };
 
-  /** Deallocates a block of memory at a given place but of unknown size
-  size.  Complexity is O(F + C) where F is the count of FixedAllocator's
-  in the pool, and C is the number of Chunks in all FixedAllocator's.  This
-  does not throw exceptions.  This overloaded version of Deallocate is
-  called by the nothow delete operator - which is called when the nothrow
-  new operator is used, but a constructor throws an exception.
+/** @struct SmallObjAccountedFrontEnd
+    @ingroup SmallObjectGroupInternal
+ Wraps FrontEnd so its blocks are charged to the SmallObjAccount of Tag.
+ With no tag it is FrontEnd itself.  A block is charged its footprint
+ wherever it comes from: the pools, a region, or the default allocator.
+ */
+template <class FrontEnd, class AllocSingleton, class Tag>
+struct SmallObjAccountedFrontEnd {
+  /// # of charges of blocks from nothrow new each thread remembers.
+  enum { PendingCount = 8 };
+
+  /** Charges of the latest blocks this thread got from nothrow new, so the
+   unsized Deallocate can credit a block whose constructor threw.  Charges
+   of objects which were made are never forgotten, only overwritten.
    */
-  void Deallocate(void *p);
+  struct Pending {
+    void *blocks_[PendingCount];
+    std::size_t bytes_[PendingCount];
+    unsigned int next_;
+  };
+
+  static Pending &GetPending(void) {
+    static thread_local Pending pending = {{}, {}, 0};
+    return pending;
+  }
 
-  /// Returns max # of bytes which this can allocate.
-  inline std::size_t GetMaxObjectSize() const { return maxSmallObjectSize_; }
+  static void *Allocate(std::size_t size, bool doThrow) {
+    const std::size_t bytes = AllocSingleton::Instance().GetFootprint(size);
+    SmallObjAccount &account = Tag::GetAccount();
+    if (!account.Charge(bytes)) {
+      if (doThrow)
+        throw std::bad_alloc();
+      return nullptr;
+    }
+    void *p = nullptr;
+    try {
+      p = FrontEnd::Allocate(size, doThrow);
+    } catch (...) {
+      account.Refund(bytes);
+      throw;
+    }
+    if (nullptr == p) {
+      account.Refund(bytes);
+    } else if (!doThrow) {
+      Pending &pending = GetPending();
+      pending.blocks_[pending.next_] = p;
+      pending.bytes_[pending.next_] = bytes;
+      pending.next_ = (pending.next_ + 1) % PendingCount;
+    }
+    return p;
+  }
 
-  /// Returns # of bytes between allocation boundaries.
-  inline std::size_t GetAlignment() const { return objectAlignSize_; }
+  static void Deallocate(void *p, std::size_t size) {
+    if (nullptr == p)
+      return;
+    Tag::GetAccount().Credit(AllocSingleton::Instance().GetFootprint(size));
+    FrontEnd::Deallocate(p, size);
+  }
 
-  /** Releases empty Chunks from memory.  Complexity is O(F + C) where F
-  is the count of FixedAllocator's in the pool, and C is the number of
-  Chunks in all FixedAllocator's.  This will never throw.  This is called
-  by AllocatorSingleto::ClearExtraMemory, the new_handler function for
-  Loki's allocator, and is called internally when an allocation fails.
-  @return True if any memory released, or false if none released.
+  /** This is only called when the constructor of an object made by nothrow
+   new throws, so its charge is found among the pending ones, newest first.
+   It is only lost if the constructor made more than PendingCount objects
+   of this front end by nothrow new, and then only a block of the pools can
+   still be credited, by its size.
    */
-  bool TrimExcessMemory(void);
+  static void Deallocate(void *p) {
+    if (nullptr == p)
+      return;
+    Pending &pending = GetPending();
+    std::size_t bytes = 0;
+    for (unsigned int ii = 1; ii <= PendingCount; ++ii) {
+      const unsigned int index =
+          (pending.next_ + PendingCount - ii) % PendingCount;
+      if (p == pending.blocks_[index]) {
+        pending.blocks_[index] = nullptr;
+        bytes = pending.bytes_[index];
+        break;
+      }
+    }
+    if (0 == bytes)
+      bytes = AllocSingleton::Instance().GetBlockSizeOf(p);
+    if (0 != bytes)
+      Tag::GetAccount().Credit(bytes);
+    FrontEnd::Deallocate(p);
+  }
+};
 
-  /** Returns true if anything in implementation is corrupt.  Complexity
-   is O(F + C + B) where F is the count of FixedAllocator's in the pool,
-   C is the number of Chunks in all FixedAllocator's, and B is the number
-   of blocks in all Chunks.  If it determines any data is corrupted, this
-   will return true in release version, but assert in debug version at
-   the line where it detects the corrupted data.  If it does not detect
-   any corrupted data, it returns false.
-   */
-  bool IsCorrupt(void) const;
+template <class FrontEnd, class AllocSingleton>
+struct SmallObjAccountedFrontEnd<FrontEnd, AllocSingleton, void> : FrontEnd {};
 
-private:
-  /// Default-constructor is not implemented.
-  SmallObjAllocator(void);
-  /// Copy-constructor is not implemented.
-  SmallObjAllocator(const SmallObjAllocator &);
-  /// Copy-assignment operator is not implemented.
-  SmallObjAllocator &operator=(const SmallObjAllocator &);
+/** @struct SmallObjAccountedTypedFrontEnd
+    @ingroup SmallObjectGroupInternal
+ Typed front end whose blocks are charged to the SmallObjAccount of Tag.
+ */
+template <class TypedFrontEnd, class AllocSingleton, class Tag,
+          std::size_t size>
+struct SmallObjAccountedTypedFrontEnd {
+  static void *Allocate(bool doThrow) {
+    const std::size_t bytes = AllocSingleton::Instance().GetFootprint(size);
+    SmallObjAccount &account = Tag::GetAccount();
+    if (!account.Charge(bytes)) {
+      if (doThrow)
+        throw std::bad_alloc();
+      return nullptr;
+    }
+    void *p = nullptr;
+    try {
+      p = TypedFrontEnd::Allocate(doThrow);
+    } catch (...) {
+      account.Refund(bytes);
+      throw;
+    }
+    if (nullptr == p)
+      account.Refund(bytes);
+    return p;
+  }
 
-  /// Pointer to array of fixed-size allocators.
-  Loki::Private::FixedAllocator *pool_;
+  static void Deallocate(void *p) {
+    if (nullptr == p)
+      return;
+    Tag::GetAccount().Credit(AllocSingleton::Instance().GetFootprint(size));
+    TypedFrontEnd::Deallocate(p);
+  }
+};
 
-  /// Largest object size supported by allocators.
-  const std::size_t maxSmallObjectSize_;
+template <class TypedFrontEnd, class AllocSingleton, std::size_t size>
+struct SmallObjAccountedTypedFrontEnd<TypedFrontEnd, AllocSingleton, void,
+                                      size> : TypedFrontEnd {};
 
-  /// Size of alignment boundaries.
-  const std::size_t objectAlignSize_;
-};
+} // end namespace Private
 
 /** @class AllocatorSingleton
     @ingroup SmallObjectGroupInternal
@@ -215,6 +2261,19 @@ private:
  Thus, the only functions in the allocator which show up in SmallObject or
  SmallValueObject inheritance hierarchies are the new and delete
  operators.
+
+ @par ChunkIndexType
+ Type of the stealth indexes inside each Chunk, either unsigned char (the
+ default) or unsigned short.  With unsigned char a Chunk holds at most
+ UCHAR_MAX blocks.  With unsigned short it holds up to USHRT_MAX blocks, so
+ pools of small objects need far fewer Chunks if chunkSize is raised to
+ match, e.g. 512 KB for 8-byte objects.  Blocks smaller than an unsigned
+ short can't hold a 16-bit index, so their Chunks stay below UCHAR_MAX.
+
+ @par PoolTag
+ Any type, which only makes a singleton apart from those of other tags
+ with the same parameters, so a subsystem can have pools of its own.
+ SmallObjHeapTag passes its Subsystem here.
 */
 template <template <class, class> class ThreadingModel =
               LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL,
@@ -223,12 +2282,15 @@ template <template <class, class> class ThreadingModel =
           std::size_t objectAlignSize = LOKI_DEFAULT_OBJECT_ALIGNMENT,
           template <class> class LifetimePolicy =
               LOKI_DEFAULT_SMALLOBJ_LIFETIME,
-          class MutexPolicy = LOKI_DEFAULT_MUTEX>
+          class MutexPolicy = LOKI_DEFAULT_MUTEX,
+          class ChunkIndexType = LOKI_DEFAULT_CHUNK_INDEX_TYPE,
+          class PoolTag = void>
 class AllocatorSingleton : public SmallObjAllocator {
 public:
   /// Defines type of allocator.
   typedef AllocatorSingleton<ThreadingModel, chunkSize, maxSmallObjectSize,
-                             objectAlignSize, LifetimePolicy>
+                             objectAlignSize, LifetimePolicy, MutexPolicy,
+                             ChunkIndexType, PoolTag>
       MyAllocator;
 
   /// Defines type for thread-safety locking mechanism.
@@ -239,6 +2301,13 @@ public:
                                 ThreadingModel>
       MyAllocatorSingleton;
 
+  /// Defines how blocks are reached: under the lock, or via a thread cache.
+  typedef Private::SmallObjSampledFrontEnd<
+      Private::SmallObjFrontEnd<ThreadingModel, MyAllocatorSingleton,
+                                typename MyThreadingModel::Lock>,
+      MyAllocatorSingleton>
+      MyFrontEnd;
+
   /// Returns reference to the singleton.
   inline static AllocatorSingleton &Instance(void) {
     return MyAllocatorSingleton::Instance();
@@ -246,7 +2315,12 @@ public:
 
   /// The default constructor is not meant to be called directly.
   inline AllocatorSingleton()
-      : SmallObjAllocator(chunkSize, maxSmallObjectSize, objectAlignSize) {}
+      : SmallObjAllocator(chunkSize, maxSmallObjectSize, objectAlignSize,
+                          static_cast<ChunkIndexType>(-1)) {
+    LOKI_STATIC_CHECK((sizeof(ChunkIndexType) <= sizeof(unsigned short)) &&
+                          (static_cast<ChunkIndexType>(-1) > 0),
+                      ChunkIndexType_Must_Be_Unsigned_Char_Or_Short);
+  }
 
   /// The destructor is not meant to be called directly.
   inline ~AllocatorSingleton(void) {}
@@ -271,6 +2345,42 @@ public:
    */
   static bool IsCorrupted(void);
 
+  /// Returns a snapshot of the allocator's counters.
+  static SmallObjStats GetStats(void);
+
+  /** Releases at most budget empty Chunks under the lock.  This is meant
+   to be called now and then by a maintenance thread.
+   @see SmallObjAllocator::Trim
+   @return # of Chunks released.
+   */
+  static std::size_t Trim(std::size_t budget);
+
+  /// @see SmallObjAllocator::SetIncrementalTrim
+  static void SetIncrementalTrim(bool incremental,
+                                 std::size_t keepEmptyChunks);
+
+  /// @see SmallObjAllocator::GetAlignedSize
+  static std::size_t GetAlignedSize(std::size_t numBytes,
+                                    std::size_t alignment);
+
+  /** Returns the heap profiler, which has its own lock.  It only takes
+   samples while sampling is on.
+   @see SmallObjProfiler
+   */
+  static SmallObjProfiler &GetProfiler(void);
+
+  /** Allocates count blocks of numBytes each under a single lock, and
+   bypasses any per-thread cache.
+   @return # of blocks allocated, which is less than count only if memory
+    ran out.
+   */
+  static std::size_t AllocateBatch(std::size_t numBytes, void **blocks,
+                                   std::size_t count);
+
+  /// Deallocates count blocks of numBytes each under a single lock.
+  static void DeallocateBatch(void **blocks, std::size_t count,
+                              std::size_t numBytes);
+
 private:
   /// Copy-constructor is not implemented.
   AllocatorSingleton(const AllocatorSingleton &);
@@ -279,21 +2389,119 @@ private:
 };
 
 template <template <class, class> class T, std::size_t C, std::size_t M,
-          std::size_t O, template <class> class L, class X>
-void AllocatorSingleton<T, C, M, O, L, X>::ClearExtraMemory(void) {
+          std::size_t O, template <class> class L, class X, class I,
+          class G>
+void AllocatorSingleton<T, C, M, O, L, X, I, G>::ClearExtraMemory(void) {
   typename MyThreadingModel::Lock lock;
   (void)lock; // get rid of warning
   Instance().TrimExcessMemory();
 }
 
 template <template <class, class> class T, std::size_t C, std::size_t M,
-          std::size_t O, template <class> class L, class X>
-bool AllocatorSingleton<T, C, M, O, L, X>::IsCorrupted(void) {
+          std::size_t O, template <class> class L, class X, class I,
+          class G>
+bool AllocatorSingleton<T, C, M, O, L, X, I, G>::IsCorrupted(void) {
   typename MyThreadingModel::Lock lock;
   (void)lock; // get rid of warning
   return Instance().IsCorrupt();
 }
 
+template <template <class, class> class T, std::size_t C, std::size_t M,
+          std::size_t O, template <class> class L, class X, class I,
+          class G>
+SmallObjStats AllocatorSingleton<T, C, M, O, L, X, I, G>::GetStats(void) {
+  SmallObjStats stats;
+  typename MyThreadingModel::Lock lock;
+  (void)lock; // get rid of warning
+  Instance().SmallObjAllocator::GetStats(stats);
+  return stats;
+}
+
+template <template <class, class> class T, std::size_t C, std::size_t M,
+          std::size_t O, template <class> class L, class X, class I,
+          class G>
+std::size_t
+AllocatorSingleton<T, C, M, O, L, X, I, G>::Trim(std::size_t budget) {
+  typename MyThreadingModel::Lock lock;
+  (void)lock; // get rid of warning
+  return Instance().SmallObjAllocator::Trim(budget);
+}
+
+template <template <class, class> class T, std::size_t C, std::size_t M,
+          std::size_t O, template <class> class L, class X, class I,
+          class G>
+void AllocatorSingleton<T, C, M, O, L, X, I, G>::SetIncrementalTrim(
+    bool incremental, std::size_t keepEmptyChunks) {
+  typename MyThreadingModel::Lock lock;
+  (void)lock; // get rid of warning
+  Instance().SmallObjAllocator::SetIncrementalTrim(incremental,
+                                                   keepEmptyChunks);
+}
+
+template <template <class, class> class T, std::size_t C, std::size_t M,
+          std::size_t O, template <class> class L, class X, class I,
+          class G>
+SmallObjProfiler &
+AllocatorSingleton<T, C, M, O, L, X, I, G>::GetProfiler(void) {
+  return Instance().SmallObjAllocator::GetProfiler();
+}
+
+template <template <class, class> class T, std::size_t C, std::size_t M,
+          std::size_t O, template <class> class L, class X, class I,
+          class G>
+std::size_t AllocatorSingleton<T, C, M, O, L, X, I, G>::GetAlignedSize(
+    std::size_t numBytes, std::size_t alignment) {
+  // The size classes never change, so this needs no lock.
+  return Instance().SmallObjAllocator::GetAlignedSize(numBytes, alignment);
+}
+
+template <template <class, class> class T, std::size_t C, std::size_t M,
+          std::size_t O, template <class> class L, class X, class I,
+          class G>
+std::size_t AllocatorSingleton<T, C, M, O, L, X, I, G>::AllocateBatch(
+    std::size_t numBytes, void **blocks, std::size_t count) {
+  typename MyThreadingModel::Lock lock;
+  (void)lock; // get rid of warning
+  return Instance().SmallObjAllocator::AllocateBatch(numBytes, blocks, count);
+}
+
+template <template <class, class> class T, std::size_t C, std::size_t M,
+          std::size_t O, template <class> class L, class X, class I,
+          class G>
+void AllocatorSingleton<T, C, M, O, L, X, I, G>::DeallocateBatch(
+    void **blocks, std::size_t count, std::size_t numBytes) {
+  typename MyThreadingModel::Lock lock;
+  (void)lock; // get rid of warning
+  Instance().SmallObjAllocator::DeallocateBatch(blocks, count, numBytes);
+}
+
+/** @class SmallObjRegion
+    @ingroup SmallObjectGroup
+ Scope within which objects of classes using the RegionLockable threading
+ model are made by a pointer bump.  AllocT is the AllocatorSingleton of
+ those classes, which SmallObject calls ObjAllocatorSingleton.  Opening a
+ region makes it the innermost region of the current thread, until it is
+ closed.  Deleting an object of the region releases nothing, and closing
+ the region - or calling Reset - releases all its memory in time
+ proportional to the # of region chunks.
+
+ @code
+ class Node : public Loki::SmallObject<Loki::RegionLockable> { ... };
+ void HandleRequest() {
+   Loki::SmallObjRegion<Node::ObjAllocatorSingleton> region;
+   // Every new Node comes from region until it closes.
+ }
+ @endcode
+ */
+template <class AllocT>
+class SmallObjRegion
+    : public Private::Region<typename AllocT::MyAllocatorSingleton,
+                             typename AllocT::MyThreadingModel::Lock> {
+public:
+  /// Opens a region as the innermost one of this thread.
+  inline SmallObjRegion(void) {}
+};
+
 /** This standalone function provides the longevity level for Small-Object
  Allocators which use the Loki::SingletonWithLongevity policy.  The
  SingletonWithLongevity class can find this function through argument-
@@ -307,8 +2515,10 @@ bool AllocatorSingleton<T, C, M, O, L, X>::IsCorrupted(void) {
  than any such object.
  */
 template <template <class, class> class T, std::size_t C, std::size_t M,
-          std::size_t O, template <class> class L, class X>
-inline unsigned int GetLongevity(AllocatorSingleton<T, C, M, O, L, X> *) {
+          std::size_t O, template <class> class L, class X, class I,
+          class G>
+inline unsigned int
+GetLongevity(AllocatorSingleton<T, C, M, O, L, X, I, G> *) {
   // Returns highest possible value.
   return 0xFFFFFFFF;
 }
@@ -333,6 +2543,11 @@ inline unsigned int GetLongevity(AllocatorSingleton<T, C, M, O, L, X> *) {
  it can't use the default constructor in ObjectLevelLockable.  If you need
  a thread-safe allocator, use the ClassLevelLockable policy.
 
+ @par Tag
+ Either void, the default, or a SmallObjTag or SmallObjHeapTag naming the
+ subsystem whose SmallObjAccount the objects are charged to.  A
+ SmallObjHeapTag also gives them an AllocatorSingleton of their own.
+
  @par Lifetime Policy
 
  The SmallObjectBase template needs a lifetime policy because it owns
@@ -404,7 +2619,9 @@ inline unsigned int GetLongevity(AllocatorSingleton<T, C, M, O, L, X> *) {
  */
 template <template <class, class> class ThreadingModel, std::size_t chunkSize,
           std::size_t maxSmallObjectSize, std::size_t objectAlignSize,
-          template <class> class LifetimePolicy, class MutexPolicy>
+          template <class> class LifetimePolicy, class MutexPolicy,
+          class ChunkIndexType = LOKI_DEFAULT_CHUNK_INDEX_TYPE,
+          class Tag = void>
 class SmallObjectBase {
 
 #if (LOKI_MAX_SMALL_OBJECT_SIZE != 0) && (LOKI_DEFAULT_CHUNK_SIZE != 0) &&     \
@@ -414,16 +2631,20 @@ public:
   /// Defines type of allocator singleton, must be public
   /// to handle singleton lifetime dependencies.
   typedef AllocatorSingleton<ThreadingModel, chunkSize, maxSmallObjectSize,
-                             objectAlignSize, LifetimePolicy>
+                             objectAlignSize, LifetimePolicy, MutexPolicy,
+                             ChunkIndexType,
+                             typename Private::SmallObjPoolTag<Tag>::Type>
       ObjAllocatorSingleton;
 
 private:
   /// Defines type for thread-safety locking mechanism.
   typedef ThreadingModel<ObjAllocatorSingleton, MutexPolicy> MyThreadingModel;
 
-  /// Use singleton defined in AllocatorSingleton.
-  typedef
-      typename ObjAllocatorSingleton::MyAllocatorSingleton MyAllocatorSingleton;
+  /// Use front end defined in AllocatorSingleton, charged to Tag if any.
+  typedef Private::SmallObjAccountedFrontEnd<
+      typename ObjAllocatorSingleton::MyFrontEnd,
+      typename ObjAllocatorSingleton::MyAllocatorSingleton, Tag>
+      MyFrontEnd;
 
 public:
   /// Throwing single-object new throws bad_alloc when allocation fails.
@@ -434,16 +2655,12 @@ public:
   static void *operator new(std::size_t size) noexcept(false)
 #endif
   {
-    typename MyThreadingModel::Lock lock;
-    (void)lock; // get rid of warning
-    return MyAllocatorSingleton::Instance().Allocate(size, true);
+    return MyFrontEnd::Allocate(size, true);
   }
 
   /// Non-throwing single-object new returns NULL if allocation fails.
   static void *operator new(std::size_t size, const std::nothrow_t &) throw() {
-    typename MyThreadingModel::Lock lock;
-    (void)lock; // get rid of warning
-    return MyAllocatorSingleton::Instance().Allocate(size, false);
+    return MyFrontEnd::Allocate(size, false);
   }
 
   /// Placement single-object new merely calls global placement new.
@@ -453,18 +2670,14 @@ public:
 
   /// Single-object delete.
   static void operator delete(void *p, std::size_t size) throw() {
-    typename MyThreadingModel::Lock lock;
-    (void)lock; // get rid of warning
-    MyAllocatorSingleton::Instance().Deallocate(p, size);
+    MyFrontEnd::Deallocate(p, size);
   }
 
   /** Non-throwing single-object delete is only called when nothrow
    new operator is used, and the constructor throws an exception.
    */
   static void operator delete(void *p, const std::nothrow_t &) throw() {
-    typename MyThreadingModel::Lock lock;
-    (void)lock; // get rid of warning
-    MyAllocatorSingleton::Instance().Deallocate(p);
+    MyFrontEnd::Deallocate(p);
   }
 
   /// Placement single-object delete merely calls global placement delete.
@@ -472,6 +2685,39 @@ public:
     ::operator delete(p, place);
   }
 
+#ifdef LOKI_HAS_ALIGNED_NEW
+
+  /** Over-aligned single-object new takes a block from a pool whose blocks
+   have the alignment, or else calls the global aligned new.
+   */
+  static void *operator new(std::size_t size, std::align_val_t alignment) {
+    return AllocateAligned(size, alignment, true);
+  }
+
+  /// Non-throwing over-aligned new returns NULL if allocation fails.
+  static void *operator new(std::size_t size, std::align_val_t alignment,
+                            const std::nothrow_t &) throw() {
+    return AllocateAligned(size, alignment, false);
+  }
+
+  /// Over-aligned single-object delete.
+  static void operator delete(void *p, std::size_t size,
+                              std::align_val_t alignment) throw() {
+    DeallocateAligned(p, size, alignment);
+  }
+
+  /** Non-throwing over-aligned delete is only called when nothrow
+   over-aligned new is used, and the constructor throws an exception.  The
+   size is unknown, so a block not from a pool goes to DefaultDeallocator,
+   which matches the global aligned new wherever that uses aligned_alloc.
+   */
+  static void operator delete(void *p, std::align_val_t,
+                              const std::nothrow_t &) throw() {
+    MyFrontEnd::Deallocate(p);
+  }
+
+#endif // LOKI_HAS_ALIGNED_NEW
+
 #ifdef LOKI_SMALL_OBJECT_USE_NEW_ARRAY
 
   /// Throwing array-object new throws bad_alloc when allocation fails.
@@ -482,17 +2728,13 @@ public:
   static void *operator new[](std::size_t size) noexcept(false)
 #endif
   {
-    typename MyThreadingModel::Lock lock;
-    (void)lock; // get rid of warning
-    return MyAllocatorSingleton::Instance().Allocate(size, true);
+    return MyFrontEnd::Allocate(size, true);
   }
 
   /// Non-throwing array-object new returns NULL if allocation fails.
   static void *operator new[](std::size_t size,
                               const std::nothrow_t &) throw() {
-    typename MyThreadingModel::Lock lock;
-    (void)lock; // get rid of warning
-    return MyAllocatorSingleton::Instance().Allocate(size, false);
+    return MyFrontEnd::Allocate(size, false);
   }
 
   /// Placement array-object new merely calls global placement new.
@@ -502,28 +2744,61 @@ public:
 
   /// Array-object delete.
   static void operator delete[](void *p, std::size_t size) throw() {
-    typename MyThreadingModel::Lock lock;
-    (void)lock; // get rid of warning
-    MyAllocatorSingleton::Instance().Deallocate(p, size);
+    MyFrontEnd::Deallocate(p, size);
   }
 
   /** Non-throwing array-object delete is only called when nothrow
    new operator is used, and the constructor throws an exception.
    */
   static void operator delete[](void *p, const std::nothrow_t &) throw() {
-    typename MyThreadingModel::Lock lock;
-    (void)lock; // get rid of warning
-    MyAllocatorSingleton::Instance().Deallocate(p);
+    MyFrontEnd::Deallocate(p);
   }
 
   /// Placement array-object delete merely calls global placement delete.
   inline static void operator delete[](void *p, void *place) {
     ::operator delete(p, place);
   }
+
+#ifdef LOKI_HAS_ALIGNED_NEW
+  /// Over-aligned array-object new.
+  static void *operator new[](std::size_t size, std::align_val_t alignment) {
+    return AllocateAligned(size, alignment, true);
+  }
+
+  /// Over-aligned array-object delete.
+  static void operator delete[](void *p, std::size_t size,
+                                std::align_val_t alignment) throw() {
+    DeallocateAligned(p, size, alignment);
+  }
+#endif // LOKI_HAS_ALIGNED_NEW
 #endif // #if use new array functions.
 
 #endif // #if default template parameters are not zero
 
+#ifdef LOKI_HAS_ALIGNED_NEW
+private:
+  static void *AllocateAligned(std::size_t size, std::align_val_t alignment,
+                               bool doThrow) {
+    const std::size_t bytes = ObjAllocatorSingleton::GetAlignedSize(
+        size, static_cast<std::size_t>(alignment));
+    if (0 != bytes)
+      return MyFrontEnd::Allocate(bytes, doThrow);
+    if (doThrow)
+      return ::operator new(size, alignment);
+    return ::operator new(size, alignment, std::nothrow);
+  }
+
+  static void DeallocateAligned(void *p, std::size_t size,
+                                std::align_val_t alignment) {
+    const std::size_t bytes = ObjAllocatorSingleton::GetAlignedSize(
+        size, static_cast<std::size_t>(alignment));
+    if (0 != bytes)
+      MyFrontEnd::Deallocate(p, bytes);
+    else
+      ::operator delete(p, alignment);
+  }
+#endif // LOKI_HAS_ALIGNED_NEW
+
 protected:
   inline SmallObjectBase(void) {}
   inline SmallObjectBase(const SmallObjectBase &) {}
@@ -547,10 +2822,13 @@ template <template <class, class> class ThreadingModel =
           std::size_t objectAlignSize = LOKI_DEFAULT_OBJECT_ALIGNMENT,
           template <class> class LifetimePolicy =
               LOKI_DEFAULT_SMALLOBJ_LIFETIME,
-          class MutexPolicy = LOKI_DEFAULT_MUTEX>
+          class MutexPolicy = LOKI_DEFAULT_MUTEX,
+          class ChunkIndexType = LOKI_DEFAULT_CHUNK_INDEX_TYPE,
+          class Tag = void>
 class SmallObject
     : public SmallObjectBase<ThreadingModel, chunkSize, maxSmallObjectSize,
-                             objectAlignSize, LifetimePolicy, MutexPolicy> {
+                             objectAlignSize, LifetimePolicy, MutexPolicy,
+                             ChunkIndexType, Tag> {
 
 public:
   virtual ~SmallObject() {}
@@ -582,10 +2860,13 @@ template <template <class, class> class ThreadingModel =
           std::size_t objectAlignSize = LOKI_DEFAULT_OBJECT_ALIGNMENT,
           template <class> class LifetimePolicy =
               LOKI_DEFAULT_SMALLOBJ_LIFETIME,
-          class MutexPolicy = LOKI_DEFAULT_MUTEX>
+          class MutexPolicy = LOKI_DEFAULT_MUTEX,
+          class ChunkIndexType = LOKI_DEFAULT_CHUNK_INDEX_TYPE,
+          class Tag = void>
 class SmallValueObject
     : public SmallObjectBase<ThreadingModel, chunkSize, maxSmallObjectSize,
-                             objectAlignSize, LifetimePolicy, MutexPolicy> {
+                             objectAlignSize, LifetimePolicy, MutexPolicy,
+                             ChunkIndexType, Tag> {
 protected:
   inline SmallValueObject(void) {}
   inline SmallValueObject(const SmallValueObject &) {}
@@ -593,6 +2874,88 @@ protected:
   inline ~SmallValueObject() {}
 }; // end class SmallValueObject
 
+/** @class SmallObjectOf
+    @ingroup SmallObjectGroup
+ SmallObject for one class T, which derives from SmallObjectOf<T>.  When
+ new makes exactly a T, the size class is fixed at compile time, and its
+ pool is looked up once and kept in a static, so a monomorphic hot class
+ allocates with no size checks and no size class lookup.  Classes derived
+ from T, which are of other sizes, take the usual SmallObject path.
+ @code
+ class Node : public Loki::SmallObjectOf<Node> { ... };
+ @endcode
+ */
+template <class T,
+          template <class, class> class ThreadingModel =
+              LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL,
+          std::size_t chunkSize = LOKI_DEFAULT_CHUNK_SIZE,
+          std::size_t maxSmallObjectSize = LOKI_MAX_SMALL_OBJECT_SIZE,
+          std::size_t objectAlignSize = LOKI_DEFAULT_OBJECT_ALIGNMENT,
+          template <class> class LifetimePolicy =
+              LOKI_DEFAULT_SMALLOBJ_LIFETIME,
+          class MutexPolicy = LOKI_DEFAULT_MUTEX,
+          class ChunkIndexType = LOKI_DEFAULT_CHUNK_INDEX_TYPE,
+          class Tag = void>
+class SmallObjectOf
+    : public SmallObject<ThreadingModel, chunkSize, maxSmallObjectSize,
+                         objectAlignSize, LifetimePolicy, MutexPolicy,
+                         ChunkIndexType, Tag> {
+  typedef SmallObject<ThreadingModel, chunkSize, maxSmallObjectSize,
+                      objectAlignSize, LifetimePolicy, MutexPolicy,
+                      ChunkIndexType, Tag>
+      MyBase;
+
+  typedef typename MyBase::ObjAllocatorSingleton MyAllocator;
+
+  /// T is complete only once a member function is instantiated.
+  template <std::size_t size> struct TypedFrontEnd {
+    typedef Private::SmallObjSampledTypedFrontEnd<
+        Private::SmallObjTypedFrontEnd<
+            ThreadingModel, typename MyAllocator::MyAllocatorSingleton,
+            typename MyAllocator::MyThreadingModel::Lock, size>,
+        typename MyAllocator::MyAllocatorSingleton, size>
+        UntaggedType;
+    typedef Private::SmallObjAccountedTypedFrontEnd<
+        UntaggedType, typename MyAllocator::MyAllocatorSingleton, Tag, size>
+        Type;
+  };
+
+public:
+  using MyBase::operator new;
+  using MyBase::operator delete;
+
+  /// Throwing single-object new throws bad_alloc when allocation fails.
+#ifdef _MSC_VER
+  /// @note MSVC complains about non-empty exception specification lists.
+  static void *operator new(std::size_t size)
+#else
+  static void *operator new(std::size_t size) noexcept(false)
+#endif
+  {
+    if (sizeof(T) != size)
+      return MyBase::operator new(size);
+    return TypedFrontEnd<sizeof(T)>::Type::Allocate(true);
+  }
+
+  /// Non-throwing single-object new returns NULL if allocation fails.
+  static void *operator new(std::size_t size, const std::nothrow_t &) throw() {
+    if (sizeof(T) != size)
+      return MyBase::operator new(size, std::nothrow);
+    return TypedFrontEnd<sizeof(T)>::Type::Allocate(false);
+  }
+
+  /// Single-object delete.
+  static void operator delete(void *p, std::size_t size) throw() {
+    if (sizeof(T) != size)
+      MyBase::operator delete(p, size);
+    else
+      TypedFrontEnd<sizeof(T)>::Type::Deallocate(p);
+  }
+
+protected:
+  inline SmallObjectOf(void) {}
+}; // end class SmallObjectOf
+
 } // namespace Loki
 
 #endif // end file guardian
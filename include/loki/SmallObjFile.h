@@ -0,0 +1,268 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+////////////////////////////////////////////////////////////////////////////////
+#ifndef LOKI_SMALLOBJFILE_INC_
+#define LOKI_SMALLOBJFILE_INC_
+
+// $Id$
+
+#include <loki/SmallObj.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/** @file SmallObjFile.h
+ A SmallObjAllocator whose Chunks live in a memory-mapped file, so a process
+ can map the file again after a restart and find its objects where it left
+ them, and OffsetPtr, a pointer which stays valid wherever the file is
+ mapped.
+ */
+
+namespace Loki {
+
+/** @class OffsetPtr
+    @ingroup SmallObjectGroup
+ Pointer which holds the distance from itself to the object it points to,
+ rather than the object's address.  If the pointer and the object are in
+ the same mapping, the pointer stays valid when the mapping moves, so an
+ object graph in a SmallObjFileAllocator should link its nodes with these.
+ Copying one recomputes the distance from the copy.
+ */
+template <class T> class OffsetPtr {
+public:
+  OffsetPtr(void) : offset_(Null) {}
+
+  OffsetPtr(T *p) : offset_(Encode(p)) {}
+
+  OffsetPtr(const OffsetPtr &that) : offset_(Encode(that.Get())) {}
+
+  OffsetPtr &operator=(const OffsetPtr &that) {
+    offset_ = Encode(that.Get());
+    return *this;
+  }
+
+  OffsetPtr &operator=(T *p) {
+    offset_ = Encode(p);
+    return *this;
+  }
+
+  /// Returns the address of the object, or nullptr.
+  inline T *Get(void) const {
+    if (Null == offset_)
+      return nullptr;
+    return reinterpret_cast<T *>(reinterpret_cast<std::intptr_t>(this) +
+                                 offset_);
+  }
+
+  inline T &operator*(void) const { return *Get(); }
+
+  inline T *operator->(void) const { return Get(); }
+
+  inline explicit operator bool(void) const { return Null != offset_; }
+
+  inline bool operator==(const OffsetPtr &that) const {
+    return Get() == that.Get();
+  }
+
+  inline bool operator!=(const OffsetPtr &that) const {
+    return Get() != that.Get();
+  }
+
+private:
+  /// Offset which stands for nullptr.  Zero would be the pointer itself.
+  static const std::ptrdiff_t Null = 1;
+
+  inline std::ptrdiff_t Encode(const T *p) const {
+    if (nullptr == p)
+      return Null;
+    return reinterpret_cast<std::intptr_t>(p) -
+           reinterpret_cast<std::intptr_t>(this);
+  }
+
+  /// Distance in bytes from this to the object, or Null.
+  std::ptrdiff_t offset_;
+};
+
+/** @class SmallObjFileAllocator
+    @ingroup SmallObjectGroup
+ A SmallObjAllocator whose Chunks are slots of a memory-mapped file.  The
+ file starts with a header, which tells which parameters made it, and a
+ table with a record for every slot: the size class of its Chunk, and the
+ first free block and count of free blocks.  The free blocks themselves
+ are linked through the stealth indexes inside them, so a record is all
+ it takes to rebuild the Chunk, and each allocation and deallocation
+ writes through to the record of the Chunk it touched.
+
+ Create makes a new file.  Attach maps an existing one, and rebuilds every
+ FixedAllocator from the table, so the blocks allocated before are still
+ allocated, with the same contents, and no block is copied.  One of them
+ can be kept as the root of the object graph with SetRoot.
+
+ The file is mapped at base if one is given, and at any address aligned on
+ the chunk size otherwise.  If it may move, objects in it must refer to
+ each other with OffsetPtr, or with offsets from GetBase, and never hold
+ pointers out of the file.  Objects with virtual functions can't move
+ between processes at all.
+
+ Crash consistency is left to the user: a Sync after a batch of changes
+ makes a point to come back to, but a crash in the middle of a change may
+ leave a record out of date, which Attach or IsCorrupt will report.  This
+ is not thread safe, so callers on several threads must hold a lock.
+ */
+class LOKI_EXPORT SmallObjFileAllocator : private SmallObjChunkSource,
+                                          protected SmallObjAllocator {
+public:
+  /// Parameters are those of SmallObjAllocator, and must match the file's.
+  SmallObjFileAllocator(std::size_t pageSize = LOKI_DEFAULT_CHUNK_SIZE,
+                        std::size_t maxObjectSize = LOKI_MAX_SMALL_OBJECT_SIZE,
+                        std::size_t objectAlignSize =
+                            LOKI_DEFAULT_OBJECT_ALIGNMENT,
+                        std::size_t maxBlocksPerChunk = UCHAR_MAX);
+
+  /// Detaches from the file, whose blocks stay in the file.
+  ~SmallObjFileAllocator(void);
+
+  /** Makes a new file at path of at most length bytes, replacing any file
+   there, and maps it.  This detaches from any file first.
+   @param base Address to map the file at, or nullptr for anywhere.  It
+    must be a multiple of GetChunkSize.
+   @return False if the file can't be made or mapped there, or if length
+    is too short for the header and one Chunk.
+   */
+  bool Create(const char *path, std::size_t length, void *base = nullptr);
+
+  /** Maps the file at path made by Create, and rebuilds all Chunks from
+   its table.  This detaches from any file first.
+   @param base Address to map the file at, or nullptr for anywhere.
+   @return False if the file can't be mapped there, if it was made with
+    other parameters, or if a record doesn't match its Chunk.
+   */
+  bool Attach(const char *path, void *base = nullptr);
+
+  /// Forgets all Chunks and unmaps the file.  Their blocks stay in it.
+  void Detach(void);
+
+  /// Writes the mapping back to the file.  @return False if that failed.
+  bool Sync(void);
+
+  /// Returns true if a file is mapped.
+  inline bool IsAttached(void) const { return nullptr != base_; }
+
+  /** Allocates a block of numBytes from the file.  Unlike
+   SmallObjAllocator, this never uses the heap for big objects.
+   @return The block, or nullptr if numBytes exceeds GetMaxObjectSize, if
+    the file is full, or if none is mapped, unless doThrow is true.
+   @throw std::bad_alloc if doThrow is true and no block is left.
+   */
+  void *Allocate(std::size_t numBytes, bool doThrow);
+
+  /// Deallocates a block of numBytes made by Allocate.
+  void Deallocate(void *p, std::size_t numBytes);
+
+  /// Deallocates a block made by Allocate, whatever its size.
+  void Deallocate(void *p);
+
+  /// Keeps p, a block in the file or nullptr, as the root of the graph.
+  void SetRoot(void *p);
+
+  /// Returns the root kept by SetRoot, or nullptr.
+  void *GetRoot(void) const;
+
+  /// Returns where the file is mapped, or nullptr.
+  inline void *GetBase(void) const { return base_; }
+
+  /// Returns # of bytes mapped.
+  inline std::size_t GetLength(void) const { return length_; }
+
+  /// Returns # of bytes in each slot, which is the alignment of the mapping.
+  inline std::size_t GetChunkSize(void) const { return GetRegionChunkSize(); }
+
+  /** Checks the header, that every Chunk has a matching record and every
+   record a Chunk, and that the pools are not corrupt.  If anything is
+   corrupt, this returns true in release mode, or asserts in debug mode.
+   */
+  bool IsCorrupt(void) const;
+
+  using SmallObjAllocator::GetAlignment;
+  using SmallObjAllocator::GetBlockSizeOf;
+  using SmallObjAllocator::GetMaxObjectSize;
+  using SmallObjAllocator::GetStats;
+  using SmallObjAllocator::HasBlock;
+  using SmallObjAllocator::TrimExcessMemory;
+
+private:
+  struct Header;
+  struct SlotRecord;
+
+  /// Copy-constructor is not implemented.
+  SmallObjFileAllocator(const SmallObjFileAllocator &);
+  /// Copy-assignment operator is not implemented.
+  SmallObjFileAllocator &operator=(const SmallObjFileAllocator &);
+
+  /// Takes the lowest free slot for a Chunk.
+  virtual void *AllocateChunk(void);
+
+  /// Marks the slot of a released Chunk as free.
+  virtual void DeallocateChunk(void *p);
+
+  /** Opens the file at path and maps length bytes of it at base, or all of
+   it if length is zero.  The file is made, or cut to length, if create.
+   */
+  bool Open(const char *path, std::size_t length, void *base, bool create);
+
+  /// Unmaps and closes the file.
+  void Close(void);
+
+  /// Copies the state of the Chunk holding p into its record.
+  void Record(const void *p);
+
+  /// Lists every slot whose record is free, lowest last.
+  void FindFreeSlots(void);
+
+  inline Header *GetHeader(void) const {
+    return reinterpret_cast<Header *>(base_);
+  }
+
+  SlotRecord *GetRecords(void) const;
+
+  inline std::size_t GetSlot(const void *p) const {
+    return static_cast<std::size_t>(static_cast<const unsigned char *>(p) -
+                                    base_) /
+           GetChunkSize();
+  }
+
+  /// Start of the mapping, or nullptr.
+  unsigned char *base_;
+  /// # of bytes mapped.
+  std::size_t length_;
+  /// File descriptor, or HANDLE on Windows.
+  std::intptr_t file_;
+  /// File mapping HANDLE on Windows.
+  void *mapping_;
+  /// Free slots, lowest last.  Room for every slot is reserved up front.
+  std::vector<std::size_t> freeSlots_;
+};
+
+} // namespace Loki
+
+#endif // end file guardian
@@ -0,0 +1,243 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+////////////////////////////////////////////////////////////////////////////////
+#ifndef LOKI_SMALLOBJSHARED_INC_
+#define LOKI_SMALLOBJSHARED_INC_
+
+// $Id$
+
+#include <loki/SmallObjFile.h>
+
+#include <cstddef>
+#include <cstdint>
+
+/** @file SmallObjShared.h
+ A small-object heap in a POSIX shared-memory segment, which several
+ processes allocate from and deallocate to at once, and SmallObjSharedHeap,
+ which lets LokiAllocator put containers in it.
+ */
+
+namespace Loki {
+
+/** @class SmallObjSharedAllocator
+    @ingroup SmallObjectGroup
+ A small-object heap whose blocks and bookkeeping all live in one POSIX
+ shared-memory segment, so any process which maps it can deallocate blocks
+ made by another.  The segment is cut into slots of the chunk size.  Each
+ slot used by a size class is a Chunk like those of SmallObjAllocator,
+ whose free blocks are linked through stealth indexes inside them.  A
+ table of records, one per slot, takes the place of FixedAllocator's
+ private containers: it holds each Chunk's size class, first free block
+ and free count, and links the partly used Chunks of each size class and
+ the free slots into lists by slot index.  Nothing in the segment is an
+ address, so every process may map it at a different base.
+
+ Objects bigger than the max object size get a run of whole slots, found
+ by first fit, so containers whose buffers grow past it still fit.
+
+ Every call takes a robust, process-shared mutex kept in the segment.  If a
+ process dies while holding it, the next caller checks the records as
+ IsCorrupt does.  If they agree, it takes the mutex over, and only the
+ block being moved by the dead process may be lost.  If they don't, the
+ segment is given up: from then on, in every process, Allocate returns
+ nullptr or throws, Deallocate does nothing, and IsCorrupt returns true, so
+ the segment must be removed and made again.
+
+ Processes forked after Create or Attach inherit the mapping at the same
+ address, so objects in the segment may hold plain pointers to each other.
+ Processes which map it on their own must use OffsetPtr instead, and so
+ must containers, unless every process passes the same base.
+ */
+class LOKI_EXPORT SmallObjSharedAllocator {
+public:
+  SmallObjSharedAllocator(void);
+
+  /// Detaches from the segment, which stays until Remove is called.
+  ~SmallObjSharedAllocator(void);
+
+  /** Makes a new segment called name, replacing any segment of that name,
+   and maps it.  This detaches from any segment first.
+   @param name Name for shm_open, which starts with a slash.
+   @param length Most # of bytes in the segment, including bookkeeping.
+   @param maxObjectSize Largest # of bytes served from a Chunk.
+   @param objectAlignSize # of bytes between size classes, and alignment
+    of all blocks.  It must be a power of two, and at least two.
+   @param chunkSize # of bytes in a slot.  It must be a multiple of the
+    page size, and at least maxObjectSize.
+   @param base Address to map the segment at, or nullptr for anywhere.
+   @return False if the parameters are invalid or the segment can't be
+    made or mapped.
+   */
+  bool Create(const char *name, std::size_t length,
+              std::size_t maxObjectSize = LOKI_MAX_SMALL_OBJECT_SIZE,
+              std::size_t objectAlignSize = LOKI_DEFAULT_OBJECT_ALIGNMENT,
+              std::size_t chunkSize = LOKI_DEFAULT_CHUNK_SIZE,
+              void *base = nullptr);
+
+  /** Maps the segment called name, made by Create in this or any other
+   process, with the parameters it was made with.  This detaches from any
+   segment first.
+   @return False if it doesn't exist, can't be mapped, or wasn't made by
+    Create.
+   */
+  bool Attach(const char *name, void *base = nullptr);
+
+  /// Unmaps the segment.  Its blocks stay there for other processes.
+  void Detach(void);
+
+  /// Removes the segment called name, once every process has unmapped it.
+  static bool Remove(const char *name);
+
+  /// Returns true if a segment is mapped.
+  inline bool IsAttached(void) const { return nullptr != base_; }
+
+  /** Allocates a block of numBytes from the segment.  Complexity is O(1)
+   unless numBytes exceeds GetMaxObjectSize, when it is O(S) where S is the
+   # of slots.  This never uses the heap.
+   @return The block, or nullptr if the segment is full, given up or not
+    mapped, unless doThrow is true.
+   @throw std::bad_alloc if doThrow is true and no block is left.
+   */
+  void *Allocate(std::size_t numBytes, bool doThrow);
+
+  /// Deallocates a block of numBytes made by any process.  This is O(1).
+  void Deallocate(void *p, std::size_t numBytes);
+
+  /// Deallocates a block made by any process, whatever its size.
+  void Deallocate(void *p);
+
+  /// Returns true if p is where a block or run of the segment starts.
+  bool HasBlock(const void *p) const;
+
+  /// Keeps p, a block in the segment or nullptr, as the root for Attach.
+  void SetRoot(void *p);
+
+  /// Returns the root kept by SetRoot in any process, or nullptr.
+  void *GetRoot(void) const;
+
+  /// Returns where the segment is mapped, or nullptr.
+  inline void *GetBase(void) const { return base_; }
+
+  /// Returns # of bytes mapped.
+  inline std::size_t GetLength(void) const { return length_; }
+
+  /// Returns the largest # of bytes served from a Chunk.
+  std::size_t GetMaxObjectSize(void) const;
+
+  /// Returns # of bytes between size classes.
+  std::size_t GetAlignment(void) const;
+
+  /// Returns # of bytes in each slot.
+  std::size_t GetChunkSize(void) const;
+
+  /** Fills stats with the counters of every size class, as kept by all
+   processes together.  Runs of slots are counted as fallbacks.
+   @throw std::bad_alloc if the vector of size classes can't grow.
+   */
+  void GetStats(SmallObjStats &stats) const;
+
+  /** Walks every record under the lock, and checks that each Chunk's free
+   blocks, the partial lists and the free slot list agree with each other.
+   Complexity is O(S + B) where B is the # of free blocks.  If any data is
+   corrupt, this returns true in release mode, or asserts in debug mode.
+   It also returns true if the segment was given up after a process died
+   holding its mutex.
+   */
+  bool IsCorrupt(void) const;
+
+private:
+  struct Header;
+  struct ClassRecord;
+  struct SlotRecord;
+  class SharedLock;
+
+  /// Copy-constructor is not implemented.
+  SmallObjSharedAllocator(const SmallObjSharedAllocator &);
+  /// Copy-assignment operator is not implemented.
+  SmallObjSharedAllocator &operator=(const SmallObjSharedAllocator &);
+
+  /// Maps length bytes of the open segment fd at base, or anywhere.
+  bool Map(int fd, std::size_t length, void *base);
+
+  /// Allocates a block of size class c.  The lock must be held.
+  void *AllocateBlock(std::size_t c);
+
+  /// Allocates a run of slots for numBytes.  The lock must be held.
+  void *AllocateRun(std::size_t numBytes);
+
+  /// Deallocates p, whose size class is in its slot's record.
+  void DeallocateBlock(void *p);
+
+  /// The check of IsCorrupt, without asserting.  The lock must be held, or
+  /// have been left by a dead process.
+  bool HasCorruptRecords(void) const;
+
+  /// Takes slot off the list starting at head.
+  void Unlink(std::uint32_t &head, std::uint32_t slot);
+
+  /// Puts slot first on the list starting at head.
+  void Link(std::uint32_t &head, std::uint32_t slot);
+
+  inline Header *GetHeader(void) const {
+    return reinterpret_cast<Header *>(base_);
+  }
+
+  ClassRecord *GetClasses(void) const;
+
+  SlotRecord *GetSlots(void) const;
+
+  /// Returns the slot holding p, which must be inside the mapping.
+  std::uint32_t GetSlot(const void *p) const;
+
+  /// Start of the mapping, or nullptr.
+  unsigned char *base_;
+  /// # of bytes mapped.
+  std::size_t length_;
+};
+
+/** @class SmallObjSharedHeap
+    @ingroup SmallObjectGroup
+ A SmallObjSharedAllocator made as a singleton, so it can be the AllocT of
+ LokiAllocator: LokiAllocator<T, SmallObjSharedHeap<> > puts the nodes and
+ buffers of standard containers in the segment.  Its singleton is never
+ destroyed, so containers may outlive any other static object.  Tag makes
+ separate heaps for separate segments.  Call Create or Attach on
+ Instance before the first allocation, and before forking workers.
+ */
+template <class Tag = void>
+class SmallObjSharedHeap : public SmallObjSharedAllocator {
+public:
+  /// Defines singleton made from the heap.
+  typedef Loki::SingletonHolder<SmallObjSharedHeap, Loki::CreateUsingNew,
+                                Loki::NoDestroy,
+                                LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL>
+      MyAllocatorSingleton;
+
+  /// Returns reference to the singleton.
+  inline static SmallObjSharedHeap &Instance(void) {
+    return MyAllocatorSingleton::Instance();
+  }
+};
+
+} // namespace Loki
+
+#endif // end file guardian
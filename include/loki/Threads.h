@@ -35,6 +35,16 @@
 ///  - SingleThreaded
 ///  - ObjectLevelLockable
 ///  - ClassLevelLockable
+///  - ObjectLevelRWLockable
+///  - ClassLevelRWLockable
+///
+///  Each has a Lock, and a ReadLock and WriteLock.  Code which only reads
+///  the guarded data takes a ReadLock, which the RW policies let several
+///  threads hold at once, and the others make the same as Lock.
+///
+///  Each also has an AtomicType, which holds a Host shared by threads with
+///  the load and store of std::atomic.  A threading model of your own may
+///  leave it out: Loki then uses std::atomic<Host>, see AtomicTypeOf.
 ///
 ///  All classes in Loki have configurable threading model.
 ///
@@ -60,8 +70,13 @@
 ///    To avoid this redesign your synchronization. See also:
 ///    http://sourceforge.net/tracker/index.php?func=detail&aid=1516182&group_id=29557&atid=396647
 
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <mutex>
+#if __cplusplus >= 201402L
+#include <shared_mutex>
+#endif
 
 #define LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL ::Loki::ClassLevelLockable
 
@@ -77,6 +92,15 @@
 #if !defined(LOKI_DEFAULT_RECURSIVE_MUTEX)
 #define LOKI_DEFAULT_RECURSIVE_MUTEX Loki::Mutex<std::recursive_mutex>
 #endif
+#if !defined(LOKI_DEFAULT_RW_MUTEX)
+#if __cplusplus >= 201703L
+#define LOKI_DEFAULT_RW_MUTEX Loki::RWMutex<std::shared_mutex>
+#elif __cplusplus >= 201402L
+#define LOKI_DEFAULT_RW_MUTEX Loki::RWMutex<std::shared_timed_mutex>
+#else
+#define LOKI_DEFAULT_RW_MUTEX Loki::WriterPreferringRWMutex
+#endif
+#endif
 
 namespace Loki {
 ////////////////////////////////////////////////////////////////////////////////
@@ -101,6 +125,140 @@ private:
   T mtx_;
 };
 
+////////////////////////////////////////////////////////////////////////////////
+///  \class RWMutex
+//
+///  \ingroup ThreadingGroup
+///  A readers/writer mutex over std::shared_mutex, or any class with its
+///  lock_shared and unlock_shared.  A policy class for ObjectLevelRWLockable
+///  and ClassLevelRWLockable.
+////////////////////////////////////////////////////////////////////////////////
+
+template <class T> class RWMutex {
+public:
+  RWMutex() {}
+  ~RWMutex() {}
+  void Lock() { mtx_.lock(); }
+  inline void Unlock() { mtx_.unlock(); }
+  void ReadLock() { mtx_.lock_shared(); }
+  inline void ReadUnlock() { mtx_.unlock_shared(); }
+
+private:
+  /// Copy-constructor not implemented.
+  RWMutex(const RWMutex &);
+  /// Copy-assignement operator not implemented.
+  RWMutex &operator=(const RWMutex &);
+  T mtx_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+///  \class WriterPreferringRWMutex
+//
+///  \ingroup ThreadingGroup
+///  A readers/writer mutex which lets no new reader in while a writer waits,
+///  so a steady stream of readers can't starve the writers, as it may with
+///  std::shared_mutex.  Needs only C++11.
+////////////////////////////////////////////////////////////////////////////////
+
+class WriterPreferringRWMutex {
+public:
+  WriterPreferringRWMutex()
+      : mtx_(), readersGo_(), writersGo_(), readers_(0), waitingWriters_(0),
+        writing_(false) {}
+  ~WriterPreferringRWMutex() {}
+
+  void Lock() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    ++waitingWriters_;
+    while (writing_ || (0 < readers_))
+      writersGo_.wait(lock);
+    --waitingWriters_;
+    writing_ = true;
+  }
+
+  void Unlock() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    writing_ = false;
+    if (0 < waitingWriters_)
+      writersGo_.notify_one();
+    else
+      readersGo_.notify_all();
+  }
+
+  void ReadLock() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    while (writing_ || (0 < waitingWriters_))
+      readersGo_.wait(lock);
+    ++readers_;
+  }
+
+  void ReadUnlock() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if ((0 == --readers_) && (0 < waitingWriters_))
+      writersGo_.notify_one();
+  }
+
+private:
+  /// Copy-constructor not implemented.
+  WriterPreferringRWMutex(const WriterPreferringRWMutex &);
+  /// Copy-assignement operator not implemented.
+  WriterPreferringRWMutex &operator=(const WriterPreferringRWMutex &);
+  std::mutex mtx_;
+  std::condition_variable readersGo_;
+  std::condition_variable writersGo_;
+  unsigned int readers_;
+  unsigned int waitingWriters_;
+  bool writing_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+///  \class NonAtomic
+///
+///  \ingroup ThreadingGroup
+///  Holds a value with the load and store of std::atomic, but without any
+///  synchronization, for threading models where only one thread runs.
+////////////////////////////////////////////////////////////////////////////////
+template <class T> class NonAtomic {
+public:
+  NonAtomic() {}
+  constexpr NonAtomic(T value) : value_(value) {}
+
+  inline T load(std::memory_order = std::memory_order_seq_cst) const {
+    return value_;
+  }
+
+  inline void store(T value, std::memory_order = std::memory_order_seq_cst) {
+    value_ = value;
+  }
+
+private:
+  NonAtomic(const NonAtomic &);
+  NonAtomic &operator=(const NonAtomic &);
+  T value_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+///  \struct AtomicTypeOf
+///
+///  \ingroup ThreadingGroup
+///  Type is ThreadingModel<Host, MutexPolicy>::AtomicType if the threading
+///  model has one, else std::atomic<Host>, which is safe under any model.
+////////////////////////////////////////////////////////////////////////////////
+template <class Model, class Host, class = void> struct AtomicTypeOf {
+  typedef std::atomic<Host> Type;
+};
+
+namespace Private {
+template <class T> struct AlwaysVoid { typedef void Type; };
+} // namespace Private
+
+template <class Model, class Host>
+struct AtomicTypeOf<Model, Host,
+                    typename Private::AlwaysVoid<
+                        typename Model::AtomicType>::Type> {
+  typedef typename Model::AtomicType Type;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 ///  \class SingleThreaded
 ///
@@ -119,8 +277,14 @@ public:
     explicit Lock(const SingleThreaded *) {}
   };
 
+  typedef Lock ReadLock;
+  typedef Lock WriteLock;
+
   typedef Host VolatileType;
 
+  /// Holds a Host shared by threads, here with no synchronization.
+  typedef NonAtomic<Host> AtomicType;
+
   typedef int IntType;
 };
 
@@ -170,7 +334,14 @@ public:
     const ObjectLevelLockable &host_;
   };
 
+  typedef Lock ReadLock;
+  typedef Lock WriteLock;
+
   typedef volatile Host VolatileType;
+
+  /// Holds a Host shared by threads, read and written without the lock.
+  typedef std::atomic<Host> AtomicType;
+
   static MutexPolicy atomic_mutex_;
 };
 
@@ -249,7 +420,14 @@ public:
     Lock &operator=(const Lock &);
   };
 
+  typedef Lock ReadLock;
+  typedef Lock WriteLock;
+
   typedef volatile Host VolatileType;
+
+  /// Holds a Host shared by threads, read and written without the lock.
+  typedef std::atomic<Host> AtomicType;
+
   static MutexPolicy atomic_mutex_;
 };
 
@@ -259,6 +437,214 @@ MutexPolicy ClassLevelLockable<Host, MutexPolicy>::atomic_mutex_;
 template <class Host, class MutexPolicy>
 typename ClassLevelLockable<Host, MutexPolicy>::Initializer
     ClassLevelLockable<Host, MutexPolicy>::initializer_;
+
+////////////////////////////////////////////////////////////////////////////////
+///  \class ObjectLevelRWLockable
+///
+///  \ingroup ThreadingGroup
+///  Implementation of the ThreadingModel policy used by various classes
+///  Implements an object-level locking scheme where readers share the lock
+///  and writers hold it alone, for objects read far more often than written.
+///  Lock is the same as WriteLock.
+////////////////////////////////////////////////////////////////////////////////
+template <class Host, class MutexPolicy = LOKI_DEFAULT_RW_MUTEX>
+class ObjectLevelRWLockable {
+  mutable MutexPolicy mtx_;
+
+public:
+  ObjectLevelRWLockable() : mtx_() {}
+
+  ObjectLevelRWLockable(const ObjectLevelRWLockable &) : mtx_() {}
+
+  ~ObjectLevelRWLockable() {}
+
+  class ReadLock;
+  friend class ReadLock;
+  class WriteLock;
+  friend class WriteLock;
+
+  ///  \struct ReadLock
+  ///  Lock class to lock on object level for reading
+  class ReadLock {
+  public:
+    /// Lock object for reading
+    explicit ReadLock(const ObjectLevelRWLockable &host) : host_(host) {
+      host_.mtx_.ReadLock();
+    }
+
+    /// Lock object for reading
+    explicit ReadLock(const ObjectLevelRWLockable *host) : host_(*host) {
+      host_.mtx_.ReadLock();
+    }
+
+    /// Unlock object
+    ~ReadLock() { host_.mtx_.ReadUnlock(); }
+
+  private:
+    /// private by design of the object level threading
+    ReadLock();
+    ReadLock(const ReadLock &);
+    ReadLock &operator=(const ReadLock &);
+    const ObjectLevelRWLockable &host_;
+  };
+
+  ///  \struct WriteLock
+  ///  Lock class to lock on object level for writing
+  class WriteLock {
+  public:
+    /// Lock object for writing
+    explicit WriteLock(const ObjectLevelRWLockable &host) : host_(host) {
+      host_.mtx_.Lock();
+    }
+
+    /// Lock object for writing
+    explicit WriteLock(const ObjectLevelRWLockable *host) : host_(*host) {
+      host_.mtx_.Lock();
+    }
+
+    /// Unlock object
+    ~WriteLock() { host_.mtx_.Unlock(); }
+
+  private:
+    /// private by design of the object level threading
+    WriteLock();
+    WriteLock(const WriteLock &);
+    WriteLock &operator=(const WriteLock &);
+    const ObjectLevelRWLockable &host_;
+  };
+
+  typedef WriteLock Lock;
+
+  typedef volatile Host VolatileType;
+
+  /// Holds a Host shared by threads, read and written without the lock.
+  typedef std::atomic<Host> AtomicType;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+///  \class ClassLevelRWLockable
+///
+///  \ingroup ThreadingGroup
+///  Implementation of the ThreadingModel policy used by various classes
+///  Implements a class-level locking scheme where readers share the lock and
+///  writers hold it alone, for data read far more often than written.
+///  Lock is the same as WriteLock.
+////////////////////////////////////////////////////////////////////////////////
+template <class Host, class MutexPolicy = LOKI_DEFAULT_RW_MUTEX>
+class ClassLevelRWLockable {
+  struct Initializer {
+    friend ClassLevelRWLockable;
+
+    static Initializer &GetIt(void) { return initializer_; }
+
+    inline bool IsInit(void) { return init_; }
+    inline MutexPolicy &GetMutex(void) { return mtx_; }
+
+  private:
+    bool init_;
+    MutexPolicy mtx_;
+
+    Initializer() : init_(false), mtx_() { init_ = true; }
+
+    ~Initializer() { assert(init_); }
+
+    Initializer(const Initializer &) = delete;
+    Initializer &operator=(const Initializer &) = delete;
+  };
+
+  static Initializer initializer_;
+
+public:
+  class ReadLock;
+  friend class ReadLock;
+  class WriteLock;
+  friend class WriteLock;
+
+  ///  \struct ReadLock
+  ///  Lock class to lock on class level for reading
+  class ReadLock {
+  public:
+    /// Lock class for reading
+    ReadLock() {
+      Initializer &initializer = Initializer::GetIt();
+      assert(initializer.IsInit());
+      initializer.GetMutex().ReadLock();
+    }
+
+    /// Lock class for reading
+    explicit ReadLock(const ClassLevelRWLockable &) {
+      Initializer &initializer = Initializer::GetIt();
+      assert(initializer.IsInit());
+      initializer.GetMutex().ReadLock();
+    }
+
+    /// Lock class for reading
+    explicit ReadLock(const ClassLevelRWLockable *) {
+      Initializer &initializer = Initializer::GetIt();
+      assert(initializer.IsInit());
+      initializer.GetMutex().ReadLock();
+    }
+
+    /// Unlock class
+    ~ReadLock() {
+      Initializer &initializer = Initializer::GetIt();
+      assert(initializer.IsInit());
+      initializer.GetMutex().ReadUnlock();
+    }
+
+  private:
+    ReadLock(const ReadLock &);
+    ReadLock &operator=(const ReadLock &);
+  };
+
+  ///  \struct WriteLock
+  ///  Lock class to lock on class level for writing
+  class WriteLock {
+  public:
+    /// Lock class for writing
+    WriteLock() {
+      Initializer &initializer = Initializer::GetIt();
+      assert(initializer.IsInit());
+      initializer.GetMutex().Lock();
+    }
+
+    /// Lock class for writing
+    explicit WriteLock(const ClassLevelRWLockable &) {
+      Initializer &initializer = Initializer::GetIt();
+      assert(initializer.IsInit());
+      initializer.GetMutex().Lock();
+    }
+
+    /// Lock class for writing
+    explicit WriteLock(const ClassLevelRWLockable *) {
+      Initializer &initializer = Initializer::GetIt();
+      assert(initializer.IsInit());
+      initializer.GetMutex().Lock();
+    }
+
+    /// Unlock class
+    ~WriteLock() {
+      Initializer &initializer = Initializer::GetIt();
+      assert(initializer.IsInit());
+      initializer.GetMutex().Unlock();
+    }
+
+  private:
+    WriteLock(const WriteLock &);
+    WriteLock &operator=(const WriteLock &);
+  };
+
+  typedef WriteLock Lock;
+
+  typedef volatile Host VolatileType;
+
+  /// Holds a Host shared by threads, read and written without the lock.
+  typedef std::atomic<Host> AtomicType;
+};
+
+template <class Host, class MutexPolicy>
+typename ClassLevelRWLockable<Host, MutexPolicy>::Initializer
+    ClassLevelRWLockable<Host, MutexPolicy>::initializer_;
 } // namespace Loki
 
 #endif // end file guardian
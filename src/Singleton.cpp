@@ -29,23 +29,115 @@
 
 #include <loki/Singleton.h>
 
+#include <algorithm>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
 Loki::Private::TrackerArray Loki::Private::pTrackerArray = 0;
 unsigned int Loki::Private::elements = 0;
 
+namespace {
+
+/// # of trackers pTrackerArray has room for.
+unsigned int capacity = 0;
+
+/// # of trackers reserved room for, but not added yet.
+unsigned int reserved = 0;
+
+/// # of trackers ever added, to order those with equal longevities.
+unsigned long added = 0;
+
+/// True from registering AtExitFn until it has run.
+bool atExitRegistered = false;
+
+/// Guards the data above, since singletons in different threads may be given
+/// a longevity at once.  Never destroyed, so AtExitFn can use it whenever.
+std::mutex &GetTrackerMutex() {
+  static std::mutex *mutex = new std::mutex;
+  return *mutex;
+}
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+// function ReserveLifetimeTracker
+// Doubles pTrackerArray when full, so adding n trackers costs O(n) copies
+////////////////////////////////////////////////////////////////////////////////
+
+void Loki::Private::ReserveLifetimeTracker() {
+  std::lock_guard<std::mutex> lock(GetTrackerMutex());
+  if (elements + reserved < capacity) {
+    ++reserved;
+    return;
+  }
+  const unsigned int newCapacity = (0 == capacity) ? 16 : 2 * capacity;
+  TrackerArray pNewArray = static_cast<TrackerArray>(
+      std::realloc(pTrackerArray, sizeof(*pTrackerArray) * newCapacity));
+  if (!pNewArray)
+    throw std::bad_alloc();
+  pTrackerArray = pNewArray;
+  capacity = newCapacity;
+  ++reserved;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// function UnreserveLifetimeTracker
+// Undoes ReserveLifetimeTracker, leaving pTrackerArray as it is
+////////////////////////////////////////////////////////////////////////////////
+
+void Loki::Private::UnreserveLifetimeTracker() {
+  std::lock_guard<std::mutex> lock(GetTrackerMutex());
+  assert(0 < reserved);
+  --reserved;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// function AddLifetimeTracker
+// Keeps pTrackerArray a heap whose top is the next tracker to destroy
+////////////////////////////////////////////////////////////////////////////////
+
+void Loki::Private::AddLifetimeTracker(LifetimeTracker *p) {
+  std::lock_guard<std::mutex> lock(GetTrackerMutex());
+  assert(0 < reserved && elements < capacity);
+  --reserved;
+  p->order_ = added++;
+  pTrackerArray[elements++] = p;
+  std::push_heap(pTrackerArray, pTrackerArray + elements,
+                 LifetimeTracker::Compare);
+
+  // One call to AtExitFn destroys all the objects.  If it already ran, the
+  // program is exiting, and the object still needs destroying later on.
+  if (!atExitRegistered) {
+    atExitRegistered = true;
+    std::atexit(AtExitFn);
+  }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // function AtExitFn
 // Ensures proper destruction of objects with longevity
 ////////////////////////////////////////////////////////////////////////////////
 
 void LOKI_C_CALLING_CONVENTION_QUALIFIER Loki::Private::AtExitFn() {
+  std::unique_lock<std::mutex> lock(GetTrackerMutex());
   assert(elements > 0 && pTrackerArray != 0);
-  // Pick the element at the top of the stack
-  LifetimeTracker *pTop = pTrackerArray[elements - 1];
-  // Remove that object off the stack
-  // Don't check errors - realloc with less memory
-  //     can't fail
-  pTrackerArray = static_cast<TrackerArray>(
-      std::realloc(pTrackerArray, sizeof(*pTrackerArray) * --elements));
-  // Destroy the element
-  delete pTop;
+  // Objects given a longevity by a destructor on the way are destroyed too,
+  // in their turn.
+  while (elements > 0) {
+    // Pick the element at the top of the heap
+    std::pop_heap(pTrackerArray, pTrackerArray + elements,
+                  LifetimeTracker::Compare);
+    LifetimeTracker *pTop = pTrackerArray[--elements];
+    // Destroy the element, without the lock a destructor may need
+    lock.unlock();
+    delete pTop;
+    lock.lock();
+  }
+  if (0 == reserved) {
+    std::free(pTrackerArray);
+    pTrackerArray = 0;
+    capacity = 0;
+  }
+  atExitRegistered = false;
 }
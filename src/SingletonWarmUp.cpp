@@ -0,0 +1,259 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+////////////////////////////////////////////////////////////////////////////////
+
+// $Id$
+
+#include <loki/SingletonWarmUp.h>
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#if defined(__GNUC__)
+#include <cstdlib>
+#include <cxxabi.h>
+#endif
+
+namespace Loki {
+
+namespace {
+
+/// A registered holder, and the holders to make once it is made.
+struct WarmUpNode {
+  SingletonWarmUp::Task task;
+  std::vector<std::size_t> dependents;
+  /// # of holders to make before this one.
+  std::size_t dependencies;
+};
+
+struct WarmUpRegistry {
+  std::mutex mutex;
+  std::vector<WarmUpNode> nodes;
+  std::map<SingletonWarmUp::MakeFunction, std::size_t> indices;
+  /// Default names, kept after Clear since timings may still point to them.
+  std::set<std::string> names;
+};
+
+/// Never destroyed, since Registrations may outlive any static object.
+WarmUpRegistry &GetRegistry() {
+  static WarmUpRegistry *registry = new WarmUpRegistry;
+  return *registry;
+}
+
+/// @return The readable name of type, which lives as long as registry.
+const char *GetDefaultName(WarmUpRegistry &registry,
+                           const std::type_info &type) {
+  std::string name = type.name();
+#if defined(__GNUC__)
+  int status = 0;
+  char *demangled = abi::__cxa_demangle(type.name(), 0, 0, &status);
+  if ((0 == status) && (0 != demangled))
+    name = demangled;
+  std::free(demangled);
+#endif
+  return registry.names.insert(name).first->c_str();
+}
+
+/// @return The index of the node for task, added if it has none yet.
+std::size_t FindNode(WarmUpRegistry &registry,
+                     const SingletonWarmUp::Task &task) {
+  std::map<SingletonWarmUp::MakeFunction, std::size_t>::const_iterator it =
+      registry.indices.find(task.make);
+  if (registry.indices.end() != it)
+    return it->second;
+  WarmUpNode node = {task, std::vector<std::size_t>(), 0};
+  if (0 == node.task.name)
+    node.task.name = GetDefaultName(registry, *task.type);
+  registry.nodes.push_back(node);
+  registry.indices[task.make] = registry.nodes.size() - 1;
+  return registry.nodes.size() - 1;
+}
+
+/// @return True if every node can be made after its dependencies.
+bool IsAcyclic(const std::vector<WarmUpNode> &nodes) {
+  std::vector<std::size_t> waiting(nodes.size());
+  std::vector<std::size_t> ready;
+  for (std::size_t ii = 0; ii < nodes.size(); ++ii) {
+    waiting[ii] = nodes[ii].dependencies;
+    if (0 == waiting[ii])
+      ready.push_back(ii);
+  }
+  std::size_t ordered = 0;
+  while (!ready.empty()) {
+    const WarmUpNode &node = nodes[ready.back()];
+    ready.pop_back();
+    ++ordered;
+    for (std::size_t ii = 0; ii < node.dependents.size(); ++ii)
+      if (0 == --waiting[node.dependents[ii]])
+        ready.push_back(node.dependents[ii]);
+  }
+  return nodes.size() == ordered;
+}
+
+/// What the threads of one WarmUp share, all guarded by mutex.
+class WarmUpRun {
+public:
+  explicit WarmUpRun(const std::vector<WarmUpNode> &nodes)
+      : nodes_(nodes), waiting_(nodes.size()), ready_(), finished_(0),
+        timings_(), error_(), mutex_(), changed_(),
+        start_(std::chrono::steady_clock::now()) {
+    for (std::size_t ii = 0; ii < nodes_.size(); ++ii) {
+      waiting_[ii] = nodes_[ii].dependencies;
+      if (0 == waiting_[ii])
+        ready_.push_back(ii);
+    }
+  }
+
+  /// Makes ready holders until all are made, or one of them threw.
+  void Work(unsigned int thread);
+
+  std::vector<SingletonWarmUp::Timing> &GetTimings() { return timings_; }
+
+  std::exception_ptr GetError() const { return error_; }
+
+private:
+  const std::vector<WarmUpNode> &nodes_;
+  std::vector<std::size_t> waiting_;
+  /// Holders whose dependencies are all made, in the order they got so.
+  std::deque<std::size_t> ready_;
+  std::size_t finished_;
+  std::vector<SingletonWarmUp::Timing> timings_;
+  std::exception_ptr error_;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  const std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace
+
+// WarmUpRun::Work ------------------------------------------------------------
+
+void WarmUpRun::Work(unsigned int thread) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    while (ready_.empty() && (finished_ < nodes_.size()) && !error_)
+      changed_.wait(lock);
+    if ((finished_ == nodes_.size()) || error_)
+      return;
+    const std::size_t index = ready_.front();
+    ready_.pop_front();
+    const WarmUpNode &node = nodes_[index];
+    lock.unlock();
+
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    try {
+      node.task.make();
+    } catch (...) {
+      lock.lock();
+      if (!error_)
+        error_ = std::current_exception();
+      changed_.notify_all();
+      return;
+    }
+    const std::chrono::steady_clock::time_point end =
+        std::chrono::steady_clock::now();
+
+    lock.lock();
+    const SingletonWarmUp::Timing timing = {
+        node.task.name, thread,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(start - start_),
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)};
+    timings_.push_back(timing);
+    ++finished_;
+    for (std::size_t ii = 0; ii < node.dependents.size(); ++ii)
+      if (0 == --waiting_[node.dependents[ii]])
+        ready_.push_back(node.dependents[ii]);
+    changed_.notify_all();
+  }
+}
+
+// SingletonWarmUp::Add -------------------------------------------------------
+
+void SingletonWarmUp::Add(const Task &task,
+                          const std::vector<Task> &dependencies) {
+  WarmUpRegistry &registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  const std::size_t index = FindNode(registry, task);
+  // A name given explicitly beats the typeid name from being a dependency.
+  if (0 != task.name)
+    registry.nodes[index].task.name = task.name;
+  for (std::size_t ii = 0; ii < dependencies.size(); ++ii) {
+    const std::size_t dependency = FindNode(registry, dependencies[ii]);
+    registry.nodes[dependency].dependents.push_back(index);
+    ++registry.nodes[index].dependencies;
+  }
+}
+
+// SingletonWarmUp::WarmUp ----------------------------------------------------
+
+std::vector<SingletonWarmUp::Timing>
+SingletonWarmUp::WarmUp(unsigned int threadCount) {
+  // A copy, so constructors may register holders without deadlock.
+  std::vector<WarmUpNode> nodes;
+  {
+    WarmUpRegistry &registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    nodes = registry.nodes;
+  }
+  if (!IsAcyclic(nodes))
+    throw std::logic_error("Singleton warm-up dependencies form a cycle");
+
+  WarmUpRun run(nodes);
+  std::vector<std::thread> threads;
+  for (unsigned int ii = 1; ii < threadCount; ++ii) {
+    try {
+      threads.push_back(std::thread(&WarmUpRun::Work, &run, ii));
+    } catch (const std::system_error &) {
+      // Make do with the threads there are.
+      break;
+    }
+  }
+  run.Work(0);
+  for (std::size_t ii = 0; ii < threads.size(); ++ii)
+    threads[ii].join();
+
+  if (run.GetError())
+    std::rethrow_exception(run.GetError());
+  std::vector<Timing> timings;
+  timings.swap(run.GetTimings());
+  return timings;
+}
+
+// SingletonWarmUp::Clear -----------------------------------------------------
+
+void SingletonWarmUp::Clear() {
+  WarmUpRegistry &registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  registry.nodes.clear();
+  registry.indices.clear();
+}
+
+} // namespace Loki
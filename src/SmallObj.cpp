@@ -34,22 +34,326 @@
 #include <bitset>
 #include <cassert>
 #include <climits>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#if defined(_WIN32)
+#include <malloc.h> // needed for _aligned_malloc
+#endif
+
+#if defined(_MSC_VER) && defined(_WIN64)
+#include <intrin.h> // needed for _BitScanForward64
+#endif
+
 // #define DO_EXTRA_LOKI_TESTS
 // #define USE_NEW_TO_ALLOCATE
 // #define LOKI_CHECK_FOR_CORRUPTION
+// #define LOKI_SMALLOBJ_MMAP_ARENA
+
+#ifdef LOKI_SMALLOBJ_MMAP_ARENA
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__GLIBC__)
+#include <execinfo.h> // needed for backtrace
+#define LOKI_SMALLOBJ_HAS_BACKTRACE
+#endif
 
 #ifdef DO_EXTRA_LOKI_TESTS
 #include <iostream>
 #endif
 
+#ifndef LOKI_SMALLOBJ_ARENA_RANGE_SIZE
+/// # of bytes of address space reserved at once by ChunkArena.
+#define LOKI_SMALLOBJ_ARENA_RANGE_SIZE (64 * 1024 * 1024)
+#endif
+
+#ifndef LOKI_SMALLOBJ_ARENA_ADVICE
+/** How ChunkArena returns pages of released Chunks to the OS.  MADV_DONTNEED
+ lowers resident memory at once, while MADV_FREE lets the kernel reclaim
+ the pages lazily, which is cheaper if Chunks are soon reused.
+ */
+#define LOKI_SMALLOBJ_ARENA_ADVICE MADV_DONTNEED
+#endif
+
+#ifndef LOKI_SMALLOBJ_HOT_CHUNK_COUNT
+/** A FixedAllocator with at least this many Chunks is a hot size class, and
+ gets new Chunks from huge pages when ChunkArena can provide them.
+ */
+#define LOKI_SMALLOBJ_HOT_CHUNK_COUNT 64
+#endif
+
+#ifndef LOKI_SMALLOBJ_PARTIAL_BUCKETS
+/** # of buckets into which FixedAllocator sorts its partly used Chunks by
+ how full they are, so it can allocate from one of the fullest at once.
+ */
+#define LOKI_SMALLOBJ_PARTIAL_BUCKETS 4
+#endif
+
 namespace Loki {
 namespace Private {
 
 // ----------------------------------------------------------------------------
 
+/** @class ChunkMap
+    @ingroup SmallObjectGroupInternal
+ Maps the address of any block to the Chunk which owns it in constant time.
+ Each Chunk's storage starts at a multiple of its size class's alignment, a
+ power of two no shorter than the Chunk nor than the map's unit, and the
+ Chunk is recorded at every unit of that span.  So the address of a block
+ shifted right by log2(unit) identifies its Chunk.  That key is looked up in
+ a radix tree whose nodes are only allocated for parts of the address space
+ which hold Chunks.  One ChunkMap is shared by all the FixedAllocator's of a
+ SmallObjAllocator, so it also tells which FixedAllocator owns a block.
+ */
+class ChunkMap {
+public:
+  /// Owner of a Chunk, and index of the Chunk in the owner's container.
+  struct Entry {
+    FixedAllocator *owner_;
+    ::std::size_t index_;
+  };
+
+  /// @param unit Power of two, the least alignment of any Chunk.
+  explicit ChunkMap(::std::size_t unit);
+
+  /// Releases all nodes of the radix tree.
+  ~ChunkMap(void);
+
+  /// Returns the least alignment of any Chunk.
+  inline ::std::size_t GetUnit(void) const {
+    return ::std::size_t(1) << shift_;
+  }
+
+  /** Records that the Chunk whose storage starts at pData, and is aligned
+   on span, is owned by owner at position index.  Overwrites any previous
+   record.  Records nothing if it fails.
+   @return False if a node could not be allocated, or if pData is outside
+    the range of addresses covered by LOKI_SMALLOBJ_ADDRESS_BITS.
+   */
+  bool Insert(const void *pData, ::std::size_t span, FixedAllocator *owner,
+              ::std::size_t index);
+
+  /// Forgets the Chunk whose storage starts at pData, and is aligned on span.
+  void Erase(const void *pData, ::std::size_t span);
+
+  /** Returns the record of the Chunk whose aligned span contains p, or
+   nullptr if there is none.  The caller must still check that p is inside
+   the Chunk, since a Chunk may be shorter than the alignment.
+   */
+  Entry *Find(const void *p) const;
+
+private:
+  /// Each node of the tree is indexed by NodeBits bits of the key.
+  enum { NodeBits = 9, NodeSize = 1 << NodeBits };
+
+  /// Returns the leaf Entry for key, allocating nodes if doCreate is true.
+  Entry *Walk(::std::uintptr_t key, bool doCreate) const;
+
+  /// Releases node and all of its children.
+  static void FreeNode(void **node, unsigned int level);
+
+  /// Not implemented.
+  ChunkMap(const ChunkMap &);
+  /// Not implemented.
+  ChunkMap &operator=(const ChunkMap &);
+
+  /// Interior nodes are arrays of node pointers, leaves are arrays of Entry.
+  mutable void **root_;
+  /// log2 of the unit.
+  unsigned int shift_;
+  /// # of levels in the tree, including the leaves.
+  unsigned int levels_;
+};
+
+// ----------------------------------------------------------------------------
+
+/** @class ChunkArena
+    @ingroup SmallObjectGroupInternal
+ Provides the storage for every Chunk of a SmallObjAllocator.  Storage
+ always starts at a multiple of the alignment its size class asks for, so
+ the ChunkMap can find it.  By default each Chunk is allocated by itself
+ from the heap.  The heap may leave up to one alignment free in front of
+ each Chunk, which only smaller allocations can reuse, so with glibc a
+ Chunk can take twice its alignment of resident memory.
+
+ If LOKI_SMALLOBJ_MMAP_ARENA is defined, Chunks are instead carved from
+ ranges of LOKI_SMALLOBJ_ARENA_RANGE_SIZE bytes reserved with mmap.  Each
+ Chunk occupies one slot as long as its alignment.  The pages of a
+ released slot are handed back to the OS with madvise, so trimming lowers
+ resident memory, and the slot is reused by the next Chunk.  Slots for hot
+ size classes come from a separate range which asks for transparent huge
+ pages to cut TLB misses.  The arena only needs mmap and madvise, so it
+ works on POSIX systems but not on Windows.
+
+ If the SmallObjAllocator was made with a SmallObjChunkSource, all storage
+ comes from that source instead, whichever way the arena was built.
+ */
+class ChunkArena {
+public:
+  /** @param maxAlignment Power of two, the most alignment any Chunk asks
+    for, which is also the length of every slot a source provides.
+   @param source Provides all storage, or nullptr to use the heap or mmap.
+   */
+  ChunkArena(::std::size_t maxAlignment, SmallObjChunkSource *source);
+
+  /// Unmaps all ranges.  Every Chunk must be released first.
+  ~ChunkArena(void);
+
+  /** Returns storage for a Chunk of numBytes, starting at a multiple of
+   alignment, or nullptr if none is available.  This never throws.
+   @param alignment Power of two, which numBytes may not exceed, nor may it
+    exceed the most alignment.
+   @param hot True if the Chunk is for a hot size class.
+   */
+  void *Allocate(::std::size_t numBytes, ::std::size_t alignment, bool hot);
+
+  /// Releases storage made by Allocate with the same alignment.
+  void Deallocate(void *p, ::std::size_t alignment);
+
+  /// Returns the most alignment of any Chunk, and most it may hold.
+  inline ::std::size_t GetAlignment(void) const { return alignment_; }
+
+private:
+  /// Not implemented.
+  ChunkArena(const ChunkArena &);
+  /// Not implemented.
+  ChunkArena &operator=(const ChunkArena &);
+
+  /// Most alignment and length of any Chunk's storage.
+  ::std::size_t alignment_;
+
+  /// Provides all storage if not nullptr.
+  SmallObjChunkSource *source_;
+
+#ifdef LOKI_SMALLOBJ_MMAP_ARENA
+  /// Part of a reserved range which no Chunk has used yet.
+  struct Range {
+    unsigned char *next_;
+    unsigned char *end_;
+  };
+
+  /// Reserves a new range, and asks for huge pages if hot is true.
+  bool Reserve(Range &range, bool hot);
+
+  /// Returns log2 of alignment, which is a power of two.
+  static inline unsigned int GetShift(::std::size_t alignment) {
+    unsigned int shift = 0;
+    while ((::std::size_t(1) << shift) < alignment)
+      ++shift;
+    return shift;
+  }
+
+  /// Unused parts of the latest normal range, and of the latest hot range.
+  Range ranges_[2];
+  /// Released slots, whose pages were already given back to the OS, by
+  /// log2 of their length.
+  ::std::vector<::std::vector<void *>> freeSlots_;
+  /// Start and length of every mapping, for unmapping them all.
+  ::std::vector<::std::pair<void *, ::std::size_t>> mappings_;
+#endif
+};
+
+// ----------------------------------------------------------------------------
+
+/** @class ChunkBitmap
+    @ingroup SmallObjectGroupInternal
+ A set of Chunk indexes, kept as a bitmap with a summary word for every 64
+ words, so finding the lowest index in the set reads at most one word per
+ 4096 Chunks, and in practice one or two.
+ */
+class ChunkBitmap {
+public:
+  /// Index returned by FindFirst if the set is empty.
+  static const ::std::size_t NoIndex = static_cast<::std::size_t>(-1);
+
+  ChunkBitmap(void) : words_(), summary_() {}
+
+  /** Makes room for indexes below count.  Indexes already in the set stay.
+   @throw std::bad_alloc if it can't make room.
+   */
+  void Reserve(::std::size_t count);
+
+  /// Returns the lowest index which Reserve made room for.
+  inline ::std::size_t GetCapacity(void) const {
+    return words_.size() * WordBits;
+  }
+
+  /// Adds index to the set.
+  inline void Set(::std::size_t index) {
+    const ::std::size_t word = index / WordBits;
+    words_[word] |= Word(1) << (index % WordBits);
+    summary_[word / WordBits] |= Word(1) << (word % WordBits);
+  }
+
+  /// Removes index from the set.
+  inline void Clear(::std::size_t index) {
+    const ::std::size_t word = index / WordBits;
+    words_[word] &= ~(Word(1) << (index % WordBits));
+    if (0 == words_[word])
+      summary_[word / WordBits] &= ~(Word(1) << (word % WordBits));
+  }
+
+  /// Returns true if index is in the set.
+  inline bool Test(::std::size_t index) const {
+    return 0 != (words_[index / WordBits] & (Word(1) << (index % WordBits)));
+  }
+
+  /// Returns the lowest index in the set, or NoIndex if it is empty.
+  ::std::size_t FindFirst(void) const;
+
+  /** Returns true if a summary bit disagrees with its word, or if an index
+   at or above count is in the set.
+   */
+  bool IsCorrupt(::std::size_t count) const;
+
+private:
+  typedef ::std::uint64_t Word;
+  enum { WordBits = 64 };
+
+  /// Bit i of word w is set if index w * 64 + i is in the set.
+  ::std::vector<Word> words_;
+  /// Bit i of summary word s is set if word s * 64 + i is not zero.
+  ::std::vector<Word> summary_;
+};
+
+// ----------------------------------------------------------------------------
+
+/// Type wide enough for the stealth index of any block in any Chunk.
+typedef unsigned short StealthIndex;
+
+/// Reads the stealth index stored at the start of an empty block.
+inline StealthIndex ReadStealthIndex(const unsigned char *p, bool wide) {
+  if (!wide)
+    return *p;
+  // Blocks need not be aligned for an unsigned short, so copy bytewise.
+  StealthIndex index;
+  ::std::memcpy(&index, p, sizeof(index));
+  return index;
+}
+
+/// Writes a stealth index at the start of an empty block.
+inline void WriteStealthIndex(unsigned char *p, StealthIndex index, bool wide) {
+  if (!wide)
+    *p = static_cast<unsigned char>(index);
+  else
+    ::std::memcpy(p, &index, sizeof(index));
+}
+
+// ----------------------------------------------------------------------------
+
 /** @struct Chunk
     @ingroup SmallObjectGroupInternal
  Contains info about each allocated Chunk - which is a collection of
@@ -81,7 +385,9 @@ namespace Private {
  block.  These stealth indexes form a singly-linked list within the blocks.
  A Chunk is corrupt if this singly-linked list has a loop or is shorter
  than blocksAvailable_.  Much of the allocator's time and space efficiency
- comes from how these stealth indexes are implemented.
+ comes from how these stealth indexes are implemented.  A Chunk with more
+ than UCHAR_MAX blocks uses the first two bytes of each empty block for a
+ wide stealth index instead, so it may hold up to USHRT_MAX blocks.
  */
 class Chunk {
 private:
@@ -90,37 +396,43 @@ private:
   /** Initializes a just-constructed Chunk.
    @param blockSize Number of bytes per block.
    @param blocks Number of blocks per Chunk.
+   @param alignment Power of two at which the Chunk's storage starts.
+   @param arena Provides storage for the Chunk.
+   @param hot True if the Chunk is for a hot size class.
    @return True for success, false for failure.
    */
-  bool Init(::std::size_t blockSize, unsigned char blocks);
+  bool Init(::std::size_t blockSize, StealthIndex blocks,
+            ::std::size_t alignment, ChunkArena &arena, bool hot);
 
   /** Allocate a block within the Chunk.  Complexity is always O(1), and
    this will never throw.  Does not actually "allocate" by calling
    malloc, new, or any other function, but merely adjusts some internal
    indexes to indicate an already allocated block is no longer available.
+   @param wideIndexes True if stealth indexes are two bytes wide.
    @return Pointer to block within Chunk.
    */
-  void *Allocate(::std::size_t blockSize);
+  void *Allocate(::std::size_t blockSize, bool wideIndexes);
 
   /** Deallocate a block within the Chunk. Complexity is always O(1), and
    this will never throw.  For efficiency, this assumes the address is
    within the block and aligned along the correct byte boundary.  An
    assertion checks the alignment, and a call to HasBlock is done from
-   within VicinityFind.  Does not actually "deallocate" by calling free,
-   delete, or other function, but merely adjusts some internal indexes to
-   indicate a block is now available.
+   within FixedAllocator::Deallocate.  Does not actually "deallocate" by
+   calling free, delete, or other function, but merely adjusts some
+   internal indexes to indicate a block is now available.
    */
-  void Deallocate(void *p, ::std::size_t blockSize);
+  void Deallocate(void *p, ::std::size_t blockSize, bool wideIndexes);
 
   /** Resets the Chunk back to pristine values. The available count is
    set back to zero, and the first available index is set to the zeroth
    block.  The stealth indexes inside each block are set to point to the
    next block. This assumes the Chunk's data was already using Init.
    */
-  void Reset(::std::size_t blockSize, unsigned char blocks);
+  void Reset(::std::size_t blockSize, StealthIndex blocks);
 
-  /// Releases the allocated block of memory.
-  void Release();
+  /// Releases the allocated block of memory, made with alignment, back to
+  /// the arena.
+  void Release(ChunkArena &arena, ::std::size_t alignment);
 
   /** Determines if the Chunk has been corrupted.
    @param numBlocks Total # of blocks in the Chunk.
@@ -131,7 +443,7 @@ private:
     release version runs faster.)
    @return True if Chunk is corrupt.
    */
-  bool IsCorrupt(unsigned char numBlocks, ::std::size_t blockSize,
+  bool IsCorrupt(StealthIndex numBlocks, ::std::size_t blockSize,
                  bool checkIndexes) const;
 
   /** Determines if block is available.
@@ -140,7 +452,7 @@ private:
    @param blockSize # of bytes in each block.
    @return True if block is available, else false if allocated.
    */
-  bool IsBlockAvailable(void *p, unsigned char numBlocks,
+  bool IsBlockAvailable(void *p, StealthIndex numBlocks,
                         ::std::size_t blockSize) const;
 
   /// Returns true if block at address P is inside this Chunk.
@@ -149,18 +461,23 @@ private:
     return (pData_ <= pc) && (pc < pData_ + chunkLength);
   }
 
-  inline bool HasAvailable(unsigned char numBlocks) const {
+  inline bool HasAvailable(StealthIndex numBlocks) const {
     return (blocksAvailable_ == numBlocks);
   }
 
   inline bool IsFilled(void) const { return (0 == blocksAvailable_); }
 
+  /// Returns true if a Chunk of numBlocks needs two byte stealth indexes.
+  static inline bool HasWideIndexes(::std::size_t numBlocks) {
+    return (UCHAR_MAX < numBlocks);
+  }
+
   /// Pointer to array of allocated blocks.
   unsigned char *pData_;
   /// Index of first empty block.
-  unsigned char firstAvailableBlock_;
+  StealthIndex firstAvailableBlock_;
   /// Count of empty blocks.
-  unsigned char blocksAvailable_;
+  StealthIndex blocksAvailable_;
 };
 
 /** @class FixedAllocator
@@ -173,6 +490,9 @@ private:
  - There is always either zero or one Chunk which is empty.
  - If this has no empty Chunk, then emptyChunk_ is nullptr.
  - If this has an empty Chunk, then emptyChunk_ points to it.
+ - Spare Chunks are empty, and are neither in the Chunk container nor in
+   the ChunkMap.  There are spare Chunks only if retainSpares_ was set,
+   or if a Trim or TrimExcessMemory has yet to release them.
  - If the Chunk container is empty, then deallocChunk_ and allocChunk_
    are nullptr.
  - If the Chunk container is not-empty, then deallocChunk_ and allocChunk_
@@ -180,6 +500,8 @@ private:
  - allocChunk_ will often point to the last Chunk in the container since
    it was likely allocated most recently, and therefore likely to have an
    available block.
+ - Each partly used Chunk's index is in exactly one of the partial_
+   bitmaps, the one for its bucket.  Full and empty Chunks are in none.
  */
 class FixedAllocator {
 private:
@@ -196,19 +518,45 @@ private:
    */
   bool MakeNewChunk(void);
 
-  /** Finds the Chunk which owns the block at address p.  It starts at
-   deallocChunk_ and searches in both forwards and backwards directions
-   from there until it finds the Chunk which owns p.  This algorithm
-   should find the Chunk quickly if it is deallocChunk_ or is close to it
-   in the Chunks container.  This goes both forwards and backwards since
-   that works well for both same-order and opposite-order deallocations.
-   (Same-order = objects are deallocated in the same order in which they
-   were allocated.  Opposite order = objects are deallocated in a last to
-   first order.  Complexity is O(C) where C is count of all Chunks.  This
-   never throws.
-   @return Pointer to Chunk that owns p, or nullptr if no owner found.
+  /** Makes room for one more Chunk in the container and the bitmaps.  If
+   the container moves, allocChunk_, deallocChunk_ and emptyChunk_ move
+   along with it, so they stay valid even if the new Chunk is not made.
+   @throw std::bad_alloc if there is no room.
+   */
+  void ReserveChunks(void);
+
+  /** Swaps the contents of two Chunks in the container, and updates
+   their records in the ChunkMap.
+   */
+  void SwapChunks(Chunk *lhs, Chunk *rhs);
+
+  /** Removes the last Chunk from the container and forgets it in ChunkMap.
+   The Chunk's storage is released, or kept as a spare if toSpares is true.
+   */
+  void PopLastChunk(bool toSpares);
+
+  /** Returns the bucket of a Chunk with available free blocks.  Bucket 0
+   holds the fullest partly used Chunks.  Full and empty Chunks are in no
+   bucket, and get LOKI_SMALLOBJ_PARTIAL_BUCKETS.
+   */
+  inline unsigned int GetBucket(::std::size_t available) const {
+    if ((0 == available) || (numBlocks_ == available))
+      return LOKI_SMALLOBJ_PARTIAL_BUCKETS;
+    unsigned int bucket = 0;
+    while (bucketLimits_[bucket] < available)
+      ++bucket;
+    return bucket;
+  }
+
+  /** Moves chunk to the bucket for its blocks available now, if that is not
+   the bucket for when it had wasAvailable blocks.
    */
-  Chunk *VicinityFind(void *p) const;
+  inline void UpdateBucket(const Chunk *chunk, ::std::size_t wasAvailable);
+
+  /** Returns one of the fullest partly used Chunks, or nullptr if every
+   Chunk is full or empty.
+   */
+  Chunk *FindPartialChunk(void);
 
   /// Not implemented.
   FixedAllocator(const FixedAllocator &);
@@ -225,13 +573,18 @@ private:
   /// Fewest # of objects managed by a Chunk.
   static unsigned char MinObjectsPerChunk_;
 
-  /// Most # of objects managed by a Chunk - never exceeds UCHAR_MAX.
-  static unsigned char MaxObjectsPerChunk_;
-
+  /// Map shared by all FixedAllocator's to find which Chunk owns a block.
+  ChunkMap *chunkMap_;
+  /// Arena shared by all FixedAllocator's to provide storage for Chunks.
+  ChunkArena *chunkArena_;
   /// Number of bytes in a single block within a Chunk.
   ::std::size_t blockSize_;
   /// Number of blocks managed by each Chunk.
-  unsigned char numBlocks_;
+  StealthIndex numBlocks_;
+  /// Power of two at which each Chunk's storage starts.
+  ::std::size_t chunkAlignment_;
+  /// True if Chunks have more than UCHAR_MAX blocks.
+  bool wideIndexes_;
 
   /// Container of Chunks.
   Chunks chunks_;
@@ -241,6 +594,25 @@ private:
   Chunk *deallocChunk_;
   /// Pointer to the only empty Chunk if there is one, else nullptr.
   Chunk *emptyChunk_;
+  /// Empty Chunks kept out of the container for reuse or a later Trim.
+  Chunks spares_;
+  /// True if Chunks emptied by Deallocate become spares.
+  bool retainSpares_;
+  /// Indexes of partly used Chunks, by how full they are.
+  ChunkBitmap partial_[LOKI_SMALLOBJ_PARTIAL_BUCKETS];
+  /// Most blocks available in a Chunk of each bucket.
+  StealthIndex bucketLimits_[LOKI_SMALLOBJ_PARTIAL_BUCKETS];
+
+  /// # of blocks ever allocated.
+  ::std::uint64_t allocations_;
+  /// # of blocks ever deallocated.
+  ::std::uint64_t deallocations_;
+  /// # of blocks allocated now.
+  ::std::size_t liveBlocks_;
+  /// Most blocks ever allocated at once.
+  ::std::size_t maxLiveBlocks_;
+  /// Most Chunks ever held at once.
+  ::std::size_t maxChunks_;
 
 public:
   /// Create a FixedAllocator which manages blocks of 'blockSize' size.
@@ -249,14 +621,34 @@ public:
   /// Destroy the FixedAllocator and release all its Chunks.
   ~FixedAllocator();
 
-  /// Initializes a FixedAllocator by calculating # of blocks per Chunk.
-  void Initialize(::std::size_t blockSize, ::std::size_t pageSize);
+  /** Returns # of blocks per Chunk for blocks of blockSize bytes.  This
+   never exceeds maxBlocks, nor UCHAR_MAX if a block is too small to hold
+   a wide stealth index.
+   */
+  static ::std::size_t GetNumBlocks(::std::size_t blockSize,
+                                    ::std::size_t pageSize,
+                                    ::std::size_t maxBlocks);
+
+  /** Initializes a FixedAllocator by calculating # of blocks per Chunk.
+   Chunks get their storage from chunkArena, starting at multiples of
+   chunkAlignment, and are registered in chunkMap.  chunkAlignment must be
+   a power of two no less than the length of a Chunk nor the map's unit.
+   */
+  void Initialize(::std::size_t blockSize, ::std::size_t pageSize,
+                  ::std::size_t maxBlocks, ::std::size_t chunkAlignment,
+                  ChunkMap *chunkMap, ChunkArena *chunkArena);
 
   /** Returns pointer to allocated memory block of fixed size - or nullptr
    if it failed to allocate.
    */
   void *Allocate(void);
 
+  /** Fills blocks with up to count blocks, taking every available block
+   from a Chunk before moving on to the next one.
+   @return # of blocks allocated.
+   */
+  ::std::size_t AllocateBatch(void **blocks, ::std::size_t count);
+
   /** Deallocate a memory block previously allocated with Allocate.  If
    the block is not owned by this FixedAllocator, it returns false so
    that SmallObjAllocator can call the default deallocator.  If the
@@ -267,12 +659,27 @@ public:
   /// Returns block size with which the FixedAllocator was initialized.
   inline ::std::size_t BlockSize() const { return blockSize_; }
 
+  /// Returns the power of two at which each Chunk's storage starts.
+  inline ::std::size_t GetChunkAlignment() const { return chunkAlignment_; }
+
   /** Releases the memory used by the empty Chunk.  This will take
    constant time under any situation.
    @return True if empty chunk found and released, false if none empty.
    */
   bool TrimEmptyChunk(void);
 
+  /** Releases empty Chunks - spares first - until no more than keep remain
+   or budget Chunks were released.  This never looks at more Chunks than it
+   releases, so it takes O(budget) time.
+   @return # of Chunks released.
+   */
+  ::std::size_t TrimSpares(::std::size_t keep, ::std::size_t budget);
+
+  /** Sets whether Chunks emptied by Deallocate are kept as spares instead
+   of being released when there is already an empty Chunk.
+   */
+  inline void SetRetainSpares(bool retain) { retainSpares_ = retain; }
+
   /** Releases unused spots from ChunkList.  This takes constant time
    with respect to # of Chunks, but actual time depends on underlying
    memory allocator.
@@ -293,11 +700,33 @@ public:
    */
   bool IsCorrupt(void) const;
 
-  /** Returns true if the block at address p is within a Chunk owned by
-   this FixedAllocator.  Complexity is O(C) where C is the total number
-   of Chunks - empty or used.
+  /** Returns the Chunk owning the block at address p if that Chunk is
+   owned by this FixedAllocator, else nullptr.  Complexity is O(1) since
+   it only does a ChunkMap lookup.
    */
   const Chunk *HasBlock(void *p) const;
+
+  /// Fills stats with the counters of this FixedAllocator.
+  void GetStats(SmallObjSizeClassStats &stats) const;
+
+  /// Fills state with the record of the Chunk at index, except its class.
+  void GetChunkState(::std::size_t index, SmallObjChunkState &state) const;
+
+  /// Adds records of all Chunks, including spares, as size class sizeClass.
+  void GetChunkStates(::std::size_t sizeClass,
+                      ::std::vector<SmallObjChunkState> &states) const;
+
+  /** Takes a Chunk whose storage at pData already holds blocks, after
+   checking its free blocks.  If there is already an empty Chunk and this
+   one is empty too, its storage is released instead.  This never throws.
+   @return False if the Chunk is corrupt or the container can't grow.
+   */
+  bool Adopt(void *pData, StealthIndex firstAvailable,
+             StealthIndex available);
+
+  /// Forgets all Chunks without releasing their storage.
+  void Discard(void);
+
   inline Chunk *HasBlock(void *p) {
     return const_cast<Chunk *>(
         const_cast<const FixedAllocator *>(this)->HasBlock(p));
@@ -305,7 +734,6 @@ public:
 };
 
 unsigned char FixedAllocator::MinObjectsPerChunk_ = 8;
-unsigned char FixedAllocator::MaxObjectsPerChunk_ = UCHAR_MAX;
 
 /** @ingroup SmallObjectGroupInternal
  Calls the default allocator when SmallObjAllocator decides not to handle a
@@ -326,26 +754,420 @@ void *DefaultAllocator(::std::size_t numBytes, bool doThrow);
  */
 void DefaultDeallocator(void *p);
 
+/** @ingroup SmallObjectGroupInternal
+ Allocates storage for a Chunk which starts at a multiple of alignment.
+ @param alignment Power of two, and a multiple of sizeof(void *).
+ @return nullptr if it failed to allocate.  This never throws.
+ */
+void *AlignedAllocate(::std::size_t alignment, ::std::size_t numBytes);
+
+/// @ingroup SmallObjectGroupInternal
+/// Releases storage made by AlignedAllocate.
+void AlignedDeallocate(void *p);
+
+// ChunkMap::ChunkMap ---------------------------------------------------------
+
+ChunkMap::ChunkMap(::std::size_t unit)
+    : root_(nullptr), shift_(0), levels_(0) {
+  assert(0 < unit);
+  // Must be a power of two.
+  assert(0 == (unit & (unit - 1)));
+  while ((::std::size_t(1) << shift_) < unit)
+    ++shift_;
+  const unsigned int addressBits = LOKI_SMALLOBJ_ADDRESS_BITS;
+  const unsigned int keyBits =
+      (addressBits > shift_) ? (addressBits - shift_) : 1;
+  levels_ = (keyBits + NodeBits - 1) / NodeBits;
+}
+
+// ChunkMap::~ChunkMap --------------------------------------------------------
+
+ChunkMap::~ChunkMap(void) {
+  if (nullptr != root_)
+    FreeNode(root_, levels_ - 1);
+}
+
+// ChunkMap::FreeNode ---------------------------------------------------------
+
+void ChunkMap::FreeNode(void **node, unsigned int level) {
+  if (0 == level) {
+    delete[] reinterpret_cast<Entry *>(node);
+    return;
+  }
+  for (unsigned int ii = 0; ii < NodeSize; ++ii) {
+    if (nullptr != node[ii])
+      FreeNode(static_cast<void **>(node[ii]), level - 1);
+  }
+  delete[] node;
+}
+
+// ChunkMap::Walk -------------------------------------------------------------
+
+ChunkMap::Entry *ChunkMap::Walk(::std::uintptr_t key, bool doCreate) const {
+  // Keys beyond the covered address range are never stored.
+  if ((key >> (levels_ * NodeBits)) != 0)
+    return nullptr;
+
+  void **slot = reinterpret_cast<void **>(&root_);
+  for (unsigned int level = levels_; 0 < level; --level) {
+    if (nullptr == *slot) {
+      if (!doCreate)
+        return nullptr;
+      if (1 == level)
+        *slot = new (::std::nothrow) Entry[NodeSize]();
+      else
+        *slot = new (::std::nothrow) void *[NodeSize]();
+      if (nullptr == *slot)
+        return nullptr;
+    }
+    if (1 == level)
+      break;
+    const ::std::size_t index =
+        (key >> ((level - 1) * NodeBits)) & (NodeSize - 1);
+    slot = static_cast<void **>(*slot) + index;
+  }
+  return static_cast<Entry *>(*slot) + (key & (NodeSize - 1));
+}
+
+// ChunkMap::Insert -----------------------------------------------------------
+
+bool ChunkMap::Insert(const void *pData, ::std::size_t span,
+                      FixedAllocator *owner, ::std::size_t index) {
+  const ::std::uintptr_t address = reinterpret_cast<::std::uintptr_t>(pData);
+  // Chunks must start on a boundary of their span, which is whole units.
+  assert(GetUnit() <= span);
+  assert(0 == (address & (span - 1)));
+  const ::std::uintptr_t first = address >> shift_;
+  const ::std::uintptr_t last = first + (span >> shift_);
+  for (::std::uintptr_t key = first; key < last; ++key) {
+    Entry *entry = Walk(key, true);
+    if (nullptr == entry) {
+      // Forget the units recorded so far.
+      for (::std::uintptr_t undo = first; undo < key; ++undo)
+        Walk(undo, false)->owner_ = nullptr;
+      return false;
+    }
+    entry->owner_ = owner;
+    entry->index_ = index;
+  }
+  return true;
+}
+
+// ChunkMap::Erase ------------------------------------------------------------
+
+void ChunkMap::Erase(const void *pData, ::std::size_t span) {
+  const ::std::uintptr_t address = reinterpret_cast<::std::uintptr_t>(pData);
+  const ::std::uintptr_t first = address >> shift_;
+  const ::std::uintptr_t last = first + (span >> shift_);
+  for (::std::uintptr_t key = first; key < last; ++key) {
+    Entry *entry = Walk(key, false);
+    assert(nullptr != entry);
+    if (nullptr != entry)
+      entry->owner_ = nullptr;
+  }
+}
+
+// ChunkMap::Find -------------------------------------------------------------
+
+ChunkMap::Entry *ChunkMap::Find(const void *p) const {
+  const ::std::uintptr_t address = reinterpret_cast<::std::uintptr_t>(p);
+  Entry *entry = Walk(address >> shift_, false);
+  if ((nullptr == entry) || (nullptr == entry->owner_))
+    return nullptr;
+  return entry;
+}
+
+// OwnerMap::OwnerMap ---------------------------------------------------------
+
+OwnerMap::OwnerMap(::std::size_t chunkAlignment)
+    : root_(nullptr), shift_(0), levels_(0) {
+  assert(0 < chunkAlignment);
+  // Must be a power of two.
+  assert(0 == (chunkAlignment & (chunkAlignment - 1)));
+  while ((::std::size_t(1) << shift_) < chunkAlignment)
+    ++shift_;
+  const unsigned int addressBits = LOKI_SMALLOBJ_ADDRESS_BITS;
+  const unsigned int keyBits =
+      (addressBits > shift_) ? (addressBits - shift_) : 1;
+  levels_ = (keyBits + NodeBits - 1) / NodeBits;
+}
+
+// OwnerMap::~OwnerMap --------------------------------------------------------
+
+OwnerMap::~OwnerMap(void) {
+  void *root = root_.load();
+  if (nullptr != root)
+    FreeNode(static_cast<::std::atomic<void *> *>(root), levels_ - 1);
+}
+
+// OwnerMap::FreeNode ---------------------------------------------------------
+
+void OwnerMap::FreeNode(::std::atomic<void *> *node, unsigned int level) {
+  if (0 < level) {
+    for (unsigned int ii = 0; ii < NodeSize; ++ii) {
+      void *child = node[ii].load();
+      if (nullptr != child)
+        FreeNode(static_cast<::std::atomic<void *> *>(child), level - 1);
+    }
+  }
+  delete[] node;
+}
+
+// OwnerMap::GetEntry ---------------------------------------------------------
+
+::std::atomic<void *> *OwnerMap::GetEntry(const void *p, bool doCreate) {
+  const ::std::uintptr_t key = reinterpret_cast<::std::uintptr_t>(p) >> shift_;
+  // Keys beyond the covered address range are never stored.
+  if ((key >> (levels_ * NodeBits)) != 0)
+    return nullptr;
+
+  ::std::atomic<void *> *slot = &root_;
+  for (unsigned int level = levels_; 0 < level; --level) {
+    void *node = slot->load(::std::memory_order_acquire);
+    if (nullptr == node) {
+      if (!doCreate)
+        return nullptr;
+      ::std::atomic<void *> *made =
+          new (::std::nothrow)::std::atomic<void *>[NodeSize];
+      if (nullptr == made)
+        return nullptr;
+      for (unsigned int ii = 0; ii < NodeSize; ++ii)
+        made[ii].store(nullptr, ::std::memory_order_relaxed);
+      // Another thread may have added the same node meanwhile.
+      if (slot->compare_exchange_strong(node, made,
+                                        ::std::memory_order_acq_rel))
+        node = made;
+      else
+        delete[] made;
+    }
+    const ::std::size_t index =
+        (key >> ((level - 1) * NodeBits)) & (NodeSize - 1);
+    slot = static_cast<::std::atomic<void *> *>(node) + index;
+  }
+  return slot;
+}
+
+// ChunkArena::ChunkArena -----------------------------------------------------
+
+ChunkArena::ChunkArena(::std::size_t maxAlignment,
+                       SmallObjChunkSource *source)
+    : alignment_(maxAlignment), source_(source) {
+  assert(0 < maxAlignment);
+  // Must be a power of two.
+  assert(0 == (maxAlignment & (maxAlignment - 1)));
+#ifdef LOKI_SMALLOBJ_MMAP_ARENA
+  for (unsigned int ii = 0; ii < 2; ++ii)
+    ranges_[ii].next_ = ranges_[ii].end_ = nullptr;
+  freeSlots_.resize(GetShift(maxAlignment) + 1);
+#endif
+}
+
+// ChunkArena::~ChunkArena ----------------------------------------------------
+
+ChunkArena::~ChunkArena(void) {
+#ifdef LOKI_SMALLOBJ_MMAP_ARENA
+  for (::std::size_t ii = 0; ii < mappings_.size(); ++ii)
+    ::munmap(mappings_[ii].first, mappings_[ii].second);
+#endif
+}
+
+#ifdef LOKI_SMALLOBJ_MMAP_ARENA
+
+// ChunkArena::Reserve --------------------------------------------------------
+
+bool ChunkArena::Reserve(Range &range, bool hot) {
+  // Huge pages are only used if the range is aligned on a huge page, so
+  // hot ranges are aligned on 2 MB as well as on the chunk alignment.
+  const ::std::size_t hugePageSize = 2 * 1024 * 1024;
+  const ::std::size_t alignment =
+      (hot && (alignment_ < hugePageSize)) ? hugePageSize : alignment_;
+  ::std::size_t length = LOKI_SMALLOBJ_ARENA_RANGE_SIZE;
+  if (length < alignment)
+    length = alignment;
+  length = (length + alignment - 1) & ~(alignment - 1);
+
+  // Over-reserve so an aligned range fits inside, then unmap the excess.
+  const ::std::size_t pageSize =
+      static_cast<::std::size_t>(::sysconf(_SC_PAGESIZE));
+  const ::std::size_t reserved = length + alignment - pageSize;
+  if (reserved < length)
+    return false;
+  void *p = ::mmap(nullptr, reserved, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (MAP_FAILED == p)
+    return false;
+  unsigned char *start = static_cast<unsigned char *>(p);
+  unsigned char *aligned = reinterpret_cast<unsigned char *>(
+      (reinterpret_cast<::std::uintptr_t>(start) + alignment - 1) &
+      ~static_cast<::std::uintptr_t>(alignment - 1));
+  const ::std::size_t head = static_cast<::std::size_t>(aligned - start);
+  if (0 < head)
+    ::munmap(start, head);
+  if (head + length < reserved)
+    ::munmap(aligned + length, reserved - head - length);
+
+  try {
+    mappings_.push_back(::std::make_pair(static_cast<void *>(aligned), length));
+  } catch (...) {
+    ::munmap(aligned, length);
+    return false;
+  }
+#ifdef MADV_HUGEPAGE
+  if (hot)
+    ::madvise(aligned, length, MADV_HUGEPAGE);
+#endif
+  range.next_ = aligned;
+  range.end_ = aligned + length;
+  return true;
+}
+
+#endif
+
+// ChunkArena::Allocate -------------------------------------------------------
+
+void *ChunkArena::Allocate(::std::size_t numBytes, ::std::size_t alignment,
+                           bool hot) {
+  assert(numBytes <= alignment);
+  assert(alignment <= alignment_);
+  // Must be a power of two.
+  assert(0 == (alignment & (alignment - 1)));
+  if (nullptr != source_)
+    // Slots of a source are aligned on, and as long as, the most alignment.
+    return source_->AllocateChunk();
+#ifdef LOKI_SMALLOBJ_MMAP_ARENA
+  (void)numBytes;
+  ::std::vector<void *> &freeSlots = freeSlots_[GetShift(alignment)];
+  if (!freeSlots.empty()) {
+    void *p = freeSlots.back();
+    freeSlots.pop_back();
+    return p;
+  }
+  // Ranges are aligned on the most alignment, so skipping to the next
+  // multiple of a lesser one never passes the end.  The skipped bytes are
+  // never touched, so they take no memory.
+  Range &range = ranges_[hot ? 1 : 0];
+  unsigned char *next = reinterpret_cast<unsigned char *>(
+      (reinterpret_cast<::std::uintptr_t>(range.next_) + alignment - 1) &
+      ~static_cast<::std::uintptr_t>(alignment - 1));
+  if (next == range.end_) {
+    if (!Reserve(range, hot))
+      return nullptr;
+    next = range.next_;
+  }
+  range.next_ = next + alignment;
+  return next;
+#else
+  (void)hot;
+  return AlignedAllocate(alignment, numBytes);
+#endif
+}
+
+// ChunkArena::Deallocate -----------------------------------------------------
+
+void ChunkArena::Deallocate(void *p, ::std::size_t alignment) {
+  assert(nullptr != p);
+  assert(alignment <= alignment_);
+  if (nullptr != source_) {
+    source_->DeallocateChunk(p);
+    return;
+  }
+#ifdef LOKI_SMALLOBJ_MMAP_ARENA
+  ::madvise(p, alignment, LOKI_SMALLOBJ_ARENA_ADVICE);
+  try {
+    freeSlots_[GetShift(alignment)].push_back(p);
+  } catch (...) {
+    // Can't remember the slot for reuse, so give up its address space.
+    ::munmap(p, alignment);
+  }
+#else
+  (void)alignment;
+  AlignedDeallocate(p);
+#endif
+}
+
+// FindFirstSet ---------------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+/// Returns position of the lowest set bit of a word which is not zero.
+inline unsigned int FindFirstSet(::std::uint64_t word) {
+  assert(0 != word);
+#if defined(__GNUC__)
+  return static_cast<unsigned int>(__builtin_ctzll(word));
+#elif defined(_MSC_VER) && defined(_WIN64)
+  unsigned long position;
+  _BitScanForward64(&position, word);
+  return static_cast<unsigned int>(position);
+#else
+  unsigned int position = 0;
+  for (; 0 == (word & 1); word >>= 1)
+    ++position;
+  return position;
+#endif
+}
+
+// ChunkBitmap::Reserve -------------------------------------------------------
+
+void ChunkBitmap::Reserve(::std::size_t count) {
+  const ::std::size_t words = (count + WordBits - 1) / WordBits;
+  if (words <= words_.size())
+    return;
+  // Grow the summary first, so a throw from either leaves both usable.
+  summary_.resize((words + WordBits - 1) / WordBits, 0);
+  words_.resize(words, 0);
+}
+
+// ChunkBitmap::FindFirst -----------------------------------------------------
+
+::std::size_t ChunkBitmap::FindFirst(void) const {
+  for (::std::size_t s = 0; s < summary_.size(); ++s) {
+    if (0 == summary_[s])
+      continue;
+    const ::std::size_t word = s * WordBits + FindFirstSet(summary_[s]);
+    assert(0 != words_[word]);
+    return word * WordBits + FindFirstSet(words_[word]);
+  }
+  return NoIndex;
+}
+
+// ChunkBitmap::IsCorrupt -----------------------------------------------------
+
+bool ChunkBitmap::IsCorrupt(::std::size_t count) const {
+  if (summary_.size() != (words_.size() + WordBits - 1) / WordBits) {
+    assert(false);
+    return true;
+  }
+  for (::std::size_t w = 0; w < words_.size(); ++w) {
+    const bool summarized =
+        0 != (summary_[w / WordBits] & (Word(1) << (w % WordBits)));
+    if (summarized != (0 != words_[w])) {
+      assert(false);
+      return true;
+    }
+  }
+  for (::std::size_t i = count; i < GetCapacity(); ++i) {
+    if (Test(i)) {
+      assert(false);
+      return true;
+    }
+  }
+  return false;
+}
+
 // Chunk::Init ----------------------------------------------------------------
 
-bool Chunk::Init(::std::size_t blockSize, unsigned char blocks) {
+bool Chunk::Init(::std::size_t blockSize, StealthIndex blocks,
+                 ::std::size_t alignment, ChunkArena &arena, bool hot) {
   assert(blockSize > 0);
   assert(blocks > 0);
   // Overflow check
   const ::std::size_t allocSize = blockSize * blocks;
   assert(allocSize / blockSize == blocks);
 
-#ifdef USE_NEW_TO_ALLOCATE
-  // If this new operator fails, it will throw, and the exception will get
-  // caught one layer up.
-  pData_ = static_cast<unsigned char *>(::operator new(allocSize));
-#else
-  // malloc can't throw, so its only way to indicate an error is to return
-  // a nullptr pointer, so we have to check for that.
-  pData_ = static_cast<unsigned char *>(::std::malloc(allocSize));
+  // The arena can't throw, so its only way to indicate an error is to
+  // return a nullptr pointer.
+  pData_ = static_cast<unsigned char *>(
+      arena.Allocate(allocSize, alignment, hot));
   if (nullptr == pData_)
     return false;
-#endif
 
   Reset(blockSize, blocks);
   return true;
@@ -353,42 +1175,40 @@ bool Chunk::Init(::std::size_t blockSize, unsigned char blocks) {
 
 // Chunk::Reset ---------------------------------------------------------------
 
-void Chunk::Reset(::std::size_t blockSize, unsigned char blocks) {
+void Chunk::Reset(::std::size_t blockSize, StealthIndex blocks) {
   assert(blockSize > 0);
   assert(blocks > 0);
   // Overflow check
   assert((blockSize * blocks) / blockSize == blocks);
+  const bool wideIndexes = HasWideIndexes(blocks);
+  assert(!wideIndexes || (blockSize >= sizeof(StealthIndex)));
 
   firstAvailableBlock_ = 0;
   blocksAvailable_ = blocks;
 
-  unsigned char i = 0;
+  StealthIndex i = 0;
   for (unsigned char *p = pData_; i != blocks; p += blockSize) {
-    *p = ++i;
+    WriteStealthIndex(p, ++i, wideIndexes);
   }
 }
 
 // Chunk::Release -------------------------------------------------------------
 
-void Chunk::Release() {
+void Chunk::Release(ChunkArena &arena, ::std::size_t alignment) {
   assert(nullptr != pData_);
-#ifdef USE_NEW_TO_ALLOCATE
-  ::operator delete(pData_);
-#else
-  ::std::free(static_cast<void *>(pData_));
-#endif
+  arena.Deallocate(pData_, alignment);
 }
 
 // Chunk::Allocate ------------------------------------------------------------
 
-void *Chunk::Allocate(::std::size_t blockSize) {
+void *Chunk::Allocate(::std::size_t blockSize, bool wideIndexes) {
   if (IsFilled())
     return nullptr;
 
   assert((firstAvailableBlock_ * blockSize) / blockSize ==
          firstAvailableBlock_);
   unsigned char *pResult = pData_ + (firstAvailableBlock_ * blockSize);
-  firstAvailableBlock_ = *pResult;
+  firstAvailableBlock_ = ReadStealthIndex(pResult, wideIndexes);
   --blocksAvailable_;
 
   return pResult;
@@ -396,13 +1216,13 @@ void *Chunk::Allocate(::std::size_t blockSize) {
 
 // Chunk::Deallocate ----------------------------------------------------------
 
-void Chunk::Deallocate(void *p, ::std::size_t blockSize) {
+void Chunk::Deallocate(void *p, ::std::size_t blockSize, bool wideIndexes) {
   assert(p >= pData_);
 
   unsigned char *toRelease = static_cast<unsigned char *>(p);
   // Alignment check
   assert((toRelease - pData_) % blockSize == 0);
-  unsigned char index = static_cast<unsigned char>(
+  StealthIndex index = static_cast<StealthIndex>(
       static_cast<size_t>(toRelease - pData_) / blockSize);
 
 #if defined(DEBUG) || defined(_DEBUG)
@@ -413,7 +1233,7 @@ void Chunk::Deallocate(void *p, ::std::size_t blockSize) {
     assert(firstAvailableBlock_ != index);
 #endif
 
-  *toRelease = firstAvailableBlock_;
+  WriteStealthIndex(toRelease, firstAvailableBlock_, wideIndexes);
   firstAvailableBlock_ = index;
   // Truncation check
   assert(firstAvailableBlock_ == (toRelease - pData_) / blockSize);
@@ -423,7 +1243,7 @@ void Chunk::Deallocate(void *p, ::std::size_t blockSize) {
 
 // Chunk::IsCorrupt -----------------------------------------------------------
 
-bool Chunk::IsCorrupt(unsigned char numBlocks, ::std::size_t blockSize,
+bool Chunk::IsCorrupt(StealthIndex numBlocks, ::std::size_t blockSize,
                       bool checkIndexes) const {
 
   if (numBlocks < blocksAvailable_) {
@@ -435,7 +1255,7 @@ bool Chunk::IsCorrupt(unsigned char numBlocks, ::std::size_t blockSize,
   if (IsFilled())
     // Useless to do further corruption checks if all blocks allocated.
     return false;
-  unsigned char index = firstAvailableBlock_;
+  StealthIndex index = firstAvailableBlock_;
   if (numBlocks <= index) {
     // Contents at this Chunk corrupted.  This might mean something has
     // overwritten memory owned by the Chunks container.
@@ -449,7 +1269,8 @@ bool Chunk::IsCorrupt(unsigned char numBlocks, ::std::size_t blockSize,
   /* If the bit at index was set in foundBlocks, then the stealth index was
    found on the linked-list.
    */
-  ::std::bitset<UCHAR_MAX> foundBlocks;
+  ::std::bitset<USHRT_MAX> foundBlocks;
+  const bool wideIndexes = HasWideIndexes(numBlocks);
   unsigned char *nextBlock = nullptr;
 
   /* The loop goes along singly linked-list of stealth indexes and makes sure
@@ -478,14 +1299,14 @@ bool Chunk::IsCorrupt(unsigned char numBlocks, ::std::size_t blockSize,
     No index should be repeated within the linked-list since that would
     indicate the presence of a loop in the linked-list.
    */
-  for (unsigned char cc = 0;;) {
+  for (StealthIndex cc = 0;;) {
     nextBlock = pData_ + (index * blockSize);
     foundBlocks.set(index, true);
     ++cc;
     if (cc >= blocksAvailable_)
       // Successfully counted off number of nodes in linked-list.
       break;
-    index = *nextBlock;
+    index = ReadStealthIndex(nextBlock, wideIndexes);
     if (numBlocks <= index) {
       /* This catches Type 1 corruptions as shown in above comments.
        This implies that a block was corrupted due to a stray pointer
@@ -517,7 +1338,7 @@ bool Chunk::IsCorrupt(unsigned char numBlocks, ::std::size_t blockSize,
 
 // Chunk::IsBlockAvailable ----------------------------------------------------
 
-bool Chunk::IsBlockAvailable(void *p, unsigned char numBlocks,
+bool Chunk::IsBlockAvailable(void *p, StealthIndex numBlocks,
                              ::std::size_t blockSize) const {
   (void)numBlocks;
 
@@ -527,10 +1348,10 @@ bool Chunk::IsBlockAvailable(void *p, unsigned char numBlocks,
   unsigned char *place = static_cast<unsigned char *>(p);
   // Alignment check
   assert((place - pData_) % blockSize == 0);
-  unsigned char blockIndex = static_cast<unsigned char>(
+  StealthIndex blockIndex = static_cast<StealthIndex>(
       static_cast<size_t>(place - pData_) / blockSize);
 
-  unsigned char index = firstAvailableBlock_;
+  StealthIndex index = firstAvailableBlock_;
   assert(numBlocks > index);
   if (index == blockIndex)
     return true;
@@ -538,16 +1359,17 @@ bool Chunk::IsBlockAvailable(void *p, unsigned char numBlocks,
   /* If the bit at index was set in foundBlocks, then the stealth index was
    found on the linked-list.
    */
-  ::std::bitset<UCHAR_MAX> foundBlocks;
+  ::std::bitset<USHRT_MAX> foundBlocks;
+  const bool wideIndexes = HasWideIndexes(numBlocks);
   unsigned char *nextBlock = nullptr;
-  for (unsigned char cc = 0;;) {
+  for (StealthIndex cc = 0;;) {
     nextBlock = pData_ + (index * blockSize);
     foundBlocks.set(index, true);
     ++cc;
     if (cc >= blocksAvailable_)
       // Successfully counted off number of nodes in linked-list.
       break;
-    index = *nextBlock;
+    index = ReadStealthIndex(nextBlock, wideIndexes);
     if (index == blockIndex)
       return true;
     assert(numBlocks > index);
@@ -560,8 +1382,11 @@ bool Chunk::IsBlockAvailable(void *p, unsigned char numBlocks,
 // FixedAllocator::FixedAllocator ---------------------------------------------
 
 FixedAllocator::FixedAllocator()
-    : blockSize_(0), numBlocks_(0), chunks_(0), allocChunk_(nullptr),
-      deallocChunk_(nullptr), emptyChunk_(nullptr) {}
+    : chunkMap_(nullptr), chunkArena_(nullptr), blockSize_(0), numBlocks_(0),
+      chunkAlignment_(0), wideIndexes_(false), chunks_(0), allocChunk_(nullptr),
+      deallocChunk_(nullptr), emptyChunk_(nullptr), spares_(),
+      retainSpares_(false), partial_(), bucketLimits_(), allocations_(0),
+      deallocations_(0), liveBlocks_(0), maxLiveBlocks_(0), maxChunks_(0) {}
 
 // FixedAllocator::~FixedAllocator --------------------------------------------
 
@@ -571,25 +1396,57 @@ FixedAllocator::~FixedAllocator() {
   assert(chunks_.empty() && "Memory leak detected!");
 #endif
   for (ChunkIter i(chunks_.begin()); i != chunks_.end(); ++i)
-    i->Release();
+    i->Release(*chunkArena_, chunkAlignment_);
+  for (ChunkIter i(spares_.begin()); i != spares_.end(); ++i)
+    i->Release(*chunkArena_, chunkAlignment_);
 }
 
-// FixedAllocator::Initialize -------------------------------------------------
+// FixedAllocator::GetNumBlocks -----------------------------------------------
 
-void FixedAllocator::Initialize(::std::size_t blockSize,
-                                ::std::size_t pageSize) {
+::std::size_t FixedAllocator::GetNumBlocks(::std::size_t blockSize,
+                                           ::std::size_t pageSize,
+                                           ::std::size_t maxBlocks) {
   assert(blockSize > 0);
-  assert(pageSize >= blockSize);
-  blockSize_ = blockSize;
-
+  assert((UCHAR_MAX <= maxBlocks) && (maxBlocks <= USHRT_MAX));
+  if (blockSize < sizeof(StealthIndex))
+    // A block this small can't hold a wide stealth index.
+    maxBlocks = UCHAR_MAX;
   ::std::size_t numBlocks = pageSize / blockSize;
-  if (numBlocks > MaxObjectsPerChunk_)
-    numBlocks = MaxObjectsPerChunk_;
+  if (numBlocks > maxBlocks)
+    numBlocks = maxBlocks;
   else if (numBlocks < MinObjectsPerChunk_)
     numBlocks = MinObjectsPerChunk_;
+  return numBlocks;
+}
+
+// FixedAllocator::Initialize -------------------------------------------------
+
+void FixedAllocator::Initialize(::std::size_t blockSize, ::std::size_t pageSize,
+                                ::std::size_t maxBlocks,
+                                ::std::size_t chunkAlignment,
+                                ChunkMap *chunkMap, ChunkArena *chunkArena) {
+  assert(blockSize > 0);
+  assert(nullptr != chunkMap);
+  assert(nullptr != chunkArena);
+  assert(chunkMap->GetUnit() <= chunkAlignment);
+  assert(chunkAlignment <= chunkArena->GetAlignment());
+  blockSize_ = blockSize;
+  chunkAlignment_ = chunkAlignment;
+  chunkMap_ = chunkMap;
+  chunkArena_ = chunkArena;
 
-  numBlocks_ = static_cast<unsigned char>(numBlocks);
+  const ::std::size_t numBlocks = GetNumBlocks(blockSize, pageSize, maxBlocks);
+  numBlocks_ = static_cast<StealthIndex>(numBlocks);
   assert(numBlocks_ == numBlocks);
+  wideIndexes_ = Chunk::HasWideIndexes(numBlocks_);
+  assert(numBlocks_ * blockSize_ <= chunkAlignment_);
+
+  // The buckets split 1 to numBlocks - 1 available blocks evenly.
+  for (unsigned int b = 0; b < LOKI_SMALLOBJ_PARTIAL_BUCKETS; ++b) {
+    const ::std::size_t limit =
+        ((numBlocks - 1) * (b + 1)) / LOKI_SMALLOBJ_PARTIAL_BUCKETS;
+    bucketLimits_[b] = static_cast<StealthIndex>((0 == limit) ? 1 : limit);
+  }
 }
 
 // FixedAllocator::CountEmptyChunks -------------------------------------------
@@ -696,28 +1553,251 @@ bool FixedAllocator::IsCorrupt(void) const {
       assert(false);
       return true;
     }
+    ::std::size_t liveBlocks = 0;
     for (ChunkCIter it(start); it != last; ++it) {
       const Chunk &chunk = *it;
       if (chunk.IsCorrupt(numBlocks_, blockSize_, true))
         return true;
-    }
+      liveBlocks += numBlocks_ - chunk.blocksAvailable_;
+      // Each Chunk must be found in the ChunkMap at its own position.
+      const ChunkMap::Entry *entry = chunkMap_->Find(chunk.pData_);
+      if ((nullptr == entry) || (this != entry->owner_) ||
+          (&chunk != front + entry->index_)) {
+        assert(false);
+        return true;
+      }
+      // A partly used Chunk must be in the bitmap of its bucket only.
+      const ::std::size_t index = static_cast<::std::size_t>(&chunk - front);
+      const unsigned int bucket = GetBucket(chunk.blocksAvailable_);
+      for (unsigned int b = 0; b < LOKI_SMALLOBJ_PARTIAL_BUCKETS; ++b) {
+        if ((partial_[b].GetCapacity() <= index) ||
+            (partial_[b].Test(index) != (b == bucket))) {
+          assert(false);
+          return true;
+        }
+      }
+    }
+    // The counter of live blocks must match what the Chunks say.
+    if (liveBlocks != liveBlocks_) {
+      assert(false);
+      return true;
+    }
+  }
+
+  // Bucket limits must rise to the most blocks a partly used Chunk has,
+  // and no bitmap may hold an index past the last Chunk.
+  for (unsigned int b = 0; b < LOKI_SMALLOBJ_PARTIAL_BUCKETS; ++b) {
+    if ((0 == bucketLimits_[b]) ||
+        ((0 < b) && (bucketLimits_[b] < bucketLimits_[b - 1]))) {
+      assert(false);
+      return true;
+    }
+    if (partial_[b].IsCorrupt(chunks_.size()))
+      return true;
+  }
+  if ((1 < numBlocks_) &&
+      (numBlocks_ - 1 != bucketLimits_[LOKI_SMALLOBJ_PARTIAL_BUCKETS - 1])) {
+    assert(false);
+    return true;
+  }
+
+  // Spare Chunks must be empty, and must not be found in the ChunkMap.
+  for (ChunkCIter it(spares_.begin()); it != spares_.end(); ++it) {
+    if (!it->HasAvailable(numBlocks_)) {
+      assert(false);
+      return true;
+    }
+    if (it->IsCorrupt(numBlocks_, blockSize_, true))
+      return true;
+    if (nullptr != chunkMap_->Find(it->pData_)) {
+      assert(false);
+      return true;
+    }
   }
 
   return false;
 }
 
+// FixedAllocator::GetStats ---------------------------------------------------
+
+void FixedAllocator::GetStats(SmallObjSizeClassStats &stats) const {
+  stats.blockSize = blockSize_;
+  stats.blocksPerChunk = numBlocks_;
+  stats.allocations = allocations_;
+  stats.deallocations = deallocations_;
+  stats.liveBlocks = liveBlocks_;
+  stats.maxLiveBlocks = maxLiveBlocks_;
+  stats.chunks = chunks_.size() + spares_.size();
+  stats.emptyChunks = ((nullptr == emptyChunk_) ? 0 : 1) + spares_.size();
+  stats.maxChunks = maxChunks_;
+  stats.bytesReserved = stats.chunks * numBlocks_ * blockSize_;
+  stats.bytesInUse = liveBlocks_ * blockSize_;
+}
+
+// FixedAllocator::GetChunkState ----------------------------------------------
+
+void FixedAllocator::GetChunkState(::std::size_t index,
+                                   SmallObjChunkState &state) const {
+  assert(index < chunks_.size());
+  const Chunk &chunk = chunks_[index];
+  state.data = chunk.pData_;
+  state.firstAvailable = chunk.firstAvailableBlock_;
+  state.available = chunk.blocksAvailable_;
+}
+
+// FixedAllocator::GetChunkStates ---------------------------------------------
+
+void FixedAllocator::GetChunkStates(
+    ::std::size_t sizeClass, ::std::vector<SmallObjChunkState> &states) const {
+  SmallObjChunkState state;
+  state.sizeClass = sizeClass;
+  for (::std::size_t ii = 0; ii < chunks_.size(); ++ii) {
+    GetChunkState(ii, state);
+    states.push_back(state);
+  }
+  for (ChunkCIter it(spares_.begin()); it != spares_.end(); ++it) {
+    state.data = it->pData_;
+    state.firstAvailable = it->firstAvailableBlock_;
+    state.available = it->blocksAvailable_;
+    states.push_back(state);
+  }
+}
+
+// FixedAllocator::Adopt ------------------------------------------------------
+
+bool FixedAllocator::Adopt(void *pData, StealthIndex firstAvailable,
+                           StealthIndex available) {
+  Chunk chunk;
+  chunk.pData_ = static_cast<unsigned char *>(pData);
+  chunk.firstAvailableBlock_ = firstAvailable;
+  chunk.blocksAvailable_ = available;
+  if ((numBlocks_ < available) ||
+      ((0 < available) && (numBlocks_ <= firstAvailable)))
+    return false;
+  if (chunk.IsCorrupt(numBlocks_, blockSize_, true))
+    return false;
+  if (chunk.HasAvailable(numBlocks_) && (nullptr != emptyChunk_)) {
+    chunk.Release(*chunkArena_, chunkAlignment_);
+    return true;
+  }
+
+  try {
+    ReserveChunks();
+  } catch (...) {
+    return false;
+  }
+  if (!chunkMap_->Insert(chunk.pData_, chunkAlignment_, this, chunks_.size()))
+    return false;
+  chunks_.push_back(chunk);
+
+  Chunk *added = &chunks_.back();
+  // An empty or full Chunk is in no bucket, so it starts out as empty.
+  UpdateBucket(added, numBlocks_);
+  if (added->HasAvailable(numBlocks_))
+    emptyChunk_ = added;
+  allocChunk_ = added;
+  deallocChunk_ = &chunks_.front();
+  liveBlocks_ += numBlocks_ - available;
+  if (maxLiveBlocks_ < liveBlocks_)
+    maxLiveBlocks_ = liveBlocks_;
+  if (maxChunks_ < chunks_.size())
+    maxChunks_ = chunks_.size();
+  return true;
+}
+
+// FixedAllocator::Discard ----------------------------------------------------
+
+void FixedAllocator::Discard(void) {
+  for (::std::size_t ii = 0; ii < chunks_.size(); ++ii) {
+    chunkMap_->Erase(chunks_[ii].pData_, chunkAlignment_);
+    for (unsigned int b = 0; b < LOKI_SMALLOBJ_PARTIAL_BUCKETS; ++b)
+      partial_[b].Clear(ii);
+  }
+  chunks_.clear();
+  spares_.clear();
+  allocChunk_ = nullptr;
+  deallocChunk_ = nullptr;
+  emptyChunk_ = nullptr;
+  liveBlocks_ = 0;
+}
+
 // FixedAllocator::HasBlock ---------------------------------------------------
 
 const Chunk *FixedAllocator::HasBlock(void *p) const {
-  const ::std::size_t chunkLength = numBlocks_ * blockSize_;
-  for (ChunkCIter it(chunks_.begin()); it != chunks_.end(); ++it) {
-    const Chunk &chunk = *it;
-    if (chunk.HasBlock(p, chunkLength))
-      return &chunk;
+  const ChunkMap::Entry *entry = chunkMap_->Find(p);
+  if ((nullptr == entry) || (this != entry->owner_))
+    return nullptr;
+  assert(entry->index_ < chunks_.size());
+  const Chunk &chunk = chunks_[entry->index_];
+  return chunk.HasBlock(p, numBlocks_ * blockSize_) ? &chunk : nullptr;
+}
+
+// FixedAllocator::SwapChunks -------------------------------------------------
+
+void FixedAllocator::SwapChunks(Chunk *lhs, Chunk *rhs) {
+  // Each Chunk takes its bucket along to its new index.
+  const ::std::size_t lhsAvailable = lhs->blocksAvailable_;
+  const ::std::size_t rhsAvailable = rhs->blocksAvailable_;
+  ::std::swap(*lhs, *rhs);
+  UpdateBucket(lhs, lhsAvailable);
+  UpdateBucket(rhs, rhsAvailable);
+  Chunk *front = &chunks_.front();
+  chunkMap_->Insert(lhs->pData_, chunkAlignment_, this,
+                    static_cast<::std::size_t>(lhs - front));
+  chunkMap_->Insert(rhs->pData_, chunkAlignment_, this,
+                    static_cast<::std::size_t>(rhs - front));
+}
+
+// FixedAllocator::UpdateBucket -----------------------------------------------
+
+inline void FixedAllocator::UpdateBucket(const Chunk *chunk,
+                                         ::std::size_t wasAvailable) {
+  const unsigned int was = GetBucket(wasAvailable);
+  const unsigned int now = GetBucket(chunk->blocksAvailable_);
+  if (was == now)
+    return;
+  const ::std::size_t index =
+      static_cast<::std::size_t>(chunk - &chunks_.front());
+  if (LOKI_SMALLOBJ_PARTIAL_BUCKETS != was)
+    partial_[was].Clear(index);
+  if (LOKI_SMALLOBJ_PARTIAL_BUCKETS != now)
+    partial_[now].Set(index);
+}
+
+// FixedAllocator::FindPartialChunk -------------------------------------------
+
+Chunk *FixedAllocator::FindPartialChunk(void) {
+  for (unsigned int b = 0; b < LOKI_SMALLOBJ_PARTIAL_BUCKETS; ++b) {
+    const ::std::size_t index = partial_[b].FindFirst();
+    if (ChunkBitmap::NoIndex != index) {
+      assert(index < chunks_.size());
+      return &chunks_[index];
+    }
   }
   return nullptr;
 }
 
+// FixedAllocator::PopLastChunk -----------------------------------------------
+
+void FixedAllocator::PopLastChunk(bool toSpares) {
+  Chunk &lastChunk = chunks_.back();
+  // An empty Chunk is in no bucket, so no bitmap needs changing.
+  assert(lastChunk.HasAvailable(numBlocks_));
+  chunkMap_->Erase(lastChunk.pData_, chunkAlignment_);
+  bool kept = false;
+  if (toSpares) {
+    try {
+      spares_.push_back(lastChunk);
+      kept = true;
+    } catch (...) {
+      // No room to keep it, so release it as usual.
+    }
+  }
+  if (!kept)
+    lastChunk.Release(*chunkArena_, chunkAlignment_);
+  chunks_.pop_back();
+}
+
 // FixedAllocator::TrimEmptyChunk ---------------------------------------------
 
 bool FixedAllocator::TrimEmptyChunk(void) {
@@ -733,10 +1813,9 @@ bool FixedAllocator::TrimEmptyChunk(void) {
 
   Chunk *lastChunk = &chunks_.back();
   if (lastChunk != emptyChunk_)
-    ::std::swap(*emptyChunk_, *lastChunk);
+    SwapChunks(emptyChunk_, lastChunk);
   assert(lastChunk->HasAvailable(numBlocks_));
-  lastChunk->Release();
-  chunks_.pop_back();
+  PopLastChunk(false);
 
   if (chunks_.empty()) {
     allocChunk_ = nullptr;
@@ -758,6 +1837,23 @@ bool FixedAllocator::TrimEmptyChunk(void) {
   return true;
 }
 
+// FixedAllocator::TrimSpares -------------------------------------------------
+
+::std::size_t FixedAllocator::TrimSpares(::std::size_t keep,
+                                         ::std::size_t budget) {
+  ::std::size_t empty = spares_.size() + ((nullptr == emptyChunk_) ? 0 : 1);
+  ::std::size_t released = 0;
+  for (; (released < budget) && (keep < empty); --empty, ++released) {
+    if (spares_.empty()) {
+      TrimEmptyChunk();
+    } else {
+      spares_.back().Release(*chunkArena_, chunkAlignment_);
+      spares_.pop_back();
+    }
+  }
+  return released;
+}
+
 // FixedAllocator::TrimChunkList ----------------------------------------------
 
 bool FixedAllocator::TrimChunkList(void) {
@@ -766,6 +1862,9 @@ bool FixedAllocator::TrimChunkList(void) {
     assert(nullptr == deallocChunk_);
   }
 
+  if (spares_.empty() && (0 < spares_.capacity()))
+    Chunks().swap(spares_);
+
   if (chunks_.size() == chunks_.capacity())
     return false;
 
@@ -791,19 +1890,31 @@ bool FixedAllocator::TrimChunkList(void) {
 bool FixedAllocator::MakeNewChunk(void) {
   bool allocated = false;
   try {
-    ::std::size_t size = chunks_.size();
-    // Calling chunks_.reserve *before* creating and initializing the new
+    // Calling ReserveChunks *before* creating and initializing the new
     // Chunk means that nothing is leaked by this function in case an
     // exception is thrown from reserve.
-    if (chunks_.capacity() == size) {
-      if (0 == size)
-        size = 4;
-      chunks_.reserve(size * 2);
-    }
+    ReserveChunks();
     Chunk newChunk;
-    allocated = newChunk.Init(blockSize_, numBlocks_);
-    if (allocated)
-      chunks_.push_back(newChunk);
+    if (!spares_.empty()) {
+      // A spare is still empty, so it is reused as is.
+      newChunk = spares_.back();
+      spares_.pop_back();
+      allocated = true;
+    } else {
+      const bool hot = (LOKI_SMALLOBJ_HOT_CHUNK_COUNT <= chunks_.size());
+      allocated = newChunk.Init(blockSize_, numBlocks_, chunkAlignment_,
+                                *chunkArena_, hot);
+    }
+    if (allocated) {
+      // The ChunkMap entry is made first, so nothing is left behind if the
+      // map can't grow.  push_back won't throw since capacity was reserved.
+      allocated = chunkMap_->Insert(newChunk.pData_, chunkAlignment_, this,
+                                    chunks_.size());
+      if (allocated)
+        chunks_.push_back(newChunk);
+      else
+        newChunk.Release(*chunkArena_, chunkAlignment_);
+    }
   } catch (...) {
     allocated = false;
   }
@@ -812,9 +1923,31 @@ bool FixedAllocator::MakeNewChunk(void) {
 
   allocChunk_ = &chunks_.back();
   deallocChunk_ = &chunks_.front();
+  if (maxChunks_ < chunks_.size())
+    maxChunks_ = chunks_.size();
   return true;
 }
 
+// FixedAllocator::ReserveChunks ----------------------------------------------
+
+void FixedAllocator::ReserveChunks(void) {
+  ::std::size_t size = chunks_.size();
+  if (chunks_.capacity() == size) {
+    const ::std::size_t allocIndex =
+        (nullptr == allocChunk_) ? size : allocChunk_ - &chunks_[0];
+    const ::std::size_t deallocIndex =
+        (nullptr == deallocChunk_) ? size : deallocChunk_ - &chunks_[0];
+    const ::std::size_t emptyIndex =
+        (nullptr == emptyChunk_) ? size : emptyChunk_ - &chunks_[0];
+    chunks_.reserve((0 == size) ? 8 : size * 2);
+    allocChunk_ = (allocIndex < size) ? &chunks_[allocIndex] : nullptr;
+    deallocChunk_ = (deallocIndex < size) ? &chunks_[deallocIndex] : nullptr;
+    emptyChunk_ = (emptyIndex < size) ? &chunks_[emptyIndex] : nullptr;
+  }
+  for (unsigned int b = 0; b < LOKI_SMALLOBJ_PARTIAL_BUCKETS; ++b)
+    partial_[b].Reserve(chunks_.capacity());
+}
+
 // FixedAllocator::Allocate ---------------------------------------------------
 
 void *FixedAllocator::Allocate(void) {
@@ -823,22 +1956,16 @@ void *FixedAllocator::Allocate(void) {
   assert(CountEmptyChunks() < 2);
 
   if ((nullptr == allocChunk_) || allocChunk_->IsFilled()) {
-    if (nullptr != emptyChunk_) {
+    // The fullest partly used Chunk comes first, so emptier Chunks get the
+    // chance to empty out and be released.
+    Chunk *partial = FindPartialChunk();
+    if (nullptr != partial)
+      allocChunk_ = partial;
+    else if (nullptr != emptyChunk_) {
       allocChunk_ = emptyChunk_;
       emptyChunk_ = nullptr;
-    } else {
-      for (ChunkIter i(chunks_.begin());; ++i) {
-        if (chunks_.end() == i) {
-          if (!MakeNewChunk())
-            return nullptr;
-          break;
-        }
-        if (!i->IsFilled()) {
-          allocChunk_ = &*i;
-          break;
-        }
-      }
-    }
+    } else if (!MakeNewChunk())
+      return nullptr;
   } else if (allocChunk_ == emptyChunk_)
     // detach emptyChunk_ from allocChunk_, because after
     // calling allocChunk_->Allocate(blockSize_); the chunk
@@ -847,7 +1974,12 @@ void *FixedAllocator::Allocate(void) {
 
   assert(allocChunk_ != nullptr);
   assert(!allocChunk_->IsFilled());
-  void *place = allocChunk_->Allocate(blockSize_);
+  const ::std::size_t available = allocChunk_->blocksAvailable_;
+  void *place = allocChunk_->Allocate(blockSize_, wideIndexes_);
+  UpdateBucket(allocChunk_, available);
+  ++allocations_;
+  if (maxLiveBlocks_ < ++liveBlocks_)
+    maxLiveBlocks_ = liveBlocks_;
 
   // prove either emptyChunk_ points nowhere, or points to a truly empty Chunk.
   assert((nullptr == emptyChunk_) || (emptyChunk_->HasAvailable(numBlocks_)));
@@ -862,6 +1994,32 @@ void *FixedAllocator::Allocate(void) {
   return place;
 }
 
+// FixedAllocator::AllocateBatch ----------------------------------------------
+
+::std::size_t FixedAllocator::AllocateBatch(void **blocks,
+                                            ::std::size_t count) {
+  ::std::size_t done = 0;
+  while (done < count) {
+    // Allocate finds or makes a Chunk with an available block, which then
+    // becomes allocChunk_, so the rest of that Chunk is drained directly.
+    void *place = Allocate();
+    if (nullptr == place)
+      break;
+    blocks[done++] = place;
+    const ::std::size_t start = done;
+    const ::std::size_t available = allocChunk_->blocksAvailable_;
+    while ((done < count) && !allocChunk_->IsFilled())
+      blocks[done++] = allocChunk_->Allocate(blockSize_, wideIndexes_);
+    UpdateBucket(allocChunk_, available);
+    allocations_ += done - start;
+    liveBlocks_ += done - start;
+    if (maxLiveBlocks_ < liveBlocks_)
+      maxLiveBlocks_ = liveBlocks_;
+  }
+  assert((nullptr == emptyChunk_) || (emptyChunk_->HasAvailable(numBlocks_)));
+  return done;
+}
+
 // FixedAllocator::Deallocate -------------------------------------------------
 
 bool FixedAllocator::Deallocate(void *p, Chunk *hint) {
@@ -881,7 +2039,7 @@ bool FixedAllocator::Deallocate(void *p, Chunk *hint) {
   else if (allocChunk_->HasBlock(p, chunkLength))
     foundChunk = allocChunk_;
   else
-    foundChunk = VicinityFind(p);
+    foundChunk = HasBlock(p);
   if (nullptr == foundChunk)
     return false;
 
@@ -898,54 +2056,14 @@ bool FixedAllocator::Deallocate(void *p, Chunk *hint) {
 #endif
   deallocChunk_ = foundChunk;
   DoDeallocate(p);
+  ++deallocations_;
+  assert(0 < liveBlocks_);
+  --liveBlocks_;
   assert(CountEmptyChunks() < 2);
 
   return true;
 }
 
-// FixedAllocator::VicinityFind -----------------------------------------------
-
-Chunk *FixedAllocator::VicinityFind(void *p) const {
-  if (chunks_.empty())
-    return nullptr;
-  assert(deallocChunk_);
-
-  const ::std::size_t chunkLength = numBlocks_ * blockSize_;
-  Chunk *lo = deallocChunk_;
-  Chunk *hi = deallocChunk_ + 1;
-  const Chunk *loBound = &chunks_.front();
-  const Chunk *hiBound = &chunks_.back() + 1;
-
-  // Special case: deallocChunk_ is the last in the array
-  if (hi == hiBound)
-    hi = nullptr;
-
-  for (;;) {
-    if (lo) {
-      if (lo->HasBlock(p, chunkLength))
-        return lo;
-      if (lo == loBound) {
-        lo = nullptr;
-        if (nullptr == hi)
-          break;
-      } else
-        --lo;
-    }
-
-    if (hi) {
-      if (hi->HasBlock(p, chunkLength))
-        return hi;
-      if (++hi == hiBound) {
-        hi = nullptr;
-        if (nullptr == lo)
-          break;
-      }
-    }
-  }
-
-  return nullptr;
-}
-
 // FixedAllocator::DoDeallocate -----------------------------------------------
 
 void FixedAllocator::DoDeallocate(void *p) {
@@ -959,7 +2077,9 @@ void FixedAllocator::DoDeallocate(void *p) {
   assert((nullptr == emptyChunk_) || (emptyChunk_->HasAvailable(numBlocks_)));
 
   // call into the chunk, will adjust the inner list but won't release memory
-  deallocChunk_->Deallocate(p, blockSize_);
+  const ::std::size_t available = deallocChunk_->blocksAvailable_;
+  deallocChunk_->Deallocate(p, blockSize_, wideIndexes_);
+  UpdateBucket(deallocChunk_, available);
 
   if (deallocChunk_->HasAvailable(numBlocks_)) {
     assert(emptyChunk_ != deallocChunk_);
@@ -975,10 +2095,9 @@ void FixedAllocator::DoDeallocate(void *p) {
       if (lastChunk == deallocChunk_)
         deallocChunk_ = emptyChunk_;
       else if (lastChunk != emptyChunk_)
-        ::std::swap(*emptyChunk_, *lastChunk);
+        SwapChunks(emptyChunk_, lastChunk);
       assert(lastChunk->HasAvailable(numBlocks_));
-      lastChunk->Release();
-      chunks_.pop_back();
+      PopLastChunk(retainSpares_);
       if ((allocChunk_ == lastChunk) || allocChunk_->IsFilled())
         allocChunk_ = deallocChunk_;
     }
@@ -989,13 +2108,44 @@ void FixedAllocator::DoDeallocate(void *p) {
   assert((nullptr == emptyChunk_) || (emptyChunk_->HasAvailable(numBlocks_)));
 }
 
-// GetOffset ------------------------------------------------------------------
+// GetSizeClassStep -----------------------------------------------------------
 /// @ingroup SmallObjectGroupInternal
-/// Calculates index into array where a FixedAllocator of numBytes is located.
-inline ::std::size_t GetOffset(::std::size_t numBytes,
-                               ::std::size_t alignment) {
-  const ::std::size_t alignExtra = alignment - 1;
-  return (numBytes + alignExtra) / alignment;
+/// Calculates # of bytes between the size class of blockSize and the next.
+inline ::std::size_t GetSizeClassStep(::std::size_t blockSize,
+                                      ::std::size_t alignment) {
+  const ::std::size_t perDoubling = LOKI_SMALLOBJ_CLASSES_PER_DOUBLING;
+  if (0 == perDoubling)
+    return alignment;
+  ::std::size_t powerOfTwo = 1;
+  while (powerOfTwo <= blockSize / 2)
+    powerOfTwo *= 2;
+  const ::std::size_t step = powerOfTwo / perDoubling;
+  if (step <= alignment)
+    return alignment;
+  // Keep every block size a multiple of the alignment.
+  return ((step + alignment - 1) / alignment) * alignment;
+}
+
+// GetPaddedAlignment ---------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+/** Returns the alignment of blocks.  In cache line padding mode, every block
+ is a whole # of cache lines, so no two blocks share a line.
+ */
+inline ::std::size_t GetPaddedAlignment(::std::size_t alignment) {
+#ifdef LOKI_SMALLOBJ_CACHE_LINE_PADDING
+  const ::std::size_t line = LOKI_SMALLOBJ_CACHE_LINE_SIZE;
+  return ((alignment + line - 1) / line) * line;
+#else
+  return alignment;
+#endif
+}
+
+// NextGeneration -------------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+/// Returns a new generation for a SmallObjAllocator, never 0.
+inline ::std::uint64_t NextGeneration(void) {
+  static ::std::atomic<::std::uint64_t> last(0);
+  return ++last;
 }
 
 // DefaultAllocator -----------------------------------------------------------
@@ -1022,6 +2172,29 @@ void DefaultDeallocator(void *p) {
 #endif
 }
 
+// AlignedAllocate ------------------------------------------------------------
+
+void *AlignedAllocate(::std::size_t alignment, ::std::size_t numBytes) {
+#if defined(_WIN32)
+  return ::_aligned_malloc(numBytes, alignment);
+#else
+  void *p = nullptr;
+  if (0 != ::posix_memalign(&p, alignment, numBytes))
+    return nullptr;
+  return p;
+#endif
+}
+
+// AlignedDeallocate ----------------------------------------------------------
+
+void AlignedDeallocate(void *p) {
+#if defined(_WIN32)
+  ::_aligned_free(p);
+#else
+  ::std::free(p);
+#endif
+}
+
 // ----------------------------------------------------------------------------
 
 } // end namespace Private
@@ -1032,17 +2205,89 @@ using namespace ::Loki::Private;
 
 SmallObjAllocator::SmallObjAllocator(::std::size_t pageSize,
                                      ::std::size_t maxObjectSize,
-                                     ::std::size_t objectAlignSize)
-    : pool_(nullptr), maxSmallObjectSize_(maxObjectSize),
-      objectAlignSize_(objectAlignSize) {
+                                     ::std::size_t objectAlignSize,
+                                     ::std::size_t maxBlocksPerChunk,
+                                     SmallObjChunkSource *chunkSource)
+    : pool_(nullptr), chunkMap_(nullptr), chunkArena_(nullptr),
+      pageSize_(pageSize), maxSmallObjectSize_(maxObjectSize),
+      objectAlignSize_(GetPaddedAlignment(objectAlignSize)),
+      maxBlocksPerChunk_(maxBlocksPerChunk),
+      sizeClassCount_(0), sizeClassTable_(nullptr), fallbackAllocations_(0),
+      fallbackDeallocations_(0), incrementalTrim_(false), keepEmptyChunks_(0),
+      trimCursor_(0), profiler_(nullptr), generation_(NextGeneration()) {
 #ifdef DO_EXTRA_LOKI_TESTS
   std::cout << "SmallObjAllocator " << this << std::endl;
 #endif
   assert(0 != objectAlignSize);
-  const ::std::size_t allocCount = GetOffset(maxObjectSize, objectAlignSize);
-  pool_ = new FixedAllocator[allocCount];
-  for (::std::size_t i = 0; i < allocCount; ++i)
-    pool_[i].Initialize((i + 1) * objectAlignSize, pageSize);
+  assert(0 != maxObjectSize);
+  assert((UCHAR_MAX <= maxBlocksPerChunk) && (maxBlocksPerChunk <= USHRT_MAX));
+
+  // The largest class is the max object size rounded up to the alignment.
+  const ::std::size_t tableSize =
+      (maxObjectSize + objectAlignSize_ - 1) / objectAlignSize_;
+  const ::std::size_t largest = tableSize * objectAlignSize_;
+  ::std::vector<::std::size_t> blockSizes;
+  for (::std::size_t blockSize = objectAlignSize_;;
+       blockSize += GetSizeClassStep(blockSize, objectAlignSize_)) {
+    if (largest <= blockSize) {
+      blockSizes.push_back(largest);
+      break;
+    }
+    blockSizes.push_back(blockSize);
+  }
+  sizeClassCount_ = blockSizes.size();
+  assert(sizeClassCount_ <= USHRT_MAX);
+
+  // Maps each multiple of the alignment to the smallest class holding it.
+  sizeClassTable_ = new unsigned short[tableSize];
+  ::std::size_t sizeClass = 0;
+  for (::std::size_t i = 0; i < tableSize; ++i) {
+    while (blockSizes[sizeClass] < (i + 1) * objectAlignSize_)
+      ++sizeClass;
+    sizeClassTable_[i] = static_cast<unsigned short>(sizeClass);
+  }
+
+  // Each class's Chunks are aligned on the smallest power of two which is
+  // at least as long as one of them, so short Chunks don't pay for the
+  // longest.  The mmap arena can only hand whole pages back to the OS, so
+  // there no alignment is less than a typical page.  Region chunks, and
+  // slots of a chunk source, are as long as the most alignment, which is
+  // never less than a typical page either.
+#ifdef LOKI_SMALLOBJ_MMAP_ARENA
+  const ::std::size_t leastAlignment = 4096;
+#else
+  const ::std::size_t leastAlignment = sizeof(void *);
+#endif
+  ::std::vector<::std::size_t> chunkAlignments(sizeClassCount_);
+  ::std::size_t maxAlignment = 4096;
+  for (::std::size_t i = 0; i < sizeClassCount_; ++i) {
+    const ::std::size_t blockSize = blockSizes[i];
+    const ::std::size_t chunkLength =
+        blockSize *
+        FixedAllocator::GetNumBlocks(blockSize, pageSize, maxBlocksPerChunk);
+    ::std::size_t alignment = leastAlignment;
+    while (alignment < chunkLength)
+      alignment *= 2;
+    chunkAlignments[i] = alignment;
+    if (maxAlignment < alignment)
+      maxAlignment = alignment;
+  }
+  // The ChunkMap records a Chunk at each unit of its alignment, so the
+  // unit is not so small that a long Chunk needs more than 16 records.
+  ::std::size_t unit = maxAlignment;
+  for (::std::size_t i = 0; i < sizeClassCount_; ++i) {
+    if (chunkAlignments[i] < maxAlignment / 16)
+      chunkAlignments[i] = maxAlignment / 16;
+    if (chunkAlignments[i] < unit)
+      unit = chunkAlignments[i];
+  }
+  chunkMap_ = new ChunkMap(unit);
+  chunkArena_ = new ChunkArena(maxAlignment, chunkSource);
+
+  pool_ = new FixedAllocator[sizeClassCount_];
+  for (::std::size_t i = 0; i < sizeClassCount_; ++i)
+    pool_[i].Initialize(blockSizes[i], pageSize, maxBlocksPerChunk,
+                        chunkAlignments[i], chunkMap_, chunkArena_);
 }
 
 // SmallObjAllocator::~SmallObjAllocator --------------------------------------
@@ -1051,21 +2296,38 @@ SmallObjAllocator::~SmallObjAllocator(void) {
 #ifdef DO_EXTRA_LOKI_TESTS
   std::cout << "~SmallObjAllocator " << this << std::endl;
 #endif
+  delete profiler_.load();
   delete[] pool_;
+  delete chunkArena_;
+  delete chunkMap_;
+  delete[] sizeClassTable_;
+}
+
+// SmallObjAllocator::GetProfiler ---------------------------------------------
+
+SmallObjProfiler &SmallObjAllocator::GetProfiler(void) {
+  SmallObjProfiler *profiler = profiler_.load(::std::memory_order_acquire);
+  if (nullptr != profiler)
+    return *profiler;
+  SmallObjProfiler *made = new SmallObjProfiler(*this);
+  if (profiler_.compare_exchange_strong(profiler, made,
+                                        ::std::memory_order_acq_rel))
+    return *made;
+  // Another thread made one first.
+  delete made;
+  return *profiler;
 }
 
 // SmallObjAllocator::TrimExcessMemory ----------------------------------------
 
 bool SmallObjAllocator::TrimExcessMemory(void) {
   bool found = false;
-  const ::std::size_t allocCount =
-      GetOffset(GetMaxObjectSize(), GetAlignment());
   ::std::size_t i = 0;
-  for (; i < allocCount; ++i) {
-    if (pool_[i].TrimEmptyChunk())
+  for (; i < sizeClassCount_; ++i) {
+    if (0 < pool_[i].TrimSpares(0, SIZE_MAX))
       found = true;
   }
-  for (i = 0; i < allocCount; ++i) {
+  for (i = 0; i < sizeClassCount_; ++i) {
     if (pool_[i].TrimChunkList())
       found = true;
   }
@@ -1073,27 +2335,69 @@ bool SmallObjAllocator::TrimExcessMemory(void) {
   return found;
 }
 
+// SmallObjAllocator::TrimSome ------------------------------------------------
+
+::std::size_t SmallObjAllocator::TrimSome(::std::size_t keep,
+                                          ::std::size_t budget) {
+  assert(nullptr != pool_);
+  ::std::size_t released = 0;
+  for (::std::size_t visited = 0;
+       (visited < sizeClassCount_) && (released < budget); ++visited) {
+    released += pool_[trimCursor_].TrimSpares(keep, budget - released);
+    // A size class with Chunks left over is where the next call resumes.
+    if (released < budget)
+      trimCursor_ = (trimCursor_ + 1) % sizeClassCount_;
+  }
+  return released;
+}
+
+// SmallObjAllocator::Trim ----------------------------------------------------
+
+::std::size_t SmallObjAllocator::Trim(::std::size_t budget) {
+  return TrimSome(keepEmptyChunks_, budget);
+}
+
+// SmallObjAllocator::SetIncrementalTrim --------------------------------------
+
+void SmallObjAllocator::SetIncrementalTrim(bool incremental,
+                                           ::std::size_t keepEmptyChunks) {
+  assert(nullptr != pool_);
+  incrementalTrim_ = incremental;
+  keepEmptyChunks_ = keepEmptyChunks;
+  for (::std::size_t i = 0; i < sizeClassCount_; ++i)
+    pool_[i].SetRetainSpares(incremental);
+}
+
+// SmallObjAllocator::TrimAfterFailure ----------------------------------------
+
+bool SmallObjAllocator::TrimAfterFailure(void) {
+  // Releasing a few spares is usually enough, and far quicker than walking
+  // every Chunk of every pool.
+  if (incrementalTrim_ && (0 < TrimSome(0, LOKI_SMALLOBJ_FAILURE_TRIM_BUDGET)))
+    return true;
+  return TrimExcessMemory();
+}
+
 // SmallObjAllocator::Allocate ------------------------------------------------
 
 void *SmallObjAllocator::Allocate(::std::size_t numBytes, bool doThrow) {
-  if (numBytes > GetMaxObjectSize())
+  if (numBytes > GetMaxObjectSize()) {
+    ++fallbackAllocations_;
     return DefaultAllocator(numBytes, doThrow);
+  }
 
   assert(nullptr != pool_);
   if (0 == numBytes)
     numBytes = 1;
-  const ::std::size_t index = GetOffset(numBytes, GetAlignment()) - 1;
-  const ::std::size_t allocCount =
-      GetOffset(GetMaxObjectSize(), GetAlignment());
-  (void)allocCount;
-  assert(index < allocCount);
+  const ::std::size_t index = GetSizeClass(numBytes);
+  assert(index < sizeClassCount_);
 
   FixedAllocator &allocator = pool_[index];
   assert(allocator.BlockSize() >= numBytes);
-  assert(allocator.BlockSize() < numBytes + GetAlignment());
+  assert((0 == index) || (pool_[index - 1].BlockSize() < numBytes));
   void *place = allocator.Allocate();
 
-  if ((nullptr == place) && TrimExcessMemory())
+  if ((nullptr == place) && TrimAfterFailure())
     place = allocator.Allocate();
 
   if ((nullptr == place) && doThrow) {
@@ -1110,20 +2414,18 @@ void SmallObjAllocator::Deallocate(void *p, ::std::size_t numBytes) {
   if (nullptr == p)
     return;
   if (numBytes > GetMaxObjectSize()) {
+    ++fallbackDeallocations_;
     DefaultDeallocator(p);
     return;
   }
   assert(nullptr != pool_);
   if (0 == numBytes)
     numBytes = 1;
-  const ::std::size_t index = GetOffset(numBytes, GetAlignment()) - 1;
-  const ::std::size_t allocCount =
-      GetOffset(GetMaxObjectSize(), GetAlignment());
-  (void)allocCount;
-  assert(index < allocCount);
+  const ::std::size_t index = GetSizeClass(numBytes);
+  assert(index < sizeClassCount_);
   FixedAllocator &allocator = pool_[index];
   assert(allocator.BlockSize() >= numBytes);
-  assert(allocator.BlockSize() < numBytes + GetAlignment());
+  assert((0 == index) || (pool_[index - 1].BlockSize() < numBytes));
   const bool found = allocator.Deallocate(p, nullptr);
   (void)found;
   assert(found);
@@ -1135,19 +2437,13 @@ void SmallObjAllocator::Deallocate(void *p) {
   if (nullptr == p)
     return;
   assert(nullptr != pool_);
-  FixedAllocator *pAllocator = nullptr;
-  const ::std::size_t allocCount =
-      GetOffset(GetMaxObjectSize(), GetAlignment());
-  Chunk *chunk = nullptr;
-
-  for (::std::size_t ii = 0; ii < allocCount; ++ii) {
-    chunk = pool_[ii].HasBlock(p);
-    if (nullptr != chunk) {
-      pAllocator = &pool_[ii];
-      break;
-    }
-  }
-  if (nullptr == pAllocator) {
+  // The ChunkMap tells which FixedAllocator owns p, if any does.
+  const ChunkMap::Entry *entry = chunkMap_->Find(p);
+  FixedAllocator *pAllocator =
+      (nullptr == entry) ? nullptr : entry->owner_;
+  Chunk *chunk = (nullptr == pAllocator) ? nullptr : pAllocator->HasBlock(p);
+  if (nullptr == chunk) {
+    ++fallbackDeallocations_;
     DefaultDeallocator(p);
     return;
   }
@@ -1158,6 +2454,227 @@ void SmallObjAllocator::Deallocate(void *p) {
   assert(found);
 }
 
+// SmallObjAllocator::AllocateBatch -------------------------------------------
+
+::std::size_t SmallObjAllocator::AllocateBatch(::std::size_t numBytes,
+                                               void **blocks,
+                                               ::std::size_t count) {
+  if (numBytes > GetMaxObjectSize()) {
+    ::std::size_t done = 0;
+    for (; done < count; ++done) {
+      blocks[done] = DefaultAllocator(numBytes, false);
+      if (nullptr == blocks[done])
+        break;
+    }
+    fallbackAllocations_ += done;
+    return done;
+  }
+
+  assert(nullptr != pool_);
+  if (0 == numBytes)
+    numBytes = 1;
+  const ::std::size_t index = GetSizeClass(numBytes);
+  assert(index < sizeClassCount_);
+  FixedAllocator &allocator = pool_[index];
+  ::std::size_t done = allocator.AllocateBatch(blocks, count);
+  if ((done < count) && TrimAfterFailure())
+    done += allocator.AllocateBatch(blocks + done, count - done);
+  return done;
+}
+
+// SmallObjAllocator::DeallocateBatch -----------------------------------------
+
+void SmallObjAllocator::DeallocateBatch(void **blocks, ::std::size_t count,
+                                        ::std::size_t numBytes) {
+  if (numBytes > GetMaxObjectSize()) {
+    for (::std::size_t ii = 0; ii < count; ++ii) {
+      if (nullptr == blocks[ii])
+        continue;
+      ++fallbackDeallocations_;
+      DefaultDeallocator(blocks[ii]);
+    }
+    return;
+  }
+
+  assert(nullptr != pool_);
+  if (0 == numBytes)
+    numBytes = 1;
+  const ::std::size_t index = GetSizeClass(numBytes);
+  assert(index < sizeClassCount_);
+  FixedAllocator &allocator = pool_[index];
+  // FixedAllocator::Deallocate checks the Chunk of the previous block
+  // first, so a run of blocks from one Chunk needs no ChunkMap lookups.
+  for (::std::size_t ii = 0; ii < count; ++ii) {
+    if (nullptr == blocks[ii])
+      continue;
+    const bool found = allocator.Deallocate(blocks[ii], nullptr);
+    (void)found;
+    assert(found);
+  }
+}
+
+// SmallObjAllocator::GetBlockSize --------------------------------------------
+
+::std::size_t SmallObjAllocator::GetBlockSize(::std::size_t sizeClass) const {
+  assert(sizeClass < sizeClassCount_);
+  return pool_[sizeClass].BlockSize();
+}
+
+// SmallObjAllocator::GetFootprint -------------------------------------------
+
+::std::size_t SmallObjAllocator::GetFootprint(::std::size_t numBytes) const {
+  if (maxSmallObjectSize_ < numBytes)
+    return numBytes;
+  return pool_[GetSizeClass(numBytes)].BlockSize();
+}
+
+// SmallObjAllocator::GetAlignedSize -----------------------------------------
+
+::std::size_t SmallObjAllocator::GetAlignedSize(::std::size_t numBytes,
+                                                ::std::size_t alignment) const {
+  // Must be a power of two.
+  if ((0 == alignment) || (0 != (alignment & (alignment - 1))))
+    return 0;
+  if (0 == numBytes)
+    numBytes = 1;
+  if (numBytes > GetMaxObjectSize())
+    return 0;
+  const ::std::size_t rounded = (numBytes + alignment - 1) & ~(alignment - 1);
+  if (rounded > GetMaxObjectSize())
+    return 0;
+  // Blocks start at multiples of their size from an aligned Chunk.
+  const FixedAllocator &pool = pool_[GetSizeClass(rounded)];
+  if ((alignment > pool.GetChunkAlignment()) ||
+      (0 != pool.BlockSize() % alignment))
+    return 0;
+  return rounded;
+}
+
+// SmallObjAllocator::GetPool -------------------------------------------------
+
+FixedAllocator *SmallObjAllocator::GetPool(::std::size_t numBytes) {
+  if (numBytes > GetMaxObjectSize())
+    return nullptr;
+  assert(nullptr != pool_);
+  if (0 == numBytes)
+    numBytes = 1;
+  return pool_ + GetSizeClass(numBytes);
+}
+
+// SmallObjAllocator::AllocateFrom --------------------------------------------
+
+void *SmallObjAllocator::AllocateFrom(FixedAllocator &pool, bool doThrow) {
+  assert((pool_ <= &pool) && (&pool < pool_ + sizeClassCount_));
+  void *place = pool.Allocate();
+
+  if ((nullptr == place) && TrimAfterFailure())
+    place = pool.Allocate();
+
+  if ((nullptr == place) && doThrow)
+    throw std::bad_alloc();
+  return place;
+}
+
+// SmallObjAllocator::DeallocateTo --------------------------------------------
+
+void SmallObjAllocator::DeallocateTo(FixedAllocator &pool, void *p) {
+  if (nullptr == p)
+    return;
+  assert((pool_ <= &pool) && (&pool < pool_ + sizeClassCount_));
+  const bool found = pool.Deallocate(p, nullptr);
+  (void)found;
+  assert(found);
+}
+
+// SmallObjAllocator::HasBlock ------------------------------------------------
+
+bool SmallObjAllocator::HasBlock(const void *p) const {
+  const ChunkMap::Entry *entry = chunkMap_->Find(p);
+  return (nullptr != entry) &&
+         (nullptr != entry->owner_->HasBlock(const_cast<void *>(p)));
+}
+
+// SmallObjAllocator::GetBlockSizeOf -----------------------------------------
+
+::std::size_t SmallObjAllocator::GetBlockSizeOf(const void *p) const {
+  const ChunkMap::Entry *entry = chunkMap_->Find(p);
+  if ((nullptr == entry) ||
+      (nullptr == entry->owner_->HasBlock(const_cast<void *>(p))))
+    return 0;
+  return entry->owner_->BlockSize();
+}
+
+// SmallObjAllocator::GetChunkState -------------------------------------------
+
+bool SmallObjAllocator::GetChunkState(const void *p,
+                                      SmallObjChunkState &state) const {
+  const ChunkMap::Entry *entry = chunkMap_->Find(p);
+  if ((nullptr == entry) || (nullptr == entry->owner_))
+    return false;
+  state.sizeClass = static_cast<::std::size_t>(entry->owner_ - pool_);
+  entry->owner_->GetChunkState(entry->index_, state);
+  return true;
+}
+
+// SmallObjAllocator::GetChunkStates ------------------------------------------
+
+void SmallObjAllocator::GetChunkStates(
+    ::std::vector<SmallObjChunkState> &states) const {
+  states.clear();
+  for (::std::size_t i = 0; i < sizeClassCount_; ++i)
+    pool_[i].GetChunkStates(i, states);
+}
+
+// SmallObjAllocator::AdoptChunk ----------------------------------------------
+
+bool SmallObjAllocator::AdoptChunk(const SmallObjChunkState &state) {
+  const ::std::uintptr_t address =
+      reinterpret_cast<::std::uintptr_t>(state.data);
+  if ((sizeClassCount_ <= state.sizeClass) || (nullptr == state.data) ||
+      (0 != (address & (pool_[state.sizeClass].GetChunkAlignment() - 1))) ||
+      (USHRT_MAX < state.firstAvailable) || (USHRT_MAX < state.available))
+    return false;
+  // The same storage can't be adopted twice.
+  const ChunkMap::Entry *entry = chunkMap_->Find(state.data);
+  if ((nullptr != entry) && (nullptr != entry->owner_))
+    return false;
+  return pool_[state.sizeClass].Adopt(
+      state.data, static_cast<StealthIndex>(state.firstAvailable),
+      static_cast<StealthIndex>(state.available));
+}
+
+// SmallObjAllocator::DiscardChunks -------------------------------------------
+
+void SmallObjAllocator::DiscardChunks(void) {
+  for (::std::size_t i = 0; i < sizeClassCount_; ++i)
+    pool_[i].Discard();
+}
+
+// SmallObjAllocator::AllocateRegionChunk -------------------------------------
+
+void *SmallObjAllocator::AllocateRegionChunk(void) {
+  return chunkArena_->Allocate(chunkArena_->GetAlignment(),
+                               chunkArena_->GetAlignment(), false);
+}
+
+// SmallObjAllocator::DeallocateRegionChunk -----------------------------------
+
+void SmallObjAllocator::DeallocateRegionChunk(void *p) {
+  chunkArena_->Deallocate(p, chunkArena_->GetAlignment());
+}
+
+// SmallObjAllocator::GetRegionChunkSize --------------------------------------
+
+::std::size_t SmallObjAllocator::GetRegionChunkSize(void) const {
+  return chunkArena_->GetAlignment();
+}
+
+// SmallObjAllocator::GetLeastChunkAlignment ----------------------------------
+
+::std::size_t SmallObjAllocator::GetLeastChunkAlignment(void) const {
+  return chunkMap_->GetUnit();
+}
+
 // SmallObjAllocator::IsCorrupt -----------------------------------------------
 
 bool SmallObjAllocator::IsCorrupt(void) const {
@@ -1173,13 +2690,463 @@ bool SmallObjAllocator::IsCorrupt(void) const {
     assert(false);
     return true;
   }
-  const ::std::size_t allocCount =
-      GetOffset(GetMaxObjectSize(), GetAlignment());
-  for (::std::size_t ii = 0; ii < allocCount; ++ii) {
+  for (::std::size_t ii = 0; ii < sizeClassCount_; ++ii) {
     if (pool_[ii].IsCorrupt())
       return true;
   }
   return false;
 }
 
+// SmallObjAllocator::GetStats ------------------------------------------------
+
+void SmallObjAllocator::GetStats(SmallObjStats &stats) const {
+  assert(nullptr != pool_);
+  stats.sizeClasses.resize(sizeClassCount_);
+  stats.fallbackAllocations = fallbackAllocations_;
+  stats.fallbackDeallocations = fallbackDeallocations_;
+  stats.bytesReserved = 0;
+  stats.bytesInUse = 0;
+  for (::std::size_t ii = 0; ii < sizeClassCount_; ++ii) {
+    pool_[ii].GetStats(stats.sizeClasses[ii]);
+    stats.bytesReserved += stats.sizeClasses[ii].bytesReserved;
+    stats.bytesInUse += stats.sizeClasses[ii].bytesInUse;
+  }
+}
+
+// SmallObjStats::WriteText ---------------------------------------------------
+
+void SmallObjStats::WriteText(::std::ostream &out) const {
+  out << "size\tblocks/chunk\tallocs\tfrees\tlive\tmax live\tchunks"
+         "\tempty\tmax chunks\treserved\tin use\n";
+  for (::std::size_t ii = 0; ii < sizeClasses.size(); ++ii) {
+    const SmallObjSizeClassStats &sc = sizeClasses[ii];
+    if ((0 == sc.allocations) && (0 == sc.chunks))
+      continue;
+    out << sc.blockSize << '\t' << sc.blocksPerChunk << "\t\t"
+        << sc.allocations << '\t' << sc.deallocations << '\t'
+        << sc.liveBlocks << '\t' << sc.maxLiveBlocks << "\t\t" << sc.chunks
+        << '\t' << sc.emptyChunks << '\t' << sc.maxChunks << "\t\t"
+        << sc.bytesReserved << "\t\t" << sc.bytesInUse << '\n';
+  }
+  out << "bytes reserved: " << bytesReserved << ", in use: " << bytesInUse
+      << ", fallback allocations: " << fallbackAllocations
+      << ", fallback deallocations: " << fallbackDeallocations << '\n';
+}
+
+// SmallObjStats::WriteJson ---------------------------------------------------
+
+void SmallObjStats::WriteJson(::std::ostream &out) const {
+  out << "{\"bytesReserved\":" << bytesReserved
+      << ",\"bytesInUse\":" << bytesInUse
+      << ",\"fallbackAllocations\":" << fallbackAllocations
+      << ",\"fallbackDeallocations\":" << fallbackDeallocations
+      << ",\"sizeClasses\":[";
+  for (::std::size_t ii = 0; ii < sizeClasses.size(); ++ii) {
+    const SmallObjSizeClassStats &sc = sizeClasses[ii];
+    if (0 < ii)
+      out << ',';
+    out << "{\"blockSize\":" << sc.blockSize
+        << ",\"blocksPerChunk\":" << sc.blocksPerChunk
+        << ",\"allocations\":" << sc.allocations
+        << ",\"deallocations\":" << sc.deallocations
+        << ",\"liveBlocks\":" << sc.liveBlocks
+        << ",\"maxLiveBlocks\":" << sc.maxLiveBlocks
+        << ",\"chunks\":" << sc.chunks
+        << ",\"emptyChunks\":" << sc.emptyChunks
+        << ",\"maxChunks\":" << sc.maxChunks
+        << ",\"bytesReserved\":" << sc.bytesReserved
+        << ",\"bytesInUse\":" << sc.bytesInUse << '}';
+  }
+  out << "]}";
+}
+
+namespace Private {
+
+/// Head of the list of all accounts.  Accounts are only ever added.
+static ::std::atomic<SmallObjAccount *> FirstAccount(nullptr);
+
+} // end namespace Private
+
+// SmallObjAccount::SmallObjAccount -------------------------------------------
+
+SmallObjAccount::SmallObjAccount(const char *name)
+    : name_(name), next_(nullptr), liveBytes_(0), peakBytes_(0), budget_(0),
+      allocations_(0), deallocations_(0), refusals_(0) {
+  next_ = FirstAccount.load(::std::memory_order_relaxed);
+  while (!FirstAccount.compare_exchange_weak(next_, this,
+                                             ::std::memory_order_release,
+                                             ::std::memory_order_relaxed))
+    ;
+}
+
+// SmallObjAccount::~SmallObjAccount ------------------------------------------
+
+SmallObjAccount::~SmallObjAccount(void) {}
+
+// SmallObjAccount::GetFirst --------------------------------------------------
+
+SmallObjAccount *SmallObjAccount::GetFirst(void) {
+  return FirstAccount.load(::std::memory_order_acquire);
+}
+
+// SmallObjAccount::WriteText -------------------------------------------------
+
+void SmallObjAccount::WriteText(::std::ostream &out) {
+  out << "account\tlive\tpeak\tbudget\tallocs\tfrees\trefused\n";
+  for (const SmallObjAccount *account = GetFirst(); nullptr != account;
+       account = account->GetNext()) {
+    out << account->GetName() << '\t' << account->GetLiveBytes() << '\t'
+        << account->GetPeakBytes() << '\t' << account->GetBudget() << '\t'
+        << account->GetAllocations() << '\t' << account->GetDeallocations()
+        << '\t' << account->GetRefusals() << '\n';
+  }
+}
+
+// SmallObjProfiler::Tables ---------------------------------------------------
+
+/** Samples of a SmallObjProfiler.  Live samples are found by address.
+ Freed samples are only counted, by call site and size class, since all
+ that matters about them is how much each call site allocated.
+ */
+struct SmallObjProfiler::Tables {
+  /// Most frames kept of each backtrace.
+  enum { MaxDepth = 32 };
+
+  /// Call site and size class, which samples are grouped by.
+  struct Site {
+    ::std::size_t sizeClass_;
+    unsigned int depth_;
+    void *frames_[MaxDepth];
+
+    bool operator<(const Site &that) const {
+      if (sizeClass_ != that.sizeClass_)
+        return sizeClass_ < that.sizeClass_;
+      if (depth_ != that.depth_)
+        return depth_ < that.depth_;
+      return ::std::memcmp(frames_, that.frames_, depth_ * sizeof(void *)) < 0;
+    }
+  };
+
+  struct Sample {
+    Site site_;
+    /// # of bytes asked for.
+    ::std::size_t size_;
+    /// # of allocations this sample stands for.
+    double weight_;
+  };
+
+  /// Sums for one call site and size class.
+  struct Totals {
+    Totals(void) : samples_(0), bytes_(0), objects_(0), estimatedBytes_(0) {}
+
+    void Add(const Sample &sample) {
+      ++samples_;
+      bytes_ += sample.size_;
+      objects_ += sample.weight_;
+      estimatedBytes_ += sample.weight_ * double(sample.size_);
+    }
+
+    ::std::size_t samples_;
+    ::std::size_t bytes_;
+    double objects_;
+    double estimatedBytes_;
+  };
+
+  typedef ::std::unordered_map<const void *, Sample> LiveSamples;
+  typedef ::std::map<Site, Totals> SiteTotals;
+
+  /// Sums the live samples by site, and the live and freed samples too.
+  void Sum(SiteTotals &live, SiteTotals &all) const {
+    for (LiveSamples::const_iterator it(live_.begin()); it != live_.end();
+         ++it) {
+      live[it->second.site_].Add(it->second);
+      all[it->second.site_].Add(it->second);
+    }
+    for (SiteTotals::const_iterator it(freed_.begin()); it != freed_.end();
+         ++it) {
+      Totals &totals = all[it->first];
+      totals.samples_ += it->second.samples_;
+      totals.bytes_ += it->second.bytes_;
+      totals.objects_ += it->second.objects_;
+      totals.estimatedBytes_ += it->second.estimatedBytes_;
+    }
+  }
+
+  mutable ::std::mutex mutex_;
+  LiveSamples live_;
+  SiteTotals freed_;
+  /// # of freed samples.
+  ::std::size_t freedCount_;
+};
+
+#ifdef LOKI_SMALLOBJ_SAMPLING
+::std::atomic<bool> SmallObjProfiler::sampling_(true);
+#else
+::std::atomic<bool> SmallObjProfiler::sampling_(false);
+#endif
+
+// SmallObjProfiler::SmallObjProfiler -----------------------------------------
+
+SmallObjProfiler::SmallObjProfiler(const SmallObjAllocator &allocator)
+    : allocator_(allocator), interval_(LOKI_SMALLOBJ_SAMPLE_INTERVAL),
+      tables_(new Tables) {
+  tables_->freedCount_ = 0;
+  for (::std::size_t ii = 0; ii < FilterSize; ++ii)
+    filter_[ii].store(0, ::std::memory_order_relaxed);
+}
+
+// SmallObjProfiler::~SmallObjProfiler ----------------------------------------
+
+SmallObjProfiler::~SmallObjProfiler(void) { delete tables_; }
+
+// SmallObjProfiler::SetInterval ----------------------------------------------
+
+void SmallObjProfiler::SetInterval(::std::size_t bytes) {
+  interval_.store(bytes, ::std::memory_order_relaxed);
+}
+
+// SmallObjProfiler::DrawCountdown --------------------------------------------
+
+::std::ptrdiff_t SmallObjProfiler::DrawCountdown(void) {
+  return Draw(GetInterval());
+}
+
+// SmallObjProfiler::Draw -----------------------------------------------------
+
+::std::ptrdiff_t SmallObjProfiler::Draw(::std::size_t interval) {
+  // While sampling is off, each thread looks again after this many bytes.
+  const ::std::ptrdiff_t recheck = 1024 * 1024;
+  if (0 == interval)
+    return recheck;
+
+  // Draw the next count from an exponential distribution, with a
+  // xorshift generator seeded differently for each thread.  Ids of dead
+  // threads are reused, so a count of seeded threads goes in the seed too.
+  static ::std::atomic<::std::uint64_t> seeded(0);
+  static thread_local ::std::uint64_t state = 0;
+  if (0 == state)
+    state = ((::std::hash<::std::thread::id>()(::std::this_thread::get_id()) ^
+              seeded.fetch_add(1, ::std::memory_order_relaxed)) |
+             1) *
+            0x9E3779B97F4A7C15ULL;
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  const double uniform =
+      (double((state * 0x2545F4914F6CDD1DULL) >> 11) + 1.0) /
+      9007199254740993.0;
+  const double next = -::std::log(uniform) * double(interval);
+  return (next < double(PTRDIFF_MAX / 2)) ? ::std::ptrdiff_t(next) + 1
+                                          : PTRDIFF_MAX / 2;
+}
+
+// SmallObjProfiler::Sample ---------------------------------------------------
+
+::std::ptrdiff_t SmallObjProfiler::Sample(void *p, ::std::size_t size) {
+  const ::std::size_t interval = GetInterval();
+  const ::std::ptrdiff_t countdown = Draw(interval);
+  if (0 == interval)
+    return countdown;
+
+  Tables::Sample sample;
+  sample.size_ = size;
+  sample.weight_ = 1.0 / (1.0 - ::std::exp(-double(size) / double(interval)));
+  sample.site_.sizeClass_ = (size <= allocator_.GetMaxObjectSize())
+                                ? allocator_.GetSizeClass(size)
+                                : allocator_.GetSizeClassCount();
+  sample.site_.depth_ = 0;
+#ifdef LOKI_SMALLOBJ_HAS_BACKTRACE
+  // The first frame is this function, so it is dropped.
+  void *frames[Tables::MaxDepth + 1];
+  const int depth = ::backtrace(frames, Tables::MaxDepth + 1);
+  if (1 < depth) {
+    sample.site_.depth_ = static_cast<unsigned int>(depth - 1);
+    ::std::memcpy(sample.site_.frames_, frames + 1,
+                  sample.site_.depth_ * sizeof(void *));
+  }
+#endif
+
+  try {
+    ::std::lock_guard<::std::mutex> lock(tables_->mutex_);
+    ::std::pair<Tables::LiveSamples::iterator, bool> added =
+        tables_->live_.insert(::std::make_pair(p, sample));
+    if (added.second) {
+      filter_[GetSlot(p)].fetch_add(1, ::std::memory_order_relaxed);
+    } else {
+      // The block was released without a deallocation, as by a Region.
+      tables_->freed_[added.first->second.site_].Add(added.first->second);
+      ++tables_->freedCount_;
+      added.first->second = sample;
+    }
+  } catch (...) {
+    // No room for the sample, so it is dropped.
+  }
+  return countdown;
+}
+
+// SmallObjProfiler::Release --------------------------------------------------
+
+void SmallObjProfiler::Release(const void *p) {
+  ::std::lock_guard<::std::mutex> lock(tables_->mutex_);
+  Tables::LiveSamples::iterator it(tables_->live_.find(p));
+  if (tables_->live_.end() == it)
+    return;
+  try {
+    tables_->freed_[it->second.site_].Add(it->second);
+    ++tables_->freedCount_;
+  } catch (...) {
+    // No room to count the freed sample, so it is forgotten.
+  }
+  tables_->live_.erase(it);
+  filter_[GetSlot(p)].fetch_sub(1, ::std::memory_order_relaxed);
+}
+
+// SmallObjProfiler::Clear ----------------------------------------------------
+
+void SmallObjProfiler::Clear(void) {
+  ::std::lock_guard<::std::mutex> lock(tables_->mutex_);
+  tables_->live_.clear();
+  tables_->freed_.clear();
+  tables_->freedCount_ = 0;
+  for (::std::size_t ii = 0; ii < FilterSize; ++ii)
+    filter_[ii].store(0, ::std::memory_order_relaxed);
+}
+
+// SmallObjProfiler::GetLiveSampleCount ---------------------------------------
+
+::std::size_t SmallObjProfiler::GetLiveSampleCount(void) const {
+  ::std::lock_guard<::std::mutex> lock(tables_->mutex_);
+  return tables_->live_.size();
+}
+
+// SmallObjProfiler::GetFreedSampleCount --------------------------------------
+
+::std::size_t SmallObjProfiler::GetFreedSampleCount(void) const {
+  ::std::lock_guard<::std::mutex> lock(tables_->mutex_);
+  return tables_->freedCount_;
+}
+
+// SmallObjProfiler::WriteText ------------------------------------------------
+
+void SmallObjProfiler::WriteText(::std::ostream &out) const {
+  Tables::SiteTotals live;
+  Tables::SiteTotals all;
+  ::std::size_t liveCount = 0;
+  ::std::size_t freedCount = 0;
+  {
+    ::std::lock_guard<::std::mutex> lock(tables_->mutex_);
+    tables_->Sum(live, all);
+    liveCount = tables_->live_.size();
+    freedCount = tables_->freedCount_;
+  }
+
+  const ::std::size_t classCount = allocator_.GetSizeClassCount();
+  ::std::vector<Tables::Totals> byClass(classCount + 1);
+  for (Tables::SiteTotals::const_iterator it(live.begin()); it != live.end();
+       ++it) {
+    Tables::Totals &totals = byClass[it->first.sizeClass_];
+    totals.samples_ += it->second.samples_;
+    totals.objects_ += it->second.objects_;
+    totals.estimatedBytes_ += it->second.estimatedBytes_;
+  }
+
+  out << "heap profile: one sample per " << GetInterval()
+      << " bytes, live samples: " << liveCount
+      << ", freed samples: " << freedCount << '\n';
+  out << "block size\tlive samples\test. objects\test. bytes\n";
+  for (::std::size_t ii = 0; ii <= classCount; ++ii) {
+    const Tables::Totals &totals = byClass[ii];
+    if (0 == totals.samples_)
+      continue;
+    if (ii < classCount)
+      out << allocator_.GetBlockSize(ii);
+    else
+      out << "large";
+    out << "\t\t" << totals.samples_ << "\t\t" << ::std::size_t(totals.objects_)
+        << "\t\t" << ::std::size_t(totals.estimatedBytes_) << '\n';
+  }
+
+  // Call sites, each with its frames, the most live bytes first.
+  ::std::multimap<double, const Tables::Site *> sites;
+  for (Tables::SiteTotals::const_iterator it(live.begin()); it != live.end();
+       ++it)
+    sites.insert(::std::make_pair(-it->second.estimatedBytes_, &it->first));
+  for (::std::multimap<double, const Tables::Site *>::const_iterator it(
+           sites.begin());
+       it != sites.end(); ++it) {
+    const Tables::Site &site = *it->second;
+    const Tables::Totals &totals = live[site];
+    out << '\n'
+        << ::std::size_t(totals.estimatedBytes_) << " bytes in "
+        << ::std::size_t(totals.objects_) << " objects of ";
+    if (site.sizeClass_ < classCount)
+      out << allocator_.GetBlockSize(site.sizeClass_) << " byte blocks";
+    else
+      out << "large blocks";
+    out << " (" << totals.samples_ << " samples)\n";
+#ifdef LOKI_SMALLOBJ_HAS_BACKTRACE
+    char **symbols = ::backtrace_symbols(
+        const_cast<void *const *>(site.frames_), int(site.depth_));
+#else
+    char **symbols = nullptr;
+#endif
+    for (unsigned int ff = 0; ff < site.depth_; ++ff) {
+      out << "    #" << ff << ' ';
+      if (nullptr != symbols)
+        out << symbols[ff];
+      else
+        out << site.frames_[ff];
+      out << '\n';
+    }
+    ::std::free(symbols);
+  }
+}
+
+// SmallObjProfiler::WritePprof -----------------------------------------------
+
+void SmallObjProfiler::WritePprof(::std::ostream &out) const {
+  Tables::SiteTotals live;
+  Tables::SiteTotals all;
+  {
+    ::std::lock_guard<::std::mutex> lock(tables_->mutex_);
+    tables_->Sum(live, all);
+  }
+
+  // pprof scales the raw samples itself, given the interval.
+  Tables::Totals liveSum;
+  Tables::Totals allSum;
+  for (Tables::SiteTotals::const_iterator it(all.begin()); it != all.end();
+       ++it) {
+    allSum.samples_ += it->second.samples_;
+    allSum.bytes_ += it->second.bytes_;
+    Tables::SiteTotals::const_iterator found(live.find(it->first));
+    if (live.end() != found) {
+      liveSum.samples_ += found->second.samples_;
+      liveSum.bytes_ += found->second.bytes_;
+    }
+  }
+  out << "heap profile: " << liveSum.samples_ << ": " << liveSum.bytes_
+      << " [" << allSum.samples_ << ": " << allSum.bytes_
+      << "] @ heap_v2/" << GetInterval() << '\n';
+  for (Tables::SiteTotals::const_iterator it(all.begin()); it != all.end();
+       ++it) {
+    Tables::SiteTotals::const_iterator found(live.find(it->first));
+    const ::std::size_t liveSamples =
+        (live.end() == found) ? 0 : found->second.samples_;
+    const ::std::size_t liveBytes =
+        (live.end() == found) ? 0 : found->second.bytes_;
+    out << ' ' << liveSamples << ": " << liveBytes << " ["
+        << it->second.samples_ << ": " << it->second.bytes_ << "] @";
+    for (unsigned int ff = 0; ff < it->first.depth_; ++ff)
+      out << ' ' << it->first.frames_[ff];
+    out << '\n';
+  }
+
+  // pprof needs the mappings to find symbols in shared libraries.
+  out << "\nMAPPED_LIBRARIES:\n";
+  ::std::ifstream maps("/proc/self/maps");
+  if (maps)
+    out << maps.rdbuf();
+}
+
 } // end namespace Loki
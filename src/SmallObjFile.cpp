@@ -0,0 +1,572 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+////////////////////////////////////////////////////////////////////////////////
+
+// $Id$
+
+// ----------------------------------------------------------------------------
+
+#include <loki/SmallObjFile.h>
+
+#include <cassert>
+#include <cstring>
+#include <new>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Loki {
+
+/** @struct SmallObjFileAllocator::Header
+ Start of the file.  Every field has a fixed width, so a file made by one
+ build can be checked by another.
+ */
+struct SmallObjFileAllocator::Header {
+  /// Tells a file made by Create from any other file.
+  char magic_[8];
+  /// Layout of the header and records.
+  std::uint32_t version_;
+  /// # of slots taken by the header and records.
+  std::uint32_t headerSlots_;
+  /// # of slots in the file, including the header's.
+  std::uint64_t slotCount_;
+  /// Parameters of the allocator which made the file.
+  std::uint64_t chunkSize_;
+  std::uint64_t pageSize_;
+  std::uint64_t maxObjectSize_;
+  std::uint64_t objectAlignSize_;
+  std::uint64_t maxBlocksPerChunk_;
+  std::uint64_t sizeClassCount_;
+  /// Offset of the root block from the start of the file, or zero.
+  std::uint64_t root_;
+};
+
+/** @struct SmallObjFileAllocator::SlotRecord
+ State of the Chunk in one slot, as kept by SmallObjChunkState.
+ */
+struct SmallObjFileAllocator::SlotRecord {
+  /// Size class of the Chunk, or FreeSlot.
+  std::uint32_t sizeClass_;
+  std::uint16_t firstAvailable_;
+  std::uint16_t available_;
+};
+
+namespace Private {
+
+/// Magic of the header, with the version in the last character.
+static const char FileMagic[8] = {'L', 'o', 'k', 'i', 'S', 'O', 'F', '1'};
+static const std::uint32_t FileVersion = 1;
+/// Size class of a slot which holds no Chunk.
+static const std::uint32_t FreeSlot = 0xFFFFFFFF;
+
+} // end namespace Private
+
+using namespace ::Loki::Private;
+
+// SmallObjFileAllocator::SmallObjFileAllocator -------------------------------
+
+SmallObjFileAllocator::SmallObjFileAllocator(std::size_t pageSize,
+                                             std::size_t maxObjectSize,
+                                             std::size_t objectAlignSize,
+                                             std::size_t maxBlocksPerChunk)
+    : SmallObjChunkSource(),
+      SmallObjAllocator(pageSize, maxObjectSize, objectAlignSize,
+                        maxBlocksPerChunk, this),
+      base_(nullptr), length_(0), file_(-1), mapping_(nullptr), freeSlots_() {}
+
+// SmallObjFileAllocator::~SmallObjFileAllocator ------------------------------
+
+SmallObjFileAllocator::~SmallObjFileAllocator(void) { Detach(); }
+
+// SmallObjFileAllocator::GetRecords ------------------------------------------
+
+SmallObjFileAllocator::SlotRecord *
+SmallObjFileAllocator::GetRecords(void) const {
+  return reinterpret_cast<SlotRecord *>(base_ + sizeof(Header));
+}
+
+// SmallObjFileAllocator::Create ----------------------------------------------
+
+bool SmallObjFileAllocator::Create(const char *path, std::size_t length,
+                                   void *base) {
+  Detach();
+  const std::size_t chunkSize = GetChunkSize();
+  const std::size_t slotCount = length / chunkSize;
+  const std::size_t headerSlots =
+      (sizeof(Header) + slotCount * sizeof(SlotRecord) + chunkSize - 1) /
+      chunkSize;
+  if ((slotCount <= headerSlots) || (FreeSlot <= slotCount))
+    return false;
+  try {
+    freeSlots_.reserve(slotCount);
+  } catch (...) {
+    return false;
+  }
+  if (!Open(path, slotCount * chunkSize, base, true))
+    return false;
+
+  Header *header = GetHeader();
+  ::memset(header, 0, sizeof(Header));
+  ::memcpy(header->magic_, FileMagic, sizeof(FileMagic));
+  header->version_ = FileVersion;
+  header->headerSlots_ = static_cast<std::uint32_t>(headerSlots);
+  header->slotCount_ = slotCount;
+  header->chunkSize_ = chunkSize;
+  header->pageSize_ = GetPageSize();
+  header->maxObjectSize_ = GetMaxObjectSize();
+  header->objectAlignSize_ = GetAlignment();
+  header->maxBlocksPerChunk_ = GetMaxBlocksPerChunk();
+  header->sizeClassCount_ = GetSizeClassCount();
+  header->root_ = 0;
+  SlotRecord *records = GetRecords();
+  for (std::size_t ii = 0; ii < slotCount; ++ii) {
+    records[ii].sizeClass_ = FreeSlot;
+    records[ii].firstAvailable_ = 0;
+    records[ii].available_ = 0;
+  }
+  FindFreeSlots();
+  return true;
+}
+
+// SmallObjFileAllocator::Attach ----------------------------------------------
+
+bool SmallObjFileAllocator::Attach(const char *path, void *base) {
+  Detach();
+  if (!Open(path, 0, base, false))
+    return false;
+
+  const Header *header = GetHeader();
+  const std::size_t chunkSize = GetChunkSize();
+  const std::size_t slotCount = length_ / chunkSize;
+  const bool matches =
+      (0 == ::memcmp(header->magic_, FileMagic, sizeof(FileMagic))) &&
+      (FileVersion == header->version_) && (slotCount == header->slotCount_) &&
+      (0 < header->headerSlots_) && (header->headerSlots_ < slotCount) &&
+      (sizeof(Header) + slotCount * sizeof(SlotRecord) <=
+       header->headerSlots_ * chunkSize) &&
+      (chunkSize == header->chunkSize_) &&
+      (GetPageSize() == header->pageSize_) &&
+      (GetMaxObjectSize() == header->maxObjectSize_) &&
+      (GetAlignment() == header->objectAlignSize_) &&
+      (GetMaxBlocksPerChunk() == header->maxBlocksPerChunk_) &&
+      (GetSizeClassCount() == header->sizeClassCount_);
+  bool attached = matches;
+  if (attached) {
+    try {
+      freeSlots_.reserve(slotCount);
+    } catch (...) {
+      attached = false;
+    }
+  }
+
+  // Each Chunk is rebuilt from its record.  A second empty Chunk in a size
+  // class is released by AdoptChunk, which marks its record free.
+  const SlotRecord *records = GetRecords();
+  for (std::size_t ii = header->headerSlots_; attached && (ii < slotCount);
+       ++ii) {
+    if (FreeSlot == records[ii].sizeClass_)
+      continue;
+    SmallObjChunkState state;
+    state.sizeClass = records[ii].sizeClass_;
+    state.data = base_ + ii * chunkSize;
+    state.firstAvailable = records[ii].firstAvailable_;
+    state.available = records[ii].available_;
+    attached = AdoptChunk(state);
+  }
+  if (!attached) {
+    DiscardChunks();
+    Close();
+    freeSlots_.clear();
+    return false;
+  }
+  FindFreeSlots();
+  return true;
+}
+
+// SmallObjFileAllocator::Detach ----------------------------------------------
+
+void SmallObjFileAllocator::Detach(void) {
+  if (!IsAttached())
+    return;
+  DiscardChunks();
+  Close();
+  freeSlots_.clear();
+}
+
+// SmallObjFileAllocator::FindFreeSlots ---------------------------------------
+
+void SmallObjFileAllocator::FindFreeSlots(void) {
+  freeSlots_.clear();
+  const SlotRecord *records = GetRecords();
+  const std::size_t headerSlots = GetHeader()->headerSlots_;
+  // Taking the lowest slot first keeps the used part of the file compact.
+  for (std::size_t ii = length_ / GetChunkSize(); headerSlots < ii; --ii) {
+    if (FreeSlot == records[ii - 1].sizeClass_)
+      freeSlots_.push_back(ii - 1);
+  }
+}
+
+// SmallObjFileAllocator::AllocateChunk ---------------------------------------
+
+void *SmallObjFileAllocator::AllocateChunk(void) {
+  if (freeSlots_.empty())
+    return nullptr;
+  const std::size_t slot = freeSlots_.back();
+  freeSlots_.pop_back();
+  // The record is written once the first block is allocated from it.
+  return base_ + slot * GetChunkSize();
+}
+
+// SmallObjFileAllocator::DeallocateChunk -------------------------------------
+
+void SmallObjFileAllocator::DeallocateChunk(void *p) {
+  const std::size_t slot = GetSlot(p);
+  assert(GetHeader()->headerSlots_ <= slot);
+  assert(slot < length_ / GetChunkSize());
+  GetRecords()[slot].sizeClass_ = FreeSlot;
+  // This never reallocates, since room for every slot was reserved.
+  assert(freeSlots_.size() < freeSlots_.capacity());
+  freeSlots_.push_back(slot);
+}
+
+// SmallObjFileAllocator::Record ----------------------------------------------
+
+void SmallObjFileAllocator::Record(const void *p) {
+  SmallObjChunkState state;
+  // If the Chunk was released, DeallocateChunk already freed its record.
+  if (!GetChunkState(p, state))
+    return;
+  SlotRecord &record = GetRecords()[GetSlot(state.data)];
+  record.sizeClass_ = static_cast<std::uint32_t>(state.sizeClass);
+  record.firstAvailable_ = static_cast<std::uint16_t>(state.firstAvailable);
+  record.available_ = static_cast<std::uint16_t>(state.available);
+}
+
+// SmallObjFileAllocator::Allocate --------------------------------------------
+
+void *SmallObjFileAllocator::Allocate(std::size_t numBytes, bool doThrow) {
+  void *p = nullptr;
+  if (IsAttached() && (numBytes <= GetMaxObjectSize()))
+    p = SmallObjAllocator::Allocate(numBytes, false);
+  if (nullptr == p) {
+    if (doThrow)
+      throw std::bad_alloc();
+    return nullptr;
+  }
+  Record(p);
+  return p;
+}
+
+// SmallObjFileAllocator::Deallocate ------------------------------------------
+
+void SmallObjFileAllocator::Deallocate(void *p, std::size_t numBytes) {
+  if (nullptr == p)
+    return;
+  assert(HasBlock(p));
+  SmallObjAllocator::Deallocate(p, numBytes);
+  Record(p);
+}
+
+// SmallObjFileAllocator::Deallocate ------------------------------------------
+
+void SmallObjFileAllocator::Deallocate(void *p) {
+  if (nullptr == p)
+    return;
+  assert(HasBlock(p));
+  SmallObjAllocator::Deallocate(p);
+  Record(p);
+}
+
+// SmallObjFileAllocator::SetRoot ---------------------------------------------
+
+void SmallObjFileAllocator::SetRoot(void *p) {
+  assert(IsAttached());
+  assert((nullptr == p) || HasBlock(p));
+  GetHeader()->root_ =
+      (nullptr == p)
+          ? 0
+          : static_cast<std::uint64_t>(static_cast<unsigned char *>(p) -
+                                       base_);
+}
+
+// SmallObjFileAllocator::GetRoot ---------------------------------------------
+
+void *SmallObjFileAllocator::GetRoot(void) const {
+  if (!IsAttached() || (0 == GetHeader()->root_))
+    return nullptr;
+  return base_ + GetHeader()->root_;
+}
+
+// SmallObjFileAllocator::IsCorrupt -------------------------------------------
+
+bool SmallObjFileAllocator::IsCorrupt(void) const {
+  if (SmallObjAllocator::IsCorrupt())
+    return true;
+  if (!IsAttached())
+    return false;
+  const Header *header = GetHeader();
+  const std::size_t chunkSize = GetChunkSize();
+  const std::size_t slotCount = length_ / chunkSize;
+  if ((0 != ::memcmp(header->magic_, FileMagic, sizeof(FileMagic))) ||
+      (slotCount != header->slotCount_) ||
+      (slotCount <= header->headerSlots_)) {
+    assert(false);
+    return true;
+  }
+  if ((0 != header->root_) &&
+      ((header->root_ < header->headerSlots_ * chunkSize) ||
+       (length_ <= header->root_) ||
+       !HasBlock(base_ + header->root_))) {
+    assert(false);
+    return true;
+  }
+
+  std::vector<SmallObjChunkState> states;
+  try {
+    GetChunkStates(states);
+  } catch (...) {
+    // Can't check the records without the states, which is not corruption.
+    return false;
+  }
+  const SlotRecord *records = GetRecords();
+  for (std::size_t ii = 0; ii < states.size(); ++ii) {
+    const SmallObjChunkState &state = states[ii];
+    const unsigned char *data = static_cast<const unsigned char *>(state.data);
+    if ((data < base_ + header->headerSlots_ * chunkSize) ||
+        (base_ + length_ <= data) ||
+        (0 != static_cast<std::size_t>(data - base_) % chunkSize)) {
+      // A Chunk is outside the slots of the file.
+      assert(false);
+      return true;
+    }
+    const SlotRecord &record = records[GetSlot(data)];
+    if ((record.sizeClass_ != state.sizeClass) ||
+        (record.available_ != state.available) ||
+        ((0 < state.available) &&
+         (record.firstAvailable_ != state.firstAvailable))) {
+      // The record would not rebuild the Chunk as it is.
+      assert(false);
+      return true;
+    }
+  }
+  std::size_t usedSlots = 0;
+  for (std::size_t ii = header->headerSlots_; ii < slotCount; ++ii) {
+    if (FreeSlot != records[ii].sizeClass_)
+      ++usedSlots;
+  }
+  if ((usedSlots != states.size()) ||
+      (usedSlots + freeSlots_.size() + header->headerSlots_ != slotCount)) {
+    // A record is left over from a released Chunk, or a slot was lost.
+    assert(false);
+    return true;
+  }
+  for (std::size_t ii = 0; ii < freeSlots_.size(); ++ii) {
+    if (FreeSlot != records[freeSlots_[ii]].sizeClass_) {
+      assert(false);
+      return true;
+    }
+  }
+  return false;
+}
+
+#if defined(_WIN32)
+
+// SmallObjFileAllocator::Open ------------------------------------------------
+
+bool SmallObjFileAllocator::Open(const char *path, std::size_t length,
+                                 void *base, bool create) {
+  HANDLE file = ::CreateFileA(path, GENERIC_READ | GENERIC_WRITE,
+                              FILE_SHARE_READ, nullptr,
+                              create ? CREATE_ALWAYS : OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (INVALID_HANDLE_VALUE == file)
+    return false;
+  if (0 == length) {
+    LARGE_INTEGER size;
+    if (::GetFileSizeEx(file, &size) && (0 < size.QuadPart))
+      length = static_cast<std::size_t>(size.QuadPart);
+  }
+  const std::size_t chunkSize = GetChunkSize();
+  HANDLE mapping = nullptr;
+  if ((0 != length) && (0 == length % chunkSize)) {
+    const std::uint64_t size = length;
+    mapping = ::CreateFileMappingA(file, nullptr, PAGE_READWRITE,
+                                   static_cast<DWORD>(size >> 32),
+                                   static_cast<DWORD>(size), nullptr);
+  }
+  void *p = nullptr;
+  if ((nullptr != mapping) && (nullptr != base)) {
+    if (0 == (reinterpret_cast<std::uintptr_t>(base) & (chunkSize - 1)))
+      p = ::MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, length, base);
+  } else if (nullptr != mapping) {
+    // Views start on the allocation granularity, so a free range aligned on
+    // both is found, and the view mapped there, which may race with other
+    // threads mapping memory, so it is tried a few times.
+    SYSTEM_INFO info;
+    ::GetSystemInfo(&info);
+    std::size_t alignment = info.dwAllocationGranularity;
+    if (alignment < chunkSize)
+      alignment = chunkSize;
+    for (unsigned int tries = 0; (nullptr == p) && (tries < 8); ++tries) {
+      void *range = ::VirtualAlloc(nullptr, length + alignment, MEM_RESERVE,
+                                   PAGE_NOACCESS);
+      if (nullptr == range)
+        break;
+      const std::uintptr_t aligned =
+          (reinterpret_cast<std::uintptr_t>(range) + alignment - 1) &
+          ~static_cast<std::uintptr_t>(alignment - 1);
+      ::VirtualFree(range, 0, MEM_RELEASE);
+      p = ::MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, length,
+                            reinterpret_cast<void *>(aligned));
+    }
+  }
+  if (nullptr == p) {
+    if (nullptr != mapping)
+      ::CloseHandle(mapping);
+    ::CloseHandle(file);
+    return false;
+  }
+  base_ = static_cast<unsigned char *>(p);
+  length_ = length;
+  file_ = reinterpret_cast<std::intptr_t>(file);
+  mapping_ = mapping;
+  return true;
+}
+
+// SmallObjFileAllocator::Close -----------------------------------------------
+
+void SmallObjFileAllocator::Close(void) {
+  ::UnmapViewOfFile(base_);
+  ::CloseHandle(static_cast<HANDLE>(mapping_));
+  ::CloseHandle(reinterpret_cast<HANDLE>(file_));
+  base_ = nullptr;
+  length_ = 0;
+  file_ = -1;
+  mapping_ = nullptr;
+}
+
+// SmallObjFileAllocator::Sync ------------------------------------------------
+
+bool SmallObjFileAllocator::Sync(void) {
+  if (!IsAttached())
+    return false;
+  return ::FlushViewOfFile(base_, length_) &&
+         ::FlushFileBuffers(reinterpret_cast<HANDLE>(file_));
+}
+
+#else
+
+// SmallObjFileAllocator::Open ------------------------------------------------
+
+bool SmallObjFileAllocator::Open(const char *path, std::size_t length,
+                                 void *base, bool create) {
+  const int fd =
+      ::open(path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644);
+  if (fd < 0)
+    return false;
+  bool sized = false;
+  if (create) {
+    sized = (0 == ::ftruncate(fd, static_cast<off_t>(length)));
+  } else {
+    struct stat info;
+    if (0 == ::fstat(fd, &info)) {
+      length = static_cast<std::size_t>(info.st_size);
+      sized = true;
+    }
+  }
+  const std::size_t chunkSize = GetChunkSize();
+  if (!sized || (0 == length) || (0 != length % chunkSize)) {
+    ::close(fd);
+    return false;
+  }
+
+  void *p = MAP_FAILED;
+  if (nullptr != base) {
+    // Without MAP_FIXED, base is only a hint, so nothing already mapped
+    // there is replaced.  Any other address is refused.
+    if (0 == (reinterpret_cast<std::uintptr_t>(base) & (chunkSize - 1)))
+      p = ::mmap(base, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if ((MAP_FAILED != p) && (base != p)) {
+      ::munmap(p, length);
+      p = MAP_FAILED;
+    }
+  } else {
+    // Over-reserve so an aligned range fits inside, map the file over it,
+    // then unmap the excess.
+    const std::size_t reserved = length + chunkSize;
+    void *range = ::mmap(nullptr, reserved, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED != range) {
+      unsigned char *start = static_cast<unsigned char *>(range);
+      unsigned char *aligned = reinterpret_cast<unsigned char *>(
+          (reinterpret_cast<std::uintptr_t>(start) + chunkSize - 1) &
+          ~static_cast<std::uintptr_t>(chunkSize - 1));
+      p = ::mmap(aligned, length, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, 0);
+      if (MAP_FAILED == p) {
+        ::munmap(range, reserved);
+      } else {
+        const std::size_t head = static_cast<std::size_t>(aligned - start);
+        if (0 < head)
+          ::munmap(start, head);
+        if (head + length < reserved)
+          ::munmap(aligned + length, reserved - head - length);
+      }
+    }
+  }
+  if (MAP_FAILED == p) {
+    ::close(fd);
+    return false;
+  }
+  base_ = static_cast<unsigned char *>(p);
+  length_ = length;
+  file_ = fd;
+  return true;
+}
+
+// SmallObjFileAllocator::Close -----------------------------------------------
+
+void SmallObjFileAllocator::Close(void) {
+  ::munmap(base_, length_);
+  ::close(static_cast<int>(file_));
+  base_ = nullptr;
+  length_ = 0;
+  file_ = -1;
+}
+
+// SmallObjFileAllocator::Sync ------------------------------------------------
+
+bool SmallObjFileAllocator::Sync(void) {
+  if (!IsAttached())
+    return false;
+  return 0 == ::msync(base_, length_, MS_SYNC);
+}
+
+#endif
+
+} // end namespace Loki
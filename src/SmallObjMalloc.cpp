@@ -0,0 +1,586 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+////////////////////////////////////////////////////////////////////////////////
+
+// $Id$
+
+// ----------------------------------------------------------------------------
+
+/** @file SmallObjMalloc.cpp
+ Replaces malloc, free and operator new/delete of a whole program with the
+ small-object engine.  This file is not part of libloki; it is built into
+ libloki_malloc.so by "make build-malloc" in src, and used with
+ LD_PRELOAD=libloki_malloc.so to compare allocators on binaries which can't
+ be rebuilt.
+
+ Requests of up to LOKI_SMALLOBJ_MALLOC_MAX_SIZE bytes come from the size
+ classes of one SmallObjAllocator, under one lock.  Storage the allocator
+ needs for itself while it holds the lock, and small requests the pools
+ can't serve, come from a simple internal heap of power-of-two blocks.
+ Larger requests are mapped directly with mmap, behind a header which
+ remembers the mapping.  The Chunks themselves come from the mmap arena.
+ All state is constant-initialized and the allocator is made on first use,
+ so malloc works before any static initializer has run.  The lock is held
+ across fork, and remade in the child.
+ */
+
+#include <loki/SmallObj.h>
+
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef LOKI_SMALLOBJ_MALLOC_MAX_SIZE
+/// Largest request served by the pools.  Larger ones are mapped directly.
+#define LOKI_SMALLOBJ_MALLOC_MAX_SIZE 1024
+#endif
+
+#ifndef LOKI_SMALLOBJ_MALLOC_INTERNAL_MAX_SIZE
+/// Largest block the internal heap serves, a power of two.  Larger storage
+/// asked for by the allocator itself is mapped directly.
+#define LOKI_SMALLOBJ_MALLOC_INTERNAL_MAX_SIZE 65536
+#endif
+
+#ifndef LOKI_SMALLOBJ_MALLOC_PAGE_SIZE
+/// # of bytes from which the blocks per Chunk of each size class are found.
+#define LOKI_SMALLOBJ_MALLOC_PAGE_SIZE 4096
+#endif
+
+/// Everything else is built with hidden visibility, so this is all a
+/// program sees of the library.
+#define LOKI_MALLOC_EXPORT __attribute__((visibility("default")))
+
+namespace Loki {
+namespace Private {
+
+/// malloc must return storage suitably aligned for any type.
+const ::std::size_t MallocAlignment = 16;
+
+/** @class MallocAllocator
+    @ingroup SmallObjectGroupInternal
+ The allocator behind malloc.  It only exists to make the constructor of
+ SmallObjAllocator reachable.
+ */
+class MallocAllocator : public SmallObjAllocator {
+public:
+  MallocAllocator(void)
+      : SmallObjAllocator(LOKI_SMALLOBJ_MALLOC_PAGE_SIZE,
+                          LOKI_SMALLOBJ_MALLOC_MAX_SIZE, MallocAlignment) {}
+};
+
+/// Recursive, so the allocator may call malloc while it holds the lock.
+pthread_mutex_t mallocMutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/// # of times the thread holding mallocMutex has locked it.
+unsigned int mallocDepth = 0;
+
+/// Made in mallocStorage on first use, and never destroyed.
+MallocAllocator *mallocAllocator = nullptr;
+
+alignas(MallocAllocator) unsigned char mallocStorage[sizeof(MallocAllocator)];
+
+/** @class MallocLock
+    @ingroup SmallObjectGroupInternal
+ Locks mallocMutex, and tells whether this call came from inside the
+ allocator, in which case the allocator must not be used again.
+ */
+class MallocLock {
+public:
+  MallocLock(void) {
+    ::pthread_mutex_lock(&mallocMutex);
+    ++mallocDepth;
+  }
+
+  ~MallocLock(void) {
+    --mallocDepth;
+    ::pthread_mutex_unlock(&mallocMutex);
+  }
+
+  /// Returns the allocator, or nullptr if it is busy or can't be made.
+  MallocAllocator *GetAllocator(void);
+
+  /// Returns true if this call came from inside the allocator.
+  inline bool IsNested(void) const { return 1 < mallocDepth; }
+
+private:
+  /// Not implemented.
+  MallocLock(const MallocLock &);
+  /// Not implemented.
+  MallocLock &operator=(const MallocLock &);
+};
+
+// PrepareFork ----------------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+/// Holds the lock across fork, so the child never sees the pools mid-change.
+void PrepareFork(void) { ::pthread_mutex_lock(&mallocMutex); }
+
+// ParentAfterFork ------------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+void ParentAfterFork(void) { ::pthread_mutex_unlock(&mallocMutex); }
+
+// ChildAfterFork -------------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+/// Remakes the lock, since only the forking thread exists in the child.
+void ChildAfterFork(void) {
+  pthread_mutexattr_t attributes;
+  ::pthread_mutexattr_init(&attributes);
+  ::pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+  ::pthread_mutex_init(&mallocMutex, &attributes);
+  ::pthread_mutexattr_destroy(&attributes);
+  mallocDepth = 0;
+}
+
+// MallocLock::GetAllocator ---------------------------------------------------
+
+MallocAllocator *MallocLock::GetAllocator(void) {
+  if (1 < mallocDepth)
+    return nullptr;
+  if (nullptr == mallocAllocator) {
+    // Anything allocated from here on is mapped, since the lock is held.
+    ++mallocDepth;
+    try {
+      mallocAllocator = new (mallocStorage) MallocAllocator;
+      ::pthread_atfork(&PrepareFork, &ParentAfterFork, &ChildAfterFork);
+    } catch (...) {
+      mallocAllocator = nullptr;
+    }
+    --mallocDepth;
+  }
+  return mallocAllocator;
+}
+
+/** @struct MappedHeader
+    @ingroup SmallObjectGroupInternal
+ Placed right before each block mapped by MapBlock, or made by the internal
+ heap, in which case base_ is nullptr and length_ is the block's size.
+ */
+struct MappedHeader {
+  void *base_;
+  ::std::size_t length_;
+};
+
+/// # of bytes in front of each block for its MappedHeader.
+const ::std::size_t HeaderSize =
+    ((sizeof(MappedHeader) + MallocAlignment - 1) / MallocAlignment) *
+    MallocAlignment;
+
+/// # of bytes reserved at a time for the internal heap.
+const ::std::size_t InternalRangeSize =
+    16 * LOKI_SMALLOBJ_MALLOC_INTERNAL_MAX_SIZE;
+
+/// Freed blocks of the internal heap, one list per power of two.  Each
+/// block holds the address of the next one.
+void *internalFreeLists[sizeof(::std::size_t) * 8];
+
+/// Part of the latest internal range which no block has used yet.
+unsigned char *internalNext = nullptr;
+unsigned char *internalEnd = nullptr;
+
+// GetMappedHeader ------------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+inline MappedHeader *GetMappedHeader(void *p) {
+  return static_cast<MappedHeader *>(p) - 1;
+}
+
+// IsInternalBlock ------------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+/// Tells if a block which is not pooled came from the internal heap.
+inline bool IsInternalBlock(void *p) {
+  return nullptr == GetMappedHeader(p)->base_;
+}
+
+// InternalAllocate -----------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+/** Returns a block of at least size bytes, aligned on MallocAlignment, from
+ the internal heap, or nullptr.  Blocks are powers of two, carved from
+ ranges reserved with mmap, and are never unmapped, only reused.  When a
+ range can't hold the next block, the rest of it is left untouched, so it
+ takes address space but no memory.  mallocMutex must be held.
+ */
+void *InternalAllocate(::std::size_t size) {
+  assert(size <= LOKI_SMALLOBJ_MALLOC_INTERNAL_MAX_SIZE);
+  ::std::size_t blockSize = MallocAlignment;
+  unsigned int shift = 0;
+  while (blockSize < size) {
+    blockSize <<= 1;
+    ++shift;
+  }
+  void *p = internalFreeLists[shift];
+  if (nullptr != p) {
+    internalFreeLists[shift] = *static_cast<void **>(p);
+    return p;
+  }
+  const ::std::size_t length = HeaderSize + blockSize;
+  if (static_cast<::std::size_t>(internalEnd - internalNext) < length) {
+    void *range = ::mmap(nullptr, InternalRangeSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == range)
+      return nullptr;
+    internalNext = static_cast<unsigned char *>(range);
+    internalEnd = internalNext + InternalRangeSize;
+  }
+  p = internalNext + HeaderSize;
+  internalNext += length;
+  MappedHeader *header = GetMappedHeader(p);
+  header->base_ = nullptr;
+  header->length_ = blockSize;
+  return p;
+}
+
+// InternalDeallocate ---------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+/// Keeps a block of the internal heap for reuse.  mallocMutex must be held.
+void InternalDeallocate(void *p) {
+  unsigned int shift = 0;
+  while ((MallocAlignment << shift) < GetMappedHeader(p)->length_)
+    ++shift;
+  *static_cast<void **>(p) = internalFreeLists[shift];
+  internalFreeLists[shift] = p;
+}
+
+// MapBlock -------------------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+/// Maps a block of size bytes aligned on alignment, a power of two.
+void *MapBlock(::std::size_t size, ::std::size_t alignment) {
+  const ::std::size_t page =
+      static_cast<::std::size_t>(::sysconf(_SC_PAGESIZE));
+  const ::std::size_t offset =
+      (alignment < HeaderSize) ? HeaderSize : alignment;
+  // Alignments above a page need room to slide the block forward.
+  const ::std::size_t slack = (page < alignment) ? alignment : 0;
+  if (SIZE_MAX - offset - slack - page < size)
+    return nullptr;
+  const ::std::size_t length =
+      ((offset + slack + size + page - 1) / page) * page;
+  void *base = ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == base)
+    return nullptr;
+  ::std::uintptr_t p = reinterpret_cast<::std::uintptr_t>(base) + offset;
+  p = (p + alignment - 1) & ~(alignment - 1);
+  MappedHeader *header = reinterpret_cast<MappedHeader *>(p) - 1;
+  header->base_ = base;
+  header->length_ = length;
+  return reinterpret_cast<void *>(p);
+}
+
+// GetMappedSize --------------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+/// Returns # of usable bytes in a block made by MapBlock or the internal heap.
+inline ::std::size_t GetMappedSize(void *p) {
+  const MappedHeader *header = GetMappedHeader(p);
+  if (nullptr == header->base_)
+    return header->length_;
+  return header->length_ - static_cast<::std::size_t>(
+                               static_cast<unsigned char *>(p) -
+                               static_cast<unsigned char *>(header->base_));
+}
+
+// UnmapBlock -----------------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+inline void UnmapBlock(void *p) {
+  const MappedHeader *header = GetMappedHeader(p);
+  ::munmap(header->base_, header->length_);
+}
+
+// MallocAllocate -------------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+/// Returns a block of size bytes aligned on alignment, or nullptr.
+void *MallocAllocate(::std::size_t size, ::std::size_t alignment) {
+  if (0 == size)
+    size = 1;
+  if (alignment < MallocAlignment)
+    alignment = MallocAlignment;
+  if (size <= LOKI_SMALLOBJ_MALLOC_INTERNAL_MAX_SIZE) {
+    MallocLock lock;
+    MallocAllocator *allocator = lock.GetAllocator();
+    if ((nullptr != allocator) && (size <= LOKI_SMALLOBJ_MALLOC_MAX_SIZE)) {
+      // Blocks of a class are aligned on the lowest set bit of their size.
+      const ::std::size_t rounded = (size + alignment - 1) & ~(alignment - 1);
+      const ::std::size_t blockSize = (rounded <= LOKI_SMALLOBJ_MALLOC_MAX_SIZE)
+          ? allocator->GetBlockSize(allocator->GetSizeClass(rounded))
+          : 0;
+      if ((0 != blockSize) && (alignment <= (blockSize & (~blockSize + 1)))) {
+        void *p = allocator->Allocate(rounded, false);
+        if (nullptr != p)
+          return p;
+      }
+    }
+    // The allocator's own storage, and small blocks the pools can't serve,
+    // don't take a mapping each.
+    if ((alignment <= MallocAlignment) &&
+        ((size <= LOKI_SMALLOBJ_MALLOC_MAX_SIZE) || lock.IsNested())) {
+      void *p = InternalAllocate(size);
+      if (nullptr != p)
+        return p;
+    }
+  }
+  return MapBlock(size, alignment);
+}
+
+// MallocDeallocate -----------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+void MallocDeallocate(void *p) {
+  if (nullptr == p)
+    return;
+  {
+    MallocLock lock;
+    MallocAllocator *allocator = lock.GetAllocator();
+    // Storage freed from inside the allocator never came from the pools.
+    if ((nullptr != allocator) && allocator->HasBlock(p)) {
+      allocator->Deallocate(p);
+      return;
+    }
+    if (IsInternalBlock(p)) {
+      InternalDeallocate(p);
+      return;
+    }
+  }
+  UnmapBlock(p);
+}
+
+// MallocGetSize --------------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+/// Returns # of usable bytes in the block at p.
+::std::size_t MallocGetSize(void *p) {
+  {
+    MallocLock lock;
+    MallocAllocator *allocator = lock.GetAllocator();
+    const ::std::size_t size =
+        (nullptr == allocator) ? 0 : allocator->GetBlockSizeOf(p);
+    if (0 != size)
+      return size;
+  }
+  return GetMappedSize(p);
+}
+
+// MallocReallocate -----------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+void *MallocReallocate(void *p, ::std::size_t size) {
+  if (nullptr == p)
+    return MallocAllocate(size, MallocAlignment);
+  if (0 == size) {
+    MallocDeallocate(p);
+    return nullptr;
+  }
+  const ::std::size_t oldSize = MallocGetSize(p);
+  // Shrinking a pooled block, or a mapped one by less than half, is free.
+  if ((size <= oldSize) &&
+      ((oldSize <= LOKI_SMALLOBJ_MALLOC_MAX_SIZE) || (oldSize / 2 < size)))
+    return p;
+  void *q = MallocAllocate(size, MallocAlignment);
+  if (nullptr == q)
+    return nullptr;
+  ::std::memcpy(q, p, (size < oldSize) ? size : oldSize);
+  MallocDeallocate(p);
+  return q;
+}
+
+// IsPowerOfTwo ---------------------------------------------------------------
+/// @ingroup SmallObjectGroupInternal
+inline bool IsPowerOfTwo(::std::size_t n) {
+  return (0 != n) && (0 == (n & (n - 1)));
+}
+
+} // end namespace Private
+} // end namespace Loki
+
+using namespace ::Loki::Private;
+
+// malloc ---------------------------------------------------------------------
+
+extern "C" LOKI_MALLOC_EXPORT void *malloc(size_t size) noexcept {
+  void *p = MallocAllocate(size, MallocAlignment);
+  if (nullptr == p)
+    errno = ENOMEM;
+  return p;
+}
+
+// free -----------------------------------------------------------------------
+
+extern "C" LOKI_MALLOC_EXPORT void free(void *p) noexcept {
+  MallocDeallocate(p);
+}
+
+// calloc ---------------------------------------------------------------------
+
+extern "C" LOKI_MALLOC_EXPORT void *calloc(size_t count, size_t size) noexcept {
+  if ((0 != size) && (SIZE_MAX / size < count)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  const ::std::size_t total = count * size;
+  void *p = MallocAllocate(total, MallocAlignment);
+  if (nullptr == p)
+    errno = ENOMEM;
+  else if ((total <= LOKI_SMALLOBJ_MALLOC_MAX_SIZE) || IsInternalBlock(p))
+    // Other blocks are freshly mapped, so already zeroed.
+    ::std::memset(p, 0, total);
+  return p;
+}
+
+// realloc --------------------------------------------------------------------
+
+extern "C" LOKI_MALLOC_EXPORT void *realloc(void *p, size_t size) noexcept {
+  void *q = MallocReallocate(p, size);
+  if ((nullptr == q) && (0 != size))
+    errno = ENOMEM;
+  return q;
+}
+
+// reallocarray ---------------------------------------------------------------
+
+extern "C" LOKI_MALLOC_EXPORT void *reallocarray(void *p, size_t count,
+                                                 size_t size) noexcept {
+  if ((0 != size) && (SIZE_MAX / size < count)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  return realloc(p, count * size);
+}
+
+// posix_memalign -------------------------------------------------------------
+
+extern "C" LOKI_MALLOC_EXPORT int posix_memalign(void **result,
+                                                 size_t alignment,
+                                                 size_t size) noexcept {
+  if (!IsPowerOfTwo(alignment) || (0 != alignment % sizeof(void *)))
+    return EINVAL;
+  void *p = MallocAllocate(size, alignment);
+  if (nullptr == p)
+    return ENOMEM;
+  *result = p;
+  return 0;
+}
+
+// aligned_alloc --------------------------------------------------------------
+
+extern "C" LOKI_MALLOC_EXPORT void *aligned_alloc(size_t alignment,
+                                                  size_t size) noexcept {
+  if (!IsPowerOfTwo(alignment)) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  void *p = MallocAllocate(size, alignment);
+  if (nullptr == p)
+    errno = ENOMEM;
+  return p;
+}
+
+// memalign -------------------------------------------------------------------
+
+extern "C" LOKI_MALLOC_EXPORT void *memalign(size_t alignment,
+                                             size_t size) noexcept {
+  return aligned_alloc(alignment, size);
+}
+
+// valloc ---------------------------------------------------------------------
+
+extern "C" LOKI_MALLOC_EXPORT void *valloc(size_t size) noexcept {
+  return aligned_alloc(static_cast<::std::size_t>(::sysconf(_SC_PAGESIZE)),
+                       size);
+}
+
+// pvalloc --------------------------------------------------------------------
+
+extern "C" LOKI_MALLOC_EXPORT void *pvalloc(size_t size) noexcept {
+  const ::std::size_t page =
+      static_cast<::std::size_t>(::sysconf(_SC_PAGESIZE));
+  if (SIZE_MAX - page < size) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  return aligned_alloc(page, ((size + page - 1) / page) * page);
+}
+
+// malloc_usable_size ---------------------------------------------------------
+
+extern "C" LOKI_MALLOC_EXPORT size_t malloc_usable_size(void *p) noexcept {
+  return (nullptr == p) ? 0 : MallocGetSize(p);
+}
+
+// operator new ---------------------------------------------------------------
+
+LOKI_MALLOC_EXPORT void *operator new(::std::size_t size) {
+  for (;;) {
+    void *p = MallocAllocate(size, MallocAlignment);
+    if (nullptr != p)
+      return p;
+    ::std::new_handler handler = ::std::get_new_handler();
+    if (nullptr == handler)
+      throw ::std::bad_alloc();
+    handler();
+  }
+}
+
+LOKI_MALLOC_EXPORT void *operator new[](::std::size_t size) {
+  return ::operator new(size);
+}
+
+LOKI_MALLOC_EXPORT void *operator new(::std::size_t size,
+                                      const ::std::nothrow_t &) noexcept {
+  try {
+    return ::operator new(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+LOKI_MALLOC_EXPORT void *operator new[](::std::size_t size,
+                                        const ::std::nothrow_t &) noexcept {
+  try {
+    return ::operator new(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+// operator delete ------------------------------------------------------------
+
+LOKI_MALLOC_EXPORT void operator delete(void *p) noexcept {
+  MallocDeallocate(p);
+}
+
+LOKI_MALLOC_EXPORT void operator delete[](void *p) noexcept {
+  MallocDeallocate(p);
+}
+
+LOKI_MALLOC_EXPORT void operator delete(void *p,
+                                        const ::std::nothrow_t &) noexcept {
+  MallocDeallocate(p);
+}
+
+LOKI_MALLOC_EXPORT void operator delete[](void *p,
+                                          const ::std::nothrow_t &) noexcept {
+  MallocDeallocate(p);
+}
+
+// ----------------------------------------------------------------------------
@@ -0,0 +1,821 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+////////////////////////////////////////////////////////////////////////////////
+
+// $Id$
+
+// ----------------------------------------------------------------------------
+
+#include <loki/SmallObjShared.h>
+
+// Shared-memory segments and process-shared mutexes are POSIX only.
+#if !defined(_WIN32)
+
+#include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(EOWNERDEAD) && !defined(__APPLE__)
+/// Defined if a mutex can be taken over from a process which died with it.
+#define LOKI_SMALLOBJ_ROBUST_MUTEX
+#endif
+
+namespace Loki {
+
+/** @struct SmallObjSharedAllocator::Header
+ Start of the segment, followed by a ClassRecord for every size class and a
+ SlotRecord for every slot.
+ */
+struct SmallObjSharedAllocator::Header {
+  /// Tells a segment made by Create from any other.
+  char magic_[8];
+  /// Layout of the header and records.
+  std::uint32_t version_;
+  /// # of slots taken by the header and records.
+  std::uint32_t headerSlots_;
+  /// # of bytes in the segment.
+  std::uint64_t length_;
+  /// # of slots in the segment, including the header's.
+  std::uint32_t slotCount_;
+  std::uint32_t chunkSize_;
+  std::uint32_t maxObjectSize_;
+  std::uint32_t objectAlignSize_;
+  std::uint32_t classCount_;
+  /// First slot of the list of free slots, and # of slots on it.
+  std::uint32_t freeHead_;
+  std::uint32_t freeCount_;
+  std::uint32_t unused_;
+  /// Offset of the root block from the start of the segment, or zero.
+  std::uint64_t root_;
+  /// # of runs of slots ever allocated and deallocated.
+  std::uint64_t runAllocations_;
+  std::uint64_t runDeallocations_;
+  /// Guards everything in the segment.
+  pthread_mutex_t mutex_;
+};
+
+/** @struct SmallObjSharedAllocator::ClassRecord
+ Takes the place of a FixedAllocator for one size class.
+ */
+struct SmallObjSharedAllocator::ClassRecord {
+  std::uint32_t blockSize_;
+  std::uint32_t numBlocks_;
+  /// First slot of the list of partly used Chunks.
+  std::uint32_t partialHead_;
+  /// Slot of the one empty Chunk kept for reuse, or NoSlot.
+  std::uint32_t emptySlot_;
+  /// # of Chunks held now, and most ever held at once.
+  std::uint32_t chunks_;
+  std::uint32_t maxChunks_;
+  std::uint64_t allocations_;
+  std::uint64_t deallocations_;
+  std::uint64_t liveBlocks_;
+  std::uint64_t maxLiveBlocks_;
+};
+
+/** @struct SmallObjSharedAllocator::SlotRecord
+ State of one slot.  A slot with a Chunk is on the partial list of its
+ size class if it is partly used, and a free slot is on the free list.
+ */
+struct SmallObjSharedAllocator::SlotRecord {
+  /// Size class of the Chunk, or one of the states below.
+  std::uint32_t sizeClass_;
+  std::uint16_t firstAvailable_;
+  std::uint16_t available_;
+  /// Neighbors on the slot's list, or NoSlot.
+  std::uint32_t next_;
+  std::uint32_t prev_;
+  /// # of slots of a run, kept in the first one.
+  std::uint32_t run_;
+};
+
+namespace Private {
+
+static const char SharedMagic[8] = {'L', 'o', 'k', 'i', 'S', 'O', 'S', '1'};
+static const std::uint32_t SharedVersion = 1;
+/// End of a list of slots.
+static const std::uint32_t NoSlot = 0xFFFFFFFF;
+/// States of a slot which holds no Chunk.
+static const std::uint32_t UnusedSlot = 0xFFFFFFFF;
+static const std::uint32_t HeaderSlot = 0xFFFFFFFE;
+static const std::uint32_t RunHead = 0xFFFFFFFD;
+static const std::uint32_t RunTail = 0xFFFFFFFC;
+
+/// Returns the stealth index kept in a free block.
+inline std::uint16_t GetIndex(const unsigned char *block) {
+  std::uint16_t index;
+  ::memcpy(&index, block, sizeof(index));
+  return index;
+}
+
+/// Keeps a stealth index in a free block.
+inline void SetIndex(unsigned char *block, std::uint16_t index) {
+  ::memcpy(block, &index, sizeof(index));
+}
+
+} // end namespace Private
+
+using namespace ::Loki::Private;
+
+/** @class SmallObjSharedAllocator::SharedLock
+ Holds the mutex of a segment for its lifetime.  If the process which held
+ it died, the records may be half changed, so the mutex is taken over only
+ if they still agree.  Otherwise it is left unrecoverable, and this and
+ every later lock of the segment fails.
+ */
+class SmallObjSharedAllocator::SharedLock {
+public:
+  explicit SharedLock(const SmallObjSharedAllocator &allocator)
+      : mutex_(allocator.GetHeader()->mutex_), locked_(false) {
+    const int result = ::pthread_mutex_lock(&mutex_);
+#ifdef LOKI_SMALLOBJ_ROBUST_MUTEX
+    if (EOWNERDEAD == result) {
+      if (allocator.HasCorruptRecords()) {
+        ::pthread_mutex_unlock(&mutex_);
+        return;
+      }
+      ::pthread_mutex_consistent(&mutex_);
+    } else if (0 != result)
+      return;
+#else
+    if (0 != result)
+      return;
+#endif
+    locked_ = true;
+  }
+
+  ~SharedLock(void) {
+    if (locked_)
+      ::pthread_mutex_unlock(&mutex_);
+  }
+
+  /// Returns false if the segment was given up, after its owner died.
+  inline bool IsLocked(void) const { return locked_; }
+
+private:
+  /// Not implemented.
+  SharedLock(const SharedLock &);
+  /// Not implemented.
+  SharedLock &operator=(const SharedLock &);
+
+  pthread_mutex_t &mutex_;
+  bool locked_;
+};
+
+// SmallObjSharedAllocator::SmallObjSharedAllocator ---------------------------
+
+SmallObjSharedAllocator::SmallObjSharedAllocator(void)
+    : base_(nullptr), length_(0) {}
+
+// SmallObjSharedAllocator::~SmallObjSharedAllocator --------------------------
+
+SmallObjSharedAllocator::~SmallObjSharedAllocator(void) { Detach(); }
+
+// SmallObjSharedAllocator::GetClasses ----------------------------------------
+
+SmallObjSharedAllocator::ClassRecord *
+SmallObjSharedAllocator::GetClasses(void) const {
+  return reinterpret_cast<ClassRecord *>(base_ + sizeof(Header));
+}
+
+// SmallObjSharedAllocator::GetSlots ------------------------------------------
+
+SmallObjSharedAllocator::SlotRecord *
+SmallObjSharedAllocator::GetSlots(void) const {
+  return reinterpret_cast<SlotRecord *>(
+      base_ + sizeof(Header) + GetHeader()->classCount_ * sizeof(ClassRecord));
+}
+
+// SmallObjSharedAllocator::GetSlot -------------------------------------------
+
+std::uint32_t SmallObjSharedAllocator::GetSlot(const void *p) const {
+  const std::size_t offset =
+      static_cast<std::size_t>(static_cast<const unsigned char *>(p) - base_);
+  assert(offset < length_);
+  return static_cast<std::uint32_t>(offset / GetHeader()->chunkSize_);
+}
+
+// SmallObjSharedAllocator::GetMaxObjectSize ----------------------------------
+
+std::size_t SmallObjSharedAllocator::GetMaxObjectSize(void) const {
+  return IsAttached() ? GetHeader()->maxObjectSize_ : 0;
+}
+
+// SmallObjSharedAllocator::GetAlignment --------------------------------------
+
+std::size_t SmallObjSharedAllocator::GetAlignment(void) const {
+  return IsAttached() ? GetHeader()->objectAlignSize_ : 0;
+}
+
+// SmallObjSharedAllocator::GetChunkSize --------------------------------------
+
+std::size_t SmallObjSharedAllocator::GetChunkSize(void) const {
+  return IsAttached() ? GetHeader()->chunkSize_ : 0;
+}
+
+// SmallObjSharedAllocator::Map -----------------------------------------------
+
+bool SmallObjSharedAllocator::Map(int fd, std::size_t length, void *base) {
+  // Without MAP_FIXED, base is only a hint, so nothing already mapped there
+  // is replaced.  Any other address is refused.
+  void *p = ::mmap(base, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (MAP_FAILED == p)
+    return false;
+  if ((nullptr != base) && (base != p)) {
+    ::munmap(p, length);
+    return false;
+  }
+  base_ = static_cast<unsigned char *>(p);
+  length_ = length;
+  return true;
+}
+
+// SmallObjSharedAllocator::Create --------------------------------------------
+
+bool SmallObjSharedAllocator::Create(const char *name, std::size_t length,
+                                     std::size_t maxObjectSize,
+                                     std::size_t objectAlignSize,
+                                     std::size_t chunkSize, void *base) {
+  Detach();
+  const std::size_t pageSize =
+      static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+  if ((objectAlignSize < 2) ||
+      (0 != (objectAlignSize & (objectAlignSize - 1))) ||
+      (0 == chunkSize) || (0 != chunkSize % pageSize) ||
+      (UINT_MAX < chunkSize) || (0 == maxObjectSize) ||
+      (chunkSize < maxObjectSize))
+    return false;
+  const std::size_t classCount =
+      (maxObjectSize + objectAlignSize - 1) / objectAlignSize;
+  const std::size_t slotCount = length / chunkSize;
+  const std::size_t bookkeeping = sizeof(Header) +
+                                  classCount * sizeof(ClassRecord) +
+                                  slotCount * sizeof(SlotRecord);
+  const std::size_t headerSlots = (bookkeeping + chunkSize - 1) / chunkSize;
+  if ((slotCount <= headerSlots) || (RunTail <= slotCount))
+    return false;
+
+  ::shm_unlink(name);
+  const int fd = ::shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    return false;
+  length = slotCount * chunkSize;
+  const bool mapped = (0 == ::ftruncate(fd, static_cast<off_t>(length))) &&
+                      Map(fd, length, base);
+  ::close(fd);
+  if (!mapped) {
+    ::shm_unlink(name);
+    return false;
+  }
+
+  Header *header = GetHeader();
+  ::memcpy(header->magic_, SharedMagic, sizeof(SharedMagic));
+  header->version_ = SharedVersion;
+  header->headerSlots_ = static_cast<std::uint32_t>(headerSlots);
+  header->length_ = length;
+  header->slotCount_ = static_cast<std::uint32_t>(slotCount);
+  header->chunkSize_ = static_cast<std::uint32_t>(chunkSize);
+  header->maxObjectSize_ = static_cast<std::uint32_t>(maxObjectSize);
+  header->objectAlignSize_ = static_cast<std::uint32_t>(objectAlignSize);
+  header->classCount_ = static_cast<std::uint32_t>(classCount);
+  header->freeHead_ = NoSlot;
+  header->freeCount_ = 0;
+  header->unused_ = 0;
+  header->root_ = 0;
+  header->runAllocations_ = 0;
+  header->runDeallocations_ = 0;
+
+  pthread_mutexattr_t attributes;
+  ::pthread_mutexattr_init(&attributes);
+  ::pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+#ifdef LOKI_SMALLOBJ_ROBUST_MUTEX
+  ::pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+#endif
+  const int made = ::pthread_mutex_init(&header->mutex_, &attributes);
+  ::pthread_mutexattr_destroy(&attributes);
+  if (0 != made) {
+    Detach();
+    ::shm_unlink(name);
+    return false;
+  }
+
+  ClassRecord *classes = GetClasses();
+  for (std::size_t c = 0; c < classCount; ++c) {
+    ClassRecord &record = classes[c];
+    const std::size_t blockSize = (c + 1) * objectAlignSize;
+    std::size_t numBlocks = chunkSize / blockSize;
+    if (USHRT_MAX < numBlocks)
+      numBlocks = USHRT_MAX;
+    record.blockSize_ = static_cast<std::uint32_t>(blockSize);
+    record.numBlocks_ = static_cast<std::uint32_t>(numBlocks);
+    record.partialHead_ = NoSlot;
+    record.emptySlot_ = NoSlot;
+    record.chunks_ = 0;
+    record.maxChunks_ = 0;
+    record.allocations_ = 0;
+    record.deallocations_ = 0;
+    record.liveBlocks_ = 0;
+    record.maxLiveBlocks_ = 0;
+  }
+  SlotRecord *slots = GetSlots();
+  for (std::size_t ii = 0; ii < slotCount; ++ii) {
+    slots[ii].sizeClass_ = (ii < headerSlots) ? HeaderSlot : UnusedSlot;
+    slots[ii].firstAvailable_ = 0;
+    slots[ii].available_ = 0;
+    slots[ii].next_ = NoSlot;
+    slots[ii].prev_ = NoSlot;
+    slots[ii].run_ = 0;
+  }
+  // Linked from the top down, so the lowest slots are used first.
+  for (std::size_t ii = slotCount; headerSlots < ii; --ii)
+    Link(header->freeHead_, static_cast<std::uint32_t>(ii - 1));
+  header->freeCount_ = static_cast<std::uint32_t>(slotCount - headerSlots);
+  return true;
+}
+
+// SmallObjSharedAllocator::Attach --------------------------------------------
+
+bool SmallObjSharedAllocator::Attach(const char *name, void *base) {
+  Detach();
+  const int fd = ::shm_open(name, O_RDWR, 0600);
+  if (fd < 0)
+    return false;
+  struct stat info;
+  const bool mapped =
+      (0 == ::fstat(fd, &info)) &&
+      (sizeof(Header) <= static_cast<std::size_t>(info.st_size)) &&
+      Map(fd, static_cast<std::size_t>(info.st_size), base);
+  ::close(fd);
+  if (!mapped)
+    return false;
+  const Header *header = GetHeader();
+  if ((0 != ::memcmp(header->magic_, SharedMagic, sizeof(SharedMagic))) ||
+      (SharedVersion != header->version_) || (length_ != header->length_) ||
+      (0 == header->chunkSize_) ||
+      (static_cast<std::uint64_t>(header->slotCount_) * header->chunkSize_ !=
+       length_)) {
+    Detach();
+    return false;
+  }
+  return true;
+}
+
+// SmallObjSharedAllocator::Detach --------------------------------------------
+
+void SmallObjSharedAllocator::Detach(void) {
+  if (!IsAttached())
+    return;
+  ::munmap(base_, length_);
+  base_ = nullptr;
+  length_ = 0;
+}
+
+// SmallObjSharedAllocator::Remove --------------------------------------------
+
+bool SmallObjSharedAllocator::Remove(const char *name) {
+  return 0 == ::shm_unlink(name);
+}
+
+// SmallObjSharedAllocator::Link ----------------------------------------------
+
+void SmallObjSharedAllocator::Link(std::uint32_t &head, std::uint32_t slot) {
+  SlotRecord *slots = GetSlots();
+  slots[slot].prev_ = NoSlot;
+  slots[slot].next_ = head;
+  if (NoSlot != head)
+    slots[head].prev_ = slot;
+  head = slot;
+}
+
+// SmallObjSharedAllocator::Unlink --------------------------------------------
+
+void SmallObjSharedAllocator::Unlink(std::uint32_t &head, std::uint32_t slot) {
+  SlotRecord *slots = GetSlots();
+  SlotRecord &record = slots[slot];
+  if (NoSlot == record.prev_) {
+    assert(head == slot);
+    head = record.next_;
+  } else
+    slots[record.prev_].next_ = record.next_;
+  if (NoSlot != record.next_)
+    slots[record.next_].prev_ = record.prev_;
+  record.next_ = NoSlot;
+  record.prev_ = NoSlot;
+}
+
+// SmallObjSharedAllocator::AllocateBlock -------------------------------------
+
+void *SmallObjSharedAllocator::AllocateBlock(std::size_t c) {
+  Header *header = GetHeader();
+  ClassRecord &cls = GetClasses()[c];
+  SlotRecord *slots = GetSlots();
+  std::uint32_t slot = cls.partialHead_;
+  if (NoSlot == slot) {
+    slot = cls.emptySlot_;
+    cls.emptySlot_ = NoSlot;
+    if (NoSlot == slot) {
+      if (NoSlot == header->freeHead_) {
+        // Take back the empty Chunks kept by other size classes.
+        ClassRecord *classes = GetClasses();
+        for (std::uint32_t ii = 0; ii < header->classCount_; ++ii) {
+          const std::uint32_t empty = classes[ii].emptySlot_;
+          if (NoSlot == empty)
+            continue;
+          classes[ii].emptySlot_ = NoSlot;
+          --classes[ii].chunks_;
+          slots[empty].sizeClass_ = UnusedSlot;
+          Link(header->freeHead_, empty);
+          ++header->freeCount_;
+        }
+        if (NoSlot == header->freeHead_)
+          return nullptr;
+      }
+      slot = header->freeHead_;
+      Unlink(header->freeHead_, slot);
+      --header->freeCount_;
+      unsigned char *data = base_ + std::size_t(slot) * header->chunkSize_;
+      for (std::uint32_t ii = 0; ii < cls.numBlocks_; ++ii)
+        SetIndex(data + std::size_t(ii) * cls.blockSize_,
+                 static_cast<std::uint16_t>(ii + 1));
+      slots[slot].sizeClass_ = static_cast<std::uint32_t>(c);
+      slots[slot].firstAvailable_ = 0;
+      slots[slot].available_ = static_cast<std::uint16_t>(cls.numBlocks_);
+      if (cls.maxChunks_ < ++cls.chunks_)
+        cls.maxChunks_ = cls.chunks_;
+    }
+    Link(cls.partialHead_, slot);
+  }
+
+  SlotRecord &record = slots[slot];
+  assert(0 < record.available_);
+  unsigned char *block = base_ + std::size_t(slot) * header->chunkSize_ +
+                         std::size_t(record.firstAvailable_) * cls.blockSize_;
+  record.firstAvailable_ = GetIndex(block);
+  if (0 == --record.available_)
+    Unlink(cls.partialHead_, slot);
+  ++cls.allocations_;
+  if (cls.maxLiveBlocks_ < ++cls.liveBlocks_)
+    cls.maxLiveBlocks_ = cls.liveBlocks_;
+  return block;
+}
+
+// SmallObjSharedAllocator::AllocateRun ---------------------------------------
+
+void *SmallObjSharedAllocator::AllocateRun(std::size_t numBytes) {
+  Header *header = GetHeader();
+  SlotRecord *slots = GetSlots();
+  const std::size_t count = (numBytes + header->chunkSize_ - 1) /
+                            header->chunkSize_;
+  if (header->freeCount_ < count)
+    return nullptr;
+  std::size_t found = 0;
+  std::uint32_t ii = header->headerSlots_;
+  for (; (ii < header->slotCount_) && (found < count); ++ii)
+    found = (UnusedSlot == slots[ii].sizeClass_) ? found + 1 : 0;
+  if (found < count)
+    return nullptr;
+
+  const std::uint32_t start = static_cast<std::uint32_t>(ii - count);
+  for (std::uint32_t jj = start; jj < ii; ++jj) {
+    Unlink(header->freeHead_, jj);
+    slots[jj].sizeClass_ = RunTail;
+  }
+  slots[start].sizeClass_ = RunHead;
+  slots[start].run_ = static_cast<std::uint32_t>(count);
+  header->freeCount_ -= static_cast<std::uint32_t>(count);
+  ++header->runAllocations_;
+  return base_ + std::size_t(start) * header->chunkSize_;
+}
+
+// SmallObjSharedAllocator::DeallocateBlock -----------------------------------
+
+void SmallObjSharedAllocator::DeallocateBlock(void *p) {
+  Header *header = GetHeader();
+  SlotRecord *slots = GetSlots();
+  const std::uint32_t slot = GetSlot(p);
+  SlotRecord &record = slots[slot];
+  unsigned char *data = base_ + std::size_t(slot) * header->chunkSize_;
+
+  if (RunHead == record.sizeClass_) {
+    assert(data == p);
+    const std::uint32_t count = record.run_;
+    for (std::uint32_t ii = slot + count; slot < ii; --ii) {
+      slots[ii - 1].sizeClass_ = UnusedSlot;
+      slots[ii - 1].run_ = 0;
+      Link(header->freeHead_, ii - 1);
+    }
+    header->freeCount_ += count;
+    ++header->runDeallocations_;
+    return;
+  }
+
+  assert(record.sizeClass_ < header->classCount_);
+  ClassRecord &cls = GetClasses()[record.sizeClass_];
+  unsigned char *block = static_cast<unsigned char *>(p);
+  const std::size_t offset = static_cast<std::size_t>(block - data);
+  assert(0 == offset % cls.blockSize_);
+  const bool wasFull = (0 == record.available_);
+  SetIndex(block, record.firstAvailable_);
+  record.firstAvailable_ = static_cast<std::uint16_t>(offset / cls.blockSize_);
+  ++record.available_;
+  ++cls.deallocations_;
+  --cls.liveBlocks_;
+
+  if (cls.numBlocks_ == record.available_) {
+    if (!wasFull)
+      Unlink(cls.partialHead_, slot);
+    // One empty Chunk is kept, so a block going back and forth doesn't
+    // make and release a Chunk each time.
+    if (NoSlot == cls.emptySlot_) {
+      cls.emptySlot_ = slot;
+    } else {
+      record.sizeClass_ = UnusedSlot;
+      Link(header->freeHead_, slot);
+      ++header->freeCount_;
+      --cls.chunks_;
+    }
+  } else if (wasFull)
+    Link(cls.partialHead_, slot);
+}
+
+// SmallObjSharedAllocator::Allocate ------------------------------------------
+
+void *SmallObjSharedAllocator::Allocate(std::size_t numBytes, bool doThrow) {
+  void *p = nullptr;
+  if (IsAttached()) {
+    Header *header = GetHeader();
+    SharedLock lock(*this);
+    if (!lock.IsLocked())
+      p = nullptr;
+    else if (numBytes <= header->maxObjectSize_) {
+      const std::size_t c =
+          (0 == numBytes) ? 0 : (numBytes - 1) / header->objectAlignSize_;
+      p = AllocateBlock(c);
+    } else
+      p = AllocateRun(numBytes);
+  }
+  if ((nullptr == p) && doThrow)
+    throw std::bad_alloc();
+  return p;
+}
+
+// SmallObjSharedAllocator::Deallocate ----------------------------------------
+
+void SmallObjSharedAllocator::Deallocate(void *p, std::size_t numBytes) {
+  if (nullptr == p)
+    return;
+  assert(HasBlock(p));
+  (void)numBytes;
+  SharedLock lock(*this);
+  if (lock.IsLocked())
+    DeallocateBlock(p);
+}
+
+// SmallObjSharedAllocator::Deallocate ----------------------------------------
+
+void SmallObjSharedAllocator::Deallocate(void *p) {
+  if (nullptr == p)
+    return;
+  assert(HasBlock(p));
+  SharedLock lock(*this);
+  if (lock.IsLocked())
+    DeallocateBlock(p);
+}
+
+// SmallObjSharedAllocator::HasBlock ------------------------------------------
+
+bool SmallObjSharedAllocator::HasBlock(const void *p) const {
+  const unsigned char *pc = static_cast<const unsigned char *>(p);
+  if (!IsAttached() || (pc < base_) || (base_ + length_ <= pc))
+    return false;
+  const Header *header = GetHeader();
+  const std::uint32_t slot = GetSlot(p);
+  const std::size_t offset = static_cast<std::size_t>(pc - base_) -
+                             std::size_t(slot) * header->chunkSize_;
+  SharedLock lock(*this);
+  if (!lock.IsLocked())
+    return false;
+  const SlotRecord &record = GetSlots()[slot];
+  if (RunHead == record.sizeClass_)
+    return 0 == offset;
+  if (header->classCount_ <= record.sizeClass_)
+    return false;
+  const ClassRecord &cls = GetClasses()[record.sizeClass_];
+  return (0 == offset % cls.blockSize_) &&
+         (offset / cls.blockSize_ < cls.numBlocks_);
+}
+
+// SmallObjSharedAllocator::SetRoot -------------------------------------------
+
+void SmallObjSharedAllocator::SetRoot(void *p) {
+  assert(IsAttached());
+  assert((nullptr == p) || HasBlock(p));
+  SharedLock lock(*this);
+  if (!lock.IsLocked())
+    return;
+  GetHeader()->root_ =
+      (nullptr == p)
+          ? 0
+          : static_cast<std::uint64_t>(static_cast<unsigned char *>(p) -
+                                       base_);
+}
+
+// SmallObjSharedAllocator::GetRoot -------------------------------------------
+
+void *SmallObjSharedAllocator::GetRoot(void) const {
+  if (!IsAttached())
+    return nullptr;
+  SharedLock lock(*this);
+  if (!lock.IsLocked())
+    return nullptr;
+  const std::uint64_t root = GetHeader()->root_;
+  return (0 == root) ? nullptr : base_ + root;
+}
+
+// SmallObjSharedAllocator::GetStats ------------------------------------------
+
+void SmallObjSharedAllocator::GetStats(SmallObjStats &stats) const {
+  stats.sizeClasses.clear();
+  stats.fallbackAllocations = 0;
+  stats.fallbackDeallocations = 0;
+  stats.bytesReserved = 0;
+  stats.bytesInUse = 0;
+  if (!IsAttached())
+    return;
+  const Header *header = GetHeader();
+  SharedLock lock(*this);
+  if (!lock.IsLocked())
+    return;
+  stats.sizeClasses.resize(header->classCount_);
+  const ClassRecord *classes = GetClasses();
+  for (std::uint32_t c = 0; c < header->classCount_; ++c) {
+    const ClassRecord &cls = classes[c];
+    SmallObjSizeClassStats &s = stats.sizeClasses[c];
+    s.blockSize = cls.blockSize_;
+    s.blocksPerChunk = cls.numBlocks_;
+    s.allocations = cls.allocations_;
+    s.deallocations = cls.deallocations_;
+    s.liveBlocks = static_cast<std::size_t>(cls.liveBlocks_);
+    s.maxLiveBlocks = static_cast<std::size_t>(cls.maxLiveBlocks_);
+    s.chunks = cls.chunks_;
+    s.emptyChunks = (NoSlot == cls.emptySlot_) ? 0 : 1;
+    s.maxChunks = cls.maxChunks_;
+    s.bytesReserved = s.chunks * s.blocksPerChunk * s.blockSize;
+    s.bytesInUse = s.liveBlocks * s.blockSize;
+    stats.bytesReserved += s.bytesReserved;
+    stats.bytesInUse += s.bytesInUse;
+  }
+  stats.fallbackAllocations = header->runAllocations_;
+  stats.fallbackDeallocations = header->runDeallocations_;
+}
+
+// SmallObjSharedAllocator::IsCorrupt -----------------------------------------
+
+bool SmallObjSharedAllocator::IsCorrupt(void) const {
+  if (!IsAttached())
+    return false;
+  const Header *header = GetHeader();
+  if ((0 != ::memcmp(header->magic_, SharedMagic, sizeof(SharedMagic))) ||
+      (header->slotCount_ <= header->headerSlots_)) {
+    assert(false);
+    return true;
+  }
+  SharedLock lock(*this);
+  // A segment given up after its owner died counts as corrupt.
+  if (!lock.IsLocked())
+    return true;
+  const bool corrupt = HasCorruptRecords();
+  assert(!corrupt);
+  return corrupt;
+}
+
+// SmallObjSharedAllocator::HasCorruptRecords ---------------------------------
+
+bool SmallObjSharedAllocator::HasCorruptRecords(void) const {
+  const Header *header = GetHeader();
+  const ClassRecord *classes = GetClasses();
+  const SlotRecord *slots = GetSlots();
+  const std::uint32_t slotCount = header->slotCount_;
+
+  // Every slot, and every free block of every Chunk.
+  std::vector<std::uint32_t> chunks(header->classCount_, 0);
+  std::vector<std::uint64_t> liveBlocks(header->classCount_, 0);
+  std::vector<bool> seen;
+  std::uint32_t freeSlots = 0;
+  for (std::uint32_t ii = 0; ii < slotCount; ++ii) {
+    const SlotRecord &record = slots[ii];
+    const std::uint32_t state = record.sizeClass_;
+    if ((ii < header->headerSlots_) != (HeaderSlot == state)) {
+      return true;
+    }
+    if (HeaderSlot == state)
+      continue;
+    if (UnusedSlot == state) {
+      ++freeSlots;
+      continue;
+    }
+    if (RunHead == state) {
+      if ((0 == record.run_) || (slotCount - ii < record.run_)) {
+          return true;
+      }
+      for (std::uint32_t jj = 1; jj < record.run_; ++jj) {
+        if (RunTail != slots[ii + jj].sizeClass_) {
+              return true;
+        }
+      }
+      ii += record.run_ - 1;
+      continue;
+    }
+    if (header->classCount_ <= state) {
+      // A stray RunTail, or garbage.
+      return true;
+    }
+    const ClassRecord &cls = classes[state];
+    if (cls.numBlocks_ < record.available_) {
+      return true;
+    }
+    ++chunks[state];
+    liveBlocks[state] += cls.numBlocks_ - record.available_;
+    seen.assign(cls.numBlocks_, false);
+    const unsigned char *data = base_ + std::size_t(ii) * header->chunkSize_;
+    std::uint32_t index = record.firstAvailable_;
+    for (std::uint32_t jj = 0; jj < record.available_; ++jj) {
+      if ((cls.numBlocks_ <= index) || seen[index]) {
+        // The free blocks of a Chunk are linked out of range, or in a loop.
+          return true;
+      }
+      seen[index] = true;
+      index = GetIndex(data + std::size_t(index) * cls.blockSize_);
+    }
+  }
+
+  // The free list holds exactly the free slots.
+  std::uint32_t onList = 0;
+  for (std::uint32_t slot = header->freeHead_; NoSlot != slot;
+       slot = slots[slot].next_) {
+    if ((slotCount <= slot) || (UnusedSlot != slots[slot].sizeClass_) ||
+        (freeSlots < ++onList)) {
+      return true;
+    }
+  }
+  if ((onList != freeSlots) || (header->freeCount_ != freeSlots)) {
+    return true;
+  }
+
+  // The partial list of each class holds exactly its partly used Chunks.
+  for (std::uint32_t c = 0; c < header->classCount_; ++c) {
+    const ClassRecord &cls = classes[c];
+    if ((cls.chunks_ != chunks[c]) || (cls.liveBlocks_ != liveBlocks[c])) {
+      return true;
+    }
+    std::uint32_t partial = 0;
+    for (std::uint32_t slot = cls.partialHead_; NoSlot != slot;
+         slot = slots[slot].next_) {
+      if ((slotCount <= slot) || (c != slots[slot].sizeClass_) ||
+          (0 == slots[slot].available_) ||
+          (cls.numBlocks_ == slots[slot].available_) ||
+          (chunks[c] < ++partial)) {
+          return true;
+      }
+    }
+    if ((NoSlot != cls.emptySlot_) &&
+        ((slotCount <= cls.emptySlot_) ||
+         (c != slots[cls.emptySlot_].sizeClass_) ||
+         (cls.numBlocks_ != slots[cls.emptySlot_].available_))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+} // end namespace Loki
+
+#endif
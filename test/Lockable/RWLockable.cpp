@@ -0,0 +1,191 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+// The authors make no representations about the suitability of this software
+// for any purpose. It is provided "as is" without express or implied warranty.
+////////////////////////////////////////////////////////////////////////////////
+
+// $Id$
+
+// Checks ObjectLevelRWLockable and ClassLevelRWLockable, over std::shared_mutex
+// and WriterPreferringRWMutex: readers share the lock, a writer holds it
+// alone, and with WriterPreferringRWMutex a writer gets in although readers
+// keep coming.
+//
+// Then measures lookups in a read-mostly table with 1 to 8 threads, under
+// ObjectLevelLockable's Lock against ObjectLevelRWLockable's ReadLock.
+
+#include <loki/Threads.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static const unsigned int ReaderCount = 4;
+static const chrono::milliseconds HoldTime(2);
+
+/// Two values which writers change together, so readers can tell if they
+/// ever saw a write half done.
+template <template <class, class> class ThreadingModel, class MutexPolicy>
+class Pair : public ThreadingModel<Pair<ThreadingModel, MutexPolicy>,
+                                   MutexPolicy> {
+public:
+  typedef ThreadingModel<Pair, MutexPolicy> Model;
+
+  Pair()
+      : first_(0), second_(0), readers_(0), mostReaders_(0), torn_(false),
+        writes_(0) {}
+
+  void Read() {
+    typename Model::ReadLock lock(*this);
+    const unsigned int readers = ++readers_;
+    if (mostReaders_ < readers)
+      mostReaders_ = readers;
+    this_thread::sleep_for(HoldTime);
+    if (first_ != second_)
+      torn_ = true;
+    --readers_;
+  }
+
+  void Write() {
+    typename Model::WriteLock lock(*this);
+    if (0 != readers_)
+      torn_ = true;
+    ++first_;
+    this_thread::sleep_for(HoldTime);
+    ++second_;
+    ++writes_;
+  }
+
+  unsigned int GetMostReaders() const { return mostReaders_; }
+  bool IsTorn() const { return torn_; }
+  unsigned int GetWrites() const { return writes_; }
+
+private:
+  unsigned int first_;
+  unsigned int second_;
+  atomic<unsigned int> readers_;
+  atomic<unsigned int> mostReaders_;
+  atomic<bool> torn_;
+  atomic<unsigned int> writes_;
+};
+
+/// With reads 0, readers read until the writer has done its writes, so the
+/// writer must get in while readers hold the lock or wait for it.
+template <template <class, class> class ThreadingModel, class MutexPolicy>
+bool TestModel(const char *name, unsigned int reads, unsigned int writes) {
+  Pair<ThreadingModel, MutexPolicy> pair;
+  atomic<bool> done(false);
+  vector<thread> readers;
+  for (unsigned int ii = 0; ii < ReaderCount; ++ii)
+    readers.push_back(thread([&pair, &done, reads]() {
+      for (unsigned int jj = 0; (0 == reads) ? !done : (jj < reads); ++jj)
+        pair.Read();
+    }));
+  // Let the readers pile up first.
+  this_thread::sleep_for(10 * HoldTime);
+  for (unsigned int ii = 0; ii < writes; ++ii)
+    pair.Write();
+  done = true;
+  for (unsigned int ii = 0; ii < readers.size(); ++ii)
+    readers[ii].join();
+
+  const bool r = (1 < pair.GetMostReaders()) && !pair.IsTorn() &&
+                 (writes == pair.GetWrites());
+  cout << name << ": " << pair.GetMostReaders() << " readers at once, "
+       << pair.GetWrites() << " writes: " << (r ? "passed" : "FAILED")
+       << endl;
+  return r;
+}
+
+// ----------------------------------------------------------------------------
+
+static const unsigned int LookupsPerThread = 2 * 1000 * 1000;
+static const int TableSize = 200;
+
+/// A read-mostly table, such as a factory's map from ids to creators.
+template <class Lockable, class Lock> class Table : public Lockable {
+public:
+  Table() : table_() {
+    for (int ii = 0; ii < TableSize; ++ii)
+      table_[ii] = ii;
+  }
+
+  int Find(int key) const {
+    Lock lock(*this);
+    map<int, int>::const_iterator it = table_.find(key);
+    return (table_.end() == it) ? -1 : it->second;
+  }
+
+private:
+  map<int, int> table_;
+};
+
+struct Locked;
+struct Shared;
+
+typedef Table<Loki::ObjectLevelLockable<Locked>,
+              Loki::ObjectLevelLockable<Locked>::Lock>
+    LockedTable;
+typedef Table<Loki::ObjectLevelRWLockable<Shared>,
+              Loki::ObjectLevelRWLockable<Shared>::ReadLock>
+    SharedTable;
+
+template <class T>
+void Lookup(const T *table, unsigned int lookups, unsigned long *sum) {
+  unsigned long s = 0;
+  for (unsigned int ii = 0; ii < lookups; ++ii)
+    s += static_cast<unsigned long>(
+        table->Find(static_cast<int>(ii % TableSize)));
+  *sum = s;
+}
+
+/// Returns ns per lookup with threadCount threads looking up at once.
+template <class T> double Measure(const T &table, unsigned int threadCount) {
+  vector<thread> threads;
+  vector<unsigned long> sums(threadCount, 0);
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (unsigned int ii = 0; ii < threadCount; ++ii)
+    threads.push_back(thread(&Lookup<T>, &table,
+                             LookupsPerThread / threadCount, &sums[ii]));
+  for (unsigned int ii = 0; ii < threadCount; ++ii)
+    threads[ii].join();
+  const chrono::duration<double, nano> elapsed =
+      chrono::steady_clock::now() - start;
+  return elapsed.count() / LookupsPerThread;
+}
+
+// ----------------------------------------------------------------------------
+
+int main() {
+  bool r = true;
+  // std::shared_mutex may let readers starve a writer for as long as they
+  // keep coming, so there the readers stop after a while.
+  r = TestModel<Loki::ObjectLevelRWLockable, LOKI_DEFAULT_RW_MUTEX>(
+          "object level, default", 25, 20) &&
+      r;
+  r = TestModel<Loki::ClassLevelRWLockable, LOKI_DEFAULT_RW_MUTEX>(
+          "class level, default", 25, 20) &&
+      r;
+  r = TestModel<Loki::ObjectLevelRWLockable, Loki::WriterPreferringRWMutex>(
+          "object level, writer preferring", 0, 20) &&
+      r;
+  r = TestModel<Loki::ClassLevelRWLockable, Loki::WriterPreferringRWMutex>(
+          "class level, writer preferring", 0, 20) &&
+      r;
+
+  const LockedTable locked;
+  const SharedTable shared;
+  cout << "threads\tns/lookup Lock\tns/lookup ReadLock" << endl;
+  for (unsigned int threadCount = 1; threadCount <= 8; threadCount *= 2) {
+    const double l = Measure(locked, threadCount);
+    const double s = Measure(shared, threadCount);
+    cout << threadCount << '\t' << l << "\t\t" << s << endl;
+  }
+  return r ? 0 : 1;
+}
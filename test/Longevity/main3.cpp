@@ -0,0 +1,104 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+// The authors make no representations about the suitability of this software
+// for any purpose. It is provided "as is" without express or implied warranty.
+////////////////////////////////////////////////////////////////////////////////
+
+// $Id$
+
+// Gives a longevity to many objects, as a program with many plugins might,
+// and checks they die in order of longevity, and of registration for equal
+// longevities, last first.
+//
+// Adding each object should cost about the same however many there are
+// already, so the time per object is printed for growing counts.
+//
+// A destroyer which throws as SetLongevity copies it must leave the object
+// alone and the rest of the objects unaffected.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+#include <loki/Singleton.h>
+
+using namespace std;
+
+static const unsigned int Count = 200 * 1000;
+static const unsigned int Longevities = 1000;
+
+static unsigned int destroyed = 0;
+static unsigned int lastLongevity = 0;
+static unsigned int lastOrder = 0;
+static bool inOrder = true;
+
+struct Plugin {
+  Plugin(unsigned int longevity, unsigned int order)
+      : longevity_(longevity), order_(order) {}
+
+  ~Plugin() {
+    if (0 < destroyed)
+      inOrder = inOrder && ((lastLongevity < longevity_) ||
+                            ((lastLongevity == longevity_) &&
+                             (order_ < lastOrder)));
+    lastLongevity = longevity_;
+    lastOrder = order_;
+    ++destroyed;
+  }
+
+  unsigned int longevity_;
+  unsigned int order_;
+};
+
+/// Throws when copied, so its tracker can't be made.
+struct ThrowingDestroyer {
+  ThrowingDestroyer() {}
+  ThrowingDestroyer(const ThrowingDestroyer &) { throw 1; }
+  void operator()(int *) const {}
+};
+
+/// Registered before any longevity, so it runs after all of them died.
+static void Check() {
+  const bool r = inOrder && (Count == destroyed);
+  cout << destroyed << " destroyed in order: " << (r ? "passed" : "FAILED")
+       << endl;
+  if (!r)
+    _Exit(1);
+}
+
+int main() {
+  atexit(&Check);
+
+  unsigned int threw = 0;
+  int orphan = 0;
+  const ThrowingDestroyer throwing;
+  for (unsigned int ii = 0; ii < 100; ++ii) {
+    try {
+      Loki::SetLongevity(&orphan, 0, throwing);
+    } catch (int) {
+      ++threw;
+    }
+  }
+  const bool r = (100 == threw) && (0 == orphan);
+  cout << "throwing destroyer: " << (r ? "passed" : "FAILED") << endl;
+  if (!r)
+    return 1;
+
+  cout << "objects\tns/SetLongevity" << endl;
+  unsigned int order = 0;
+  for (unsigned int batch = Count / 16; order < Count; batch *= 2) {
+    if (Count - order < batch)
+      batch = Count - order;
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (unsigned int ii = 0; ii < batch; ++ii, ++order) {
+      // Scatter the longevities, so most objects go in the middle.
+      const unsigned int longevity = (order * 7919) % Longevities;
+      Loki::SetLongevity(new Plugin(longevity, order), longevity);
+    }
+    const chrono::duration<double, nano> elapsed =
+        chrono::steady_clock::now() - start;
+    cout << order << '\t' << elapsed.count() / batch << endl;
+  }
+  return 0;
+}
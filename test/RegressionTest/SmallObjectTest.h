@@ -16,8 +16,15 @@
 // $Id$
 
 
+#include <cstdio>
 #include <cstdlib>
+#include <sstream>
+#include <stdexcept>
 #include <loki/SmallObj.h>
+#include <loki/SmallObjFile.h>
+#include <loki/SmallObjShared.h>
+#include <loki/Allocator.h>
+#include <algorithm>
 #include "UnitTest.h"
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -62,9 +69,40 @@ public:
 
     bool test=buff!=NULL;
 
+    bool wideTest=wide_test();
+
+    bool statsTest=stats_test();
+
+    bool batchTest=batch_test();
+
+    bool sizeClassTest=size_class_test();
+
+    bool trimTest=trim_test();
+
+    bool regionTest=region_test();
+
+    bool typedTest=typed_test();
+
+    bool phoenixTypedTest=phoenix_typed_test();
+
+    bool alignedTest=aligned_test();
+
+    bool partialTest=partial_test();
+
+    bool profileTest=profile_test();
+
+    bool fileTest=file_test();
+
+    bool sharedTest=shared_test();
+
+    bool tagTest=tag_test();
+
 //    stress_test();
 
-    r=smallTest1 && smallTest2 && bigTest1 && bigTest2 && test;
+    r=smallTest1 && smallTest2 && bigTest1 && bigTest2 && test && wideTest && statsTest &&
+      batchTest && sizeClassTest && trimTest && regionTest && typedTest &&
+      phoenixTypedTest && alignedTest && partialTest && profileTest && fileTest && sharedTest &&
+      tagTest;
 
     testAssert("SmallObject",r,result);
 
@@ -92,6 +130,109 @@ private:
     int b;
   };
 
+  class WideClass : public Loki::SmallObject<LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL,
+    64 * 1024, LOKI_MAX_SMALL_OBJECT_SIZE, LOKI_DEFAULT_OBJECT_ALIGNMENT,
+    LOKI_DEFAULT_SMALLOBJ_LIFETIME, LOKI_DEFAULT_MUTEX, unsigned short>
+  {
+    int a[2];
+  };
+
+  typedef Loki::AllocatorSingleton<LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL,
+    4096, 64, 8, Loki::NoDestroy> StatsAllocator;
+
+  typedef Loki::AllocatorSingleton<LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL,
+    4096, 64, 8, Loki::NoDestroy, LOKI_DEFAULT_MUTEX, unsigned short>
+    BatchAllocator;
+
+  typedef Loki::AllocatorSingleton<LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL,
+    4096, 4096, 8, Loki::NoDestroy> BigAllocator;
+
+  typedef Loki::AllocatorSingleton<LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL,
+    4096, 32, 8, Loki::NoDestroy> TrimAllocator;
+
+  class RegionNode : public Loki::SmallObject<Loki::RegionLockable,
+    4096, 64, 8, Loki::NoDestroy>
+  {
+  public:
+    RegionNode* next;
+    int value;
+  };
+  typedef RegionNode::ObjAllocatorSingleton RegionAllocator;
+
+  class TypedNode : public Loki::SmallObjectOf<TypedNode,
+    LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL, 4096, 64, 8, Loki::NoDestroy>
+  {
+    int a[3];
+  };
+
+  class TypedNode2 : public TypedNode
+  {
+    int b[6];
+  };
+  typedef TypedNode::ObjAllocatorSingleton TypedAllocator;
+
+  class PhoenixNode : public Loki::SmallObjectOf<PhoenixNode,
+    LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL, 4096, 64, 8,
+    Loki::DeletableSingleton>
+  {
+    int a[3];
+  };
+  typedef PhoenixNode::ObjAllocatorSingleton PhoenixAllocator;
+
+  typedef Loki::AllocatorSingleton<LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL,
+    4096, 256, 8, Loki::NoDestroy> AlignedAllocator;
+
+  typedef Loki::AllocatorSingleton<LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL,
+    4096, 48, 8, Loki::NoDestroy> PartialAllocator;
+
+#ifdef LOKI_HAS_ALIGNED_NEW
+  class alignas(64) AlignedNode : public Loki::SmallObject<
+    LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL, 4096, 256, 8, Loki::NoDestroy>
+  {
+  public:
+    int a[3];
+  };
+#endif
+
+  struct CacheSubsystem
+  {
+    static const char* GetName() { return "cache"; }
+  };
+
+  struct SchedulerSubsystem
+  {
+    static const char* GetName() { return "scheduler"; }
+  };
+
+  class CacheEntry : public Loki::SmallObject<LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL,
+    4096, 64, 8, Loki::NoDestroy, LOKI_DEFAULT_MUTEX,
+    LOKI_DEFAULT_CHUNK_INDEX_TYPE, Loki::SmallObjTag<CacheSubsystem> >
+  {
+    int a[5];
+  };
+
+  class CacheBlob : public CacheEntry
+  {
+    char b[100];
+  };
+
+  class FailedBlob : public CacheEntry
+  {
+  public:
+    FailedBlob() { throw std::runtime_error("FailedBlob"); }
+  private:
+    char b[100];
+  };
+
+  class Task : public Loki::SmallObjectOf<Task,
+    LOKI_DEFAULT_THREADING_NO_OBJ_LEVEL, 4096, 64, 8, Loki::NoDestroy,
+    LOKI_DEFAULT_MUTEX, LOKI_DEFAULT_CHUNK_INDEX_TYPE,
+    Loki::SmallObjHeapTag<SchedulerSubsystem> >
+  {
+    int a[3];
+  };
+  typedef Task::ObjAllocatorSingleton TaskAllocator;
+
   class Base
   {
   public:
@@ -118,6 +259,571 @@ private:
     int a[4];
   };
 
+  // Fills a Chunk which uses 16-bit stealth indexes well past UCHAR_MAX
+  // blocks, then frees every other block before freeing the rest.
+  static bool wide_test()
+  {
+    std::vector<WideClass*> vec(4 * 1024);
+
+    for (size_t i = 0; i < vec.size(); ++i)
+      vec[i] = new WideClass;
+
+    for (size_t i = 0; i < vec.size(); i += 2)
+      delete vec[i];
+
+    for (size_t i = 0; i < vec.size(); i += 2)
+      vec[i] = new WideClass;
+
+    for (size_t i = 0; i < vec.size(); ++i)
+      delete vec[i];
+
+    return !WideClass::ObjAllocatorSingleton::IsCorrupted();
+  }
+
+  // Checks the counters kept for one size class and for fallbacks.
+  static bool stats_test()
+  {
+    Loki::SmallObjAllocator &allocator = StatsAllocator::Instance();
+    std::vector<void*> vec(300);
+
+    for (size_t i = 0; i < vec.size(); ++i)
+      vec[i] = allocator.Allocate(24, true);
+    for (size_t i = 100; i < vec.size(); ++i)
+      allocator.Deallocate(vec[i], 24);
+    void* big = allocator.Allocate(100, true);
+    allocator.Deallocate(big, 100);
+
+    Loki::SmallObjStats stats = StatsAllocator::GetStats();
+    const Loki::SmallObjSizeClassStats &sc = stats.sizeClasses[2];
+    bool r = (8 == stats.sizeClasses.size()) && (24 == sc.blockSize) &&
+      (300 == sc.allocations) && (200 == sc.deallocations) &&
+      (100 == sc.liveBlocks) && (300 == sc.maxLiveBlocks) &&
+      (2 <= sc.maxChunks) && (100 * 24 == sc.bytesInUse) &&
+      (sc.chunks * sc.blocksPerChunk * 24 == sc.bytesReserved) &&
+      (1 == stats.fallbackAllocations) && (1 == stats.fallbackDeallocations) &&
+      (stats.bytesInUse == sc.bytesInUse);
+
+    for (size_t i = 0; i < 100; ++i)
+      allocator.Deallocate(vec[i], 24);
+    StatsAllocator::ClearExtraMemory();
+    stats = StatsAllocator::GetStats();
+    r = r && (0 == stats.sizeClasses[2].liveBlocks) &&
+      (0 == stats.sizeClasses[2].chunks) && (0 == stats.bytesReserved);
+
+    std::ostringstream json;
+    stats.WriteJson(json);
+    r = r && (0 == json.str().find("{\"bytesReserved\":0,"));
+
+    return r && !StatsAllocator::IsCorrupted();
+  }
+
+  // Allocates and frees many blocks at once, in two size classes.
+  static bool batch_test()
+  {
+    std::vector<void*> vec(1000);
+    bool r = (vec.size() ==
+      BatchAllocator::AllocateBatch(40, &vec[0], vec.size()));
+    std::vector<void*> sorted(vec);
+    std::sort(sorted.begin(), sorted.end());
+    r = r && (sorted.end() == std::unique(sorted.begin(), sorted.end())) &&
+      (nullptr != sorted.front());
+    r = r && (1000 == BatchAllocator::GetStats().sizeClasses[4].liveBlocks);
+    BatchAllocator::DeallocateBatch(&vec[0], vec.size(), 40);
+
+    r = r && (10 == BatchAllocator::AllocateBatch(sizeof(double), &vec[0], 10));
+    BatchAllocator::DeallocateBatch(&vec[0], 10, sizeof(double));
+
+    Loki::SmallObjStats stats = BatchAllocator::GetStats();
+    r = r && (1000 == stats.sizeClasses[4].allocations) &&
+      (0 == stats.sizeClasses[4].liveBlocks) &&
+      (10 == stats.sizeClasses[0].allocations) &&
+      (0 == stats.sizeClasses[0].liveBlocks);
+
+    return r && !BatchAllocator::IsCorrupted();
+  }
+
+  // Objects up to 4 KB need only a few dozen geometric size classes, and
+  // each class wastes at most a quarter of its blocks to rounding.
+  static bool size_class_test()
+  {
+    Loki::SmallObjAllocator &allocator = BigAllocator::Instance();
+    bool r = (allocator.GetSizeClassCount() < 64);
+    for (std::size_t size = 1; r && (size <= 4096); ++size)
+    {
+      const std::size_t sizeClass = allocator.GetSizeClass(size);
+      const std::size_t blockSize = allocator.GetBlockSize(sizeClass);
+      r = (size <= blockSize) && (0 == blockSize % 8) &&
+        ((blockSize <= 64) || (blockSize - size < blockSize / 4)) &&
+        ((0 == sizeClass) || (allocator.GetBlockSize(sizeClass - 1) < size));
+    }
+
+    std::vector<void*> vec;
+    for (std::size_t size = 100; size <= 4096; size += 100)
+      vec.push_back(allocator.Allocate(size, true));
+    for (std::size_t i = 0; i < vec.size(); ++i)
+      allocator.Deallocate(vec[i], 100 * (i + 1));
+
+    Loki::SmallObjStats stats = BigAllocator::GetStats();
+    return r && (0 == stats.fallbackAllocations) && (0 == stats.bytesInUse) &&
+      !BigAllocator::IsCorrupted();
+  }
+
+  // Emptied Chunks are kept as spares, and then released a few at a time.
+  static bool trim_test()
+  {
+    Loki::SmallObjAllocator &allocator = TrimAllocator::Instance();
+    TrimAllocator::SetIncrementalTrim(true, 2);
+    std::vector<void*> vec(10 * 255);
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+      for (size_t i = 0; i < vec.size(); ++i)
+        vec[i] = allocator.Allocate(16, true);
+      for (size_t i = 0; i < vec.size(); ++i)
+        allocator.Deallocate(vec[i], 16);
+    }
+
+    // The second pass reused the Chunks of the first.
+    Loki::SmallObjStats stats = TrimAllocator::GetStats();
+    const Loki::SmallObjSizeClassStats &sc = stats.sizeClasses[1];
+    bool r = (255 == sc.blocksPerChunk) && (10 == sc.chunks) &&
+      (10 == sc.emptyChunks) && (10 == sc.maxChunks) &&
+      !TrimAllocator::IsCorrupted();
+
+    r = r && (3 == TrimAllocator::Trim(3));
+    r = r && (7 == TrimAllocator::GetStats().sizeClasses[1].chunks);
+    r = r && (5 == TrimAllocator::Trim(100));
+    r = r && (0 == TrimAllocator::Trim(100));
+    r = r && (2 == TrimAllocator::GetStats().sizeClasses[1].emptyChunks);
+
+    TrimAllocator::ClearExtraMemory();
+    stats = TrimAllocator::GetStats();
+    return r && (0 == stats.bytesReserved) && !TrimAllocator::IsCorrupted();
+  }
+
+  // Nodes made in a region bypass the pools, and die with the region.
+  static bool region_test()
+  {
+    const std::size_t sizeClass =
+      RegionAllocator::Instance().GetSizeClass(sizeof(RegionNode));
+    RegionNode* outside = new RegionNode;
+    bool r = (1 == RegionAllocator::GetStats().sizeClasses[sizeClass].liveBlocks);
+
+    {
+      Loki::SmallObjRegion<RegionAllocator> region;
+      RegionNode* head = NULL;
+      for (int pass = 0; pass < 2; ++pass)
+      {
+        for (int i = 0; i < 5000; ++i)
+        {
+          RegionNode* node = new RegionNode;
+          node->next = head;
+          node->value = i;
+          head = node;
+        }
+        r = r && (0 == reinterpret_cast<std::size_t>(head) % 8) &&
+          (4999 == head->value) && (4997 == head->next->next->value);
+        while (NULL != head)
+        {
+          RegionNode* next = head->next;
+          delete head;
+          head = next;
+        }
+        region.Reset();
+      }
+
+      {
+        Loki::SmallObjRegion<RegionAllocator> inner;
+        head = new RegionNode;
+        r = r && inner.Contains(head) && !region.Contains(head) &&
+          !inner.Contains(outside);
+        delete head;
+      }
+      delete outside;
+    }
+
+    Loki::SmallObjStats stats = RegionAllocator::GetStats();
+    return r && (1 == stats.sizeClasses[sizeClass].allocations) &&
+      (0 == stats.bytesInUse) && !RegionAllocator::IsCorrupted();
+  }
+
+  static bool typed_test()
+  {
+    const std::size_t sizeClass =
+      TypedAllocator::Instance().GetSizeClass(sizeof(TypedNode));
+    const std::size_t sizeClass2 =
+      TypedAllocator::Instance().GetSizeClass(sizeof(TypedNode2));
+    std::vector<TypedNode*> nodes;
+    for (int i = 0; i < 1000; ++i)
+      nodes.push_back(new TypedNode);
+    for (int i = 0; i < 10; ++i)
+      nodes.push_back(new TypedNode2);
+    nodes.push_back(new (std::nothrow) TypedNode);
+
+    Loki::SmallObjStats stats = TypedAllocator::GetStats();
+    bool r = (sizeClass != sizeClass2) &&
+      (1001 == stats.sizeClasses[sizeClass].liveBlocks) &&
+      (10 == stats.sizeClasses[sizeClass2].liveBlocks);
+
+    for (std::size_t i = 0; i < nodes.size(); ++i)
+      delete nodes[i];
+    stats = TypedAllocator::GetStats();
+    return r && (0 == stats.bytesInUse) && !TypedAllocator::IsCorrupted();
+  }
+
+  /// The allocator is made again at the same address, so the pool which
+  /// SmallObjectOf kept from the first one must not be used.
+  static bool phoenix_typed_test()
+  {
+    delete new PhoenixNode;
+    Loki::DeletableSingleton<PhoenixAllocator>::GracefulDelete();
+
+    PhoenixNode* node = new PhoenixNode;
+    const std::size_t sizeClass =
+      PhoenixAllocator::Instance().GetSizeClass(sizeof(PhoenixNode));
+    Loki::SmallObjStats stats = PhoenixAllocator::GetStats();
+    bool r = PhoenixAllocator::Instance().HasBlock(node) &&
+      (1 == stats.sizeClasses[sizeClass].liveBlocks);
+    delete node;
+    stats = PhoenixAllocator::GetStats();
+    return r && (0 == stats.bytesInUse) && !PhoenixAllocator::IsCorrupted();
+  }
+
+  static bool aligned_test()
+  {
+    bool r = (24 == AlignedAllocator::GetAlignedSize(24, 8)) &&
+      (0 == AlignedAllocator::GetAlignedSize(24, 24)) &&
+      (0 == AlignedAllocator::GetAlignedSize(300, 8)) &&
+      (0 == AlignedAllocator::GetAlignedSize(8, 8192));
+
+    const std::size_t alignments[] = { 8, 16, 32, 64, 128 };
+    std::vector<void*> blocks;
+    std::vector<std::size_t> sizes;
+    for (std::size_t i = 0; i < sizeof(alignments) / sizeof(alignments[0]); ++i)
+    {
+      for (std::size_t size = 1; size <= 256; size += 7)
+      {
+        const std::size_t bytes =
+          AlignedAllocator::GetAlignedSize(size, alignments[i]);
+        if (0 == bytes)
+          continue;
+        r = r && (size <= bytes) && (0 == bytes % alignments[i]);
+        void* p = AlignedAllocator::Instance().Allocate(bytes, true);
+        r = r && (0 == reinterpret_cast<std::size_t>(p) % alignments[i]);
+        blocks.push_back(p);
+        sizes.push_back(bytes);
+      }
+    }
+    for (std::size_t i = 0; i < blocks.size(); ++i)
+      AlignedAllocator::Instance().Deallocate(blocks[i], sizes[i]);
+
+#ifdef LOKI_HAS_ALIGNED_NEW
+    typedef AlignedNode::ObjAllocatorSingleton NodeAllocator;
+    std::vector<AlignedNode*> nodes;
+    for (int i = 0; i < 100; ++i)
+      nodes.push_back(new AlignedNode);
+    nodes.push_back(new (std::nothrow) AlignedNode);
+    for (std::size_t i = 0; i < nodes.size(); ++i)
+      r = r && (0 == reinterpret_cast<std::size_t>(nodes[i]) % 64);
+    Loki::SmallObjStats stats = NodeAllocator::GetStats();
+    r = r && (101 * sizeof(AlignedNode) == stats.bytesInUse);
+    for (std::size_t i = 0; i < nodes.size(); ++i)
+      delete nodes[i];
+    r = r && (0 == NodeAllocator::GetStats().bytesInUse) &&
+      !NodeAllocator::IsCorrupted();
+#endif
+
+    return r && (0 == AlignedAllocator::GetStats().bytesInUse) &&
+      !AlignedAllocator::IsCorrupted();
+  }
+
+  // Frees many blocks from one Chunk and one block from another, and checks
+  // the next block comes from the fuller of the two.
+  static bool partial_test()
+  {
+    Loki::SmallObjAllocator& allocator = PartialAllocator::Instance();
+    const std::size_t sizeClass = allocator.GetSizeClass(16);
+    const std::size_t perChunk =
+      PartialAllocator::GetStats().sizeClasses[sizeClass].blocksPerChunk;
+    std::vector<void*> vec(8 * perChunk);
+    for (std::size_t i = 0; i < vec.size(); ++i)
+      vec[i] = allocator.Allocate(16, true);
+
+    bool r = (8 == PartialAllocator::GetStats().sizeClasses[sizeClass].chunks);
+    for (std::size_t i = 0; i < perChunk - 10; ++i)
+    {
+      allocator.Deallocate(vec[perChunk + i], 16);
+      vec[perChunk + i] = NULL;
+    }
+    void* lonely = vec[5 * perChunk + 7];
+    allocator.Deallocate(lonely, 16);
+    vec[5 * perChunk + 7] = NULL;
+    r = r && !PartialAllocator::IsCorrupted();
+
+    void* p = allocator.Allocate(16, true);
+    r = r && (lonely == p);
+    allocator.Deallocate(p, 16);
+
+    for (std::size_t i = 0; i < vec.size(); ++i)
+      allocator.Deallocate(vec[i], 16);
+    return r && (0 == PartialAllocator::GetStats().bytesInUse) &&
+      !PartialAllocator::IsCorrupted();
+  }
+
+  // Feeds samples to the heap profiler directly, since sampling is off.
+  static bool profile_test()
+  {
+    Loki::SmallObjProfiler& profiler = StatsAllocator::GetProfiler();
+    bool r = (LOKI_SMALLOBJ_SAMPLE_INTERVAL == profiler.GetInterval()) &&
+      (&profiler == &StatsAllocator::GetProfiler());
+    profiler.SetInterval(1000);
+
+    Loki::SmallObjAllocator& allocator = StatsAllocator::Instance();
+    void* small = allocator.Allocate(24, true);
+    void* big = allocator.Allocate(1000, true);
+    r = r && (0 < profiler.Sample(small, 24)) &&
+      (0 < profiler.Sample(big, 1000)) && profiler.MayHold(small) &&
+      (2 == profiler.GetLiveSampleCount());
+
+    std::ostringstream text;
+    profiler.WriteText(text);
+    r = r && (std::string::npos != text.str().find("live samples: 2"));
+
+    profiler.Release(small);
+    profiler.Release(small);
+    r = r && (1 == profiler.GetLiveSampleCount()) &&
+      (1 == profiler.GetFreedSampleCount());
+
+    std::ostringstream pprof;
+    profiler.WritePprof(pprof);
+    r = r && (0 == pprof.str().find("heap profile: 1: 1000 [2: 1024] @ heap_v2/1000\n"));
+
+    profiler.SetInterval(0);
+    r = r && (0 < profiler.Sample(small, 24)) &&
+      (1 == profiler.GetLiveSampleCount());
+    profiler.Clear();
+    r = r && (0 == profiler.GetLiveSampleCount()) && !profiler.MayHold(big);
+    profiler.SetInterval(LOKI_SMALLOBJ_SAMPLE_INTERVAL);
+
+    allocator.Deallocate(small, 24);
+    allocator.Deallocate(big, 1000);
+    return r && !StatsAllocator::IsCorrupted();
+  }
+
+  struct FileNode
+  {
+    Loki::OffsetPtr<FileNode> next;
+    int value;
+  };
+
+  // Builds a list in a file, attaches to the file again, and checks the
+  // list and the records of its Chunks came back.
+  static bool file_test()
+  {
+    const char* path = "SmallObjectTest.heap";
+    bool r = true;
+    {
+      Loki::SmallObjFileAllocator allocator(4096, 64, 8);
+      r = allocator.Create(path, 64 * 4096) && allocator.IsAttached() &&
+        (NULL == allocator.GetRoot()) &&
+        (NULL == allocator.Allocate(65, false));
+      FileNode* head = NULL;
+      for (int i = 0; r && (i < 1000); ++i)
+      {
+        FileNode* node =
+          static_cast<FileNode*>(allocator.Allocate(sizeof(FileNode), true));
+        node->next = head;
+        node->value = i;
+        head = node;
+      }
+      // Free every other node, so Chunks are left partly used.
+      for (FileNode* node = head; r && (NULL != node); node = node->next.Get())
+      {
+        FileNode* odd = node->next.Get();
+        if (NULL == odd)
+          break;
+        node->next = odd->next;
+        allocator.Deallocate(odd, sizeof(FileNode));
+      }
+      allocator.SetRoot(head);
+      r = r && (head == allocator.GetRoot()) && allocator.Sync() &&
+        !allocator.IsCorrupt();
+    }
+    {
+      // A file made with other parameters is refused.
+      Loki::SmallObjFileAllocator allocator(4096, 128, 8);
+      r = r && !allocator.Attach(path) && !allocator.IsAttached();
+    }
+    {
+      Loki::SmallObjFileAllocator allocator(4096, 64, 8);
+      r = r && allocator.Attach(path) && !allocator.IsCorrupt();
+      const FileNode* node = static_cast<const FileNode*>(allocator.GetRoot());
+      int expected = 999;
+      for (; r && (NULL != node); node = node->next.Get(), expected -= 2)
+        r = (expected == node->value) && allocator.HasBlock(node);
+      r = r && (-1 == expected);
+
+      Loki::SmallObjStats stats;
+      allocator.GetStats(stats);
+      r = r && (500 * allocator.GetBlockSizeOf(allocator.GetRoot()) ==
+        stats.bytesInUse);
+
+      // The file holds fewer than 64 Chunks, so it runs out.
+      std::vector<void*> blocks;
+      for (void* p; NULL != (p = allocator.Allocate(64, false)); )
+        blocks.push_back(p);
+      r = r && (0 < blocks.size()) && !allocator.IsCorrupt();
+      for (std::size_t i = 0; i < blocks.size(); ++i)
+        allocator.Deallocate(blocks[i]);
+      r = r && !allocator.IsCorrupt();
+    }
+    std::remove(path);
+    return r;
+  }
+
+  static bool shared_test()
+  {
+#if defined(_WIN32)
+    return true;
+#else
+    const char* name = "/LokiSmallObjectTest";
+    Loki::SmallObjSharedAllocator allocator;
+    // The chunk size must be a multiple of the page size.
+    bool r = !allocator.Create(name, 64 * 4096, 64, 8, 4096 + 8) &&
+      allocator.Create(name, 64 * 4096, 64, 8, 4096) &&
+      (64 == allocator.GetMaxObjectSize()) && (NULL == allocator.GetRoot());
+
+    std::vector<void*> blocks;
+    for (int i = 0; r && (i < 3000); ++i)
+    {
+      void* p = allocator.Allocate(1 + i % 64, false);
+      r = (NULL != p) && allocator.HasBlock(p);
+      blocks.push_back(p);
+    }
+    // Objects too big for a Chunk get a run of slots.
+    void* big = allocator.Allocate(3 * 4096, false);
+    r = r && (NULL != big) && allocator.HasBlock(big) && !allocator.IsCorrupt();
+    for (std::size_t i = 0; i < blocks.size(); i += 2)
+      allocator.Deallocate(blocks[i], 1 + i % 64);
+    allocator.SetRoot(blocks[1]);
+    r = r && !allocator.IsCorrupt();
+
+    {
+      // Another mapping of the segment sees the same blocks.
+      Loki::SmallObjSharedAllocator other;
+      r = r && other.Attach(name) && (8 == other.GetAlignment()) &&
+        (other.GetBase() != allocator.GetBase());
+      const std::ptrdiff_t offset = static_cast<unsigned char*>(blocks[1]) -
+        static_cast<unsigned char*>(allocator.GetBase());
+      r = r && (static_cast<unsigned char*>(other.GetBase()) + offset ==
+        other.GetRoot());
+      other.Deallocate(other.GetRoot());
+      other.SetRoot(NULL);
+      r = r && !other.IsCorrupt();
+    }
+    for (std::size_t i = 3; i < blocks.size(); i += 2)
+      allocator.Deallocate(blocks[i]);
+    allocator.Deallocate(big);
+
+    Loki::SmallObjStats stats;
+    allocator.GetStats(stats);
+    r = r && (NULL == allocator.GetRoot()) && (0 == stats.bytesInUse) &&
+      (1 == stats.fallbackAllocations) && (1 == stats.fallbackDeallocations);
+
+    // Empty Chunks kept by each size class are taken back once the
+    // segment is full.
+    blocks.clear();
+    for (void* p; NULL != (p = allocator.Allocate(64, false)); )
+      blocks.push_back(p);
+    r = r && (63 * (4096 / 64) == blocks.size()) && !allocator.IsCorrupt();
+    for (std::size_t i = 0; i < blocks.size(); ++i)
+      allocator.Deallocate(blocks[i], 64);
+    r = r && !allocator.IsCorrupt();
+    allocator.Detach();
+    r = Loki::SmallObjSharedAllocator::Remove(name) && r &&
+      !allocator.Attach(name);
+    return r;
+#endif
+  }
+
+  static bool tag_test()
+  {
+    Loki::SmallObjAccount& cache = Loki::SmallObjAccount::Get<CacheSubsystem>();
+    Loki::SmallObjAccount& scheduler =
+      Loki::SmallObjAccount::Get<SchedulerSubsystem>();
+    // A SmallObjTag shares the pools of untagged classes.
+    const std::size_t entryBytes =
+      StatsAllocator::Instance().GetFootprint(sizeof(CacheEntry));
+    std::vector<CacheEntry*> entries;
+    for (int i = 0; i < 100; ++i)
+      entries.push_back(new CacheEntry);
+    // Too big for the pools, so it is charged its own size.
+    CacheEntry* blob = new CacheBlob;
+    bool r = (entryBytes < sizeof(CacheBlob)) &&
+      (100 * entryBytes + sizeof(CacheBlob) == cache.GetLiveBytes()) &&
+      (101 == cache.GetAllocations()) &&
+      (100 * entryBytes <= StatsAllocator::GetStats().bytesInUse);
+    delete blob;
+    for (std::size_t i = 0; i < 50; ++i)
+      delete entries[i];
+    entries.erase(entries.begin(), entries.begin() + 50);
+    r = r && (50 * entryBytes == cache.GetLiveBytes()) &&
+      (100 * entryBytes + sizeof(CacheBlob) == cache.GetPeakBytes());
+
+    // Past the budget, new fails as if memory ran out.
+    cache.SetBudget(cache.GetLiveBytes() + entryBytes);
+    entries.push_back(new CacheEntry);
+    r = r && (NULL == new (std::nothrow) CacheEntry);
+    bool threw = false;
+    try
+    {
+      entries.push_back(new CacheEntry);
+    }
+    catch (std::bad_alloc&)
+    {
+      threw = true;
+    }
+    r = r && threw && (2 == cache.GetRefusals()) &&
+      (51 * entryBytes == cache.GetLiveBytes());
+    cache.SetBudget(0);
+
+    // A block whose constructor throws is credited, though not pooled.
+    threw = false;
+    try
+    {
+      entries.push_back(new (std::nothrow) FailedBlob);
+    }
+    catch (std::runtime_error&)
+    {
+      threw = true;
+    }
+    r = r && threw && (51 * entryBytes == cache.GetLiveBytes());
+    for (std::size_t i = 0; i < entries.size(); ++i)
+      delete entries[i];
+    r = r && (0 == cache.GetLiveBytes()) &&
+      (cache.GetAllocations() == cache.GetDeallocations());
+
+    // A SmallObjHeapTag has pools of its own, which hold only its objects.
+    std::vector<Task*> tasks;
+    for (int i = 0; i < 1000; ++i)
+      tasks.push_back(new Task);
+    const std::size_t taskBytes =
+      1000 * TaskAllocator::Instance().GetFootprint(sizeof(Task));
+    r = r && (taskBytes == scheduler.GetLiveBytes()) &&
+      (taskBytes == TaskAllocator::GetStats().bytesInUse);
+    for (std::size_t i = 0; i < tasks.size(); ++i)
+      delete tasks[i];
+    r = r && (0 == scheduler.GetLiveBytes()) &&
+      (0 == TaskAllocator::GetStats().bytesInUse) &&
+      (taskBytes == scheduler.GetPeakBytes());
+
+    std::ostringstream out;
+    Loki::SmallObjAccount::WriteText(out);
+    r = r && (std::string::npos != out.str().find("\ncache\t0\t")) &&
+      (std::string::npos != out.str().find("\nscheduler\t0\t"));
+    return r;
+  }
+
   static void stress_test()
   {
     std::vector<Base*> vec;
@@ -171,6 +877,16 @@ private:
 #    endif
 #endif
 
+#ifndef SMALLOBJFILE_CPP
+#    define SMALLOBJFILE_CPP
+#    include "../../src/SmallObjFile.cpp"
+#endif
+
+#ifndef SMALLOBJSHARED_CPP
+#    define SMALLOBJSHARED_CPP
+#    include "../../src/SmallObjShared.cpp"
+#endif
+
 
 
 #endif
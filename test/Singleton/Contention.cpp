@@ -0,0 +1,134 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+// The authors make no representations about the suitability of this software
+// for any purpose. It is provided "as is" without express or implied warranty.
+////////////////////////////////////////////////////////////////////////////////
+
+// $Id$
+
+// Measures SingletonHolder::Instance with 1 to 8 threads calling it at once,
+// against taking the singleton's lock on every call as well, which is how
+// callers had to guard it before the instance pointer was atomic.
+//
+// The atomic fast path should cost about the same with any # of threads,
+// since it is one load of a pointer that no thread writes, while the locked
+// path gets slower as the threads fight over the mutex.
+//
+// A threading model written before AtomicType existed must still work.
+
+#include <loki/Singleton.h>
+
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+class Counter {
+public:
+  Counter() : value_(0) {}
+  inline void Add(unsigned int n) { value_ += n; }
+  unsigned int Get(void) const { return value_; }
+
+private:
+  unsigned int value_;
+};
+
+typedef Loki::SingletonHolder<Counter, Loki::CreateUsingNew,
+                              Loki::DefaultLifetime, Loki::ClassLevelLockable>
+    TheCounter;
+
+/// The lock MakeInstance takes, which callers used to take on every call.
+typedef Loki::ClassLevelLockable<TheCounter, LOKI_DEFAULT_MUTEX>::Lock
+    CounterLock;
+
+/// A threading model of the kind users wrote before AtomicType, with only a
+/// Lock and VolatileType.
+template <class Host, class MutexPolicy> class OldStyleLockable {
+public:
+  class Lock {
+  public:
+    Lock() { Mutex().lock(); }
+    ~Lock() { Mutex().unlock(); }
+  };
+
+  typedef volatile Host VolatileType;
+
+private:
+  static std::mutex &Mutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+};
+
+typedef Loki::SingletonHolder<Counter, Loki::CreateUsingNew,
+                              Loki::DefaultLifetime, OldStyleLockable>
+    TheOldStyleCounter;
+
+static const unsigned int CallsPerThread = 4 * 1000 * 1000;
+
+/// Adds the address of the singleton, so the calls can't be optimized away.
+void CallAtomic(unsigned int calls, unsigned long *sum) {
+  unsigned long s = 0;
+  for (unsigned int ii = 0; ii < calls; ++ii)
+    s += reinterpret_cast<unsigned long>(&TheCounter::Instance()) & 1;
+  *sum = s;
+}
+
+void CallLocked(unsigned int calls, unsigned long *sum) {
+  unsigned long s = 0;
+  for (unsigned int ii = 0; ii < calls; ++ii) {
+    CounterLock lock;
+    (void)lock;
+    s += reinterpret_cast<unsigned long>(&TheCounter::Instance()) & 1;
+  }
+  *sum = s;
+}
+
+/// Returns ns per call with threadCount threads calling f at once.
+double Measure(void (*f)(unsigned int, unsigned long *),
+               unsigned int threadCount) {
+  vector<thread> threads;
+  vector<unsigned long> sums(threadCount, 0);
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (unsigned int ii = 0; ii < threadCount; ++ii)
+    threads.push_back(thread(f, CallsPerThread / threadCount, &sums[ii]));
+  for (unsigned int ii = 0; ii < threadCount; ++ii)
+    threads[ii].join();
+  const chrono::duration<double, nano> elapsed =
+      chrono::steady_clock::now() - start;
+  return elapsed.count() / CallsPerThread;
+}
+
+/// @return True if several threads making the object at once all get the
+/// same one.
+template <class Holder> bool MakeOnce() {
+  vector<thread> threads;
+  vector<Counter *> seen(8, nullptr);
+  for (unsigned int ii = 0; ii < seen.size(); ++ii)
+    threads.push_back(
+        thread([&seen, ii]() { seen[ii] = &Holder::Instance(); }));
+  for (unsigned int ii = 0; ii < threads.size(); ++ii)
+    threads[ii].join();
+  bool r = true;
+  for (unsigned int ii = 0; ii < seen.size(); ++ii)
+    r = r && (seen[ii] == seen[0]);
+  return r;
+}
+
+int main() {
+  bool r = MakeOnce<TheCounter>();
+  r = MakeOnce<TheOldStyleCounter>() && r;
+
+  cout << "threads\tns/call atomic\tns/call locked" << endl;
+  for (unsigned int threadCount = 1; threadCount <= 8; threadCount *= 2) {
+    const double atomic = Measure(&CallAtomic, threadCount);
+    const double locked = Measure(&CallLocked, threadCount);
+    cout << threadCount << '\t' << atomic << "\t\t" << locked << endl;
+  }
+  cout << "one instance: " << (r ? "passed" : "FAILED") << endl;
+  return r ? 0 : 1;
+}
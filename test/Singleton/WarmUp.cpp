@@ -0,0 +1,195 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+// The authors make no representations about the suitability of this software
+// for any purpose. It is provided "as is" without express or implied warranty.
+////////////////////////////////////////////////////////////////////////////////
+
+// $Id$
+
+// Warms up a few singletons which depend on each other, and several which
+// don't, with slow constructors standing in for reading files and opening
+// connections.  Checks each is made after its dependencies and dies before
+// them, and that making them with 4 threads takes a fraction of the time.
+
+#include <loki/Singleton.h>
+#include <loki/SingletonWarmUp.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace Loki;
+
+static const chrono::milliseconds MakeTime(20);
+static const unsigned int PluginCount = 8;
+
+static atomic<bool> configAlive(false);
+static atomic<bool> databaseAlive(false);
+static atomic<bool> cacheAlive(false);
+static atomic<bool> serviceAlive(false);
+static atomic<unsigned int> pluginsAlive(0);
+static atomic<bool> inOrder(true);
+
+/// Checks a dependency is alive, as its dependent is made or destroyed.
+inline void Expect(bool alive) {
+  if (!alive)
+    inOrder = false;
+}
+
+struct Config {
+  Config() {
+    this_thread::sleep_for(MakeTime);
+    configAlive = true;
+  }
+  ~Config() {
+    Expect(!databaseAlive && !cacheAlive);
+    configAlive = false;
+  }
+};
+
+typedef SingletonHolder<Config> TheConfig;
+
+struct Database {
+  Database() {
+    Expect(configAlive);
+    TheConfig::Instance();
+    this_thread::sleep_for(MakeTime);
+    databaseAlive = true;
+  }
+  ~Database() {
+    Expect(configAlive && !serviceAlive);
+    databaseAlive = false;
+  }
+};
+
+typedef SingletonHolder<Database> TheDatabase;
+
+struct Cache {
+  Cache() {
+    Expect(configAlive);
+    this_thread::sleep_for(MakeTime);
+    cacheAlive = true;
+  }
+  ~Cache() {
+    Expect(configAlive && !serviceAlive);
+    cacheAlive = false;
+  }
+};
+
+typedef SingletonHolder<Cache> TheCache;
+
+struct Service {
+  Service() {
+    Expect(databaseAlive && cacheAlive);
+    this_thread::sleep_for(MakeTime);
+    serviceAlive = true;
+  }
+  ~Service() { serviceAlive = false; }
+};
+
+typedef SingletonHolder<Service> TheService;
+
+/// Independent of the others, and given a longevity, which several threads
+/// set at once.
+template <unsigned int N> struct Plugin {
+  Plugin() {
+    this_thread::sleep_for(MakeTime);
+    ++pluginsAlive;
+  }
+  ~Plugin() { --pluginsAlive; }
+};
+
+template <unsigned int N> inline unsigned int GetLongevity(Plugin<N> *) {
+  return N;
+}
+
+template <unsigned int N> struct ThePlugin {
+  typedef SingletonHolder<Plugin<N>, CreateUsingNew, SingletonWithLongevity>
+      Holder;
+};
+
+// The registrations name their holders, except the first plugin's, reported
+// by the name of its type.
+static SingletonWarmUp::Registration<TheConfig> configWarmUp("Config");
+static SingletonWarmUp::Registration<TheDatabase, Seq<TheConfig>>
+    databaseWarmUp("Database");
+static SingletonWarmUp::Registration<TheCache, Seq<TheConfig>>
+    cacheWarmUp("Cache");
+static SingletonWarmUp::Registration<TheService,
+                                     Seq<TheDatabase, TheCache>>
+    serviceWarmUp("Service");
+static SingletonWarmUp::Registration<ThePlugin<0>::Holder> plugin0WarmUp;
+static SingletonWarmUp::Registration<ThePlugin<1>::Holder> plugin1WarmUp("1");
+static SingletonWarmUp::Registration<ThePlugin<2>::Holder> plugin2WarmUp("2");
+static SingletonWarmUp::Registration<ThePlugin<3>::Holder> plugin3WarmUp("3");
+static SingletonWarmUp::Registration<ThePlugin<4>::Holder> plugin4WarmUp("4");
+static SingletonWarmUp::Registration<ThePlugin<5>::Holder> plugin5WarmUp("5");
+static SingletonWarmUp::Registration<ThePlugin<6>::Holder> plugin6WarmUp("6");
+static SingletonWarmUp::Registration<ThePlugin<7>::Holder> plugin7WarmUp("7");
+
+struct Loop {};
+struct Knot {};
+typedef SingletonHolder<Loop> TheLoop;
+typedef SingletonHolder<Knot> TheKnot;
+
+/// Registered before any singleton is made, so it runs after all died.
+static void Check() {
+  const bool r = inOrder && !configAlive && (0 == pluginsAlive);
+  cout << "teardown order: " << (r ? "passed" : "FAILED") << endl;
+  if (!r)
+    _Exit(1);
+}
+
+int main() {
+  atexit(&Check);
+
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  vector<SingletonWarmUp::Timing> timings = SingletonWarmUp::WarmUp(4);
+  const chrono::duration<double, milli> elapsed =
+      chrono::steady_clock::now() - start;
+
+  cout << "singleton\tthread\tstart ms\tms" << endl;
+  chrono::duration<double, milli> total(0);
+  bool named = false;
+  for (size_t ii = 0; ii < timings.size(); ++ii) {
+    // Demangled, with g++ Plugin<0u>.
+    named = named || (0 == strncmp(timings[ii].name, "Plugin<0", 8));
+    const chrono::duration<double, milli> duration = timings[ii].duration;
+    cout << timings[ii].name << '\t' << timings[ii].thread << '\t'
+         << chrono::duration<double, milli>(timings[ii].start).count() << '\t'
+         << duration.count() << endl;
+    total += duration;
+  }
+  cout << "made " << timings.size() << " in " << elapsed.count()
+       << " ms, one after another would take " << total.count() << " ms"
+       << endl;
+  bool r = (4 + PluginCount == timings.size()) && inOrder && serviceAlive &&
+           (PluginCount == pluginsAlive) && (elapsed < 0.6 * total) && named;
+  cout << "warm-up: " << (r ? "passed" : "FAILED") << endl;
+
+  // Made already, so it takes no time.
+  const chrono::steady_clock::time_point again = chrono::steady_clock::now();
+  timings = SingletonWarmUp::WarmUp(4);
+  r = r && (4 + PluginCount == timings.size()) &&
+      (chrono::steady_clock::now() - again < MakeTime);
+
+  SingletonWarmUp::Clear();
+  SingletonWarmUp::Register<TheLoop, Seq<TheKnot>>("Loop");
+  SingletonWarmUp::Register<TheKnot, Seq<TheLoop>>("Knot");
+  bool threw = false;
+  try {
+    SingletonWarmUp::WarmUp(4);
+  } catch (const logic_error &) {
+    threw = true;
+  }
+  r = r && threw;
+  cout << "again and cycle: " << (r ? "passed" : "FAILED") << endl;
+  return r ? 0 : 1;
+}
@@ -0,0 +1,147 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+////////////////////////////////////////////////////////////////////////////////
+
+// $Id$
+
+// ----------------------------------------------------------------------------
+
+#include <loki/SmallObj.h>
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// ----------------------------------------------------------------------------
+
+/** Over-aligned SmallObjects take the C++17 aligned operator new, which finds
+ a pool whose blocks have the alignment.  Per-thread counters which are each
+ a cache line wide never share a line, so threads bumping their own counters
+ don't slow each other down the way packed counters do.
+ */
+static const unsigned int IncrementCount = 20 * 1000 * 1000;
+
+typedef Loki::SmallObject<::Loki::ClassLevelLockable, 4096, 256, 8,
+                          ::Loki::NoDestroy>
+    Pooled;
+
+struct alignas(32) Vector8 : public Pooled {
+  float lanes[8];
+};
+
+struct alignas(64) Matrix4 : public Pooled {
+  float cells[16];
+};
+
+struct PackedCounter : public Pooled {
+  volatile std::uint64_t count;
+};
+
+struct alignas(LOKI_SMALLOBJ_CACHE_LINE_SIZE) LineCounter : public Pooled {
+  volatile std::uint64_t count;
+};
+
+// ----------------------------------------------------------------------------
+
+template <class T> bool IsAligned(const T *p) {
+  return 0 == reinterpret_cast<uintptr_t>(p) % alignof(T);
+}
+
+/// Checks every object is aligned, and that it came from the pools.
+bool Check(void) {
+  bool r = true;
+  vector<Vector8 *> vectors;
+  vector<Matrix4 *> matrices;
+  for (unsigned int ii = 0; ii < 1000; ++ii) {
+    vectors.push_back(new Vector8);
+    matrices.push_back(new (nothrow) Matrix4);
+    r = r && IsAligned(vectors.back()) && IsAligned(matrices.back());
+  }
+  const Loki::SmallObjStats stats = Pooled::ObjAllocatorSingleton::GetStats();
+  r = r && (1000 * (sizeof(Vector8) + sizeof(Matrix4)) == stats.bytesInUse);
+  for (unsigned int ii = 0; ii < 1000; ++ii) {
+    delete vectors[ii];
+    delete matrices[ii];
+  }
+  return r && (0 == Pooled::ObjAllocatorSingleton::GetStats().bytesInUse);
+}
+
+// ----------------------------------------------------------------------------
+
+/// Returns milliseconds for threadCount threads to bump their own counters.
+template <class T> double Time(unsigned int threadCount) {
+  vector<T *> counters;
+  for (unsigned int ii = 0; ii < threadCount; ++ii) {
+    counters.push_back(new T);
+    counters.back()->count = 0;
+  }
+  vector<thread> threads;
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (unsigned int ii = 0; ii < threadCount; ++ii) {
+    T *counter = counters[ii];
+    threads.push_back(thread([counter]() {
+      for (unsigned int jj = 0; jj < IncrementCount; ++jj)
+        counter->count = counter->count + 1;
+    }));
+  }
+  for (unsigned int ii = 0; ii < threadCount; ++ii)
+    threads[ii].join();
+  const chrono::duration<double, milli> elapsed =
+      chrono::steady_clock::now() - start;
+  for (unsigned int ii = 0; ii < threadCount; ++ii)
+    delete counters[ii];
+  return elapsed.count();
+}
+
+// ----------------------------------------------------------------------------
+
+int main() {
+  if (!Check()) {
+    cout << "An over-aligned SmallObject is misaligned or not pooled!" << endl;
+    return 1;
+  }
+
+  cout << "Milliseconds for each thread to bump its own counter "
+       << IncrementCount << " times" << endl
+       << endl;
+  cout << "threads\t" << sizeof(PackedCounter) << " byte counters\t"
+       << sizeof(LineCounter) << " byte counters" << endl;
+  for (unsigned int threadCount = 1; threadCount <= 4; threadCount *= 2) {
+    const double packed = Time<PackedCounter>(threadCount);
+    const double padded = Time<LineCounter>(threadCount);
+    cout << threadCount << '\t' << fixed << setprecision(1) << packed
+         << "\t\t\t" << padded << endl;
+  }
+
+  if (Pooled::ObjAllocatorSingleton::IsCorrupted()) {
+    cout << "Allocator is corrupt!" << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
@@ -46,6 +46,19 @@ struct Base : public ThisIsASmallObject<N>, public T {};
 template <unsigned int N>
 struct Base<N, void> : public ThisIsASmallObject<N> {};
 
+/// Uses the pool of its own size class, which is found at compile time.
+template <unsigned int N, template <class, class> class ThreadingModel,
+          std::size_t chunkSize, std::size_t maxSmallObjectSize,
+          std::size_t objectAlignSize, template <class> class LifetimePolicy,
+          class MutexPolicy>
+struct Typed
+    : public ThisIsASmallObject<N>,
+      public Loki::SmallObjectOf<
+          Typed<N, ThreadingModel, chunkSize, maxSmallObjectSize,
+                objectAlignSize, LifetimePolicy, MutexPolicy>,
+          ThreadingModel, chunkSize, maxSmallObjectSize, objectAlignSize,
+          LifetimePolicy, MutexPolicy> {};
+
 // ----------------------------------------------------------------------------
 
 #ifdef COMPARE_BOOST_POOL
@@ -221,6 +234,7 @@ LOKI_SMALLOBJ_BENCH_ARRAY(new_del_a_on_a_all, std::allocator<T[TN]> st,
   FUNC<A, N>(a, N, LOOP, TIMER, "new      :");                                 \
   FUNC<B, N>(a, N, LOOP, TIMER, "SmallObj :");                                 \
   FUNC<C, N>(a, N, LOOP, TIMER, "ValueObj :");                                 \
+  FUNC<E, N>(a, N, LOOP, TIMER, "SmallOf  :");                                 \
   FUNC##_all<A, N>(a, N, LOOP, TIMER, "allocator:");                           \
   FUNC##_mal<A, N>(a, N, LOOP, TIMER, "malloc   :");                           \
   cout << endl << endl;
@@ -231,6 +245,7 @@ LOKI_SMALLOBJ_BENCH_ARRAY(new_del_a_on_a_all, std::allocator<T[TN]> st,
   FUNC<A, N>(a, N, LOOP, TIMER, "new      :");                                 \
   FUNC<B, N>(a, N, LOOP, TIMER, "SmallObj :");                                 \
   FUNC<C, N>(a, N, LOOP, TIMER, "ValueObj :");                                 \
+  FUNC<E, N>(a, N, LOOP, TIMER, "SmallOf  :");                                 \
   FUNC<D, N>(a, N, LOOP, TIMER, "boost    :");                                 \
   FUNC##_all<A, N>(a, N, LOOP, TIMER, "allocator:");                           \
   FUNC##_mal<A, N>(a, N, LOOP, TIMER, "malloc   :");                           \
@@ -254,6 +269,9 @@ void testSize() {
                                             maxSmallObjectSize, objectAlignSize,
                                             LifetimePolicy, MutexPolicy>>
       C;
+  typedef Typed<Size, ThreadingModel, chunkSize, maxSmallObjectSize,
+                objectAlignSize, LifetimePolicy, MutexPolicy>
+      E;
   typedef Loki::AllocatorSingleton<ThreadingModel, chunkSize,
                                    maxSmallObjectSize, objectAlignSize,
                                    LifetimePolicy, MutexPolicy>
@@ -274,6 +292,8 @@ void testSize() {
        << endl;
   cout << "ValueObj = Loki::SmallValueObject\tsizeof(C) = " << sizeof(C)
        << endl;
+  cout << "SmallOf  = Loki::SmallObjectOf   \tsizeof(E) = " << sizeof(E)
+       << endl;
 #ifdef COMPARE_BOOST_POOL
   cout << "boost    = boost::object_pool    \tsizeof(D) = " << sizeof(D)
        << endl;
@@ -356,6 +376,38 @@ void DoClassLockTest(void) {
            ::Loki::NoDestroy, ::Loki::Mutex<std::mutex>>();
   testSize<17, loop, ::Loki::ClassLevelLockable, 4096, 128, 4,
            ::Loki::NoDestroy, ::Loki::Mutex<std::mutex>>();
+  testSize<24, loop, ::Loki::ClassLevelLockable, 4096, 128, 4,
+           ::Loki::NoDestroy, ::Loki::Mutex<std::mutex>>();
+}
+
+// ----------------------------------------------------------------------------
+
+void DoLockFreeTest(void) {
+  const int loop = 1000 * 1000;
+  cout << endl;
+  testSize<8, loop, ::Loki::LockFreeLockable, 4096, 128, 4, ::Loki::NoDestroy,
+           ::Loki::Mutex<std::mutex>>();
+  testSize<16, loop, ::Loki::LockFreeLockable, 4096, 128, 4, ::Loki::NoDestroy,
+           ::Loki::Mutex<std::mutex>>();
+  testSize<24, loop, ::Loki::LockFreeLockable, 4096, 128, 4, ::Loki::NoDestroy,
+           ::Loki::Mutex<std::mutex>>();
+}
+
+// ----------------------------------------------------------------------------
+
+void DoRegionTest(void) {
+  typedef Loki::AllocatorSingleton<::Loki::RegionLockable, 4096, 128, 4,
+                                   ::Loki::NoDestroy, ::Loki::Mutex<std::mutex>>
+      RegionAllocator;
+  const int loop = 1000 * 1000;
+  cout << endl;
+  // Objects are made inside a region, so deletes release nothing.
+  Loki::SmallObjRegion<RegionAllocator> region;
+  testSize<8, loop, ::Loki::RegionLockable, 4096, 128, 4, ::Loki::NoDestroy,
+           ::Loki::Mutex<std::mutex>>();
+  region.Reset();
+  testSize<24, loop, ::Loki::RegionLockable, 4096, 128, 4, ::Loki::NoDestroy,
+           ::Loki::Mutex<std::mutex>>();
 }
 
 #endif
@@ -367,6 +419,8 @@ int main() {
 
 #if defined(LOKI_CLASS_LEVEL_THREADING)
   DoClassLockTest();
+  DoLockFreeTest();
+  DoRegionTest();
 #endif
 
   return 0;
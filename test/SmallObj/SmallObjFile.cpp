@@ -0,0 +1,194 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+////////////////////////////////////////////////////////////////////////////////
+
+// $Id$
+
+/// @file SmallObjFile.cpp Builds a search tree in a SmallObjFileAllocator,
+/// and restarts itself to check the tree comes back from the file.
+
+// ----------------------------------------------------------------------------
+
+#include <loki/SmallObjFile.h>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+using namespace std;
+
+// ----------------------------------------------------------------------------
+
+static const char *HeapPath = "SmallObjFile.heap";
+static const unsigned int NodeCount = 200 * 1000;
+
+/// Node of an unbalanced search tree, linked by OffsetPtr so the file can
+/// be mapped anywhere.
+struct Node {
+  Loki::OffsetPtr<Node> left;
+  Loki::OffsetPtr<Node> right;
+  unsigned int key;
+  char payload[20];
+};
+
+/// Kept as the root block of the file.
+struct Index {
+  Loki::OffsetPtr<Node> top;
+  unsigned int count;
+};
+
+// ----------------------------------------------------------------------------
+
+/// Returns key number ii of a sequence which visits every key once.
+inline unsigned int GetKey(unsigned int ii) {
+  return static_cast<unsigned int>((ii * 2654435761ull) % NodeCount);
+}
+
+void Insert(Loki::SmallObjFileAllocator &allocator, Index &index,
+            unsigned int key) {
+  Node *node = new (allocator.Allocate(sizeof(Node), true)) Node;
+  node->key = key;
+  ::snprintf(node->payload, sizeof(node->payload), "node %u", key);
+  Loki::OffsetPtr<Node> *link = &index.top;
+  while (*link)
+    link = (key < (*link)->key) ? &(*link)->left : &(*link)->right;
+  *link = node;
+  ++index.count;
+}
+
+/// Returns # of nodes in ascending order whose payload matches their key.
+unsigned int Check(const Node *node, unsigned int &next) {
+  if (nullptr == node)
+    return 0;
+  unsigned int count = Check(node->left.Get(), next);
+  char payload[20];
+  ::snprintf(payload, sizeof(payload), "node %u", node->key);
+  if ((next <= node->key) && (0 == ::strcmp(payload, node->payload)))
+    ++count;
+  next = node->key + 1;
+  return count + Check(node->right.Get(), next);
+}
+
+// ----------------------------------------------------------------------------
+
+/** Runs in the restarted process.  Maps the file somewhere else than the
+ first process did, checks the tree, and adds the odd keys, which the first
+ process left out.
+ @param oldBase Where the first process mapped the file.
+ */
+int Restart(const char *oldBase) {
+  // Keeps the range the file was mapped at busy, so it can't be mapped
+  // there again by chance, and only OffsetPtr makes the tree work.
+  void *old = nullptr;
+  ::sscanf(oldBase, "%p", &old);
+  void *busy = ::mmap(old, 64 * 1024 * 1024, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  Loki::SmallObjFileAllocator allocator(4096, 64, 8);
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  if (!allocator.Attach(HeapPath)) {
+    cout << "restart: can't attach to " << HeapPath << endl;
+    return 1;
+  }
+  const chrono::duration<double, milli> elapsed =
+      chrono::steady_clock::now() - start;
+  Index *index = static_cast<Index *>(allocator.GetRoot());
+  unsigned int next = 0;
+  const unsigned int sorted =
+      (nullptr == index) ? 0 : Check(index->top.Get(), next);
+  cout << "restart: attached to " << NodeCount / 2 << " nodes in "
+       << elapsed.count() << " ms, " << sorted << " came back in order"
+       << endl;
+  if ((nullptr == index) || (NodeCount / 2 != index->count) ||
+      (index->count != sorted) || (old == allocator.GetBase()) ||
+      allocator.IsCorrupt())
+    return 1;
+  for (unsigned int ii = 0; ii < NodeCount; ++ii) {
+    if (1 == GetKey(ii) % 2)
+      Insert(allocator, *index, GetKey(ii));
+  }
+  const bool r = allocator.Sync() && !allocator.IsCorrupt();
+  allocator.Detach();
+  if (MAP_FAILED != busy)
+    ::munmap(busy, 64 * 1024 * 1024);
+  return r ? 0 : 1;
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+  if ((2 < argc) && (0 == ::strcmp(argv[1], "restart")))
+    return Restart(argv[2]);
+
+  bool r = true;
+  {
+    Loki::SmallObjFileAllocator allocator(4096, 64, 8);
+    r = allocator.Create(HeapPath, 64 * 1024 * 1024);
+    const chrono::steady_clock::time_point start =
+        chrono::steady_clock::now();
+    Index *index = new (allocator.Allocate(sizeof(Index), true)) Index;
+    index->count = 0;
+    allocator.SetRoot(index);
+    for (unsigned int ii = 0; r && (ii < NodeCount); ++ii) {
+      if (0 == GetKey(ii) % 2)
+        Insert(allocator, *index, GetKey(ii));
+    }
+    const chrono::duration<double, milli> elapsed =
+        chrono::steady_clock::now() - start;
+    cout << "built " << index->count << " nodes in " << elapsed.count()
+         << " ms" << endl;
+    r = r && allocator.Sync() && !allocator.IsCorrupt();
+    cout << "first run: " << (r ? "passed" : "FAILED") << endl;
+
+    char base[32];
+    ::snprintf(base, sizeof(base), "%p", allocator.GetBase());
+    const pid_t pid = ::fork();
+    if (0 == pid) {
+      ::execl(argv[0], argv[0], "restart", base, static_cast<char *>(nullptr));
+      ::_exit(1);
+    }
+    int status = 0;
+    r = r && (pid == ::waitpid(pid, &status, 0)) && WIFEXITED(status) &&
+        (0 == WEXITSTATUS(status));
+    cout << "restart: " << (r ? "passed" : "FAILED") << endl;
+  }
+
+  // The odd keys added by the restarted process are in the file too.
+  Loki::SmallObjFileAllocator allocator(4096, 64, 8);
+  r = r && allocator.Attach(HeapPath);
+  const Index *index = static_cast<const Index *>(allocator.GetRoot());
+  unsigned int next = 0;
+  r = r && (nullptr != index) && (NodeCount == index->count) &&
+      (NodeCount == Check(index->top.Get(), next)) && !allocator.IsCorrupt();
+  cout << "second attach: " << (r ? "passed" : "FAILED") << endl;
+  allocator.Detach();
+  ::remove(HeapPath);
+  return r ? 0 : 1;
+}
+
+// ----------------------------------------------------------------------------
@@ -0,0 +1,207 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+////////////////////////////////////////////////////////////////////////////////
+
+// $Id$
+
+// ----------------------------------------------------------------------------
+
+#include <loki/Allocator.h>
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// ----------------------------------------------------------------------------
+
+/** Compares SmallObjMemoryResource against the pool resources of the
+ standard library, with the node-based and small-array workloads which pmr
+ containers typically produce.  The unsynchronized resources are compared
+ on one thread, and the synchronized ones on several threads sharing one
+ resource.
+ */
+static const unsigned int ElementCount = 1000;
+static const unsigned int RoundCount = 400;
+
+typedef Loki::AllocatorSingleton<::Loki::SingleThreaded, 4096, 256, 8,
+                                 ::Loki::NoDestroy>
+    PlainAllocator;
+typedef Loki::AllocatorSingleton<::Loki::ClassLevelLockable, 4096, 256, 8,
+                                 ::Loki::NoDestroy>
+    LockedAllocator;
+typedef Loki::AllocatorSingleton<::Loki::ThreadCachedLockable, 4096, 256, 8,
+                                 ::Loki::NoDestroy>
+    CachedAllocator;
+typedef Loki::AllocatorSingleton<::Loki::RegionLockable, 4096, 256, 8,
+                                 ::Loki::NoDestroy>
+    RegionAllocator;
+
+// ----------------------------------------------------------------------------
+
+void ListChurn(pmr::memory_resource *resource) {
+  pmr::list<int> l(resource);
+  for (unsigned int ii = 0; ii < RoundCount; ++ii) {
+    for (unsigned int jj = 0; jj < ElementCount; ++jj)
+      l.push_back(int(jj));
+    while (!l.empty())
+      l.pop_front();
+  }
+}
+
+void MapChurn(pmr::memory_resource *resource) {
+  pmr::unordered_map<int, int> m(resource);
+  for (unsigned int ii = 0; ii < RoundCount; ++ii) {
+    for (unsigned int jj = 0; jj < ElementCount; ++jj)
+      m.emplace(int(jj), int(ii));
+    for (unsigned int jj = 0; jj < ElementCount; ++jj)
+      m.erase(int(jj));
+  }
+}
+
+void VectorChurn(pmr::memory_resource *resource) {
+  for (unsigned int ii = 0; ii < RoundCount; ++ii) {
+    pmr::vector<pmr::vector<int>> outer(resource);
+    for (unsigned int jj = 0; jj < ElementCount / 10; ++jj) {
+      outer.emplace_back();
+      for (unsigned int kk = 0; kk < 20; ++kk)
+        outer.back().push_back(int(kk));
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+/// Returns milliseconds for threadCount threads to run work on one resource.
+double Time(void (*work)(pmr::memory_resource *),
+            pmr::memory_resource *resource, unsigned int threadCount) {
+  vector<thread> threads;
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (unsigned int ii = 0; ii < threadCount; ++ii)
+    threads.push_back(thread(work, resource));
+  for (unsigned int ii = 0; ii < threadCount; ++ii)
+    threads[ii].join();
+  const chrono::duration<double, milli> elapsed =
+      chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// ----------------------------------------------------------------------------
+
+/// Checks alignment, large requests, and equality of SmallObjMemoryResource.
+bool Check(void) {
+  Loki::SmallObjMemoryResource<PlainAllocator> resource;
+  bool r = resource.is_equal(Loki::SmallObjMemoryResource<PlainAllocator>());
+  r = r && !resource.is_equal(*pmr::new_delete_resource());
+
+  const size_t sizes[] = {1, 8, 24, 40, 64, 200, 256, 1000, 100000};
+  const size_t alignments[] = {1, 8, 16, 64, 256};
+  for (size_t size : sizes) {
+    for (size_t alignment : alignments) {
+      void *p = resource.allocate(size, alignment);
+      r = r && (0 == reinterpret_cast<uintptr_t>(p) % alignment);
+      resource.deallocate(p, size, alignment);
+    }
+  }
+  r = r && Loki::SmallObjMemoryResource<PlainAllocator>::IsPooled(24, 8) &&
+      !Loki::SmallObjMemoryResource<PlainAllocator>::IsPooled(24, 16) &&
+      !Loki::SmallObjMemoryResource<PlainAllocator>::IsPooled(1000, 8);
+
+  // Region blocks are only aligned on 8 bytes, whatever their size.
+  Loki::SmallObjMemoryResource<RegionAllocator> regionResource;
+  {
+    Loki::SmallObjRegion<RegionAllocator> region;
+    for (size_t size : sizes) {
+      for (size_t alignment : alignments) {
+        void *p = regionResource.allocate(size, alignment);
+        r = r && (0 == reinterpret_cast<uintptr_t>(p) % alignment);
+        regionResource.deallocate(p, size, alignment);
+      }
+    }
+  }
+  r = r && Loki::SmallObjMemoryResource<PlainAllocator>::IsPooled(32, 16) &&
+      !Loki::SmallObjMemoryResource<RegionAllocator>::IsPooled(32, 16);
+  return r;
+}
+
+// ----------------------------------------------------------------------------
+
+int main() {
+  if (!Check()) {
+    cout << "SmallObjMemoryResource returned a misaligned block!" << endl;
+    return 1;
+  }
+
+  typedef void (*Work)(pmr::memory_resource *);
+  const Work works[] = {&ListChurn, &MapChurn, &VectorChurn};
+  const char *names[] = {"list", "unordered_map", "vector"};
+
+  Loki::SmallObjMemoryResource<PlainAllocator> plain;
+  Loki::SmallObjMemoryResource<LockedAllocator> locked;
+  Loki::SmallObjMemoryResource<CachedAllocator> cached;
+
+  cout << "Milliseconds for " << RoundCount << " rounds of " << ElementCount
+       << " elements on one thread" << endl
+       << endl;
+  cout << "workload\tnew_delete\tunsynchronized_pool\tSmallObj SingleThreaded"
+       << endl;
+  for (unsigned int ii = 0; ii < 3; ++ii) {
+    pmr::unsynchronized_pool_resource pool;
+    const double heap = Time(works[ii], pmr::new_delete_resource(), 1);
+    const double standard = Time(works[ii], &pool, 1);
+    const double loki = Time(works[ii], &plain, 1);
+    cout << names[ii] << '\t' << fixed << setprecision(1) << heap << "\t\t"
+         << standard << "\t\t\t" << loki << endl;
+  }
+
+  cout << endl
+       << "Milliseconds for each thread to churn a list, all threads sharing "
+          "one resource"
+       << endl
+       << endl;
+  cout << "threads\tsynchronized_pool\tSmallObj ClassLevelLockable"
+          "\tSmallObj ThreadCachedLockable"
+       << endl;
+  for (unsigned int threadCount = 1; threadCount <= 4; threadCount *= 2) {
+    pmr::synchronized_pool_resource pool;
+    const double standard = Time(&ListChurn, &pool, threadCount);
+    const double loki = Time(&ListChurn, &locked, threadCount);
+    const double lokiCached = Time(&ListChurn, &cached, threadCount);
+    cout << threadCount << '\t' << fixed << setprecision(1) << standard
+         << "\t\t\t" << loki << "\t\t\t\t" << lokiCached << endl;
+  }
+
+  if (PlainAllocator::IsCorrupted() || LockedAllocator::IsCorrupted() ||
+      CachedAllocator::IsCorrupted()) {
+    cout << "Allocator is corrupt!" << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
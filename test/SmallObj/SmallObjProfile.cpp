@@ -0,0 +1,213 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+////////////////////////////////////////////////////////////////////////////////
+
+// $Id$
+
+// ----------------------------------------------------------------------------
+
+#include <loki/SmallObj.h>
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// ----------------------------------------------------------------------------
+
+/** Turns sampling on, so the heap profiler samples these objects.  Checks
+ that the profile finds the call site which holds most of the memory, that
+ many short threads don't inflate it, and measures how much sampling costs.
+ */
+typedef Loki::SmallObject<::Loki::ClassLevelLockable, 4096, 256, 8,
+                          ::Loki::NoDestroy>
+    Pooled;
+typedef Pooled::ObjAllocatorSingleton Allocator;
+
+struct Node : public Pooled {
+  Node *next_;
+  int value_;
+};
+
+struct Record : public Pooled {
+  char payload_[200];
+};
+
+// ----------------------------------------------------------------------------
+
+/// Keeps count Nodes alive.  This is the call site which should dominate.
+Node *MakeNodes(unsigned int count) {
+  Node *head = nullptr;
+  for (unsigned int ii = 0; ii < count; ++ii) {
+    Node *node = new Node;
+    node->next_ = head;
+    node->value_ = int(ii);
+    head = node;
+  }
+  return head;
+}
+
+void DeleteNodes(Node *head) {
+  while (nullptr != head) {
+    Node *next = head->next_;
+    delete head;
+    head = next;
+  }
+}
+
+vector<Record *> MakeRecords(unsigned int count) {
+  vector<Record *> records;
+  for (unsigned int ii = 0; ii < count; ++ii)
+    records.push_back(new Record);
+  return records;
+}
+
+// ----------------------------------------------------------------------------
+
+/// Checks the estimates against what was actually allocated.
+bool Check(void) {
+  Loki::SmallObjProfiler &profiler = Allocator::GetProfiler();
+  profiler.SetInterval(16 * 1024);
+  profiler.Clear();
+
+  const unsigned int nodeCount = 200 * 1000;
+  Node *nodes = MakeNodes(nodeCount);
+  vector<Record *> records = MakeRecords(2000);
+
+  const double actual = double(nodeCount * sizeof(Node));
+  bool r = (0 < profiler.GetLiveSampleCount());
+  ostringstream text;
+  profiler.WriteText(text);
+  // The first call site is the one with the most live bytes.
+  const string report = text.str();
+  const size_t site = report.find("\n\n");
+  r = r && (string::npos != site);
+  if (r) {
+    const double estimate = stod(report.substr(site + 2));
+    r = (0.8 * actual < estimate) && (estimate < 1.2 * actual);
+  }
+
+  ostringstream pprof;
+  profiler.WritePprof(pprof);
+  r = r && (0 == pprof.str().find("heap profile: ")) &&
+      (string::npos != pprof.str().find("@ heap_v2/16384\n")) &&
+      (string::npos != pprof.str().find("MAPPED_LIBRARIES:"));
+
+  const size_t live = profiler.GetLiveSampleCount();
+  DeleteNodes(nodes);
+  for (size_t ii = 0; ii < records.size(); ++ii)
+    delete records[ii];
+  r = r && (0 == profiler.GetLiveSampleCount()) &&
+      (live == profiler.GetFreedSampleCount());
+
+  cout << report.substr(0, report.find('\n', site + 2)) << endl << endl;
+  profiler.SetInterval(LOKI_SMALLOBJ_SAMPLE_INTERVAL);
+  return r;
+}
+
+// ----------------------------------------------------------------------------
+
+/** Starts many threads which make one Node each.  Together they allocate a
+ small fraction of an interval, so there should hardly be any samples.  If
+ each thread's first allocation were sampled, each would stand for about an
+ interval, and the estimate would be thousands of times too big.
+ */
+bool CheckThreads(void) {
+  Loki::SmallObjProfiler &profiler = Allocator::GetProfiler();
+  profiler.SetInterval(LOKI_SMALLOBJ_SAMPLE_INTERVAL);
+  profiler.Clear();
+
+  const unsigned int threadCount = 2000;
+  vector<Node *> nodes(threadCount, nullptr);
+  for (unsigned int ii = 0; ii < threadCount; ii += 8) {
+    vector<thread> threads;
+    for (unsigned int jj = ii; jj < ii + 8; ++jj)
+      threads.push_back(thread([&nodes, jj]() { nodes[jj] = new Node; }));
+    for (size_t jj = 0; jj < threads.size(); ++jj)
+      threads[jj].join();
+  }
+  // Each sample stands for about an interval, so a few are fine.
+  const size_t samples = profiler.GetLiveSampleCount();
+  const bool r = (samples <= 4);
+  cout << threadCount << " threads with one Node each, "
+       << threadCount * sizeof(Node) << " bytes: " << samples << " samples"
+       << endl;
+  for (size_t ii = 0; ii < nodes.size(); ++ii)
+    delete nodes[ii];
+  profiler.Clear();
+  return r;
+}
+
+// ----------------------------------------------------------------------------
+
+/// Returns nanoseconds per new/delete pair of Nodes.
+double Time(void) {
+  const unsigned int rounds = 200;
+  const unsigned int count = 10 * 1000;
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (unsigned int ii = 0; ii < rounds; ++ii)
+    DeleteNodes(MakeNodes(count));
+  const chrono::duration<double, nano> elapsed =
+      chrono::steady_clock::now() - start;
+  return elapsed.count() / (double(rounds) * count);
+}
+
+// ----------------------------------------------------------------------------
+
+int main() {
+  Loki::SmallObjProfiler::SetSampling(true);
+  if (!Check()) {
+    cout << "The heap profile is wrong!" << endl;
+    return 1;
+  }
+  if (!CheckThreads()) {
+    cout << "New threads inflate the heap profile!" << endl;
+    return 1;
+  }
+
+  // Best of several runs, since the difference is small.
+  double sampled = 1.0e9;
+  double off = 1.0e9;
+  for (unsigned int ii = 0; ii < 5; ++ii) {
+    Loki::SmallObjProfiler::SetSampling(true);
+    const double s = Time();
+    Loki::SmallObjProfiler::SetSampling(false);
+    const double o = Time();
+    sampled = (s < sampled) ? s : sampled;
+    off = (o < off) ? o : off;
+  }
+  cout << "ns per new/delete pair, sampling every "
+       << LOKI_SMALLOBJ_SAMPLE_INTERVAL << " bytes: " << sampled
+       << ", sampling off: " << off << endl;
+
+  if (Allocator::IsCorrupted()) {
+    cout << "Allocator is corrupt!" << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
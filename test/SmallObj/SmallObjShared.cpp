@@ -0,0 +1,256 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+////////////////////////////////////////////////////////////////////////////////
+
+// $Id$
+
+/// @file SmallObjShared.cpp Forks workers which pass messages to each other
+/// through a list in a SmallObjSharedHeap, each freeing what others made.
+/// Then kills processes in the middle of allocating, and checks the segment
+/// is either taken over intact or given up.
+
+// ----------------------------------------------------------------------------
+
+#include <loki/Allocator.h>
+#include <loki/SmallObjShared.h>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <new>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// ----------------------------------------------------------------------------
+
+static const char *SegmentName = "/LokiSmallObjShared";
+static const char *KilledSegmentName = "/LokiSmallObjSharedKilled";
+/// # of processes killed, each on a fresh segment.
+static const unsigned int KillCount = 40;
+static const unsigned int WorkerCount = 4;
+static const unsigned int MessageCount = 20 * 1000;
+/// One message in this many is too big for a Chunk.
+static const unsigned int BigEvery = 500;
+
+typedef Loki::SmallObjSharedHeap<> Heap;
+
+/// Message with its payload right after it, in the same block.
+struct Message {
+  unsigned int sender;
+  unsigned int sequence;
+  unsigned int size;
+
+  unsigned char *GetData(void) {
+    return reinterpret_cast<unsigned char *>(this + 1);
+  }
+};
+
+/// Kept as the root of the segment.  Workers forked from the parent map it
+/// at the same address, so the list may hold plain pointers.
+struct Mailbox {
+  pthread_mutex_t mutex;
+  list<Message *, Loki::LokiAllocator<Message *, Heap> > messages;
+  unsigned int received;
+  unsigned int bad;
+};
+
+// ----------------------------------------------------------------------------
+
+inline unsigned char GetByte(const Message &message, unsigned int ii) {
+  return static_cast<unsigned char>(message.sender * 31 +
+                                    message.sequence * 7 + ii);
+}
+
+Message *MakeMessage(unsigned int sender, unsigned int sequence) {
+  const unsigned int size = (0 == sequence % BigEvery)
+                                ? 3 * 4096
+                                : 8 + (sequence * 13) % 160;
+  Message *message = static_cast<Message *>(
+      Heap::Instance().Allocate(sizeof(Message) + size, true));
+  message->sender = sender;
+  message->sequence = sequence;
+  message->size = size;
+  for (unsigned int ii = 0; ii < size; ++ii)
+    message->GetData()[ii] = GetByte(*message, ii);
+  return message;
+}
+
+/// Checks the payload of a message, possibly made by another process, and
+/// frees it.  @return True if the payload is intact.
+bool TakeMessage(Message *message) {
+  bool r = true;
+  for (unsigned int ii = 0; r && (ii < message->size); ++ii)
+    r = (GetByte(*message, ii) == message->GetData()[ii]);
+  Heap::Instance().Deallocate(message, sizeof(Message) + message->size);
+  return r;
+}
+
+/// Posts MessageCount messages, and takes one for each after the first few,
+/// so most messages are freed by another worker than made them.
+int Work(Mailbox &mailbox, unsigned int worker) {
+  for (unsigned int ii = 0; ii < MessageCount; ++ii) {
+    Message *message = MakeMessage(worker, ii);
+    Message *taken = nullptr;
+    ::pthread_mutex_lock(&mailbox.mutex);
+    mailbox.messages.push_back(message);
+    if ((16 < mailbox.messages.size()) &&
+        (worker != mailbox.messages.front()->sender)) {
+      taken = mailbox.messages.front();
+      mailbox.messages.pop_front();
+      ++mailbox.received;
+    }
+    ::pthread_mutex_unlock(&mailbox.mutex);
+    if ((nullptr != taken) && !TakeMessage(taken)) {
+      ::pthread_mutex_lock(&mailbox.mutex);
+      ++mailbox.bad;
+      ::pthread_mutex_unlock(&mailbox.mutex);
+    }
+  }
+  return 0;
+}
+
+/// Allocates and deallocates until killed, so it likely dies in a call.
+void Churn(Loki::SmallObjSharedAllocator &allocator) {
+  vector<void *> blocks(64, nullptr);
+  for (unsigned int ii = 0;; ++ii) {
+    void *&block = blocks[ii % blocks.size()];
+    allocator.Deallocate(block);
+    block = allocator.Allocate(8 + (ii * 13) % 200, false);
+  }
+}
+
+/// Kills processes at random points of Churn.  After each, the segment must
+/// either work and check out, or refuse every allocation.
+bool KillHolders(unsigned int *takenOver) {
+  bool r = true;
+  *takenOver = 0;
+  for (unsigned int ii = 0; ii < KillCount; ++ii) {
+    Loki::SmallObjSharedAllocator allocator;
+    if (!allocator.Create(KilledSegmentName, 4 * 1024 * 1024, 256, 8))
+      return false;
+    const pid_t churner = ::fork();
+    if (0 == churner)
+      Churn(allocator);
+    this_thread::sleep_for(chrono::microseconds(2000 + 337 * ii));
+    ::kill(churner, SIGKILL);
+    ::waitpid(churner, nullptr, 0);
+    const bool corrupt = allocator.IsCorrupt();
+    void *p = allocator.Allocate(64, false);
+    if (corrupt) {
+      r = (nullptr == p) && (nullptr == allocator.GetRoot()) && r;
+    } else {
+      r = (nullptr != p) && allocator.HasBlock(p) && r;
+      allocator.Deallocate(p);
+      r = !allocator.IsCorrupt() && r;
+      ++*takenOver;
+    }
+    allocator.Detach();
+    Loki::SmallObjSharedAllocator::Remove(KilledSegmentName);
+  }
+  return r;
+}
+
+// ----------------------------------------------------------------------------
+
+int main(void) {
+  Heap &heap = Heap::Instance();
+  if (!heap.Create(SegmentName, 32 * 1024 * 1024, 256, 8)) {
+    cout << "can't create " << SegmentName << endl;
+    return 1;
+  }
+  Mailbox *mailbox = new (heap.Allocate(sizeof(Mailbox), true)) Mailbox;
+  pthread_mutexattr_t attributes;
+  ::pthread_mutexattr_init(&attributes);
+  ::pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+  ::pthread_mutex_init(&mailbox->mutex, &attributes);
+  ::pthread_mutexattr_destroy(&attributes);
+  mailbox->received = 0;
+  mailbox->bad = 0;
+  heap.SetRoot(mailbox);
+
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  pid_t workers[WorkerCount];
+  for (unsigned int ii = 0; ii < WorkerCount; ++ii) {
+    workers[ii] = ::fork();
+    if (0 == workers[ii])
+      ::_exit(Work(*mailbox, ii));
+  }
+  bool r = true;
+  for (unsigned int ii = 0; ii < WorkerCount; ++ii) {
+    int status = 0;
+    r = (workers[ii] == ::waitpid(workers[ii], &status, 0)) &&
+        WIFEXITED(status) && (0 == WEXITSTATUS(status)) && r;
+  }
+  const chrono::duration<double, milli> elapsed =
+      chrono::steady_clock::now() - start;
+  const unsigned int total = WorkerCount * MessageCount;
+  cout << WorkerCount << " workers passed " << total << " messages in "
+       << elapsed.count() << " ms, " << mailbox->received
+       << " freed by another process" << endl;
+  r = r && (0 == mailbox->bad) && !heap.IsCorrupt();
+  cout << "workers: " << (r ? "passed" : "FAILED") << endl;
+
+  // The parent frees what is left, and the segment ends up empty.
+  unsigned int left = 0;
+  while (!mailbox->messages.empty()) {
+    r = TakeMessage(mailbox->messages.front()) && r;
+    mailbox->messages.pop_front();
+    ++left;
+  }
+  r = r && (total == mailbox->received + left);
+  Loki::SmallObjStats stats;
+  heap.GetStats(stats);
+  // Only the mailbox is left, in a block rounded up to the alignment.
+  r = r && ((sizeof(Mailbox) + 7) / 8 * 8 == stats.bytesInUse);
+  cout << "stats: " << stats.sizeClasses.size() << " size classes, "
+       << stats.bytesInUse << " bytes in use, " << stats.fallbackAllocations
+       << " runs of slots" << endl;
+  ::pthread_mutex_destroy(&mailbox->mutex);
+  mailbox->~Mailbox();
+  heap.Deallocate(mailbox, sizeof(Mailbox));
+  heap.SetRoot(nullptr);
+  heap.GetStats(stats);
+  r = r && (0 == stats.bytesInUse) &&
+      (stats.fallbackAllocations == stats.fallbackDeallocations) &&
+      !heap.IsCorrupt();
+  cout << "drain: " << (r ? "passed" : "FAILED") << endl;
+  heap.Detach();
+  Loki::SmallObjSharedAllocator::Remove(SegmentName);
+
+  unsigned int takenOver = 0;
+  const bool killed = KillHolders(&takenOver);
+  cout << KillCount << " killed, " << takenOver
+       << " segments taken over, the rest given up: "
+       << (killed ? "passed" : "FAILED") << endl;
+  r = r && killed;
+  return r ? 0 : 1;
+}
+
+// ----------------------------------------------------------------------------
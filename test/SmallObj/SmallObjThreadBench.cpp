@@ -0,0 +1,304 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+////////////////////////////////////////////////////////////////////////////////
+
+// $Id$
+
+// ----------------------------------------------------------------------------
+
+#include <loki/SmallObj.h>
+
+#if defined(__GLIBC__)
+#include <malloc.h> // needed for mallopt
+#endif
+
+#include <chrono>
+#include <condition_variable>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// ----------------------------------------------------------------------------
+
+/** Each thread allocates a burst of objects, then deletes them, over and
+ over.  The burst is larger than a thread cache magazine so that refills and
+ flushes are part of what gets measured.
+ */
+static const unsigned int BurstSize = 100;
+static const unsigned int BurstCount = 20 * 1000;
+
+template <template <class, class> class ThreadingModel>
+class Message
+    : public Loki::SmallObject<ThreadingModel, 4096, 128, 4, Loki::NoDestroy> {
+  char payload_[24];
+};
+
+// ----------------------------------------------------------------------------
+
+template <class T> void Churn(void) {
+  vector<T *> burst(BurstSize, nullptr);
+  for (unsigned int ii = 0; ii < BurstCount; ++ii) {
+    for (unsigned int jj = 0; jj < BurstSize; ++jj)
+      burst[jj] = new T;
+    for (unsigned int jj = 0; jj < BurstSize; ++jj)
+      delete burst[jj];
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+/// Returns millions of new/delete pairs per second across all threads.
+template <class T> double Throughput(unsigned int threadCount) {
+  vector<thread> threads;
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (unsigned int ii = 0; ii < threadCount; ++ii)
+    threads.push_back(thread(&Churn<T>));
+  for (unsigned int ii = 0; ii < threadCount; ++ii)
+    threads[ii].join();
+  const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  const double pairs = double(threadCount) * BurstCount * BurstSize;
+  return pairs / elapsed.count() / 1.0e6;
+}
+
+// ----------------------------------------------------------------------------
+
+/** Hands bursts of objects from producer threads to consumer threads, so
+ every object is deleted by a thread other than the one which made it.
+ */
+template <class T> class Pipe {
+public:
+  Pipe(void) : bursts_(), mutex_(), ready_() {}
+
+  void Produce(unsigned int burstCount) {
+    for (unsigned int ii = 0; ii < burstCount; ++ii) {
+      vector<T *> burst(BurstSize, nullptr);
+      for (unsigned int jj = 0; jj < BurstSize; ++jj)
+        burst[jj] = new T;
+      lock_guard<mutex> lock(mutex_);
+      bursts_.push_back(std::move(burst));
+      ready_.notify_one();
+    }
+  }
+
+  void Consume(unsigned int burstCount) {
+    for (unsigned int ii = 0; ii < burstCount; ++ii) {
+      vector<T *> burst;
+      {
+        unique_lock<mutex> lock(mutex_);
+        while (bursts_.empty())
+          ready_.wait(lock);
+        burst = std::move(bursts_.back());
+        bursts_.pop_back();
+      }
+      for (unsigned int jj = 0; jj < BurstSize; ++jj)
+        delete burst[jj];
+    }
+  }
+
+private:
+  vector<vector<T *>> bursts_;
+  mutex mutex_;
+  condition_variable ready_;
+};
+
+/** Returns millions of objects per second made by pairCount producers and
+ deleted by pairCount consumers.
+ */
+template <class T> double Handoff(unsigned int pairCount) {
+  const unsigned int burstCount = BurstCount / 4;
+  Pipe<T> pipe;
+  vector<thread> threads;
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (unsigned int ii = 0; ii < pairCount; ++ii) {
+    threads.push_back(thread(&Pipe<T>::Produce, &pipe, burstCount));
+    threads.push_back(thread(&Pipe<T>::Consume, &pipe, burstCount));
+  }
+  for (size_t ii = 0; ii < threads.size(); ++ii)
+    threads[ii].join();
+  const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  const double objects = double(pairCount) * burstCount * BurstSize;
+  return objects / elapsed.count() / 1.0e6;
+}
+
+// ----------------------------------------------------------------------------
+
+/** Small enough that its Chunks are aligned on less than a region chunk, so
+ Chunks of two heaps may share one.
+ */
+class Tiny : public Loki::SmallValueObject<::Loki::ThreadOwnedLockable, 4096,
+                                           128, 4, Loki::NoDestroy> {
+public:
+  explicit Tiny(unsigned int value) : value_(value) {}
+  unsigned int GetValue(void) const { return value_; }
+
+private:
+  unsigned int value_;
+  unsigned int padding_;
+};
+
+/// Lets two threads take turns, each making one object per turn.
+class Turns {
+public:
+  Turns(void) : turn_(0), mutex_(), changed_() {}
+
+  void Take(unsigned int who, unsigned int count, vector<Tiny *> &made) {
+    for (unsigned int ii = 0; ii < count; ++ii) {
+      unique_lock<mutex> lock(mutex_);
+      while (turn_ % 2 != who)
+        changed_.wait(lock);
+      made.push_back(new Tiny(who));
+      ++turn_;
+      changed_.notify_all();
+    }
+  }
+
+private:
+  unsigned int turn_;
+  mutex mutex_;
+  condition_variable changed_;
+};
+
+/** Two threads take turns making small objects, so the Chunks of their
+ heaps are interleaved, then each deletes its own, or if swap is true those
+ of the other thread, which go on remote free lists.  Returns true if no
+ object was overwritten.
+ */
+bool Interleave(bool swap) {
+  const unsigned int count = 20 * 1000;
+  Turns turns;
+  vector<Tiny *> made[2];
+  thread other(&Turns::Take, &turns, 1, count, ref(made[1]));
+  turns.Take(0, count, made[0]);
+  other.join();
+
+  set<Tiny *> seen;
+  bool r = true;
+  for (unsigned int who = 0; who < 2; ++who) {
+    for (size_t ii = 0; ii < made[who].size(); ++ii) {
+      r = r && (who == made[who][ii]->GetValue());
+      r = seen.insert(made[who][ii]).second && r;
+    }
+  }
+  vector<Tiny *> &mine = made[swap ? 1 : 0];
+  vector<Tiny *> &theirs = made[swap ? 0 : 1];
+  thread deleter([&theirs]() {
+    for (size_t ii = 0; ii < theirs.size(); ++ii)
+      delete theirs[ii];
+  });
+  for (size_t ii = 0; ii < mine.size(); ++ii)
+    delete mine[ii];
+  deleter.join();
+  return r;
+}
+
+// ----------------------------------------------------------------------------
+
+int main() {
+#if defined(__GLIBC__)
+  // One malloc arena for all threads, so their heaps' Chunks are adjacent.
+  mallopt(M_ARENA_MAX, 1);
+#endif
+  if (!Interleave(false) || !Interleave(true)) {
+    cout << "ThreadOwnedLockable heaps overlap!" << endl;
+    return 1;
+  }
+
+  typedef Message<::Loki::ClassLevelLockable> Locked;
+  typedef Message<::Loki::ThreadCachedLockable> Cached;
+  typedef Message<::Loki::LockFreeLockable> LockFree;
+  typedef Message<::Loki::ThreadOwnedLockable> Owned;
+
+  cout << "Throughput of new/delete of " << sizeof(Locked)
+       << " byte SmallObjects, in millions of pairs per second" << endl
+       << endl;
+  cout << "threads\tClassLevelLockable\tThreadCachedLockable"
+          "\tLockFreeLockable\tThreadOwnedLockable"
+       << endl;
+  for (unsigned int threadCount = 1; threadCount <= 8; threadCount *= 2) {
+    const double locked = Throughput<Locked>(threadCount);
+    const double cached = Throughput<Cached>(threadCount);
+    const double lockFree = Throughput<LockFree>(threadCount);
+    const double owned = Throughput<Owned>(threadCount);
+    cout << threadCount << '\t' << fixed << setprecision(2) << locked
+         << "\t\t\t" << cached << "\t\t\t" << lockFree << "\t\t\t"
+         << owned << endl;
+  }
+
+  cout << endl
+       << "Objects made by producer threads and deleted by consumer threads, "
+          "in millions per second"
+       << endl
+       << endl;
+  cout << "pairs\tClassLevelLockable\tThreadCachedLockable"
+          "\tLockFreeLockable\tThreadOwnedLockable"
+       << endl;
+  for (unsigned int pairCount = 1; pairCount <= 4; pairCount *= 2) {
+    const double locked = Handoff<Locked>(pairCount);
+    const double cached = Handoff<Cached>(pairCount);
+    const double lockFree = Handoff<LockFree>(pairCount);
+    const double owned = Handoff<Owned>(pairCount);
+    cout << pairCount << '\t' << fixed << setprecision(2) << locked
+         << "\t\t\t" << cached << "\t\t\t" << lockFree << "\t\t\t"
+         << owned << endl;
+  }
+
+  typedef Loki::AllocatorSingleton<::Loki::ThreadCachedLockable, 4096, 128, 4,
+                                   ::Loki::NoDestroy>
+      CachedAllocator;
+  if (CachedAllocator::IsCorrupted()) {
+    cout << "ThreadCachedLockable allocator is corrupt!" << endl;
+    return 1;
+  }
+  typedef Loki::AllocatorSingleton<::Loki::LockFreeLockable, 4096, 128, 4,
+                                   ::Loki::NoDestroy>
+      LockFreeAllocator;
+  if (LockFreeAllocator::IsCorrupted()) {
+    cout << "LockFreeLockable allocator is corrupt!" << endl;
+    return 1;
+  }
+  // Every Message is deleted, so the blocks still in use are those kept on
+  // the stack, which holds no more than its depth.
+  const Loki::SmallObjStats stats = LockFreeAllocator::GetStats();
+  size_t kept = 0;
+  for (size_t ii = 0; ii < stats.sizeClasses.size(); ++ii)
+    kept += stats.sizeClasses[ii].liveBlocks;
+  cout << endl << "LockFreeLockable keeps " << kept << " free blocks" << endl;
+  if (LOKI_SMALLOBJ_LOCK_FREE_DEPTH < kept) {
+    cout << "LockFreeLockable keeps too many free blocks!" << endl;
+    return 1;
+  }
+  typedef Loki::AllocatorSingleton<::Loki::ThreadOwnedLockable, 4096, 128, 4,
+                                   ::Loki::NoDestroy>
+      OwnedAllocator;
+  if (OwnedAllocator::IsCorrupted()) {
+    cout << "ThreadOwnedLockable allocator is corrupt!" << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
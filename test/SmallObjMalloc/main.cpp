@@ -0,0 +1,198 @@
+////////////////////////////////////////////////////////////////////////////////
+// The Loki Library
+// Code covered by the MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+////////////////////////////////////////////////////////////////////////////////
+
+// $Id$
+
+/// @file main.cpp Runs under LD_PRELOAD=libloki_malloc.so, and checks that
+/// the replaced malloc and operator new work for a whole program.
+
+// ----------------------------------------------------------------------------
+
+#include <dlfcn.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// ----------------------------------------------------------------------------
+
+/// Returns true if malloc is the one in libloki_malloc.so.
+bool IsReplaced(void) {
+  Dl_info info;
+  void *(*function)(size_t) = &malloc;
+  if (0 == ::dladdr(reinterpret_cast<void *>(function), &info))
+    return false;
+  return (nullptr != info.dli_fname) &&
+         (nullptr != strstr(info.dli_fname, "libloki_malloc"));
+}
+
+// ----------------------------------------------------------------------------
+
+/// Checks every replaced function, with small and large sizes.
+bool CheckFunctions(void) {
+  bool r = true;
+  const size_t sizes[] = {0, 1, 15, 16, 24, 100, 1000, 1024, 1025, 5000,
+                          100000};
+  for (size_t size : sizes) {
+    unsigned char *p = static_cast<unsigned char *>(malloc(size));
+    r = r && (nullptr != p) && (0 == reinterpret_cast<uintptr_t>(p) % 16) &&
+        (size <= malloc_usable_size(p));
+    memset(p, 0xA5, size);
+    p = static_cast<unsigned char *>(realloc(p, size * 3 + 1));
+    for (size_t ii = 0; ii < size; ++ii)
+      r = r && (0xA5 == p[ii]);
+    p = static_cast<unsigned char *>(realloc(p, size / 2 + 1));
+    r = r && (nullptr != p) && ((0 == size) || (0xA5 == p[size / 2]));
+    free(p);
+
+    unsigned char *q = static_cast<unsigned char *>(calloc(size, 3));
+    for (size_t ii = 0; ii < size * 3; ++ii)
+      r = r && (0 == q[ii]);
+    free(q);
+  }
+
+  const size_t alignments[] = {8, 16, 32, 64, 256, 4096, 65536};
+  for (size_t alignment : alignments) {
+    for (size_t size : sizes) {
+      void *p = nullptr;
+      r = r && (0 == posix_memalign(&p, alignment, size)) &&
+          (0 == reinterpret_cast<uintptr_t>(p) % alignment);
+      free(p);
+      p = aligned_alloc(alignment, size);
+      r = r && (0 == reinterpret_cast<uintptr_t>(p) % alignment);
+      free(p);
+    }
+  }
+  void *p = nullptr;
+  r = r && (EINVAL == posix_memalign(&p, 24, 8));
+  // Volatile, so the compiler doesn't warn of the overflow being tested.
+  volatile size_t count = SIZE_MAX / 2;
+  r = r && (nullptr == calloc(count, 4));
+
+  string *s = new string(2000, 'x');
+  map<int, string> m;
+  for (int ii = 0; ii < 1000; ++ii)
+    m[ii] = *s;
+  delete s;
+  return r && (1000 == m.size());
+}
+
+// ----------------------------------------------------------------------------
+
+/// Threads allocate, pass blocks to each other, and free them.
+bool CheckThreads(void) {
+  vector<void *> blocks(8 * 1000, nullptr);
+  vector<thread> threads;
+  for (unsigned int ii = 0; ii < 8; ++ii) {
+    threads.push_back(thread([&blocks, ii]() {
+      for (unsigned int jj = 0; jj < 1000; ++jj) {
+        blocks[ii * 1000 + jj] = malloc((jj % 300) + 1);
+        vector<int> v(jj % 50);
+      }
+    }));
+  }
+  for (size_t ii = 0; ii < threads.size(); ++ii)
+    threads[ii].join();
+  threads.clear();
+  for (unsigned int ii = 0; ii < 8; ++ii) {
+    threads.push_back(thread([&blocks, ii]() {
+      // Each thread frees blocks made by another thread.
+      const unsigned int other = (ii + 1) % 8;
+      for (unsigned int jj = 0; jj < 1000; ++jj)
+        free(blocks[other * 1000 + jj]);
+    }));
+  }
+  for (size_t ii = 0; ii < threads.size(); ++ii)
+    threads[ii].join();
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+/** Forks while another thread allocates, and checks the child can still
+ allocate, which it couldn't if fork left the lock held.
+ */
+bool CheckFork(void) {
+  atomic<bool> stop(false);
+  thread busy([&stop]() {
+    while (!stop) {
+      void *p = malloc(64);
+      free(p);
+    }
+  });
+  bool r = true;
+  for (unsigned int ii = 0; ii < 20; ++ii) {
+    const pid_t pid = ::fork();
+    if (0 == pid) {
+      vector<string> v(1000, string(100, 'c'));
+      ::_exit(CheckFunctions() ? 0 : 1);
+    }
+    int status = 0;
+    r = r && (pid == ::waitpid(pid, &status, 0)) && WIFEXITED(status) &&
+        (0 == WEXITSTATUS(status));
+  }
+  stop = true;
+  busy.join();
+  return r;
+}
+
+// ----------------------------------------------------------------------------
+
+int main() {
+  if (!IsReplaced()) {
+    cout << "malloc is not the one in libloki_malloc.so!" << endl;
+    return 1;
+  }
+  const bool functions = CheckFunctions();
+  const bool threads = CheckThreads();
+  const bool forks = CheckFork();
+  cout << "functions: " << (functions ? "passed" : "FAILED") << endl;
+  cout << "threads: " << (threads ? "passed" : "FAILED") << endl;
+  cout << "fork: " << (forks ? "passed" : "FAILED") << endl;
+
+  // Run this without LD_PRELOAD to compare against the system malloc.
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (unsigned int ii = 0; ii < 1000; ++ii) {
+    map<int, int> m;
+    for (int jj = 0; jj < 1000; ++jj)
+      m[jj] = jj;
+  }
+  const chrono::duration<double, milli> elapsed =
+      chrono::steady_clock::now() - start;
+  cout << "1000 maps of 1000 ints: " << elapsed.count() << " ms" << endl;
+  return (functions && threads && forks) ? 0 : 1;
+}
+
+// ----------------------------------------------------------------------------
@@ -28,8 +28,12 @@
 
 #include "ThreadPool.hpp"
 
+#include <loki/Singleton.h>
+
+#include <atomic>
 #include <iostream>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 #include <cassert>
@@ -228,3 +232,120 @@ bool TestThreadLocalClassStaticValue(void) {
 }
 
 // ----------------------------------------------------------------------------
+
+/// Counts what one thread did, and adds it to the total as the thread exits.
+class HitCounter {
+public:
+  HitCounter(void) : hits_(0) { ++LiveCount; }
+
+  ~HitCounter(void) {
+    ExitedHits += hits_.load(::std::memory_order_relaxed);
+    --LiveCount;
+  }
+
+  inline void Hit(void) {
+    hits_.store(hits_.load(::std::memory_order_relaxed) + 1,
+                ::std::memory_order_relaxed);
+  }
+
+  inline uintptr_t GetHits(void) const {
+    return hits_.load(::std::memory_order_relaxed);
+  }
+
+  static ::std::atomic<uintptr_t> ExitedHits;
+  static ::std::atomic<unsigned int> LiveCount;
+
+private:
+  ::std::atomic<uintptr_t> hits_;
+};
+
+::std::atomic<uintptr_t> HitCounter::ExitedHits(0);
+::std::atomic<unsigned int> HitCounter::LiveCount(0);
+
+typedef ::Loki::SingletonHolder<HitCounter, ::Loki::CreateUsingNew,
+                                ::Loki::ThreadLocalLifetime>
+    HeapHitCounter;
+
+typedef ::Loki::SingletonHolder<HitCounter, ::Loki::CreateThreadLocal,
+                                ::Loki::ThreadLocalLifetime>
+    LocalHitCounter;
+
+/// Threads hold their counters until the main thread has counted them.
+static ::std::atomic<bool> MayExit(false);
+
+// ----------------------------------------------------------------------------
+
+void *HitCounters(void *p) {
+  const uintptr_t ii = reinterpret_cast<uintptr_t>(p);
+  IntVector &v = GetIntVector();
+  v[ii - 1] = reinterpret_cast<uintptr_t>(&HeapHitCounter::Instance());
+  for (uintptr_t hit = 0; hit < ii; ++hit) {
+    HeapHitCounter::Instance().Hit();
+    LocalHitCounter::Instance().Hit();
+  }
+  while (!MayExit.load())
+    ::std::this_thread::yield();
+  return nullptr;
+}
+
+// ----------------------------------------------------------------------------
+
+template <class Holder> void SumHits(unsigned int &count, uintptr_t &hits) {
+  count = 0;
+  hits = 0;
+  Holder::ForEach([&count, &hits](const HitCounter &counter) {
+    ++count;
+    hits += counter.GetHits();
+  });
+}
+
+// ----------------------------------------------------------------------------
+
+bool TestThreadLocalSingleton(void) {
+  IntVector &v = GetIntVector();
+  for (unsigned int i0 = 0; i0 < v.size(); ++i0) {
+    v[i0] = 0;
+  }
+
+  // The main thread's counters live until it exits.
+  HeapHitCounter::Instance().Hit();
+  LocalHitCounter::Instance().Hit();
+  bool okay = (&HeapHitCounter::Instance() != &LocalHitCounter::Instance());
+
+  // Each thread hits its counters as many times as its number.
+  const uintptr_t threadHits = ThreadCount * (ThreadCount + 1) / 2;
+  unsigned int count = 0;
+  uintptr_t hits = 0;
+  {
+    ThreadPool pool;
+    pool.Create(ThreadCount, &HitCounters);
+    pool.Start();
+    do {
+      ::std::this_thread::yield();
+      SumHits<HeapHitCounter>(count, hits);
+    } while ((count < ThreadCount + 1) || (hits < threadHits + 1));
+    okay = okay && (ThreadCount + 1 == count) && (threadHits + 1 == hits);
+    SumHits<LocalHitCounter>(count, hits);
+    okay = okay && (ThreadCount + 1 == count) && (threadHits + 1 == hits);
+    MayExit = true;
+    pool.Join();
+  }
+
+  // Each thread got its own counter, and left its hits behind as it exited.
+  for (unsigned int i1 = 0; i1 < ThreadCount; ++i1) {
+    for (unsigned int i2 = i1 + 1; i2 < ThreadCount; ++i2)
+      okay = okay && (v[i1] != v[i2]);
+    okay = okay && (v[i1] != reinterpret_cast<uintptr_t>(
+                                  &HeapHitCounter::Instance()));
+  }
+  okay = okay && (2 * threadHits == HitCounter::ExitedHits) &&
+         (2 == HitCounter::LiveCount);
+  SumHits<HeapHitCounter>(count, hits);
+  okay = okay && (1 == count) && (1 == hits);
+  SumHits<LocalHitCounter>(count, hits);
+  okay = okay && (1 == count) && (1 == hits);
+
+  return okay;
+}
+
+// ----------------------------------------------------------------------------
@@ -38,6 +38,8 @@ extern bool TestThreadLocalFunctionStaticValue(void);
 
 extern bool TestThreadLocalStaticValue(void);
 
+extern bool TestThreadLocalSingleton(void);
+
 // ----------------------------------------------------------------------------
 
 int main(int argc, const char *const argv[]) {
@@ -85,7 +87,11 @@ int main(int argc, const char *const argv[]) {
             "for standalone static values."
          << endl;
 
-  return 0;
+  cout << endl << "Testing SingletonHolder with ThreadLocalLifetime." << endl;
+  okay = TestThreadLocalSingleton();
+  cout << "Per-thread singletons: " << (okay ? "passed" : "FAILED") << endl;
+
+  return okay ? 0 : 1;
 }
 
 // ----------------------------------------------------------------------------